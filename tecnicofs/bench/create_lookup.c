@@ -0,0 +1,64 @@
+#include "harness.h"
+#include <assert.h>
+
+/*
+ * Create/lookup storm in the root directory.
+ * The threads share CREATE_FILES files (most of the i-node table): each one creates its files
+ * (tfs_open with TFS_O_CREAT and tfs_close) and then looks them up LOOKUP_ROUNDS times. Every
+ * create, close and lookup is a timed call.
+ */
+
+#define CREATE_FILES (INODE_TABLE_SIZE - 2)
+#define LOOKUP_ROUNDS (50)
+
+static size_t const sizes[] = {0};
+
+static size_t files_per_thread(int n_threads) {
+    size_t files = CREATE_FILES / (size_t)n_threads;
+    return files > 0 ? files : 1;
+}
+
+static size_t max_ops(int n_threads, size_t size) {
+    (void)size;
+    return files_per_thread(n_threads) * (2 + LOOKUP_ROUNDS);
+}
+
+static void run(bench_thread_t *thread) {
+    size_t files = files_per_thread(thread->bt_threads);
+    char path[MAX_FILE_NAME];
+
+    for (size_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "/c%d_%zu", thread->bt_id, i);
+
+        uint64_t start = bench_now();
+        int fh = tfs_open(path, TFS_O_CREAT);
+        bench_record(thread, start, 0);
+        if (fh == -1) {
+            continue; // more threads than i-nodes
+        }
+
+        start = bench_now();
+        assert(tfs_close(fh) != -1);
+        bench_record(thread, start, 0);
+    }
+
+    for (int round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (size_t i = 0; i < files; i++) {
+            snprintf(path, sizeof(path), "/c%d_%zu", thread->bt_id, i);
+
+            uint64_t start = bench_now();
+            tfs_lookup(path);
+            bench_record(thread, start, 0);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workload = {.bw_name = "create_lookup",
+                                 .bw_sizes = sizes,
+                                 .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                 .bw_max_ops = max_ops,
+                                 .bw_run = run};
+
+    return bench_main(argc, argv, &workload, 1);
+}
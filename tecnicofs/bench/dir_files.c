@@ -0,0 +1,78 @@
+#include "harness.h"
+#include <assert.h>
+#include <pthread.h>
+
+/*
+ * Many files in one directory.
+ * The threads fill a subdirectory with DIR_FILES files (what is left of the i-node table), and,
+ * once all are created, look up LOOKUPS random names in it, half of which do not exist (so the
+ * whole directory is searched).
+ */
+
+#define DIR_FILES (INODE_TABLE_SIZE - 3)
+#define LOOKUPS (2000)
+
+static size_t const sizes[] = {0};
+static pthread_barrier_t created;
+
+static size_t files_per_thread(int n_threads) {
+    size_t files = DIR_FILES / (size_t)n_threads;
+    return files > 0 ? files : 1;
+}
+
+static size_t max_ops(int n_threads, size_t size) {
+    (void)size;
+    return files_per_thread(n_threads) + LOOKUPS;
+}
+
+static int setup(int n_threads, size_t size) {
+    (void)size;
+    if (tfs_mkdir("/d") == -1) {
+        return -1;
+    }
+
+    pthread_barrier_destroy(&created);
+    return pthread_barrier_init(&created, NULL, (unsigned)n_threads) == 0 ? 0 : -1;
+}
+
+static void run(bench_thread_t *thread) {
+    size_t files = files_per_thread(thread->bt_threads);
+    char path[MAX_FILE_NAME];
+
+    for (size_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "/d/f%d_%zu", thread->bt_id, i);
+
+        uint64_t start = bench_now();
+        int fh = tfs_open(path, TFS_O_CREAT);
+        bench_record(thread, start, 0);
+        if (fh != -1) {
+            assert(tfs_close(fh) != -1);
+        }
+    }
+
+    pthread_barrier_wait(&created);
+
+    for (int i = 0; i < LOOKUPS; i++) {
+        int owner = rand_r(&thread->bt_seed) % thread->bt_threads;
+        size_t index = (size_t)rand_r(&thread->bt_seed) % (2 * files);
+
+        snprintf(path, sizeof(path), "/d/f%d_%zu", owner, index);
+
+        uint64_t start = bench_now();
+        tfs_lookup(path);
+        bench_record(thread, start, 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workload = {.bw_name = "dir_files",
+                                 .bw_sizes = sizes,
+                                 .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                 .bw_max_ops = max_ops,
+                                 .bw_setup = setup,
+                                 .bw_run = run};
+
+    assert(pthread_barrier_init(&created, NULL, 1) == 0);
+
+    return bench_main(argc, argv, &workload, 1);
+}
@@ -0,0 +1,67 @@
+#include "harness.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Export throughput of tfs_copy_to_external_fs.
+ * A file of the (file) size is written before the run, and every thread exports it REPS times to
+ * its own file in /tmp.
+ */
+
+#define REPS (20)
+#define MAX_SIZE (512 * BLOCK_SIZE)
+
+static size_t const sizes[] = {4 * BLOCK_SIZE, 16 * BLOCK_SIZE, 64 * BLOCK_SIZE,
+                               256 * BLOCK_SIZE};
+static char content[MAX_SIZE];
+
+static size_t max_ops(int n_threads, size_t size) {
+    (void)n_threads;
+    (void)size;
+    return REPS;
+}
+
+static int setup(int n_threads, size_t size) {
+    (void)n_threads;
+    if (size == 0 || size > MAX_SIZE) {
+        return -1;
+    }
+
+    int fh = tfs_open("/f", TFS_O_CREAT);
+    if (fh == -1) {
+        return -1;
+    }
+    ssize_t written = tfs_write(fh, content, size);
+
+    return tfs_close(fh) == 0 && written == (ssize_t)size ? 0 : -1;
+}
+
+static void run(bench_thread_t *thread) {
+    char dest[64];
+
+    snprintf(dest, sizeof(dest), "/tmp/tfs_bench_export_%d_%d", (int)getpid(), thread->bt_id);
+
+    for (int i = 0; i < REPS; i++) {
+        uint64_t start = bench_now();
+        assert(tfs_copy_to_external_fs("/f", dest) != -1);
+        bench_record(thread, start, thread->bt_size);
+    }
+
+    assert(unlink(dest) == 0);
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workload = {.bw_name = "export",
+                                 .bw_sizes = sizes,
+                                 .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                 .bw_max_ops = max_ops,
+                                 .bw_setup = setup,
+                                 .bw_run = run};
+
+    for (size_t i = 0; i < MAX_SIZE; i++) {
+        content[i] = (char)('a' + i % 26);
+    }
+
+    return bench_main(argc, argv, &workload, 1);
+}
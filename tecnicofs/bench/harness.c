@@ -0,0 +1,308 @@
+#include "harness.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SWEEP (32)
+
+typedef enum { FORMAT_CSV, FORMAT_JSON } bench_format_t;
+
+/* The sweep and output chosen by the options */
+typedef struct {
+    int threads[MAX_SWEEP];
+    size_t n_threads;
+    size_t block_sizes[MAX_SWEEP];
+    size_t n_block_sizes;
+    size_t sizes[MAX_SWEEP];
+    size_t n_sizes;
+    bench_format_t format;
+    bool set_delay;
+    unsigned delay;
+} bench_options_t;
+
+/* What the threads of a run share */
+typedef struct {
+    bench_workload_t const *workload;
+    pthread_barrier_t start;
+} bench_run_t;
+
+typedef struct {
+    bench_run_t *run;
+    bench_thread_t thread;
+    uint64_t started;
+    uint64_t finished;
+} bench_worker_t;
+
+uint64_t bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void bench_record(bench_thread_t *thread, uint64_t start, size_t bytes) {
+    uint64_t end = bench_now();
+
+    assert(thread->bt_ops < thread->bt_cap);
+    thread->bt_lat[thread->bt_ops++] = end - start;
+    thread->bt_bytes += bytes;
+}
+
+/*
+ * Parses a comma separated list of positive numbers
+ * Returns the number of values, 0 if the list is not valid
+ */
+static size_t parse_list(char const *list, size_t *values) {
+    size_t n = 0;
+    char const *p = list;
+
+    while (*p != '\0' && n < MAX_SWEEP) {
+        char *end;
+        unsigned long long value = strtoull(p, &end, 10);
+
+        if (end == p || value == 0 || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        values[n++] = (size_t)value;
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return *p == '\0' ? n : 0;
+}
+
+static int parse_options(int argc, char **argv, bench_workload_t const *workload,
+                         bench_options_t *options) {
+    size_t values[MAX_SWEEP];
+    int opt;
+
+    *options = (bench_options_t){.threads = {1, 2, 4, 8},
+                                 .n_threads = 4,
+                                 .block_sizes = {BLOCK_SIZE},
+                                 .n_block_sizes = 1,
+                                 .format = FORMAT_CSV};
+    options->n_sizes = workload->bw_n_sizes;
+    memcpy(options->sizes, workload->bw_sizes, workload->bw_n_sizes * sizeof(size_t));
+
+    while ((opt = getopt(argc, argv, "t:b:s:f:d:")) != -1) {
+        switch (opt) {
+        case 't':
+            options->n_threads = parse_list(optarg, values);
+            for (size_t i = 0; i < options->n_threads; i++) {
+                if (values[i] > 1024) {
+                    return -1;
+                }
+                options->threads[i] = (int)values[i];
+            }
+            break;
+        case 'b':
+            options->n_block_sizes = parse_list(optarg, options->block_sizes);
+            for (size_t i = 0; i < options->n_block_sizes; i++) {
+                size_t block_size = options->block_sizes[i];
+
+                if ((block_size & (block_size - 1)) != 0 || block_size < MIN_BLOCK_SIZE ||
+                    block_size > MAX_BLOCK_SIZE) {
+                    return -1;
+                }
+            }
+            break;
+        case 's':
+            options->n_sizes = parse_list(optarg, options->sizes);
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                options->format = FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                options->format = FORMAT_JSON;
+            } else {
+                return -1;
+            }
+            break;
+        case 'd':
+            options->set_delay = true;
+            options->delay = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return options->n_threads > 0 && options->n_block_sizes > 0 && options->n_sizes > 0 ? 0 : -1;
+}
+
+static void *bench_worker(void *arg) {
+    bench_worker_t *worker = (bench_worker_t *)arg;
+
+    pthread_barrier_wait(&(worker->run->start));
+    worker->started = bench_now();
+    worker->run->workload->bw_run(&(worker->thread));
+    worker->finished = bench_now();
+
+    return (void *)NULL;
+}
+
+static int compare_latency(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency below which a fraction of the (sorted) latencies are */
+static uint64_t percentile(uint64_t const *sorted, size_t n, double fraction) {
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t rank = (size_t)(fraction * (double)n + 0.999999);
+
+    return sorted[rank == 0 ? 0 : (rank > n ? n : rank) - 1];
+}
+
+/*
+ * Runs a workload once, on a new file system with blocks of block_size
+ * bytes, and prints the result
+ * Returns 0 if successful, -1 otherwise
+ */
+static int bench_run(bench_workload_t const *workload, bench_options_t const *options,
+                     int n_threads, size_t block_size, size_t size, bool first) {
+    size_t cap = workload->bw_max_ops(n_threads, size);
+    pthread_t *tids = malloc((size_t)n_threads * sizeof(pthread_t));
+    bench_worker_t *workers = calloc((size_t)n_threads, sizeof(bench_worker_t));
+    uint64_t *latencies = malloc((size_t)n_threads * (cap > 0 ? cap : 1) * sizeof(uint64_t));
+    bench_run_t run = {.workload = workload};
+    tfs_params_t params = {.tp_block_size = block_size,
+                           .tp_data_blocks = DATA_BLOCKS * BLOCK_SIZE / block_size};
+    int status = -1;
+
+    if (tids == NULL || workers == NULL || latencies == NULL ||
+        tfs_init_with_params(&params) == -1) {
+        goto out;
+    }
+
+    if (options->set_delay) {
+        device_model_t model = {.dm_kind = options->delay > 0 ? DEVICE_FIXED : DEVICE_ZERO,
+                                .dm_delay = options->delay,
+                                .dm_jitter = 0};
+        assert(tfs_set_device_model(&model) != -1);
+    }
+
+    if (workload->bw_setup != NULL && workload->bw_setup(n_threads, size) == -1) {
+        fprintf(stderr, "%s: setup failed (threads %d, block size %zu, size %zu)\n",
+                workload->bw_name, n_threads, block_size, size);
+        tfs_destroy();
+        goto out;
+    }
+
+    assert(pthread_barrier_init(&run.start, NULL, (unsigned)n_threads + 1) == 0);
+
+    for (int i = 0; i < n_threads; i++) {
+        workers[i].run = &run;
+        workers[i].thread = (bench_thread_t){.bt_id = i,
+                                             .bt_threads = n_threads,
+                                             .bt_block_size = block_size,
+                                             .bt_size = size,
+                                             .bt_seed = (unsigned)i * 7919u + 1,
+                                             .bt_lat = latencies + (size_t)i * cap,
+                                             .bt_cap = cap};
+        assert(pthread_create(&tids[i], NULL, bench_worker, &workers[i]) == 0);
+    }
+
+    pthread_barrier_wait(&run.start);
+
+    for (int i = 0; i < n_threads; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    pthread_barrier_destroy(&run.start);
+    assert(tfs_destroy() != -1);
+
+    /* The run lasts from the first thread that starts to the last one that
+     * finishes, and the latencies of all threads are put together */
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+    size_t ops = 0;
+    size_t bytes = 0;
+
+    for (int i = 0; i < n_threads; i++) {
+        start = workers[i].started < start ? workers[i].started : start;
+        end = workers[i].finished > end ? workers[i].finished : end;
+        memmove(latencies + ops, workers[i].thread.bt_lat,
+                workers[i].thread.bt_ops * sizeof(uint64_t));
+        ops += workers[i].thread.bt_ops;
+        bytes += workers[i].thread.bt_bytes;
+    }
+    qsort(latencies, ops, sizeof(uint64_t), compare_latency);
+
+    double seconds = (double)(end - start) / 1e9;
+    double ops_per_sec = seconds > 0 ? (double)ops / seconds : 0;
+    double mib_per_sec = seconds > 0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0;
+    uint64_t p50 = percentile(latencies, ops, 0.5);
+    uint64_t p99 = percentile(latencies, ops, 0.99);
+    uint64_t p999 = percentile(latencies, ops, 0.999);
+
+    if (options->format == FORMAT_CSV) {
+        printf("%s,%d,%zu,%zu,%zu,%zu,%.6f,%.0f,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               workload->bw_name, n_threads, block_size, size, ops, bytes, seconds, ops_per_sec,
+               mib_per_sec, p50, p99, p999);
+    } else {
+        printf("%s  {\"workload\": \"%s\", \"threads\": %d, \"block_size\": %zu, \"size\": %zu, "
+               "\"ops\": %zu, \"bytes\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+               "\"mib_per_sec\": %.2f, \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+               ", \"p999_ns\": %" PRIu64 "}",
+               first ? "" : ",\n", workload->bw_name, n_threads, block_size, size, ops, bytes,
+               seconds, ops_per_sec, mib_per_sec, p50, p99, p999);
+    }
+    fflush(stdout);
+    status = 0;
+
+out:
+    free(latencies);
+    free(workers);
+    free(tids);
+    return status;
+}
+
+int bench_main(int argc, char **argv, bench_workload_t const *workloads, size_t n_workloads) {
+    bench_options_t options;
+
+    if (n_workloads == 0 || parse_options(argc, argv, &workloads[0], &options) == -1) {
+        fprintf(stderr,
+                "usage: %s [-t threads,...] [-b block sizes,...] [-s sizes,...] [-f csv|json] "
+                "[-d delay_ns]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options.format == FORMAT_CSV) {
+        printf("workload,threads,block_size,size,ops,bytes,seconds,ops_per_sec,mib_per_sec,p50_ns,"
+               "p99_ns,p999_ns\n");
+    } else {
+        printf("[\n");
+    }
+
+    bool first = true;
+    int status = EXIT_SUCCESS;
+
+    for (size_t w = 0; w < n_workloads; w++) {
+        for (size_t b = 0; b < options.n_block_sizes; b++) {
+            for (size_t s = 0; s < options.n_sizes; s++) {
+                for (size_t t = 0; t < options.n_threads; t++) {
+                    if (bench_run(&workloads[w], &options, options.threads[t],
+                                  options.block_sizes[b], options.sizes[s], first) == -1) {
+                        status = EXIT_FAILURE;
+                        continue;
+                    }
+                    first = false;
+                }
+            }
+        }
+    }
+
+    if (options.format == FORMAT_JSON) {
+        printf("\n]\n");
+    }
+
+    return status;
+}
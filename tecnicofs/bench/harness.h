@@ -0,0 +1,64 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "operations.h"
+#include <stdint.h>
+
+/*
+ * Benchmark harness: a workload is a function that every thread runs, and
+ * bench_main runs it for each thread count, block size and I/O size of the
+ * sweep (each run on a new file system, of that block size and as many bytes
+ * as the default volume), timing every call the threads make. A run is
+ * printed as a CSV line (or a JSON object) with its ops/sec, MiB/s and
+ * p50/p99/p999 latencies.
+ *
+ * Options (of every benchmark):
+ *   -t 1,2,4,8   thread counts
+ *   -b 512,4096  block sizes in bytes (BLOCK_SIZE of config.h by default)
+ *   -s 512,4096  I/O sizes in bytes (replaces the sizes of the workload)
+ *   -f csv|json  output format
+ *   -d ns        fixed storage delay of a cache miss (0 for none), instead
+ *                of the DEVICE_MODEL of config.h
+ */
+
+/* One thread of a run */
+typedef struct {
+    int bt_id;            // 0 .. bt_threads - 1
+    int bt_threads;       // threads of the run
+    size_t bt_block_size; // block size of the volume of the run
+    size_t bt_size;       // I/O size of the run
+    unsigned bt_seed;     // for rand_r, different for each thread
+    size_t bt_ops;        // calls recorded (see bench_record)
+    size_t bt_bytes;      // bytes they moved
+    uint64_t *bt_lat;     // their latencies, in ns
+    size_t bt_cap;        // latencies bt_lat holds
+} bench_thread_t;
+
+typedef struct {
+    char const *bw_name;
+    size_t const *bw_sizes; // I/O sizes swept by default
+    size_t bw_n_sizes;
+    /* Calls a thread records at most, for a run of n_threads and size */
+    size_t (*bw_max_ops)(int n_threads, size_t size);
+    /* Prepares the file system for a run, before it is timed (may be NULL)
+     * Returns 0 if successful, -1 otherwise */
+    int (*bw_setup)(int n_threads, size_t size);
+    /* The work of one thread */
+    void (*bw_run)(bench_thread_t *thread);
+} bench_workload_t;
+
+/* Returns the current time, in ns */
+uint64_t bench_now(void);
+
+/* Records a call of a thread that started at start and moved bytes */
+void bench_record(bench_thread_t *thread, uint64_t start, size_t bytes);
+
+/*
+ * Runs workloads (one after another, with the same output) over the sweep
+ * given by the options (argc, argv); the sizes of the first one are the
+ * default sizes
+ * Returns the exit status of the benchmark
+ */
+int bench_main(int argc, char **argv, bench_workload_t const *workloads, size_t n_workloads);
+
+#endif // HARNESS_H
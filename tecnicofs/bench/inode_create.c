@@ -0,0 +1,74 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Micro-benchmark for the i-node allocator.
+ * For each thread count (1, 2, 4, ..., MAX_THREADS) every thread runs OPS iterations of
+ * inode_create() followed by inode_delete(), so the table never fills up, and the aggregate
+ * number of creates per second is printed as CSV (threads,creates,seconds,creates_per_sec).
+ */
+
+#define MAX_THREADS 16
+#define OPS 2000
+
+static void *fn(void *arg) {
+
+    size_t *created = (size_t *)arg;
+
+    for (int i = 0; i < OPS; i++) {
+        int inumber = inode_create(T_FILE);
+        if (inumber == -1) {
+            continue;
+        }
+        (*created)++;
+        assert(inode_delete(inumber) == 0);
+    }
+
+    return (void *)NULL;
+}
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+
+    pthread_t tids[MAX_THREADS];
+    size_t created[MAX_THREADS];
+    struct timespec start, end;
+
+    printf("threads,creates,seconds,creates_per_sec\n");
+
+    for (int n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+
+        assert(tfs_init() != -1);
+        memset(created, 0, sizeof(created));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < n_threads; i++) {
+            assert(pthread_create(&tids[i], NULL, fn, (void *)&created[i]) == 0);
+        }
+
+        for (int i = 0; i < n_threads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        size_t total = 0;
+        for (int i = 0; i < n_threads; i++) {
+            total += created[i];
+        }
+
+        double seconds = elapsed(&start, &end);
+        printf("%d,%zu,%.4f,%.0f\n", n_threads, total, seconds, (double)total / seconds);
+
+        assert(tfs_destroy() != -1);
+    }
+
+    return 0;
+}
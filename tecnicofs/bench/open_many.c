@@ -0,0 +1,118 @@
+#include "harness.h"
+#include <assert.h>
+
+/*
+ * Open and stat bursts, as an indexer makes them. Before the run, FILES files are created in the
+ * root directory; then every thread opens the first size of them (size is the burst, in files)
+ * BURSTS times, one tfs_open each (open_each) or in one tfs_open_many (open_many), and looks them
+ * up with one tfs_lookup each (lookup_each) or in one tfs_stat_many (stat_many). Every burst is a
+ * timed call; the files are closed outside of it.
+ */
+
+#define FILES (INODE_TABLE_SIZE - 2)
+#define BURSTS (200)
+
+static size_t const sizes[] = {8, 16, FILES};
+static char names[FILES][MAX_FILE_NAME];
+
+static size_t max_ops(int n_threads, size_t size) {
+    (void)n_threads;
+    (void)size;
+    return BURSTS;
+}
+
+static int setup(int n_threads, size_t size) {
+    (void)n_threads;
+
+    if (size == 0 || size > FILES) {
+        return -1;
+    }
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/o%d", i);
+
+        int fh = tfs_open(names[i], TFS_O_CREAT);
+        if (fh == -1 || tfs_close(fh) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void open_each(bench_thread_t *thread) {
+    int fhs[FILES];
+
+    for (int burst = 0; burst < BURSTS; burst++) {
+        uint64_t start = bench_now();
+        for (size_t i = 0; i < thread->bt_size; i++) {
+            fhs[i] = tfs_open(names[i], 0);
+        }
+        bench_record(thread, start, 0);
+
+        for (size_t i = 0; i < thread->bt_size; i++) {
+            assert(tfs_close(fhs[i]) != -1);
+        }
+    }
+}
+
+static void batch_init(tfs_batch_entry_t *batch, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        batch[i] = (tfs_batch_entry_t){.tb_name = names[i]};
+    }
+}
+
+static void open_many(bench_thread_t *thread) {
+    tfs_batch_entry_t batch[FILES];
+
+    for (int burst = 0; burst < BURSTS; burst++) {
+        batch_init(batch, thread->bt_size);
+
+        uint64_t start = bench_now();
+        assert(tfs_open_many(batch, thread->bt_size, 0) == (int)thread->bt_size);
+        bench_record(thread, start, 0);
+
+        for (size_t i = 0; i < thread->bt_size; i++) {
+            assert(tfs_close(batch[i].tb_fhandle) != -1);
+        }
+    }
+}
+
+static void lookup_each(bench_thread_t *thread) {
+    for (int burst = 0; burst < BURSTS; burst++) {
+        uint64_t start = bench_now();
+        for (size_t i = 0; i < thread->bt_size; i++) {
+            assert(tfs_lookup(names[i]) != -1);
+        }
+        bench_record(thread, start, 0);
+    }
+}
+
+static void stat_many(bench_thread_t *thread) {
+    tfs_batch_entry_t batch[FILES];
+
+    for (int burst = 0; burst < BURSTS; burst++) {
+        batch_init(batch, thread->bt_size);
+
+        uint64_t start = bench_now();
+        assert(tfs_stat_many(batch, thread->bt_size) == (int)thread->bt_size);
+        bench_record(thread, start, 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workloads[] = {{.bw_name = "open_each", .bw_run = open_each},
+                                    {.bw_name = "open_many", .bw_run = open_many},
+                                    {.bw_name = "lookup_each", .bw_run = lookup_each},
+                                    {.bw_name = "stat_many", .bw_run = stat_many}};
+    size_t n_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+    for (size_t i = 0; i < n_workloads; i++) {
+        workloads[i].bw_sizes = sizes;
+        workloads[i].bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+        workloads[i].bw_max_ops = max_ops;
+        workloads[i].bw_setup = setup;
+    }
+
+    return bench_main(argc, argv, workloads, n_workloads);
+}
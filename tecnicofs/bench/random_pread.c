@@ -0,0 +1,71 @@
+#include "harness.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Random reads of a shared file.
+ * One file of FILE_BYTES is written before the run; then every thread opens it and makes OPS
+ * calls of tfs_pread of the I/O size at random offsets aligned to that size.
+ */
+
+#define FILE_BYTES (256 * BLOCK_SIZE)
+#define OPS (2000)
+
+static size_t const sizes[] = {512, BLOCK_SIZE, 4 * BLOCK_SIZE, 16 * BLOCK_SIZE};
+static char content[FILE_BYTES];
+
+static size_t max_ops(int n_threads, size_t size) {
+    (void)n_threads;
+    (void)size;
+    return OPS;
+}
+
+static int setup(int n_threads, size_t size) {
+    (void)n_threads;
+    if (size == 0 || size > FILE_BYTES) {
+        return -1;
+    }
+
+    int fh = tfs_open("/r", TFS_O_CREAT);
+    if (fh == -1) {
+        return -1;
+    }
+    ssize_t written = tfs_write(fh, content, FILE_BYTES);
+
+    return tfs_close(fh) == 0 && written == FILE_BYTES ? 0 : -1;
+}
+
+static void run(bench_thread_t *thread) {
+    size_t slots = FILE_BYTES / thread->bt_size;
+    char *buffer = malloc(thread->bt_size);
+    assert(buffer != NULL);
+
+    int fh = tfs_open("/r", 0);
+    assert(fh != -1);
+
+    for (int i = 0; i < OPS; i++) {
+        size_t offset = (size_t)rand_r(&thread->bt_seed) % slots * thread->bt_size;
+
+        uint64_t start = bench_now();
+        assert(tfs_pread(fh, buffer, thread->bt_size, offset) == (ssize_t)thread->bt_size);
+        bench_record(thread, start, thread->bt_size);
+    }
+
+    assert(tfs_close(fh) != -1);
+    free(buffer);
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workload = {.bw_name = "random_pread",
+                                 .bw_sizes = sizes,
+                                 .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                 .bw_max_ops = max_ops,
+                                 .bw_setup = setup,
+                                 .bw_run = run};
+
+    for (size_t i = 0; i < FILE_BYTES; i++) {
+        content[i] = (char)('a' + i % 26);
+    }
+
+    return bench_main(argc, argv, &workload, 1);
+}
@@ -0,0 +1,107 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Read throughput on files whose blocks are interleaved.
+ * N_FILES files are written one BLOCK_SIZE chunk at a time, round robin, so consecutive blocks of
+ * every file are N_FILES blocks apart in the data blocks. Then, for each read size, every file is
+ * read sequentially from start to end by one thread per file, and the aggregate throughput is
+ * printed as CSV (read_size,bytes,seconds,mib_per_sec).
+ */
+
+#define N_FILES 4
+#define SIZE (64 * BLOCK_SIZE)
+
+static char content[N_FILES][SIZE];
+static size_t read_size;
+
+static void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    char buffer[4 * BLOCK_SIZE];
+    size_t total = 0;
+    ssize_t r;
+
+    snprintf(path, sizeof(path), "/f%d", id);
+
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+
+    while ((r = tfs_read(fh, buffer, read_size)) > 0) {
+        assert(memcmp(buffer, content[id] + total, (size_t)r) == 0);
+        total += (size_t)r;
+    }
+    assert(total == SIZE);
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+
+    pthread_t tids[N_FILES];
+    int ids[N_FILES];
+    int fhs[N_FILES];
+    struct timespec start, end;
+
+    for (int i = 0; i < N_FILES; i++) {
+        for (int j = 0; j < SIZE; j++) {
+            content[i][j] = (char)('a' + (i + j) % 26);
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < N_FILES; i++) {
+        char path[MAX_FILE_NAME];
+        snprintf(path, sizeof(path), "/f%d", i);
+        fhs[i] = tfs_open(path, TFS_O_CREAT);
+        assert(fhs[i] != -1);
+    }
+
+    for (size_t written = 0; written < SIZE; written += BLOCK_SIZE) {
+        for (int i = 0; i < N_FILES; i++) {
+            assert(tfs_write(fhs[i], content[i] + written, BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+
+    for (int i = 0; i < N_FILES; i++) {
+        assert(tfs_close(fhs[i]) != -1);
+    }
+
+    printf("read_size,bytes,seconds,mib_per_sec\n");
+
+    for (read_size = 256; read_size <= 4 * BLOCK_SIZE; read_size *= 2) {
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < N_FILES; i++) {
+            ids[i] = i;
+            assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+        }
+
+        for (int i = 0; i < N_FILES; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed(&start, &end);
+        size_t bytes = (size_t)N_FILES * SIZE;
+        printf("%zu,%zu,%.4f,%.2f\n", read_size, bytes, seconds,
+               (double)bytes / (1024.0 * 1024.0) / seconds);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    return 0;
+}
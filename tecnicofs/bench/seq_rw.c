@@ -0,0 +1,140 @@
+#include "harness.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Sequential write and read, one file per thread.
+ * The threads share SEQ_BYTES of file data: PASSES times, each one truncates its file, writes it
+ * in calls of the I/O size and reads it back in calls of the same size.
+ * seq_read only reads the files, written before the run (so scans start with little of them in the
+ * storage cache), PASSES times each.
+ */
+
+#define SEQ_BYTES (512 * BLOCK_SIZE)
+#define PASSES (4)
+#define MAX_IO_SIZE (64 * BLOCK_SIZE)
+
+static size_t const sizes[] = {256, BLOCK_SIZE, 4 * BLOCK_SIZE, 16 * BLOCK_SIZE};
+static char content[MAX_IO_SIZE];
+
+static size_t file_size(int n_threads) { return SEQ_BYTES / (size_t)n_threads; }
+
+static size_t max_ops(int n_threads, size_t size) {
+    size_t calls = (file_size(n_threads) + size - 1) / size;
+    return PASSES * 2 * (calls + 1);
+}
+
+static int setup(int n_threads, size_t size) {
+    (void)n_threads;
+    return size > 0 && size <= MAX_IO_SIZE ? 0 : -1;
+}
+
+static int setup_read(int n_threads, size_t size) {
+    char path[MAX_FILE_NAME];
+
+    if (setup(n_threads, size) == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        snprintf(path, sizeof(path), "/s%d", i);
+
+        int fh = tfs_open(path, TFS_O_CREAT);
+        if (fh == -1) {
+            return -1;
+        }
+
+        for (size_t done = 0; done < file_size(n_threads); done += MAX_IO_SIZE) {
+            size_t len = file_size(n_threads) - done < MAX_IO_SIZE ? file_size(n_threads) - done
+                                                                   : MAX_IO_SIZE;
+
+            if (tfs_write(fh, content, len) != (ssize_t)len) {
+                tfs_close(fh);
+                return -1;
+            }
+        }
+
+        if (tfs_close(fh) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Reads a file to its end in calls of the I/O size */
+static void read_all(bench_thread_t *thread, char const *path, char *buffer) {
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+
+    for (;;) {
+        uint64_t start = bench_now();
+        ssize_t r = tfs_read(fh, buffer, thread->bt_size);
+        assert(r != -1);
+        if (r == 0) {
+            break;
+        }
+        bench_record(thread, start, (size_t)r);
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+static void run(bench_thread_t *thread) {
+    size_t size = file_size(thread->bt_threads);
+    char path[MAX_FILE_NAME];
+    char *buffer = malloc(thread->bt_size);
+    assert(buffer != NULL);
+
+    snprintf(path, sizeof(path), "/s%d", thread->bt_id);
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        int fh = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fh != -1);
+
+        for (size_t done = 0; done < size; done += thread->bt_size) {
+            size_t len = size - done < thread->bt_size ? size - done : thread->bt_size;
+
+            uint64_t start = bench_now();
+            assert(tfs_write(fh, content, len) == (ssize_t)len);
+            bench_record(thread, start, len);
+        }
+        assert(tfs_close(fh) != -1);
+
+        read_all(thread, path, buffer);
+    }
+
+    free(buffer);
+}
+
+static void run_read(bench_thread_t *thread) {
+    char path[MAX_FILE_NAME];
+    char *buffer = malloc(thread->bt_size);
+    assert(buffer != NULL);
+
+    snprintf(path, sizeof(path), "/s%d", thread->bt_id);
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        read_all(thread, path, buffer);
+    }
+
+    free(buffer);
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workloads[] = {{.bw_name = "seq_rw",
+                                     .bw_sizes = sizes,
+                                     .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                     .bw_max_ops = max_ops,
+                                     .bw_setup = setup,
+                                     .bw_run = run},
+                                    {.bw_name = "seq_read",
+                                     .bw_sizes = sizes,
+                                     .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                     .bw_max_ops = max_ops,
+                                     .bw_setup = setup_read,
+                                     .bw_run = run_read}};
+
+    memset(content, 'x', sizeof(content));
+
+    return bench_main(argc, argv, workloads, sizeof(workloads) / sizeof(workloads[0]));
+}
@@ -0,0 +1,72 @@
+#include "harness.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Contention on one open file.
+ * A single file handle, opened before the run, is used by every thread: they append
+ * SHARED_BYTES, all together, in tfs_write calls of the I/O size (which serialize on the offset
+ * of the handle), and then read the file through the same handle with tfs_pread.
+ */
+
+#define SHARED_BYTES (512 * BLOCK_SIZE)
+#define MAX_IO_SIZE (16 * BLOCK_SIZE)
+
+static size_t const sizes[] = {256, BLOCK_SIZE, 4 * BLOCK_SIZE, 16 * BLOCK_SIZE};
+static char content[MAX_IO_SIZE];
+static int shared_fh;
+
+static size_t writes_per_thread(int n_threads, size_t size) {
+    size_t writes = SHARED_BYTES / size / (size_t)n_threads;
+    return writes > 0 ? writes : 1;
+}
+
+static size_t max_ops(int n_threads, size_t size) { return 2 * writes_per_thread(n_threads, size); }
+
+static int setup(int n_threads, size_t size) {
+    (void)n_threads;
+    if (size == 0 || size > MAX_IO_SIZE) {
+        return -1;
+    }
+
+    shared_fh = tfs_open("/shared", TFS_O_CREAT);
+    return shared_fh == -1 ? -1 : 0;
+}
+
+static void run(bench_thread_t *thread) {
+    size_t writes = writes_per_thread(thread->bt_threads, thread->bt_size);
+    char *buffer = malloc(thread->bt_size);
+    assert(buffer != NULL);
+
+    for (size_t i = 0; i < writes; i++) {
+        uint64_t start = bench_now();
+        ssize_t written = tfs_write(shared_fh, content, thread->bt_size);
+        bench_record(thread, start, written > 0 ? (size_t)written : 0);
+    }
+
+    /* Each thread reads back as much as it wrote, from anywhere in the file */
+    size_t slots = writes * (size_t)thread->bt_threads;
+
+    for (size_t i = 0; i < writes; i++) {
+        size_t offset = (size_t)rand_r(&thread->bt_seed) % slots * thread->bt_size;
+
+        uint64_t start = bench_now();
+        ssize_t r = tfs_pread(shared_fh, buffer, thread->bt_size, offset);
+        bench_record(thread, start, r > 0 ? (size_t)r : 0);
+    }
+
+    free(buffer);
+}
+
+int main(int argc, char **argv) {
+    bench_workload_t workload = {.bw_name = "shared_fh",
+                                 .bw_sizes = sizes,
+                                 .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                 .bw_max_ops = max_ops,
+                                 .bw_setup = setup,
+                                 .bw_run = run};
+
+    memset(content, 'x', sizeof(content));
+
+    return bench_main(argc, argv, &workload, 1);
+}
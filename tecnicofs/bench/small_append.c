@@ -0,0 +1,92 @@
+#include "harness.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Small-record ingest: every thread appends records of the I/O size to its own file, APPEND_BYTES
+ * in all, through a plain handle (small_append) and through a TFS_O_BUFFERED one
+ * (small_append_buffered, which includes writing the buffer back at tfs_close). In shared_append,
+ * all of the threads append to one log file instead, each through its own TFS_O_APPEND handle.
+ */
+
+#define APPEND_BYTES (256 * BLOCK_SIZE)
+#define MAX_RECORD (BLOCK_SIZE)
+
+static size_t const sizes[] = {16, 64, 256};
+static char content[MAX_RECORD];
+
+static size_t records(int n_threads, size_t size) {
+    return APPEND_BYTES / (size_t)n_threads / size;
+}
+
+static size_t max_ops(int n_threads, size_t size) { return records(n_threads, size) + 1; }
+
+static int setup(int n_threads, size_t size) {
+    (void)n_threads;
+    return size > 0 && size <= MAX_RECORD ? 0 : -1;
+}
+
+static int setup_shared(int n_threads, size_t size) {
+    if (setup(n_threads, size) != 0) {
+        return -1;
+    }
+
+    int fh = tfs_open("/log", TFS_O_CREAT);
+
+    return fh != -1 && tfs_close(fh) != -1 ? 0 : -1;
+}
+
+static void append(bench_thread_t *thread, char const *path, int flags) {
+    size_t n = records(thread->bt_threads, thread->bt_size);
+
+    int fh = tfs_open(path, TFS_O_CREAT | flags);
+    assert(fh != -1);
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start = bench_now();
+        assert(tfs_write(fh, content, thread->bt_size) == (ssize_t)thread->bt_size);
+        bench_record(thread, start, thread->bt_size);
+    }
+
+    uint64_t start = bench_now();
+    assert(tfs_close(fh) != -1);
+    bench_record(thread, start, 0);
+}
+
+static void append_own(bench_thread_t *thread, int flags) {
+    char path[MAX_FILE_NAME];
+
+    snprintf(path, sizeof(path), "/a%d", thread->bt_id);
+    append(thread, path, flags);
+}
+
+static void run(bench_thread_t *thread) { append_own(thread, 0); }
+
+static void run_buffered(bench_thread_t *thread) { append_own(thread, TFS_O_BUFFERED); }
+
+static void run_shared(bench_thread_t *thread) { append(thread, "/log", TFS_O_APPEND); }
+
+int main(int argc, char **argv) {
+    bench_workload_t workloads[] = {{.bw_name = "small_append",
+                                     .bw_sizes = sizes,
+                                     .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                     .bw_max_ops = max_ops,
+                                     .bw_setup = setup,
+                                     .bw_run = run},
+                                    {.bw_name = "small_append_buffered",
+                                     .bw_sizes = sizes,
+                                     .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                     .bw_max_ops = max_ops,
+                                     .bw_setup = setup,
+                                     .bw_run = run_buffered},
+                                    {.bw_name = "shared_append",
+                                     .bw_sizes = sizes,
+                                     .bw_n_sizes = sizeof(sizes) / sizeof(sizes[0]),
+                                     .bw_max_ops = max_ops,
+                                     .bw_setup = setup_shared,
+                                     .bw_run = run_shared}};
+
+    memset(content, 'x', sizeof(content));
+
+    return bench_main(argc, argv, workloads, sizeof(workloads) / sizeof(workloads[0]));
+}
@@ -0,0 +1,310 @@
+#include "async.h"
+#include <pthread.h>
+
+#define AIO_MAX_ENTRIES (1u << 16)
+
+struct tfs_aio {
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted; // workers wait for entries
+    pthread_cond_t completed; // reapers wait for completions
+
+    /* Rings: head and tail only grow, and index the entries mod their size */
+    tfs_aio_sqe_t *sq;
+    unsigned sq_mask;
+    unsigned sq_head;
+    unsigned sq_tail;
+    tfs_aio_cqe_t *cq;
+    unsigned cq_mask;
+    unsigned cq_head;
+    unsigned cq_tail;
+    unsigned in_flight; // submitted and not reaped
+
+    bool stopping;
+    int n_workers;
+    pthread_t *workers;
+    tfs_ctx_t *ctx; // of the thread that created the queue, which workers use
+};
+
+/* Inumber of the file an open file handle refers to, -1 if none */
+static int aio_inumber(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+
+    return file != NULL ? file->of_inumber : -1;
+}
+
+/* Tells whether an entry can run in the same call as the one before it */
+static bool aio_mergeable(tfs_aio_sqe_t const *prev, tfs_aio_sqe_t const *next) {
+    if (prev->sqe_op != next->sqe_op || prev->sqe_len == 0 || next->sqe_len == 0) {
+        return false;
+    }
+
+    switch (next->sqe_op) {
+    case TFS_AIO_READ:
+    case TFS_AIO_WRITE:
+        return prev->sqe_fhandle == next->sqe_fhandle;
+    case TFS_AIO_PREAD:
+    case TFS_AIO_PWRITE:
+        if (prev->sqe_len > SIZE_MAX - prev->sqe_offset ||
+            prev->sqe_offset + prev->sqe_len != next->sqe_offset) {
+            return false;
+        }
+        return prev->sqe_fhandle == next->sqe_fhandle ||
+               (aio_inumber(prev->sqe_fhandle) != -1 &&
+                aio_inumber(prev->sqe_fhandle) == aio_inumber(next->sqe_fhandle));
+    case TFS_AIO_OPEN:
+    case TFS_AIO_CLOSE:
+    default:
+        return false;
+    }
+}
+
+/*
+ * Takes the entry at the head of the submission ring, and the ones after
+ * it that merge with it (caller holds the queue mutex)
+ * Returns the number of entries taken
+ */
+static unsigned aio_take(tfs_aio_t *aio, tfs_aio_sqe_t *batch) {
+    unsigned n = 0;
+
+    batch[n++] = aio->sq[aio->sq_head++ & aio->sq_mask];
+
+    while (n < AIO_MERGE_MAX && aio->sq_head != aio->sq_tail &&
+           aio_mergeable(&batch[n - 1], &aio->sq[aio->sq_head & aio->sq_mask])) {
+        batch[n++] = aio->sq[aio->sq_head++ & aio->sq_mask];
+    }
+
+    return n;
+}
+
+/* Runs one entry */
+static ssize_t aio_run_one(tfs_aio_sqe_t const *sqe) {
+    switch (sqe->sqe_op) {
+    case TFS_AIO_OPEN:
+        return tfs_open(sqe->sqe_path, sqe->sqe_flags);
+    case TFS_AIO_CLOSE:
+        return tfs_close(sqe->sqe_fhandle);
+    case TFS_AIO_READ:
+        return tfs_read(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len);
+    case TFS_AIO_WRITE:
+        return tfs_write(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len);
+    case TFS_AIO_PREAD:
+        return tfs_pread(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len, sqe->sqe_offset);
+    case TFS_AIO_PWRITE:
+        return tfs_pwrite(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len, sqe->sqe_offset);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Runs a batch of entries taken by aio_take, as a single call if there is
+ * more than one, and fills in their completions
+ */
+static void aio_run(tfs_aio_sqe_t const *batch, unsigned n, tfs_aio_cqe_t *done) {
+    struct iovec iov[AIO_MERGE_MAX];
+    ssize_t result;
+
+    if (n == 1) {
+        done[0] = (tfs_aio_cqe_t){batch[0].sqe_user_data, aio_run_one(&batch[0])};
+        return;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        iov[i] = (struct iovec){.iov_base = batch[i].sqe_buffer, .iov_len = batch[i].sqe_len};
+    }
+
+    switch (batch[0].sqe_op) {
+    case TFS_AIO_READ:
+        result = tfs_readv(batch[0].sqe_fhandle, iov, (int)n);
+        break;
+    case TFS_AIO_WRITE:
+        result = tfs_writev(batch[0].sqe_fhandle, iov, (int)n);
+        break;
+    case TFS_AIO_PREAD:
+        result = tfs_preadv(batch[0].sqe_fhandle, iov, (int)n, batch[0].sqe_offset);
+        break;
+    case TFS_AIO_PWRITE:
+        result = tfs_pwritev(batch[0].sqe_fhandle, iov, (int)n, batch[0].sqe_offset);
+        break;
+    case TFS_AIO_OPEN:
+    case TFS_AIO_CLOSE:
+    default:
+        result = -1;
+        break;
+    }
+
+    /* The bytes moved are assigned to the entries in order, as if they had
+     * run one after another */
+    size_t left = result > 0 ? (size_t)result : 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        size_t share = left < batch[i].sqe_len ? left : batch[i].sqe_len;
+
+        done[i] = (tfs_aio_cqe_t){batch[i].sqe_user_data, result == -1 ? -1 : (ssize_t)share};
+        left -= share;
+    }
+}
+
+static void *aio_worker(void *arg) {
+    tfs_aio_t *aio = (tfs_aio_t *)arg;
+    tfs_aio_sqe_t batch[AIO_MERGE_MAX];
+    tfs_aio_cqe_t done[AIO_MERGE_MAX];
+
+    tfs_ctx_use(aio->ctx);
+    mutex_lock(&(aio->mutex));
+
+    for (;;) {
+        while (aio->sq_head == aio->sq_tail && !aio->stopping) {
+            pthread_cond_wait(&(aio->submitted), &(aio->mutex));
+        }
+
+        /* Stopping, and every entry was taken */
+        if (aio->sq_head == aio->sq_tail) {
+            break;
+        }
+
+        unsigned n = aio_take(aio, batch);
+
+        mutex_unlock(&(aio->mutex));
+        aio_run(batch, n, done);
+        mutex_lock(&(aio->mutex));
+
+        /* There is room: submissions never exceed the completion ring */
+        for (unsigned i = 0; i < n; i++) {
+            aio->cq[aio->cq_tail++ & aio->cq_mask] = done[i];
+        }
+        pthread_cond_broadcast(&(aio->completed));
+    }
+
+    mutex_unlock(&(aio->mutex));
+
+    return (void *)NULL;
+}
+
+/* Stops the first n_workers workers of a queue and frees it */
+static void aio_free(tfs_aio_t *aio, int n_workers) {
+    mutex_lock(&(aio->mutex));
+    aio->stopping = true;
+    pthread_cond_broadcast(&(aio->submitted));
+    mutex_unlock(&(aio->mutex));
+
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(aio->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&(aio->completed));
+    pthread_cond_destroy(&(aio->submitted));
+    pthread_mutex_destroy(&(aio->mutex));
+    free(aio->workers);
+    free(aio->cq);
+    free(aio->sq);
+    free(aio);
+}
+
+tfs_aio_t *tfs_aio_create(unsigned entries, int n_workers) {
+    if (entries == 0 || entries > AIO_MAX_ENTRIES || n_workers < 1) {
+        return NULL;
+    }
+
+    unsigned size = 1;
+    while (size < entries) {
+        size <<= 1;
+    }
+
+    tfs_aio_t *aio = calloc(1, sizeof(tfs_aio_t));
+    if (aio == NULL) {
+        return NULL;
+    }
+
+    aio->sq = malloc(size * sizeof(tfs_aio_sqe_t));
+    aio->cq = malloc(2 * size * sizeof(tfs_aio_cqe_t));
+    aio->workers = malloc((size_t)n_workers * sizeof(pthread_t));
+    aio->sq_mask = size - 1;
+    aio->cq_mask = 2 * size - 1;
+    aio->n_workers = n_workers;
+    aio->ctx = tfs_ctx_current();
+
+    if (aio->sq == NULL || aio->cq == NULL || aio->workers == NULL ||
+        pthread_mutex_init(&(aio->mutex), NULL) != 0) {
+        free(aio->workers);
+        free(aio->cq);
+        free(aio->sq);
+        free(aio);
+        return NULL;
+    }
+    pthread_cond_init(&(aio->submitted), NULL);
+    pthread_cond_init(&(aio->completed), NULL);
+
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&(aio->workers[i]), NULL, aio_worker, aio) != 0) {
+            aio_free(aio, i);
+            return NULL;
+        }
+    }
+
+    return aio;
+}
+
+int tfs_aio_submit(tfs_aio_t *aio, tfs_aio_sqe_t const *sqes, unsigned n) {
+    if (aio == NULL || (sqes == NULL && n > 0)) {
+        return -1;
+    }
+
+    mutex_lock(&(aio->mutex));
+
+    unsigned sq_free = aio->sq_mask + 1 - (aio->sq_tail - aio->sq_head);
+    unsigned cq_free = aio->cq_mask + 1 - aio->in_flight;
+    unsigned queued = n < sq_free ? n : sq_free;
+
+    queued = queued < cq_free ? queued : cq_free;
+
+    for (unsigned i = 0; i < queued; i++) {
+        aio->sq[aio->sq_tail++ & aio->sq_mask] = sqes[i];
+    }
+    aio->in_flight += queued;
+
+    if (queued > 0) {
+        pthread_cond_broadcast(&(aio->submitted));
+    }
+
+    mutex_unlock(&(aio->mutex));
+
+    return (int)queued;
+}
+
+int tfs_aio_reap(tfs_aio_t *aio, tfs_aio_cqe_t *cqes, unsigned max, unsigned min_complete) {
+    if (aio == NULL || (cqes == NULL && max > 0)) {
+        return -1;
+    }
+
+    mutex_lock(&(aio->mutex));
+
+    unsigned wait_for = min_complete < max ? min_complete : max;
+    wait_for = wait_for < aio->in_flight ? wait_for : aio->in_flight;
+
+    while (aio->cq_tail - aio->cq_head < wait_for) {
+        pthread_cond_wait(&(aio->completed), &(aio->mutex));
+    }
+
+    unsigned ready = aio->cq_tail - aio->cq_head;
+    unsigned reaped = ready < max ? ready : max;
+
+    for (unsigned i = 0; i < reaped; i++) {
+        cqes[i] = aio->cq[aio->cq_head++ & aio->cq_mask];
+    }
+    aio->in_flight -= reaped;
+
+    mutex_unlock(&(aio->mutex));
+
+    return (int)reaped;
+}
+
+int tfs_aio_destroy(tfs_aio_t *aio) {
+    if (aio == NULL) {
+        return -1;
+    }
+
+    aio_free(aio, aio->n_workers);
+
+    return 0;
+}
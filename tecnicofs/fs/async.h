@@ -0,0 +1,94 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "operations.h"
+#include <stdint.h>
+
+/*
+ * Asynchronous front-end: a pair of rings, like io_uring. Callers put
+ * submission entries (SQEs) in the submission ring and a pool of worker
+ * threads runs them with the tfs_* calls, putting a completion entry (CQE)
+ * with the result in the completion ring, where the callers reap them in
+ * batches.
+ *
+ * Entries that are queued one after another are merged into a single call
+ * (of up to AIO_MERGE_MAX entries) when they are:
+ *  - reads (or writes) of the same file handle, which become a tfs_readv
+ *    (or tfs_writev);
+ *  - positional reads (or writes) of the same file, each starting where
+ *    the previous one ends, which become a tfs_preadv (or tfs_pwritev).
+ * Each entry still gets its own CQE, with its share of the bytes moved.
+ *
+ * Entries that are not merged may run in any order (a read or a close on
+ * the handle of an open has to be submitted after the open completes).
+ */
+
+typedef enum {
+    TFS_AIO_OPEN,   // tfs_open(sqe_path, sqe_flags)
+    TFS_AIO_CLOSE,  // tfs_close(sqe_fhandle)
+    TFS_AIO_READ,   // tfs_read(sqe_fhandle, sqe_buffer, sqe_len)
+    TFS_AIO_WRITE,  // tfs_write(sqe_fhandle, sqe_buffer, sqe_len)
+    TFS_AIO_PREAD,  // tfs_pread(sqe_fhandle, sqe_buffer, sqe_len, sqe_offset)
+    TFS_AIO_PWRITE, // tfs_pwrite(sqe_fhandle, sqe_buffer, sqe_len, sqe_offset)
+} tfs_aio_op_t;
+
+/* Submission entry */
+typedef struct {
+    tfs_aio_op_t sqe_op;
+    int sqe_fhandle;
+    char const *sqe_path; // must stay valid until the entry completes
+    int sqe_flags;
+    void *sqe_buffer;     // must stay valid until the entry completes
+    size_t sqe_len;
+    size_t sqe_offset;
+    uint64_t sqe_user_data; // copied to the CQE
+} tfs_aio_sqe_t;
+
+/* Completion entry */
+typedef struct {
+    uint64_t cqe_user_data;
+    ssize_t cqe_result; // what the tfs_* call returned
+} tfs_aio_cqe_t;
+
+typedef struct tfs_aio tfs_aio_t;
+
+/*
+ * Creates a queue
+ * Input:
+ *  - entries: size of the submission ring (rounded up to a power of two),
+ *    and half of the completion ring
+ *  - n_workers: threads that run the entries
+ * Returns the queue, NULL if unsuccessful
+ */
+tfs_aio_t *tfs_aio_create(unsigned entries, int n_workers);
+
+/*
+ * Submits entries, which are copied to the submission ring.
+ * Input:
+ *  - aio: the queue
+ *  - sqes: array of n entries
+ * Returns the number of entries queued, which is lower than n when either
+ * ring is full (entries submitted but not reaped count against the
+ * completion ring), or -1 if unsuccessful
+ */
+int tfs_aio_submit(tfs_aio_t *aio, tfs_aio_sqe_t const *sqes, unsigned n);
+
+/*
+ * Reaps completions, waiting until at least min_complete of them are
+ * there (fewer if fewer are pending)
+ * Input:
+ *  - aio: the queue
+ *  - cqes: array filled with up to max completions
+ *  - min_complete: completions to wait for (0 does not wait)
+ * Returns the number of completions reaped, or -1 if unsuccessful
+ */
+int tfs_aio_reap(tfs_aio_t *aio, tfs_aio_cqe_t *cqes, unsigned max, unsigned min_complete);
+
+/*
+ * Runs the entries that were submitted, stops the workers and frees the
+ * queue (completions that were not reaped are dropped)
+ * Returns 0 if successful, -1 otherwise
+ */
+int tfs_aio_destroy(tfs_aio_t *aio);
+
+#endif // ASYNC_H
@@ -4,22 +4,77 @@
 /* FS root inode number */
 #define ROOT_DIR_INUM (0)
 
+/* Geometry of tfs_init and tfs_mount; tfs_init_with_params may choose
+ * another block size (a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE),
+ * number of blocks and of i-nodes, and open files (up to MAX_OPEN_FILES) */
 #define BLOCK_SIZE (1024)
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (64 * 1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
-#define MAX_OPEN_FILES (20)
+/* Open file table: handles are allocated OPEN_FILE_SEGMENT entries at a
+ * time, up to MAX_OPEN_FILES (a power of two), and each thread keeps up to
+ * OPEN_FILE_CACHE closed entries for its next opens (0 disables it) */
+#define MAX_OPEN_FILES (1 << 16)
+#define OPEN_FILE_SEGMENT (256)
+#define OPEN_FILE_CACHE (8)
 #define MAX_FILE_NAME (40)
+/* Volumes a process hosts at once: the one of tfs_init and those of
+ * tfs_ctx_create */
+#define MAX_CONTEXTS (8)
+/* tfs_open_many and tfs_stat_many: most names of a directory looked up in
+ * one pass over it */
+#define BATCH_LOOKUP (64)
 
+/* Simulated storage: latency model of a cache miss (see device_model_t),
+ * and blocks and i-nodes the cache holds (0 charges every access) */
+#define DEVICE_MODEL (DEVICE_FIXED)
 #define DELAY (5000)
+#define DELAY_JITTER (0)
+#define CACHE_FRAMES (256)
 
-#define INT_SIZE (4)
-#define MAX_DATA_BLOCKS_FOR_INODE (10 + BLOCK_SIZE / INT_SIZE)
-#define MAX_BYTES (272384)
-#define MAX_DIRECT_BLOCKS (10)
-#define MAX_BYTES_DIRECT_DATA (10240)
-#define I_BLOCK_SIZE (11)
+/* Group commit of the metadata journal (images mounted with tfs_mount) */
+#define JOURNAL_COMMIT_US (0)
+#define JOURNAL_BATCH (1)
 
-#define BUFFER_SIZE (100)
+#define INODE_EXTENTS (3)
+
+/* Attempts a mutex spins for before it blocks (0 blocks right away) */
+#define LOCK_SPIN (50)
+
+/* Per-thread counters of calls, locks and the storage cache (see
+ * tfs_stats_snapshot); 0 compiles them out */
+#define STATS_ENABLED (1)
+
+/* CRC32C of every file data block, kept in the image next to the bitmap:
+ * writes update it, reads and tfs_scrub check it; 0 compiles it out. The
+ * volumes of tfs_init and tfs_mount scrub in the background every
+ * SCRUB_INTERVAL_MS (0 for never). */
+#define BLOCK_CHECKSUMS (1)
+#define SCRUB_INTERVAL_MS (0)
+
+/* Read-ahead of sequential reads: blocks the window starts at and grows
+ * up to (doubling each time it is used), 0 disables it; it never exceeds
+ * a quarter of the storage cache */
+#define READ_AHEAD_MIN (4)
+#define READ_AHEAD_MAX (64)
+
+/* Write-back buffer of each i-node written through TFS_O_BUFFERED handles
+ * (rounded up to whole blocks of the volume) */
+#define WRITE_BUFFER_SIZE (16 * BLOCK_SIZE)
+
+/* Asynchronous queue (see async.h): most adjacent entries a worker merges
+ * into a single call */
+#define AIO_MERGE_MAX (16)
+
+/* Segments handed to each writev by tfs_copy_to_external_fs */
+#define EXPORT_SEGMENTS (64)
+
+/* tfs_copy_from_external_fs: buffer for sources that cannot be mapped, and
+ * the smallest range (and most threads) of a parallel import */
+#define IMPORT_BUFFER_SIZE (64 * BLOCK_SIZE)
+#define IMPORT_RANGE_MIN (64 * BLOCK_SIZE)
+#define IMPORT_MAX_THREADS (16)
 
 #define NOTHING_TO_WRITE "Data Error : Nothing to Write\n"
 #define WRITE_ERROR "Write Error: Error writting the content\n"
@@ -1,514 +1,1570 @@
 #include "operations.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Write-back buffers (TFS_O_BUFFERED), one per i-node: the writes of a
+ * buffered handle that continue the file where it (with its buffer) ends
+ * are gathered in memory, and written to the file as whole blocks when the
+ * buffer fills up. Every other access to the i-node writes the buffer back
+ * first, so the buffer only ever holds the end of the file.
+ * wb_len is also read without the mutex, to skip empty buffers.
+ */
+typedef struct {
+    pthread_mutex_t wb_mutex;
+    _Atomic size_t wb_len; // bytes buffered
+    size_t wb_base;        // offset in the file of the first one
+    uint8_t *wb_data;      // write_buffer_size_s bytes, allocated on first use
+} write_buffer_t;
+
+/*
+ * Contexts: the volume of each context slot of state.c (slot 0 is the one
+ * of tfs_init), with what this file keeps for it. A thread works on the
+ * volume of the context it uses (see tfs_ctx_use).
+ */
+struct tfs_ctx {
+    /* Files currently open, and whether tfs_destroy_after_all_closed is
+     * waiting for them to be closed (the last tfs_close then signals closed) */
+    struct {
+        atomic_size_t open;
+        atomic_bool draining;
+        pthread_mutex_t mutex;
+        pthread_cond_t closed;
+    } tc_open_files;
+    write_buffer_t *tc_write_buffers;
+    size_t tc_write_buffer_size; // WRITE_BUFFER_SIZE, rounded up to whole blocks
+};
+
+static tfs_ctx_t contexts_s[MAX_CONTEXTS];
+static pthread_once_t contexts_once = PTHREAD_ONCE_INIT;
+
+#define open_files_s (contexts_s[state_ctx()].tc_open_files)
+#define write_buffers_s (contexts_s[state_ctx()].tc_write_buffers)
+#define write_buffer_size_s (contexts_s[state_ctx()].tc_write_buffer_size)
+
+static void contexts_init() {
+    for (size_t i = 0; i < MAX_CONTEXTS; i++) {
+        pthread_mutex_init(&(contexts_s[i].tc_open_files.mutex), NULL);
+        pthread_cond_init(&(contexts_s[i].tc_open_files.closed), NULL);
+    }
+}
+
+/*
+ * Initializes the FS state and, unless an existing image was mounted,
+ * creates the root directory
+ */
+static int tfs_start(state_params_t const *params) {
+    pthread_once(&contexts_once, contexts_init);
+
+    if (state_init(params) == -1) {
+        return -1;
+    }
+
+    atomic_store(&(open_files_s.open), 0);
+    atomic_store(&(open_files_s.draining), false);
+
+    size_t block_size = state_block_size();
+
+    write_buffer_size_s = (WRITE_BUFFER_SIZE + block_size - 1) / block_size * block_size;
+    write_buffers_s = malloc(state_inodes() * sizeof(write_buffer_t));
+
+    if (write_buffers_s == NULL) {
+        state_destroy();
+        return -1;
+    }
+
+    for (size_t i = 0; i < state_inodes(); i++) {
+        write_buffer_t *buffer = &(write_buffers_s[i]);
+
+        pthread_mutex_init(&(buffer->wb_mutex), NULL);
+        atomic_store(&(buffer->wb_len), 0);
+        buffer->wb_data = NULL;
+    }
+
+    if (state_mounted()) {
+        return 0;
+    }
 
-int tfs_init() {
-    state_init();
     /* create root inode */
     int root = inode_create(T_DIRECTORY);
     if (root != ROOT_DIR_INUM) {
+        tfs_destroy();
         return -1;
     }
 
     return 0;
 }
 
+int tfs_init() { return tfs_start(NULL); }
+
+/*
+ * Initializes tecnicofs with the geometry of params (populated if the
+ * volume is being placed on a NUMA node)
+ */
+static int tfs_start_with(tfs_params_t const *params, bool populate) {
+    if (params == NULL) {
+        return -1;
+    }
+
+    state_params_t state_params = {
+        .block_size = params->tp_block_size,
+        .data_blocks = params->tp_data_blocks != 0 ? params->tp_data_blocks : DATA_BLOCKS,
+        .inodes = params->tp_inodes,
+        .max_open_files = params->tp_max_open_files,
+        .image_path = params->tp_image_path,
+        .journal_commit_us = JOURNAL_COMMIT_US,
+        .journal_batch = JOURNAL_BATCH,
+        .device = {.dm_kind = DEVICE_MODEL, .dm_delay = DELAY, .dm_jitter = DELAY_JITTER},
+        .cache_frames = CACHE_FRAMES,
+        .populate = populate,
+        .scrub_interval_ms = params->tp_scrub_interval_ms};
+
+    return tfs_start(&state_params);
+}
+
+int tfs_init_with_params(tfs_params_t const *params) { return tfs_start_with(params, false); }
+
+int tfs_mount(char const *image_path) {
+    tfs_params_t params = {.tp_image_path = image_path, .tp_scrub_interval_ms = SCRUB_INTERVAL_MS};
+
+    if (image_path == NULL) {
+        return -1;
+    }
+
+    return tfs_init_with_params(&params);
+}
+
+tfs_ctx_t *tfs_ctx_create(tfs_params_t const *params, int numa_node) {
+    tfs_params_t const defaults = {0};
+    uint64_t cpus[NUMA_CPU_WORDS];
+    int slot = state_ctx_alloc();
+
+    if (slot == -1) {
+        return NULL;
+    }
+
+    /* Set up from the node, the volume has its memory there */
+    if (numa_node >= 0 && state_numa_pin(numa_node, cpus) == -1) {
+        state_ctx_free(slot);
+        return NULL;
+    }
+
+    int previous = state_ctx_use(slot);
+    int status = tfs_start_with(params != NULL ? params : &defaults, numa_node >= 0);
+    state_ctx_use(previous);
+
+    if (numa_node >= 0) {
+        state_numa_restore(cpus);
+    }
+
+    if (status == -1) {
+        state_ctx_free(slot);
+        return NULL;
+    }
+
+    return &(contexts_s[slot]);
+}
+
+int tfs_ctx_destroy(tfs_ctx_t *ctx) {
+    if (ctx == NULL || ctx == &(contexts_s[0])) {
+        return -1;
+    }
+
+    int slot = (int)(ctx - contexts_s);
+    int previous = state_ctx_use(slot);
+    int status = tfs_destroy();
+
+    /* A thread that used the context goes back to the default one */
+    state_ctx_use(previous == slot ? 0 : previous);
+    state_ctx_free(slot);
+
+    return status;
+}
+
+tfs_ctx_t *tfs_ctx_use(tfs_ctx_t *ctx) {
+    int previous = state_ctx_use(ctx == NULL ? 0 : (int)(ctx - contexts_s));
+
+    return &(contexts_s[previous]);
+}
+
+tfs_ctx_t *tfs_ctx_current() { return &(contexts_s[state_ctx()]); }
+
+/*
+ * Writes the bytes buffered for an i-node to the file (caller holds the
+ * buffer mutex)
+ * Inputs:
+ *  - inode, buffer
+ *  - whole_blocks: write only up to the last block boundary they reach,
+ *    and keep the rest buffered (unless that is all of them)
+ * Returns: 0 if sucessful, -1 otherwise (the bytes are dropped)
+ */
+static int write_buffer_flush(inode_t *inode, write_buffer_t *buffer, bool whole_blocks) {
+    size_t len = atomic_load_explicit(&(buffer->wb_len), memory_order_relaxed);
+    size_t end = buffer->wb_base + len;
+    size_t flush = len;
+    size_t end_block = end & ~(state_block_size() - 1);
+
+    if (whole_blocks && end_block > buffer->wb_base) {
+        flush = end_block - buffer->wb_base;
+    }
+
+    if (flush == 0) {
+        return 0;
+    }
+
+    struct iovec iov = {.iov_base = buffer->wb_data, .iov_len = flush};
+    ssize_t written = -1;
+
+    if (inode_range_lock(inode, buffer->wb_base, flush, WRITE) == 0) {
+        written = inode_pwritev(inode, &iov, 1, buffer->wb_base);
+
+        if (inode_range_unlock(inode, buffer->wb_base, flush, WRITE) != 0) {
+            written = -1;
+        }
+    }
+
+    memmove(buffer->wb_data, buffer->wb_data + flush, len - flush);
+    buffer->wb_base += flush;
+    atomic_store_explicit(&(buffer->wb_len), len - flush, memory_order_relaxed);
+
+    journal_commit();
+
+    if (written != (ssize_t)flush) {
+        printf("[ write_buffer_flush ] %s", WRITE_ERROR);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes back what is buffered for an i-node, before another access to it
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int write_buffer_sync(inode_t *inode) {
+    write_buffer_t *buffer = &(write_buffers_s[inode_number(inode)]);
+
+    if (atomic_load_explicit(&(buffer->wb_len), memory_order_acquire) == 0) {
+        return 0;
+    }
+
+    mutex_lock(&(buffer->wb_mutex));
+    int status = write_buffer_flush(inode, buffer, false);
+    mutex_unlock(&(buffer->wb_mutex));
+
+    return status;
+}
+
+/*
+ * Buffers a write of a buffered handle (caller holds the file entry) if
+ * it starts where the file, with its buffer, ends and fits in the buffer;
+ * otherwise writes the buffer back, for the caller to write the file
+ * Returns: the bytes buffered (to_write), 0 if nothing was, -1 if
+ * the buffer could not be written back
+ */
+static ssize_t write_buffer_append(inode_t *inode, open_file_entry_t *file,
+                                   struct iovec const *iov, int iovcnt, size_t to_write) {
+    write_buffer_t *buffer = &(write_buffers_s[inode_number(inode)]);
+
+    mutex_lock(&(buffer->wb_mutex));
+
+    size_t len = atomic_load_explicit(&(buffer->wb_len), memory_order_relaxed);
+    size_t end = len > 0 ? buffer->wb_base + len : inode->i_size;
+
+    if (buffer->wb_data == NULL) {
+        buffer->wb_data = malloc(write_buffer_size_s);
+    }
+
+    if (buffer->wb_data == NULL || file->of_offset != end || to_write > write_buffer_size_s) {
+        int status = write_buffer_flush(inode, buffer, false);
+        mutex_unlock(&(buffer->wb_mutex));
+        return status;
+    }
+
+    if (len == 0) {
+        buffer->wb_base = end;
+    }
+
+    /* Whole blocks are written out to make room, then all of it if that is
+     * not enough */
+    if (len + to_write > write_buffer_size_s &&
+        (write_buffer_flush(inode, buffer, true) == -1 ||
+         (atomic_load_explicit(&(buffer->wb_len), memory_order_relaxed) + to_write >
+              write_buffer_size_s &&
+          write_buffer_flush(inode, buffer, false) == -1))) {
+        mutex_unlock(&(buffer->wb_mutex));
+        return -1;
+    }
+
+    len = atomic_load_explicit(&(buffer->wb_len), memory_order_relaxed);
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0) {
+            memcpy(buffer->wb_data + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+    }
+    atomic_store_explicit(&(buffer->wb_len), len, memory_order_release);
+    file->of_offset += to_write;
+
+    int status = len == write_buffer_size_s ? write_buffer_flush(inode, buffer, true) : 0;
+
+    mutex_unlock(&(buffer->wb_mutex));
+
+    return status == -1 ? -1 : (ssize_t)to_write;
+}
+
 int tfs_destroy() {
+    for (size_t i = 0; write_buffers_s != NULL && i < state_inodes(); i++) {
+        write_buffer_t *buffer = &(write_buffers_s[i]);
+
+        if (atomic_load(&(buffer->wb_len)) > 0) {
+            write_buffer_sync(inode_get((int)i));
+        }
+        free(buffer->wb_data);
+        buffer->wb_data = NULL;
+        pthread_mutex_destroy(&(buffer->wb_mutex));
+    }
+
+    free(write_buffers_s);
+    write_buffers_s = NULL;
+
     state_destroy();
     return 0;
 }
 
+int tfs_set_device_model(device_model_t const *model) { return state_set_device(model); }
+
+/*
+ * Uncounts n files that were closed (or could not be opened), and wakes up
+ * a drain that waits for the last one
+ */
+static void open_files_leave(size_t n) {
+    if (n > 0 && atomic_fetch_sub(&(open_files_s.open), n) == n &&
+        atomic_load(&(open_files_s.draining))) {
+        pthread_mutex_lock(&(open_files_s.mutex));
+        pthread_cond_broadcast(&(open_files_s.closed));
+        pthread_mutex_unlock(&(open_files_s.mutex));
+    }
+}
+
+/*
+ * Counts n files that are about to be opened, unless tecnicofs is draining
+ * Returns: true if they may be opened, false otherwise
+ */
+static bool open_files_enter(size_t n) {
+    atomic_fetch_add(&(open_files_s.open), n);
+
+    /* Seen after the count went up, so either the drain sees these files or
+     * the files see the drain */
+    if (atomic_load(&(open_files_s.draining))) {
+        open_files_leave(n);
+        return false;
+    }
+    return true;
+}
+
+int tfs_destroy_after_all_closed() {
+    bool draining = false;
+
+    /* From now on, tfs_open fails right away */
+    if (!atomic_compare_exchange_strong(&(open_files_s.draining), &draining, true)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&(open_files_s.mutex));
+    while (atomic_load(&(open_files_s.open)) > 0) {
+        pthread_cond_wait(&(open_files_s.closed), &(open_files_s.mutex));
+    }
+    pthread_mutex_unlock(&(open_files_s.mutex));
+
+    return tfs_destroy();
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
-int tfs_lookup(char const *name) {
-    if (!valid_pathname(name)) {
+/*
+ * Walks a path down to the directory holding its last component
+ * Input:
+ *  - name: absolute path name
+ *  - leaf: set to the last component of the path (points into name)
+ * Returns: inumber of that directory, -1 if some component is missing
+ */
+static int lookup_parent(char const *name, char const **leaf) {
+    char component[MAX_FILE_NAME];
+    int inum = ROOT_DIR_INUM;
+
+    // skip the initial '/' character
+    name++;
+
+    for (char const *slash = strchr(name, '/'); slash != NULL; slash = strchr(name, '/')) {
+        size_t len = (size_t)(slash - name);
+
+        if (len == 0 || len >= MAX_FILE_NAME) {
+            return -1;
+        }
+
+        memcpy(component, name, len);
+        component[len] = '\0';
+
+        inum = find_in_dir(inum, component);
+        if (inum == -1) {
+            return -1;
+        }
+
+        name = slash + 1;
+    }
+
+    if (strlen(name) == 0) {
+        return -1;
+    }
+
+    *leaf = name;
+    return inum;
+}
+
+static int path_lookup(char const *name) {
+    char const *leaf;
+
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    int parent = lookup_parent(name, &leaf);
+    if (parent == -1) {
+        return -1;
+    }
+
+    return find_in_dir(parent, leaf);
+}
+
+int tfs_lookup(char const *name) {
+    uint64_t start = stats_clock();
+    int inum = path_lookup(name);
+    stats_op_end(STATS_OP_LOOKUP, start);
+    return inum;
+}
+
+static int dir_make(char const *name) {
+    char const *leaf;
+
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    int parent = lookup_parent(name, &leaf);
+    if (parent == -1) {
+        return -1;
+    }
+
+    int inum = inode_create(T_DIRECTORY);
+    if (inum == -1) {
+        return -1;
+    }
+
+    if (add_dir_entry(parent, inum, leaf) == -1) {
+        inode_delete(inum);
+        return -1;
+    }
+
+    journal_commit();
+
+    return 0;
+}
+
+int tfs_mkdir(char const *name) {
+    uint64_t start = stats_clock();
+    int status = dir_make(name);
+    stats_op_end(STATS_OP_MKDIR, start);
+    return status;
+}
+
+/*
+ * Prepares an existing file to be opened: writes back what is buffered
+ * for it (its size has to include it, or be truncated after it), and
+ * truncates it if requested
+ * Input:
+ *  - inum: inumber of the file
+ *  - flags: flags it is opened with
+ *  - offset: set to its initial offset
+ * Returns: 0 if successful, -1 otherwise (also for a directory)
+ */
+static int open_inode(int inum, int flags, size_t *offset) {
+    inode_t *inode = inode_get(inum);
+
+    if (inode == NULL || inode->i_node_type == T_DIRECTORY || write_buffer_sync(inode) != 0) {
+        return -1;
+    }
+
+    /* Neither truncated nor appended to: the size does not matter */
+    if (!(flags & (TFS_O_TRUNC | TFS_O_APPEND))) {
+        *offset = 0;
+        return 0;
+    }
+
+    if (inode_lock(inode) != 0) {
+        return -1;
+    }
+
+    /* Trucate (if requested) */
+    if (flags & TFS_O_TRUNC) {
+
+        inode_range_lock(inode, 0, SIZE_MAX, WRITE);
+
+        int status = inode->i_size > 0 ? inode_truncate(inode) : 0;
+
+        inode_range_unlock(inode, 0, SIZE_MAX, WRITE);
+
+        if (status == -1) {
+            inode_unlock(inode);
+            return -1;
+        }
+    }
+    /* Determine initial offset */
+    if (flags & TFS_O_APPEND) {
+        *offset = inode->i_size;
+    } else {
+        *offset = 0;
+    }
+
+    return inode_unlock(inode);
+}
+
+/*
+ * Creates a file to be opened. If another thread creates it meanwhile,
+ * that file is prepared for the open instead (see open_inode).
+ * Input:
+ *  - name: absolute path name
+ *  - flags: flags it is opened with
+ *  - offset: set to its initial offset
+ * Returns: inumber of the file, -1 if unsuccessful
+ */
+static int open_create(char const *name, int flags, size_t *offset) {
+    int inum = inode_create(T_FILE);
+
+    if (inum == -1) {
+        return -1;
+    }
+
+    /* Add entry in the parent directory */
+    char const *leaf;
+    int parent = lookup_parent(name, &leaf);
+
+    if (parent == -1 || add_dir_entry(parent, inum, leaf) == -1) {
+        inode_delete(inum);
+
+        /* Another thread may have created it meanwhile */
+        int other = parent != -1 ? find_in_dir(parent, leaf) : -1;
+
+        if (other != -1 && open_inode(other, flags, offset) == 0) {
+            return other;
+        }
+        return -1;
+    }
+
+    *offset = 0;
+    return inum;
+}
+
+/*
+ * Opens a file, which was already counted in open_files_s
+ */
+static int tfs_open_file(char const *name, int flags) {
+    size_t offset;
+
+    /* Checks if the path name is valid */
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    int inum = path_lookup(name);
+
+    if (inum >= 0) {
+        /* The file already exists */
+        if (open_inode(inum, flags, &offset) == -1) {
+            return -1;
+        }
+    } else if (flags & TFS_O_CREAT) {
+        /* The file doesn't exist; the flags specify that it should be created*/
+        inum = open_create(name, flags, &offset);
+
+        if (inum == -1) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    /* The creation or truncation is durable before the file is used */
+    journal_commit();
+
+    /* Finally, add entry to the open file table and
+     * return the corresponding handle */
+
+    return add_to_open_file_table(inum, offset, flags & (TFS_O_APPEND | TFS_O_BUFFERED));
+
+    /* Note: for simplification, if file was created with TFS_O_CREAT and there
+     * is an error adding an entry to the open file table, the file is not
+     * opened but it remains created */
+}
+
+static int file_open(char const *name, int flags) {
+    if (!open_files_enter(1)) {
+        return -1;
+    }
+
+    int fhandle = tfs_open_file(name, flags);
+
+    if (fhandle == -1) {
+        open_files_leave(1);
+    }
+
+    return fhandle;
+}
+
+int tfs_open(char const *name, int flags) {
+    uint64_t start = stats_clock();
+    int fhandle = file_open(name, flags);
+    stats_op_end(STATS_OP_OPEN, start);
+    return fhandle;
+}
+
+/*
+ * Resolves the path names of a batch. Consecutive names in the same
+ * directory (up to BATCH_LOOKUP of them) walk the path of the directory
+ * once and are looked up in it together (see find_many_in_dir).
+ * Sets tb_inumber of every entry (-1 if it was not found), and tb_error to
+ * 0, EINVAL (invalid path name) or ENOENT (not found)
+ */
+static void batch_resolve(tfs_batch_entry_t *entries, size_t n) {
+    char const *leaves[BATCH_LOOKUP];
+    int inumbers[BATCH_LOOKUP];
+    size_t group[BATCH_LOOKUP];
+
+    for (size_t i = 0; i < n;) {
+        char const *dir = NULL;
+        size_t dir_len = 0;
+        size_t count = 0;
+        int parent = -1;
+
+        for (; i < n && count < BATCH_LOOKUP; i++) {
+            tfs_batch_entry_t *entry = &(entries[i]);
+            char const *name = entry->tb_name;
+
+            entry->tb_inumber = -1;
+            entry->tb_size = 0;
+
+            if (!valid_pathname(name) || name[strlen(name) - 1] == '/') {
+                entry->tb_error = EINVAL;
+                continue;
+            }
+
+            char const *slash = strrchr(name, '/');
+            size_t len = (size_t)(slash - name);
+
+            /* The first name in another directory starts a new group */
+            if (count > 0 && (len != dir_len || memcmp(name, dir, len) != 0)) {
+                break;
+            }
+
+            if (count == 0) {
+                char const *leaf;
+
+                parent = lookup_parent(name, &leaf);
+                if (parent == -1) {
+                    entry->tb_error = ENOENT;
+                    continue;
+                }
+                dir = name;
+                dir_len = len;
+            }
+
+            entry->tb_error = 0;
+            leaves[count] = slash + 1;
+            group[count++] = i;
+        }
+
+        if (count > 0 && find_many_in_dir(parent, leaves, count, inumbers) == -1) {
+            for (size_t j = 0; j < count; j++) {
+                inumbers[j] = -1;
+            }
+        }
+
+        for (size_t j = 0; j < count; j++) {
+            entries[group[j]].tb_inumber = inumbers[j];
+            if (inumbers[j] == -1) {
+                entries[group[j]].tb_error = ENOENT;
+            }
+        }
+    }
+}
+
+/*
+ * Opens the files of a batch, which were already counted in open_files_s
+ * Returns: the number of files opened
+ */
+static size_t open_many(tfs_batch_entry_t *entries, size_t n, int flags) {
+    size_t prepared = 0;
+    size_t opened = 0;
+
+    batch_resolve(entries, n);
+
+    for (size_t i = 0; i < n; i++) {
+        tfs_batch_entry_t *entry = &(entries[i]);
+        size_t offset;
+
+        entry->tb_fhandle = -1;
+
+        if (entry->tb_error == 0) {
+            if (open_inode(entry->tb_inumber, flags, &offset) == -1) {
+                inode_t *inode = inode_get(entry->tb_inumber);
+
+                entry->tb_error = inode != NULL && inode->i_node_type == T_DIRECTORY ? EISDIR : EIO;
+                continue;
+            }
+        } else if (entry->tb_error == ENOENT && (flags & TFS_O_CREAT)) {
+            entry->tb_inumber = open_create(entry->tb_name, flags, &offset);
+            if (entry->tb_inumber == -1) {
+                continue;
+            }
+            entry->tb_error = 0;
+        } else {
+            continue;
+        }
+
+        inode_t *inode = inode_get(entry->tb_inumber);
+
+        entry->tb_type = T_FILE;
+        entry->tb_size = inode != NULL ? inode->i_size : 0;
+        prepared++;
+    }
+
+    /* The creations and truncations are durable before the files are used */
+    if (prepared > 0) {
+        journal_commit();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        tfs_batch_entry_t *entry = &(entries[i]);
+
+        if (entry->tb_error != 0) {
+            continue;
+        }
+
+        size_t offset = (flags & TFS_O_APPEND) ? entry->tb_size : 0;
+
+        entry->tb_fhandle = add_to_open_file_table(entry->tb_inumber, offset,
+                                                   flags & (TFS_O_APPEND | TFS_O_BUFFERED));
+        if (entry->tb_fhandle == -1) {
+            entry->tb_error = EMFILE;
+            continue;
+        }
+        opened++;
+    }
+
+    return opened;
+}
+
+int tfs_open_many(tfs_batch_entry_t *entries, size_t n, int flags) {
+    if (entries == NULL || n > INT_MAX) {
+        return -1;
+    }
+
+    uint64_t start = stats_clock();
+
+    if (!open_files_enter(n)) {
+        stats_op_end(STATS_OP_OPEN_MANY, start);
+        return -1;
+    }
+
+    size_t opened = open_many(entries, n, flags);
+
+    open_files_leave(n - opened);
+    stats_op_end(STATS_OP_OPEN_MANY, start);
+
+    return (int)opened;
+}
+
+static size_t stat_many(tfs_batch_entry_t *entries, size_t n) {
+    size_t found = 0;
+
+    batch_resolve(entries, n);
+
+    for (size_t i = 0; i < n; i++) {
+        tfs_batch_entry_t *entry = &(entries[i]);
+
+        if (entry->tb_error != 0) {
+            continue;
+        }
+
+        inode_t *inode = inode_get(entry->tb_inumber);
+
+        /* The size includes what is buffered for the file */
+        if (inode == NULL || write_buffer_sync(inode) != 0) {
+            entry->tb_error = EIO;
+            continue;
+        }
+
+        entry->tb_type = inode->i_node_type;
+        entry->tb_size = inode->i_size;
+        found++;
+    }
+
+    return found;
+}
+
+int tfs_stat_many(tfs_batch_entry_t *entries, size_t n) {
+    if (entries == NULL || n > INT_MAX) {
+        return -1;
+    }
+
+    uint64_t start = stats_clock();
+    size_t found = stat_many(entries, n);
+    stats_op_end(STATS_OP_STAT_MANY, start);
+
+    return (int)found;
+}
+
+static int file_close(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    int inumber = file != NULL && (file->of_flags & TFS_O_BUFFERED) ? file->of_inumber : -1;
+
+    if (remove_from_open_file_table(fhandle) != 0) {
+        return -1;
+    }
+
+    open_files_leave(1);
+
+    /* What a buffered handle wrote is in the file once it is closed */
+    inode_t *inode = inumber != -1 ? inode_get(inumber) : NULL;
+
+    return inode != NULL ? write_buffer_sync(inode) : 0;
+}
+
+int tfs_close(int fhandle) {
+    uint64_t start = stats_clock();
+    int status = file_close(fhandle);
+    stats_op_end(STATS_OP_CLOSE, start);
+    return status;
+}
+
+/*
+ * Adds up the lengths of the segments of an iovec array
+ * Returns: the total, -1 if iovcnt is negative or the total overflows
+ */
+static ssize_t iov_total(struct iovec const *iov, int iovcnt) {
+
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    ssize_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - (size_t)len) {
+            return -1;
+        }
+        len += (ssize_t)iov[i].iov_len;
+    }
+
+    return len;
+}
+
+/*
+ * Writes to the end of the file of an append handle, at the same time as
+ * other appends to it (see inode_appendv), and leaves the handle after
+ * what it wrote
+ * Returns: total of written bytes if successful, -1 otherwise
+ */
+static ssize_t file_append(int fhandle, open_file_entry_t *file, inode_t *inode,
+                           struct iovec const *iov, int iovcnt) {
+    size_t offset;
+    ssize_t written = inode_appendv(inode, iov, iovcnt, &offset);
+
+    if (written == -1) {
+        printf("[ tfs_writev ] %s", WRITE_ERROR);
+        return -1;
+    }
+
+    if (open_file_lock(file) != 0) {
+        return -1;
+    }
+
+    if (get_open_file_entry(fhandle) == file) {
+        file->of_offset = offset + (size_t)written;
+    }
+
+    if (open_file_unlock(file) != 0) {
+        return -1;
+    }
+
+    journal_commit();
+
+    return written;
+}
+
+static ssize_t file_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+
+    ssize_t to_write = iov_total(iov, iovcnt);
+
+    if (to_write <= 0) {
+        return to_write;
+    }
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+
+    if (file == NULL) {
+        return -1;
+    }
+
+
+    if (open_file_lock(file) != 0) {
+        return -1;
+    }
+
+    /* The handle may have been closed before the entry was locked */
+    inode_t *inode = get_open_file_entry(fhandle) == file ? inode_get(file->of_inumber) : NULL;
+
+    if (inode == NULL) {
+        if (open_file_unlock(file) != 0) {
+            return -1;
+        }
+        return -1;
+    }   
+
+    /* A buffered handle appends to the write-back buffer of the i-node, and
+     * any other write goes after what the buffer holds */
+    ssize_t buffered = (file->of_flags & TFS_O_BUFFERED)
+                           ? write_buffer_append(inode, file, iov, iovcnt, (size_t)to_write)
+                           : write_buffer_sync(inode);
+
+    if (buffered != 0) {
+        if (open_file_unlock(file) != 0) {
+            return -1;
+        }
+        return buffered;
+    }
+
+    /* An append does not need the entry until it moves the offset */
+    if (file->of_flags & TFS_O_APPEND) {
+        if (open_file_unlock(file) != 0) {
+            return -1;
+        }
+        return file_append(fhandle, file, inode, iov, iovcnt);
+    }
+
+    size_t offset = file->of_offset;
+
+    if (inode_range_lock(inode, offset, (size_t)to_write, WRITE) != 0) {
+        if (open_file_unlock(file) != 0) {
+            return -1;
+        }
+        return -1;
+    }
+
+    ssize_t written = inode_writev(inode, file, iov, iovcnt);
+
+    if (inode_range_unlock(inode, offset, (size_t)to_write, WRITE) != 0) {
+        if (open_file_unlock(file) != 0) {
+            return -1;
+        }
+        return -1;
+    }    
+
+    if (open_file_unlock(file) != 0) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
+    if (written == -1) {
+        printf("[ tfs_writev ] %s", WRITE_ERROR);
+        return -1;
+    }
+
+    journal_commit();
+    
+    return written;
+}
 
-    return find_in_dir(ROOT_DIR_INUM, name);
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    uint64_t start = stats_clock();
+    ssize_t written = file_writev(fhandle, iov, iovcnt);
+    stats_op_end(STATS_OP_WRITEV, start);
+    return written;
 }
 
-int tfs_open(char const *name, int flags) {
-    int inum;
-    size_t offset;
+static ssize_t file_write(int fhandle, void const *buffer, size_t to_write) {
 
-    /* Checks if the path name is valid */
-    if (!valid_pathname(name)) {
+    if (to_write == 0) {
+        printf("[ tfs_write ] %s", NOTHING_TO_WRITE);
         return -1;
     }
 
-    inum = tfs_lookup(name);
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
 
-    if (inum >= 0) {
+    return file_writev(fhandle, &iov, 1);
+}
 
-        inode_allocation_map_lock(READ);
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    uint64_t start = stats_clock();
+    ssize_t written = file_write(fhandle, buffer, to_write);
+    stats_op_end(STATS_OP_WRITE, start);
+    return written;
+}
 
-        inode_t *inode = inode_get(inum);
+static ssize_t file_readv(int fhandle, struct iovec const *iov, int iovcnt) {
 
-        inode_allocation_map_unlock(READ);
+    ssize_t len = iov_total(iov, iovcnt);
 
-        /* The file already exists */
-        if (inode == NULL) {
-            return -1;
-        }
-        
-        if (inode_lock(inode, MUTEX) != 0) {
-            return -1;
-        }
+    if (len <= 0) {
+        return len;
+    }
 
-        
-        /* Trucate (if requested) */
-        if (flags & TFS_O_TRUNC) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
 
-            if (inode->i_size > 0) {
-                if (data_block_free(inode->i_data_block) == -1) {
+    if (file == NULL) {
+        return -1;
+    }
 
-                    if (inode_unlock(inode, MUTEX) != 0) {
-                        return -1;
-                    }
-                    return -1;
-                }
+    if (open_file_lock(file) != 0) {
+        return -1;    
+    }
 
-                inode->i_size = 0;
-            }
-        }
-        /* Determine initial offset */
-        if (flags & TFS_O_APPEND) {
-            offset = inode->i_size;
-        } else {
-            offset = 0;
-        }
+    /* The handle may have been closed before the entry was locked */
+    inode_t *inode = get_open_file_entry(fhandle) == file ? inode_get(file->of_inumber) : NULL;
 
-        if (inode_unlock(inode, MUTEX) != 0) {
-            return -1;
+    if (inode == NULL || write_buffer_sync(inode) != 0) {
+        if (open_file_unlock(file) != 0) {
+            return -1;    
         }
+        return -1;
+    }
 
-    } 
-    else if (flags & TFS_O_CREAT) {
-        /* The file doesn't exist; the flags specify that it should be created*/
-        /* Create inode */
-        inum = inode_create(T_FILE);
+    size_t offset = file->of_offset;
 
-        if (inum == -1) {
-            return -1;
+    if (inode_range_lock(inode, offset, (size_t)len, READ) != 0) {
+        if (open_file_unlock(file) != 0) {
+            return -1;    
         }
-        /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
-            inode_delete(inum);
+        return -1;    
+    }
+
+    ssize_t total_read = inode_readv(inode, file, iov, iovcnt);
+
+    if (inode_range_unlock(inode, offset, (size_t)len, READ) != 0) {
+        if (open_file_unlock(file) != 0) {
             return -1;
         }
-        offset = 0;
-    } else {
+        return -1;
+    }    
+
+    if (open_file_unlock(file) != 0) {
         return -1;
     }
 
-    /* Finally, add entry to the open file table and
-     * return the corresponding handle */
+    if (total_read == -1) {
+        printf("[ tfs_readv ] %s", READ_ERROR);
+        return -1;
+    }
 
-    file_allocation_map_lock(MUTEX);
+    return total_read;
+}
 
-    int fhandle = add_to_open_file_table(inum, offset);
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    uint64_t start = stats_clock();
+    ssize_t total_read = file_readv(fhandle, iov, iovcnt);
+    stats_op_end(STATS_OP_READV, start);
+    return total_read;
+}
 
-    file_allocation_map_unlock(MUTEX);
-    
-    return fhandle; 
+static ssize_t file_read(int fhandle, void *buffer, size_t len) {
 
-    /* Note: for simplification, if file was created with TFS_O_CREAT and there
-     * is an error adding an entry to the open file table, the file is not
-     * opened but it remains created */
+    if (len == 0) {
+        printf("[ tfs_read ] %s", NOTHING_TO_READ);
+        return -1;
+    } 
+
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+
+    return file_readv(fhandle, &iov, 1);
 }
 
-int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    uint64_t start = stats_clock();
+    ssize_t total_read = file_read(fhandle, buffer, len);
+    stats_op_end(STATS_OP_READ, start);
+    return total_read;
+}
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+/*
+ * Looks up the i-node of an open file without locking the file entry, for
+ * the positional calls
+ * Returns: the i-node, NULL if the file handle is not valid
+ */
+static inode_t *open_file_inode(int fhandle) {
 
-    ssize_t direct_bytes = 0;
-    ssize_t indirect_bytes = 0;
-    size_t direct_size = 0;
-    size_t indirect_size = 0;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    int inumber = file != NULL ? file->of_inumber : -1;
 
-    if (to_write == 0) {
-        printf("[ tfs_write ] %s", NOTHING_TO_WRITE);
-        return -1;
-    }
+    return inumber == -1 ? NULL : inode_get(inumber);
+}
 
+static ssize_t file_pwritev(int fhandle, struct iovec const *iov, int iovcnt, size_t offset) {
 
-    if (file_allocation_map_lock(READ) != 0) return -1;
+    ssize_t len = iov_total(iov, iovcnt);
 
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (len <= 0) {
+        return len;
+    }
 
-    if (file_allocation_map_unlock(READ) != 0) return -1;
+    inode_t *inode = open_file_inode(fhandle);
 
-    if (file == NULL) {
+    if (inode == NULL || write_buffer_sync(inode) != 0) {
         return -1;
     }
 
-
-    if (open_file_lock(file, MUTEX) != 0) {
+    if (inode_range_lock(inode, offset, (size_t)len, WRITE) != 0) {
         return -1;
     }
 
-    inode_t *inode = inode_get(file->of_inumber);
+    ssize_t written = inode_pwritev(inode, iov, iovcnt, offset);
 
-    if (inode == NULL) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    if (inode_range_unlock(inode, offset, (size_t)len, WRITE) != 0) {
         return -1;
-    }   
+    }
 
-    if (inode_lock(inode, READ) != 0) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    if (written == -1) {
+        printf("[ tfs_pwrite ] %s", WRITE_ERROR);
         return -1;
     }
 
-    if (inode->i_size + to_write <= MAX_BYTES_DIRECT_DATA) {
+    journal_commit();
 
-        direct_bytes = tfs_write_direct_region(inode, file, buffer, to_write);
-
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    return written;
+}
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+ssize_t tfs_pwritev(int fhandle, struct iovec const *iov, int iovcnt, size_t offset) {
+    uint64_t start = stats_clock();
+    ssize_t written = file_pwritev(fhandle, iov, iovcnt, offset);
+    stats_op_end(STATS_OP_PWRITEV, start);
+    return written;
+}
 
-        if (direct_bytes == -1) {
-            return -1;
-        }
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset) {
+    uint64_t start = stats_clock();
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    ssize_t written = file_pwritev(fhandle, &iov, 1, offset);
+    stats_op_end(STATS_OP_PWRITE, start);
+    return written;
+}
 
-        to_write = (size_t)direct_bytes;
-    }
+static ssize_t file_preadv(int fhandle, struct iovec const *iov, int iovcnt, size_t offset) {
 
-    else if (inode->i_size >= MAX_BYTES_DIRECT_DATA) {
+    ssize_t len = iov_total(iov, iovcnt);
 
-        if (inode->i_block[MAX_DIRECT_BLOCKS] == -1) {
-            tfs_handle_indirect_block(inode);
-        }
-        
-        indirect_bytes = tfs_write_indirect_region(inode, file, buffer, to_write);
+    if (len <= 0) {
+        return len;
+    }
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    inode_t *inode = open_file_inode(fhandle);
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    if (inode == NULL || write_buffer_sync(inode) != 0) {
+        return -1;
+    }
 
-        if (indirect_bytes == -1) {
-            return -1;
-        }
+    if (inode_range_lock(inode, offset, (size_t)len, READ) != 0) {
+        return -1;
+    }
 
-        to_write = (size_t) indirect_bytes;
+    ssize_t total_read = inode_preadv(inode, iov, iovcnt, offset);
 
+    if (inode_range_unlock(inode, offset, (size_t)len, READ) != 0) {
+        return -1;
     }
 
-    else {
-
-        direct_size = MAX_BYTES_DIRECT_DATA - inode->i_size;;
-        indirect_size = to_write - direct_size;
+    if (total_read == -1) {
+        printf("[ tfs_pread ] %s", READ_ERROR);
+        return -1;
+    }
 
-        direct_bytes = tfs_write_direct_region(inode, file, buffer, direct_size);
-        
-        if (inode->i_block[MAX_DIRECT_BLOCKS] == -1) {
-            tfs_handle_indirect_block(inode);
-        }
+    return total_read;
+}
 
-        if (direct_bytes == -1) {
-            printf("[ tfs_write ] %s", WRITE_ERROR);
+ssize_t tfs_preadv(int fhandle, struct iovec const *iov, int iovcnt, size_t offset) {
+    uint64_t start = stats_clock();
+    ssize_t total_read = file_preadv(fhandle, iov, iovcnt, offset);
+    stats_op_end(STATS_OP_PREADV, start);
+    return total_read;
+}
 
-            if (inode_unlock(inode, READ) != 0) {
-                if (open_file_unlock(file, MUTEX) != 0) {
-                    return -1;
-                }
-                return -1;
-            }    
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    uint64_t start = stats_clock();
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    ssize_t total_read = file_preadv(fhandle, &iov, 1, offset);
+    stats_op_end(STATS_OP_PREAD, start);
+    return total_read;
+}
 
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }
+static int file_fsync(int fhandle) {
+    inode_t *inode = open_file_inode(fhandle);
 
-       indirect_bytes = tfs_write_indirect_region(inode, file, buffer + direct_size, indirect_size);
+    if (inode == NULL || write_buffer_sync(inode) != 0) {
+        return -1;
+    }
 
-       if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    journal_commit();
+    state_sync();
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
-    
-        if (indirect_bytes == -1) {
-            printf("[ tfs_write ] %s", WRITE_ERROR);
-            return -1;
-        }
+    return 0;
+}
 
-        to_write = (size_t)(direct_bytes + indirect_bytes);
-    }
-    
-    return (ssize_t)to_write;
+int tfs_fsync(int fhandle) {
+    uint64_t start = stats_clock();
+    int status = file_fsync(fhandle);
+    stats_op_end(STATS_OP_FSYNC, start);
+    return status;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+ssize_t tfs_scrub() { return state_scrub(false); }
 
-    size_t to_read = 0;
-    size_t total_read = 0;
-    ssize_t direct_read = 0;
-    ssize_t indirect_read = 0;
+ssize_t tfs_check() { return state_check(); }
 
-    if (len == 0) {
-        printf("[ tfs_read ] %s", NOTHING_TO_READ);
+static int file_ftruncate(int fhandle, size_t len) {
+    inode_t *inode = open_file_inode(fhandle);
+
+    /* Further than the block map reaches */
+    if (inode == NULL || len > (size_t)UINT32_MAX * state_block_size()) {
         return -1;
-    } 
+    }
 
+    /* Serializes the change of size with other truncations */
+    if (inode_lock(inode) != 0) {
+        return -1;
+    }
 
-    if (file_allocation_map_lock(READ) != 0) return -1;
+    /* What is buffered goes to the file first, and is cut like the rest */
+    if (write_buffer_sync(inode) != 0) {
+        inode_unlock(inode);
+        return -1;
+    }
 
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+    size_t from = len < inode->i_size ? len : inode->i_size;
 
-    if (file_allocation_map_unlock(READ) != 0) return -1;
+    inode_range_lock(inode, from, SIZE_MAX - from, WRITE);
+    int status = inode_resize(inode, len);
+    inode_range_unlock(inode, from, SIZE_MAX - from, WRITE);
 
-    if (file == NULL) {
+    if (inode_unlock(inode) != 0) {
         return -1;
     }
 
-    if (open_file_lock(file, MUTEX) != 0) {
-        return -1;    
+    if (status == -1) {
+        printf("[ tfs_ftruncate ] %s", WRITE_ERROR);
+        return -1;
     }
 
-    inode_t *inode = inode_get(file->of_inumber);
+    journal_commit();
 
-    if (inode == NULL) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;    
-        }
-        return -1;
-    }
+    return 0;
+}
 
-    if (inode_lock(inode, READ) != 0) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;    
-        }
-        return -1;    
-    }
+int tfs_ftruncate(int fhandle, size_t len) {
+    uint64_t start = stats_clock();
+    int status = file_ftruncate(fhandle, len);
+    stats_op_end(STATS_OP_FTRUNCATE, start);
+    return status;
+}
 
 
-    to_read = inode->i_size - file->of_offset; 
+static int copy_to_external(char const *source_path, char const *dest_path) {
 
-    if (to_read > len) {
-        to_read = len;
-    } 
+    if (path_lookup(source_path) == -1) {
+        printf("[ tfs_copy_to_external_fs ] %s", FILE_NOT_FOUND);
+        return -1;
+    }
 
+    int source_file = file_open(source_path, 0);
 
-    if (file->of_offset + to_read <= MAX_BYTES_DIRECT_DATA) {
+    if (source_file < 0) {
+        printf("[ tfs_copy_to_external_fs ] (Source : %s) %s", source_path, OPEN_ERROR);
+        return -1;
+    }
 
-        direct_read = tfs_read_direct_region(file, to_read, buffer);  
+    int dest_file = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    if (dest_file < 0) {
+        printf("[ tfs_copy_to_external_fs ] (Dest : %s) %s", dest_path, OPEN_ERROR);
+        file_close(source_file);
+        return -1;
+    }
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    inode_t *inode = open_file_inode(source_file);
+    ssize_t exported = -1;
 
-        if (direct_read == -1) {
-            printf("[ tfs_read ] %s", READ_ERROR);
-            return -1;
-        }
+    /* The whole file is locked once, and its blocks are written out straight
+     * from the data blocks */
+    if (inode != NULL && inode_range_lock(inode, 0, SIZE_MAX, READ) == 0) {
+        exported = inode_export(inode, dest_file);
 
-        total_read = (size_t) direct_read;
+        if (inode_range_unlock(inode, 0, SIZE_MAX, READ) != 0) {
+            exported = -1;
+        }
+    }
 
+    if (exported == -1) {
+        printf("[ tfs_copy_to_external_fs ] %s", WRITE_ERROR);
     }
 
-    else if (file->of_offset >= MAX_BYTES_DIRECT_DATA) {
+    int close_status_source = file_close(source_file);
+    int close_status_dest = close(dest_file);
 
-        indirect_read = tfs_read_indirect_region(file, to_read, buffer);
+    if (close_status_dest < 0 || close_status_source < 0) {
+        printf("[ tfs_copy_to_external_fs ] %s", CLOSE_ERROR);
+        return -1;
+    }
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    return exported == -1 ? -1 : 0;
+}
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    uint64_t start = stats_clock();
+    int status = copy_to_external(source_path, dest_path);
+    stats_op_end(STATS_OP_COPY_TO_EXTERNAL, start);
+    return status;
+}
 
-        if (indirect_read == -1) {
-            printf("[ tfs_read ] %s", READ_ERROR);
-            return -1;
-        } 
+/* A range of a mapped source file, copied into a file by one worker */
+typedef struct {
+    inode_t *inode;
+    uint8_t const *data;
+    size_t offset;
+    size_t len;
+    ssize_t written;
+    int ctx; // context slot of the file
+} import_range_t;
 
-        total_read = (size_t) indirect_read;
-    }
+static void *import_range(void *arg) {
 
-    else {
+    import_range_t *range = (import_range_t *)arg;
 
-        size_t bytes_to_read_in_direct_region = 0;
+    state_ctx_use(range->ctx);
 
-        if (to_read + file->of_offset > MAX_BYTES_DIRECT_DATA) {
-            bytes_to_read_in_direct_region = MAX_BYTES_DIRECT_DATA - file->of_offset;
-        }
+    range->written =
+        inode_pwrite(range->inode, range->data + range->offset, range->len, range->offset);
 
-        to_read -= bytes_to_read_in_direct_region;
+    return (void *)NULL;
+}
 
-        direct_read = tfs_read_direct_region(file, bytes_to_read_in_direct_region, buffer);
+/*
+ * Copies a mapped source file into a file whose blocks were reserved,
+ * splitting it into block aligned ranges of at least IMPORT_RANGE_MIN bytes,
+ * one per worker thread (the caller copies the first one)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int import_mapped(inode_t *inode, uint8_t const *data, size_t size, int n_threads) {
+
+    pthread_t tids[IMPORT_MAX_THREADS];
+    import_range_t ranges[IMPORT_MAX_THREADS];
+    size_t block_size = state_block_size();
+    size_t blocks = (size + block_size - 1) / block_size;
+    size_t n = (size_t)n_threads;
+
+    if (n > IMPORT_MAX_THREADS) {
+        n = IMPORT_MAX_THREADS;
+    }
+    if (n > size / IMPORT_RANGE_MIN) {
+        n = size / IMPORT_RANGE_MIN > 0 ? size / IMPORT_RANGE_MIN : 1;
+    }
 
-        if (direct_read == -1) {
+    size_t offset = 0;
 
-            if (inode_unlock(inode, READ) != 0) {
-                if (open_file_unlock(file, MUTEX) != 0) {
-                    return -1;
-                }
-                return -1;
-            }    
+    for (size_t i = 0; i < n; i++) {
+        size_t end = (blocks * (i + 1) / n) * block_size;
 
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
+        if (end > size) {
+            end = size;
         }
+        ranges[i] = (import_range_t){.inode = inode, .data = data, .offset = offset,
+                                     .len = end - offset, .written = -1, .ctx = state_ctx()};
+        offset = end;
+    }
 
-        total_read = (size_t) (direct_read);
-      
-        indirect_read = tfs_read_indirect_region(file, to_read, buffer + total_read);
+    size_t started = 1;
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    while (started < n &&
+           pthread_create(&tids[started], NULL, import_range, (void *)&ranges[started]) == 0) {
+        started++;
+    }
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    /* Ranges left without a worker are copied here */
+    for (size_t i = started; i < n; i++) {
+        import_range((void *)&ranges[i]);
+    }
+    import_range((void *)&ranges[0]);
+
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
 
-        if (indirect_read == -1){
-            printf("[ tfs_read ] %s", READ_ERROR);
+    for (size_t i = 0; i < n; i++) {
+        if (ranges[i].written != (ssize_t)ranges[i].len) {
             return -1;
         }
-
-        total_read += ((size_t)indirect_read);
     }
-    return (ssize_t)total_read;
+
+    return 0;
 }
 
+/*
+ * Copies a source file that cannot be mapped (or whose size is unknown)
+ * into a file, reading it into a block aligned buffer of IMPORT_BUFFER_SIZE
+ * bytes at a time
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int import_stream(inode_t *inode, int fd) {
 
-int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    uint8_t *buffer = aligned_alloc(state_block_size(), IMPORT_BUFFER_SIZE);
+    size_t offset = 0;
+    int status = 0;
 
-    char buffer[BUFFER_SIZE];
-    int source_file;
-    FILE *dest_file;
-    ssize_t read_bytes = 0;
-    ssize_t buffer_read_bytes = 0;
-    size_t to_write_bytes = 0;
-    size_t written_bytes = 0;
-    ssize_t total_size_to_read = 0;
-    size_t to_read = 0;
-    int close_status_source = 0;
-    int close_status_dest = 0;
-
-    memset(buffer, '\0', sizeof(buffer));
-
-    if (tfs_lookup(source_path) == -1) {
-        printf("[ tfs_copy_to_external_fs ] %s", FILE_NOT_FOUND);
+    if (buffer == NULL) {
         return -1;
     }
-    else {
-        source_file = tfs_open(source_path, TFS_O_APPEND);
-    }    
 
-    if (source_file < 0) {
-        printf("[ tfs_copy_to_external_fs ] (Source : %s) %s", source_path, OPEN_ERROR);
-		return -1;
+    for (;;) {
+        ssize_t read_bytes = read(fd, buffer, IMPORT_BUFFER_SIZE);
+
+        if (read_bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes <= 0) {
+            status = (int)read_bytes;
+            break;
+        }
+        if (inode_pwrite(inode, buffer, (size_t)read_bytes, offset) != read_bytes) {
+            status = -1;
+            break;
+        }
+        offset += (size_t)read_bytes;
     }
 
-    dest_file = fopen(dest_path, "w");
+    free(buffer);
 
-    if (dest_file == NULL) {
-        printf("[ tfs_copy_to_external_fs ] (Dest : %s) %s", dest_path, OPEN_ERROR);
-		return -1;
-    }  
+    return status;
+}
+
+static int copy_from_external(char const *source_path, char const *dest_path, int n_threads) {
 
-    open_file_entry_t *file = get_open_file_entry(source_file);
+    struct stat source_stat;
 
-    pthread_mutex_lock(&file->open_file_mutex);    
+    if (n_threads < 1) {
+        return -1;
+    }
 
-    inode_t *inode = inode_get(file->of_inumber);
+    int source_file = open(source_path, O_RDONLY);
+
+    if (source_file < 0) {
+        printf("[ tfs_copy_from_external_fs ] (Source : %s) %s", source_path, OPEN_ERROR);
+        return -1;
+    }
 
-    file->of_offset = 0;
+    if (fstat(source_file, &source_stat) != 0) {
+        close(source_file);
+        return -1;
+    }
 
-    pthread_mutex_unlock(&file->open_file_mutex);    
+    int dest_file = file_open(dest_path, TFS_O_CREAT);
 
-    pthread_rwlock_rdlock(&inode->inode_rwlock);
+    if (dest_file < 0) {
+        printf("[ tfs_copy_from_external_fs ] (Dest : %s) %s", dest_path, OPEN_ERROR);
+        close(source_file);
+        return -1;
+    }
 
-    total_size_to_read = (ssize_t) inode->i_size;
+    inode_t *inode = open_file_inode(dest_file);
+    int status = -1;
 
-    pthread_rwlock_unlock(&inode->inode_rwlock);
+    /* The file is emptied, and filled in, under one lock on its whole range */
+    if (inode != NULL && inode_range_lock(inode, 0, SIZE_MAX, WRITE) == 0) {
+        status = inode->i_size > 0 ? inode_truncate(inode) : 0;
 
+        size_t size = (size_t)source_stat.st_size;
+        void *data = status == 0 && S_ISREG(source_stat.st_mode) && size > 0
+                         ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, source_file, 0)
+                         : MAP_FAILED;
 
-    do {
+        if (data != MAP_FAILED) {
+            posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
 
-        if (total_size_to_read - read_bytes >= sizeof(buffer)) {
-            buffer_read_bytes = tfs_read(source_file, buffer, sizeof(buffer));
+            status = inode_reserve(inode, size) == 0
+                         ? import_mapped(inode, (uint8_t const *)data, size, n_threads)
+                         : -1;
+            munmap(data, size);
+        } else if (status == 0) {
+            status = import_stream(inode, source_file);
         }
 
-        else {
-            to_read = (size_t) (total_size_to_read - read_bytes);
-            buffer_read_bytes = tfs_read(source_file, buffer, to_read);
+        /* A partial copy is not left behind */
+        if (status == -1) {
+            inode_truncate(inode);
         }
 
-        if (buffer_read_bytes == -1) {
-            printf("[ tfs_copy_to_external_fs ] %s", READ_ERROR);
-		    return -1;
+        if (inode_range_unlock(inode, 0, SIZE_MAX, WRITE) != 0) {
+            status = -1;
         }
+    }
+
+    if (status == -1) {
+        printf("[ tfs_copy_from_external_fs ] %s", WRITE_ERROR);
+    }
+
+    journal_commit();
 
-        read_bytes += buffer_read_bytes;
+    int close_status_source = close(source_file);
+    int close_status_dest = file_close(dest_file);
 
-        to_write_bytes = (size_t) buffer_read_bytes;
+    if (close_status_dest < 0 || close_status_source < 0) {
+        printf("[ tfs_copy_from_external_fs ] %s", CLOSE_ERROR);
+        return -1;
+    }
 
-        written_bytes = fwrite(buffer, sizeof(char), to_write_bytes, dest_file);
+    return status;
+}
 
-        if (written_bytes != buffer_read_bytes) {
-            printf("[ tfs_copy_to_external_fs ] %s", WRITE_ERROR);
-		    return -1;
-        }
+int tfs_copy_from_external_fs_parallel(char const *source_path, char const *dest_path,
+                                       int n_threads) {
+    uint64_t start = stats_clock();
+    int status = copy_from_external(source_path, dest_path, n_threads);
+    stats_op_end(STATS_OP_COPY_FROM_EXTERNAL, start);
+    return status;
+}
 
-        memset(buffer, '\0', sizeof(buffer)); 
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    return tfs_copy_from_external_fs_parallel(source_path, dest_path, 1);
+}
 
-    } while (total_size_to_read > read_bytes);
+int tfs_stats_snapshot(tfs_stats_t *stats) {
+    return stats_snapshot(stats);
+}
 
-    close_status_source =  tfs_close(source_file);
-    close_status_dest = fclose(dest_file);
+uint64_t tfs_stats_percentile(tfs_op_stats_t const *op_stats, double fraction) {
+    if (op_stats->os_count == 0) {
+        return 0;
+    }
 
-    if (close_status_dest < 0 || close_status_source < 0) {
-        printf("[ tfs_copy_to_external_fs ] %s", CLOSE_ERROR);
-		return -1;
+    /* The first bucket at which the running count reaches the rank */
+    double rank = fraction * (double)op_stats->os_count;
+    uint64_t seen = 0;
+
+    for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += op_stats->os_hist[b];
+        if (seen > 0 && (double)seen >= rank) {
+            uint64_t upper = stats_bucket_upper(b);
+            return upper < op_stats->os_max_ns ? upper : op_stats->os_max_ns;
+        }
     }
 
-    return 0;
+    return op_stats->os_max_ns;
 }
@@ -14,6 +14,7 @@ enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_BUFFERED = 0b1000,
 };
 
 /*
@@ -23,45 +24,223 @@ enum {
 int tfs_init();
 
 /*
- * Destroy tecnicofs
+ * Initializes tecnicofs backed by an image file. If the file already holds
+ * an image (left by tfs_destroy) it is mounted as is; if it is empty, a new
+ * image is created in it. Metadata changes are journaled, and reach the
+ * image file only once their records are durable: a mount of an image that
+ * was not cleanly unmounted replays the journal and repairs what a crash
+ * left half done (see tfs_check). File data is durable once it is synced
+ * (see tfs_fsync).
+ * Input:
+ *  - image_path: path of the image file (in the main file system)
  * Returns 0 if successful, -1 otherwise.
  */
-int tfs_destroy();
+int tfs_mount(char const *image_path);
+
+/*
+ * Geometry of the volume of tfs_init_with_params; fields left 0 take the
+ * defaults of config.h
+ */
+typedef struct {
+    size_t tp_block_size;      // a power of two, MIN_BLOCK_SIZE .. MAX_BLOCK_SIZE
+    size_t tp_data_blocks;     // blocks of the volume
+    size_t tp_inodes;          // files and directories it holds at most
+    size_t tp_max_open_files;  // handles open at once, at most MAX_OPEN_FILES
+    char const *tp_image_path; // image file (see tfs_mount), NULL for memory only
+    unsigned tp_scrub_interval_ms; // period of the background scrub (see tfs_scrub), 0 for none
+} tfs_params_t;
+
+/*
+ * Initializes tecnicofs with a volume of a given geometry, in memory or in
+ * an image file (which can only be mounted again with the same geometry)
+ * Input:
+ *  - params: the geometry
+ * Returns 0 if successful, -1 otherwise (e.g. the block size is not a
+ * power of two).
+ */
+int tfs_init_with_params(tfs_params_t const *params);
+
+/*
+ * Contexts: a process can host up to MAX_CONTEXTS volumes at once, each in
+ * a context of its own. Every call works on the volume of the context the
+ * calling thread uses, which is the default one (that of tfs_init,
+ * tfs_mount and tfs_init_with_params) until the thread picks another with
+ * tfs_ctx_use. File handles only mean something in the context that
+ * opened them, and the queues of async.h run their entries in the context
+ * of the thread that created them.
+ */
+typedef struct tfs_ctx tfs_ctx_t;
+
+/*
+ * Creates a context with a volume of its own
+ * Input:
+ *  - params: geometry of the volume as in tfs_init_with_params, NULL for
+ *    the defaults
+ *  - numa_node: NUMA node whose memory holds the volume, -1 for any. The
+ *    calling thread sets the volume up from the CPUs of the node, faulting
+ *    the whole image in, so it is in memory local to threads that run there.
+ * Returns the context, NULL if unsuccessful (e.g. there is no such node,
+ * or MAX_CONTEXTS are in use)
+ */
+tfs_ctx_t *tfs_ctx_create(tfs_params_t const *params, int numa_node);
+
+/*
+ * Destroys a context made by tfs_ctx_create and its volume, as tfs_destroy
+ * does (the default context is destroyed with tfs_destroy). A thread that
+ * was using it goes back to the default context.
+ * Returns 0 if successful, -1 otherwise
+ */
+int tfs_ctx_destroy(tfs_ctx_t *ctx);
+
+/*
+ * Makes the calling thread use a context (NULL for the default one)
+ * Returns the context it used before
+ */
+tfs_ctx_t *tfs_ctx_use(tfs_ctx_t *ctx);
+
+/* Returns the context the calling thread uses */
+tfs_ctx_t *tfs_ctx_current();
+
+/*
+ * Changes the latency model of the simulated storage, which accesses that
+ * miss its cache pay (e.g. DEVICE_ZERO to take it out of a measurement)
+ * Input:
+ *  - model: kind, delay and jitter (which may not exceed the delay)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_set_device_model(device_model_t const *model);
 
 /*
- * Waits until no file is open and then destroy tecnicofs 
+ * Destroy tecnicofs (an image file is synced before it is unmapped)
  * Returns 0 if successful, -1 otherwise.
  */
+int tfs_destroy();
+
+/*
+ * Waits until no file is open and then destroy tecnicofs. The caller
+ * sleeps until the last tfs_close, and tfs_open fails from the moment it
+ * starts waiting, so only the files already open have to be closed.
+ * Returns 0 if successful, -1 otherwise (also if another call is waiting).
+ */
 int tfs_destroy_after_all_closed();
 
 
 /*
  * Looks for a file
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported Input:
- *  - name: absolute path name
+ * Input:
+ *  - name: absolute path name, whose components are separated by '/'
  * Returns the inumber of the file, -1 if unsuccessful
  */
 int tfs_lookup(char const *name);
 
 /*
- * Opens a file
+ * Creates a directory
+ * Input:
+ *  - name: absolute path name (its parent directory must already exist)
+ * Returns 0 if successful, -1 otherwise
+ */
+int tfs_mkdir(char const *name);
+
+/*
+ * Opens a file (directories cannot be opened)
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): every write goes to the end of the
+ *      file, and concurrent appends to it are written side by side
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
+ *    - buffer appends (TFS_O_BUFFERED): writes through the handle that
+ *      continue the file at its end are gathered in the write-back buffer
+ *      of the file (of WRITE_BUFFER_SIZE) and written as whole blocks when
+ *      it fills up, when the handle is closed, at tfs_fsync, or before any
+ *      other access to the file
  */
 int tfs_open(char const *name, int flags);
 
+/*
+ * Entry of a batch of tfs_open_many or tfs_stat_many (only tb_name is
+ * read, the other fields are filled in)
+ */
+typedef struct {
+    char const *tb_name; // absolute path name
+    int tb_error;        // 0 if successful, otherwise EINVAL (invalid path
+                         // name), ENOENT (not found), EISDIR (a directory,
+                         // which cannot be opened), EMFILE (open file table
+                         // full) or EIO (any other error)
+    int tb_inumber;      // inumber of the file, -1 if not found
+    inode_type tb_type;  // T_FILE or T_DIRECTORY
+    size_t tb_size;      // size of the file, in bytes
+    int tb_fhandle;      // file handle, -1 if not opened (tfs_open_many only)
+} tfs_batch_entry_t;
+
+/*
+ * Opens a batch of files, as tfs_open does for each one, at a lower cost
+ * per file: consecutive names in the same directory are looked up in it
+ * together, and the creations and truncations are made durable once.
+ * Input:
+ *  - entries: the n files; each one gets its inumber, size, handle and
+ *    error
+ *  - flags: as in tfs_open, for all of them
+ * Returns the number of files opened, -1 if unsuccessful (invalid
+ * arguments, or tfs_destroy_after_all_closed is waiting)
+ */
+int tfs_open_many(tfs_batch_entry_t *entries, size_t n, int flags);
+
+/*
+ * Looks up a batch of files and directories (as tfs_open_many, without
+ * opening them)
+ * Input:
+ *  - entries: the n files; each one gets its inumber, type, size (which
+ *    includes what is buffered for it) and error
+ * Returns the number of files found, -1 if unsuccessful
+ */
+int tfs_stat_many(tfs_batch_entry_t *entries, size_t n);
+
 /* Closes a file
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise (also if the writes buffered for a
+ * TFS_O_BUFFERED handle could not be written, though it is closed).
  */
 int tfs_close(int fhandle);
 
+/* Writes back what is buffered for an open file, and makes its contents
+ * and the metadata durable in the image file (see tfs_mount)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/* Checks every data block of the files against the CRC32C that the writes
+ * to it left (see BLOCK_CHECKSUMS); a read of a block that does not match
+ * fails, and so does a copy out of its file. A background scrub prints each
+ * block it finds.
+ * Returns the number of blocks that do not match, -1 if the volume keeps
+ * no checksums.
+ */
+ssize_t tfs_scrub();
+
+/* Checks the metadata of the volume: every directory entry names a taken
+ * i-node and every taken i-node is named by one, and the data blocks taken
+ * in the bitmap are exactly those the files and directories hold, each by
+ * one of them. Each problem is printed. No other call may run meanwhile.
+ * Returns the number of problems found, -1 if it could not check.
+ */
+ssize_t tfs_check();
+
+/* Changes the size of an open file: the blocks past a smaller size are
+ * freed, and a larger size reads as zeros past the old one. The offsets of
+ * its open file handles do not change.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- len: the new size, in bytes
+ * Returns 0 if successful, -1 otherwise (also if the volume has no room
+ * for a larger size, and then the size does not change).
+ */
+int tfs_ftruncate(int fhandle, size_t len);
+
 /* Writes to an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -83,6 +262,69 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes the segments of an iovec array, in order, to an open file,
+ * starting at the current offset; the file is looked up and locked once for
+ * all of them, and they are streamed across block boundaries in one pass
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: array of iovcnt segments (iov_base, iov_len) to write
+ * 	Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file, starting at the current offset, into the
+ * segments of an iovec array, filling each before the next (see tfs_writev)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: array of iovcnt segments (iov_base, iov_len) to fill
+ * 	Returns the number of bytes that were copied from the file to the
+ * 	segments (can be lower than their total if the file size was reached),
+ * 	or -1 in case of error
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Writes to an open file at a given offset, leaving the offset of the file
+ * handle as it is. Only the written byte range is locked, so writes (and
+ * reads) of disjoint ranges of a file run in parallel. Writing past the end
+ * of the file leaves a gap that reads as zeros.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file
+ * 	Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file at a given offset, leaving the offset of the file
+ * handle as it is (see tfs_pwrite)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(0 at or past the end of the file), or -1 in case of error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/* Writes the segments of an iovec array to an open file at a given offset,
+ * one after another, as a single tfs_pwrite of their total length
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: array of iovcnt segments (iov_base, iov_len) to write
+ * 	- offset in the file
+ * 	Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_pwritev(int fhandle, struct iovec const *iov, int iovcnt, size_t offset);
+
+/* Reads from an open file at a given offset into the segments of an iovec
+ * array, filling each before the next (see tfs_pwritev)
+ * 	Returns the number of bytes that were copied from the file to the
+ * 	segments, or -1 in case of error
+ */
+ssize_t tfs_preadv(int fhandle, struct iovec const *iov, int iovcnt, size_t offset);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Devolve 0 em caso de sucesso, -1 em caso de erro.
@@ -94,4 +336,50 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 */ 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/* Copies the contents of a file in the OS' file system tree (outside
+ * TecnicoFS) to a file in TecnicoFS. The blocks it needs are allocated up
+ * front, with as few allocator calls as possible, and the source is mapped
+ * and copied straight into them (a source that cannot be mapped is read
+ * into a large buffer instead)
+ * Input:
+ *      - path name of the source file (in the main file system)
+ *      - path name of the destination file (in TecnicoFS), which is
+ *        created if needed, and overwritten if it already exists
+ *      Returns 0 if successful, -1 otherwise (the destination is then left
+ *      empty)
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
+/* Same as tfs_copy_from_external_fs, with large files split into ranges of
+ * whole blocks (at least IMPORT_RANGE_MIN bytes each) that are copied by up
+ * to n_threads threads, the caller included
+ */
+int tfs_copy_from_external_fs_parallel(char const *source_path, char const *dest_path,
+                                       int n_threads);
+
+/*
+ * Takes a snapshot of the stats (see tfs_stats_t) of every thread that
+ * called tecnicofs since the program started (tfs_destroy keeps them): how
+ * many times each call was made and how long it took, how often each kind
+ * of lock was taken and waited for, the hits and misses of the storage
+ * cache, and the reads and copies out that failed on a block that did not
+ * match its checksum (see tfs_scrub), in every context. Each call is
+ * counted once, by the function the caller made (a tfs_write is not also
+ * counted as a tfs_writev).
+ * Input:
+ *  - stats: filled in with the counters
+ * Returns 0 if successful, -1 otherwise (built with STATS_ENABLED 0).
+ */
+int tfs_stats_snapshot(tfs_stats_t *stats);
+
+/*
+ * Estimates a percentile of the latency of a call from its histogram, as
+ * the upper bound of the bucket that holds it (at most 1/8 above it)
+ * Input:
+ *  - op_stats: counters of the call (from tfs_stats_snapshot)
+ *  - fraction: percentile, between 0 and 1 (e.g. 0.99)
+ * Returns the latency in ns, 0 if the call was never made
+ */
+uint64_t tfs_stats_percentile(tfs_op_stats_t const *op_stats, double fraction);
+
 #endif // OPERATIONS_H
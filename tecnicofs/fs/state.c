@@ -1,50 +1,384 @@
 #include "state.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#if BLOCK_CHECKSUMS && defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* Contexts: a process hosts up to MAX_CONTEXTS volumes at once, each in a
+ * slot of its own (slot 0 is the one of tfs_init). The state of a volume
+ * below has an element per slot (its xxx_slots array), and xxx_s names the
+ * one of the slot the calling thread uses (see state_ctx_use). */
+static _Thread_local int ctx_slot_s;
+
+/* Free block bitmap geometry: one bit per data block, set when TAKEN */
+#define BITMAP_WORD_BITS (64)
+#define BITMAP_FULL_WORD (~(uint64_t)0)
+
+/* Persistent FS state: the i-node table, the free block bitmap and the data
+ * blocks live in one mapping (the image), which is either anonymous memory
+ * or a file that can be mounted again later. A file is mapped twice: the
+ * image everything works on is a MAP_PRIVATE copy, which the kernel never
+ * writes back, and only state that is already durable in the journal (or
+ * synced file data) is copied to the MAP_SHARED mapping of the file. */
+
+#define IMAGE_MAGIC (0x3145474d49534654ull) // "TFSIMGE1"
+#define IMAGE_VERSION (5)
+
+/* Huge pages are only worth requesting for images of at least this size */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
 
-#define FIRST_INDIRECT_BLOCK (12)
-#define REFERENCE_BLOCK_INDEX (11)
+/*
+ * Superblock, at the start of the image. The i-node table (followed by
+ * freeinode_ts), the bitmap, the block checksums (none without
+ * BLOCK_CHECKSUMS), the journal and the data blocks each start on a page.
+ */
+typedef struct {
+    uint64_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_clean; // 1 once tfs_destroy has synced the image
+    uint64_t sb_block_size;
+    uint64_t sb_data_blocks;
+    uint64_t sb_inodes;
+    uint64_t sb_inode_table_offset;
+    uint64_t sb_bitmap_offset;
+    uint64_t sb_checksum_offset;
+    uint64_t sb_journal_offset;
+    uint64_t sb_data_offset;
+    uint64_t sb_image_size;
+} superblock_t;
+
+typedef struct {
+    int fd; // -1 if the image is anonymous memory
+    uint8_t *base;
+    uint8_t *disk; // MAP_SHARED mapping of the image file, NULL in memory only
+    size_t size;
+    superblock_t *sb;
+    bool mounted; // true if an existing image was mounted by state_init
+    _Atomic uint64_t *dirty_blocks; // file data blocks written since the last sync
+} image_t;
+
+static image_t image_slots[MAX_CONTEXTS];
+#define image_s (image_slots[ctx_slot_s])
+
+/* Metadata journal (image files only): a redo log of idempotent records,
+ * replayed in order when an image that was not cleanly unmounted is
+ * mounted. Records are appended to an in-memory ring without locks and
+ * written to the journal section of the image file by group commit.
+ * Changes reach the image file only through the journal: a checkpoint
+ * applies the records of the epoch, once they are durable, to the file
+ * mapping (see image_t) and only then starts a new epoch, so that the file
+ * always holds a checkpoint plus a prefix of its records. A prefix may
+ * still leave blocks taken that no file holds, or i-nodes no directory
+ * names: a mount that replays the journal repairs those (see image_check). */
+#define JOURNAL_RECORDS (4096) // records in the journal section
+#define JOURNAL_RING (256)     // records buffered in memory
+
+typedef enum {
+    JR_INODE_INIT = 1,    // inumber, arg = type, value = directory block
+    JR_INODE_FREE,        // inumber
+    JR_INODE_SIZE,        // inumber, value = i_size
+    JR_INODE_EXTENT,      // inumber, arg = index, arg2 = e_logical,
+                          // value = e_physical << 32 | e_length; it becomes the last extent
+    JR_INODE_EXTENTS,     // inumber, value = number of extents
+    JR_INODE_EXTENT_BLOCK, // inumber, value = extent block (-1 once freed)
+    JR_BLOCK_ALLOC,       // value = first block, arg = number of blocks
+    JR_BLOCK_FREE,        // value = first block, arg = number of blocks
+    JR_DIR_BLOCK,         // value = new directory block, all entries empty
+    JR_DIR_SET,           // inumber = directory, arg = sub inumber, value = entry position, name
+    JR_INODE_INLINE,      // inumber, inline = the data the file keeps inline
+} journal_type_t;
+
+typedef struct {
+    uint32_t jr_type;
+    uint32_t jr_epoch;
+    uint64_t jr_lsn; // position in the journal section
+    int32_t jr_inumber;
+    int32_t jr_arg;
+    uint64_t jr_value;
+    uint32_t jr_check;
+    uint32_t jr_arg2;
+    union {
+        char jr_name[MAX_FILE_NAME];
+        uint8_t jr_inline[INODE_INLINE_SIZE];
+    };
+} journal_record_t;
+
+/* The parts of an image that journal records change: those of the image
+ * itself, or those of the file mapping (see journal_checkpoint) */
+typedef struct {
+    inode_t *v_inode_table;
+    _Atomic allocation_state_t *v_freeinode_ts;
+    _Atomic uint64_t *v_free_blocks;
+    uint8_t *v_fs_data;
+} image_view_t;
 
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+typedef struct {
+    uint64_t jh_epoch; // records of other epochs are stale
+} journal_header_t;
+
+typedef struct {
+    bool enabled;
+    journal_header_t *header;
+    journal_record_t *records;
+    journal_record_t ring[JOURNAL_RING];
+    _Atomic uint64_t ring_ready[JOURNAL_RING]; // lsn + 1 once its slot is filled in
+    _Atomic uint64_t next_lsn;
+    _Atomic uint64_t committed; // records below this lsn are durable
+    uint64_t epoch_base;        // lsn stored at the start of the journal section
+    bool flushing;              // a leader is writing a batch
+    unsigned commit_us;         // how long a leader waits for a batch to fill
+    size_t batch;
+    pthread_mutex_t mutex;
+    pthread_cond_t batch_cond;
+    pthread_cond_t done_cond;
+} journal_t;
+
+static journal_t journal_slots[MAX_CONTEXTS];
+#define journal_s (journal_slots[ctx_slot_s])
+
+/* lsn + 1 of the last record logged by the calling thread */
+static _Thread_local uint64_t journal_last_lsn_slots[MAX_CONTEXTS];
+#define journal_last_lsn (journal_last_lsn_slots[ctx_slot_s])
+
+static void journal_flush_upto(uint64_t target);
+static void journal_apply(image_view_t const *view, journal_record_t const *record);
+static int scrubber_start(unsigned interval_ms);
+static ssize_t image_check(bool repair, bool report);
 
 /* I-node table */
 typedef struct {
-    inode_t inode_table[INODE_TABLE_SIZE];
-    allocation_state_t freeinode_ts[INODE_TABLE_SIZE];
-    pthread_mutex_t inode_table_mutex;
-    pthread_rwlock_t inode_table_rwlock;
+    inode_t *inode_table;
+    _Atomic allocation_state_t *freeinode_ts;
+    /* Free inumbers, kept as a lock-free stack linked through free_next */
+    _Atomic int *free_next;
+    _Atomic uint64_t free_head; // (ABA tag << 32) | (top inumber + 1)
 } inode_table_t;
 
-static inode_table_t inode_table_s;
+static inode_table_t inode_table_slots[MAX_CONTEXTS];
+#define inode_table_s (inode_table_slots[ctx_slot_s])
+
+/* An empty stack keeps its tag too (inumber -1 packs to 0 in the low half):
+ * a stack that empties and fills up again must not reuse the heads it had */
+#define FREE_HEAD_EMPTY (0)
+#define FREE_HEAD_PACK(tag, inumber) (((uint64_t)(tag) << 32) | (uint64_t)((inumber) + 1))
+#define FREE_HEAD_INUMBER(head) ((int)((head) & 0xFFFFFFFFu) - 1)
+#define FREE_HEAD_TAG(head) ((head) >> 32)
+#define FREE_HEAD_IS_EMPTY(head) (((head) & 0xFFFFFFFFu) == 0)
 
+/* Data blocks: a page-aligned byte arena inside the image */
 typedef struct {
-    allocation_state_t fs_data[BLOCK_SIZE * DATA_BLOCKS];
-    allocation_state_t free_blocks[DATA_BLOCKS];
-    pthread_mutex_t data_blocks_mutex;
+    uint8_t *fs_data;
+    size_t n_blocks;
+    _Atomic uint64_t *free_blocks;
+    size_t bitmap_words;
+    atomic_size_t free_blocks_hint; // lowest word that may have a free bit
+    _Atomic uint64_t *checksums;    // an entry per block (see block_csum_end)
 } data_blocks_t;
 
-static data_blocks_t data_blocks_s;
+static data_blocks_t data_blocks_slots[MAX_CONTEXTS];
+#define data_blocks_s (data_blocks_slots[ctx_slot_s])
+
+/* Geometry of the volume, set by state_init (see state_params_t). Blocks
+ * are a power of two bytes, so an offset is split into its block and the
+ * offset in it with a shift and a mask. */
+typedef struct {
+    size_t g_block_size;
+    unsigned g_block_shift;
+    size_t g_inodes;
+    size_t g_max_open_files;
+    size_t g_dir_entries; // directory entries in a block
+    size_t g_max_extents; // of a file: INODE_EXTENTS, then a block of them
+} geometry_t;
+
+static geometry_t geometry_slots[MAX_CONTEXTS];
+#define geometry_s (geometry_slots[ctx_slot_s])
+
+#define FS_BLOCK_SIZE (geometry_s.g_block_size)
+#define N_INODES (geometry_s.g_inodes)
+#define DIR_ENTRIES_PER_BLOCK (geometry_s.g_dir_entries)
+#define MAX_EXTENTS (geometry_s.g_max_extents)
+
+/* Returns the block an offset falls in */
+static inline size_t block_of(size_t offset) { return offset >> geometry_s.g_block_shift; }
+
+/* Returns the position of an offset in its block */
+static inline size_t offset_in_block(size_t offset) {
+    return offset & (geometry_s.g_block_size - 1);
+}
+
+/* Returns the number of blocks that hold a number of bytes */
+static inline size_t blocks_for(size_t bytes) {
+    return block_of(bytes + geometry_s.g_block_size - 1);
+}
+
+/* Word of the bitmap where the calling thread last allocated a block */
+static _Thread_local size_t block_alloc_cursor_slots[MAX_CONTEXTS];
+#define block_alloc_cursor (block_alloc_cursor_slots[ctx_slot_s])
 
 /* Volatile FS state */
 
+/* Open file table: segments of OPEN_FILE_SEGMENT entries, allocated when
+ * first needed and never moved, so an entry can be found without a lock.
+ * The geometry sets how many are handed out, at most MAX_OPEN_FILES.
+ * A file handle is (generation << OPEN_FILE_INDEX_BITS) | index; the
+ * generation of an entry changes every time it is reused, so a handle
+ * that was closed no longer matches the of_handle of its entry. */
+#define OPEN_FILE_SEGMENTS (MAX_OPEN_FILES / OPEN_FILE_SEGMENT)
+#define OPEN_FILE_INDEX_BITS (__builtin_ctz(MAX_OPEN_FILES))
+#define OPEN_FILE_GEN_MASK ((1u << (31 - OPEN_FILE_INDEX_BITS)) - 1)
+
+_Static_assert((MAX_OPEN_FILES & (MAX_OPEN_FILES - 1)) == 0 && MAX_OPEN_FILES < (1 << 30),
+               "MAX_OPEN_FILES must be a power of two below 2^30");
+_Static_assert(MAX_OPEN_FILES % OPEN_FILE_SEGMENT == 0,
+               "MAX_OPEN_FILES must be a multiple of OPEN_FILE_SEGMENT");
+
 typedef struct {
-    open_file_entry_t open_file_table[MAX_OPEN_FILES];
-    char free_open_file_entries[MAX_OPEN_FILES]; 
-    pthread_mutex_t fs_state_mutex; 
-    pthread_rwlock_t fs_state_rwlock; 
+    open_file_entry_t *_Atomic segments[OPEN_FILE_SEGMENTS];
+    atomic_int n_used;    // entries handed out at least once
+    _Atomic uint64_t free_head; // (ABA tag << 32) | (top index + 1)
+    atomic_uint epoch;    // tells per-thread caches of older tables apart
 } fs_state_t;
 
-static fs_state_t fs_state_s;
+static fs_state_t fs_state_slots[MAX_CONTEXTS];
+#define fs_state_s (fs_state_slots[ctx_slot_s])
+
+#if OPEN_FILE_CACHE > 0
+/* Entries closed by a thread, reused by its next opens; given back to the
+ * table when the thread exits */
+typedef struct {
+    unsigned oc_epoch;
+    size_t oc_count;
+    int oc_index[OPEN_FILE_CACHE];
+} open_file_cache_t;
+
+static pthread_once_t open_file_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t open_file_cache_key;
+static _Thread_local open_file_cache_t *open_file_cache_slots[MAX_CONTEXTS];
+#define open_file_cache_s (open_file_cache_slots[ctx_slot_s])
+#endif
+
+/* I-node locks: stripe i serves every inumber congruent to i, and each
+ * stripe has a cache line of its own. Besides the mutex that serializes
+ * opens, a stripe has the mutex that serializes changes to the block map
+ * and size of its i-nodes, and a table of the byte ranges locked in them. */
+#define INODE_LOCK_STRIPES (64)
+#define RANGE_LOCK_SLOTS (32)
+
+typedef struct {
+    int r_inumber;
+    size_t r_start;
+    size_t r_end;        // exclusive
+    lock_state_t r_mode; // READ or WRITE, 0 if the slot is unused
+} byte_range_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t il_mutex;
+    pthread_mutex_t il_map_mutex;
+    pthread_mutex_t il_range_mutex;
+    pthread_cond_t il_range_cond;
+    pthread_cond_t il_append_cond; // an append (or a resize) is done
+    byte_range_t il_ranges[RANGE_LOCK_SLOTS];
+} inode_lock_t;
+
+static inode_lock_t inode_lock_slots[MAX_CONTEXTS][INODE_LOCK_STRIPES];
+#define inode_locks_s (inode_lock_slots[ctx_slot_s])
+
+/* Directory name index: open addressing over the entries of a directory.
+ * Each slot packs the name hash with the entry position; readers never lock
+ * and instead retry when di_seq shows a concurrent writer. Arrays replaced
+ * when the index grows stay allocated (ds_retired) until state_destroy,
+ * since a reader may still be probing them. */
+#define DIR_INDEX_MIN_SLOTS (16) // power of two
+#define DIR_INDEX_EMPTY ((uint64_t)0)
+#define DIR_INDEX_TOMBSTONE (~(uint64_t)0)
+#define DIR_INDEX_PACK(hash, pos) (((uint64_t)(hash) << 32) | (uint64_t)((pos) + 1))
+#define DIR_INDEX_HASH(slot) ((uint32_t)((slot) >> 32))
+#define DIR_INDEX_POS(slot) ((size_t)((slot) & 0xFFFFFFFFu) - 1)
+
+typedef struct dir_slots {
+    size_t ds_mask;
+    struct dir_slots *ds_retired;
+    _Atomic uint64_t ds_slots[];
+} dir_slots_t;
+
+typedef struct {
+    atomic_uint di_seq; // odd while a writer is updating the directory
+    pthread_mutex_t di_mutex;
+    _Atomic(dir_slots_t *) di_slots;
+    size_t di_used;      // live and deleted slots
+    size_t di_free_hint; // lowest entry position that may be free
+} dir_index_t;
+
+static dir_index_t *dir_index_slots[MAX_CONTEXTS];
+#define dir_index_s (dir_index_slots[ctx_slot_s])
+
+/* Dentry cache: (parent inumber, name) -> inumber, where -1 caches a miss.
+ * Direct-mapped; each bucket is a seqlock and writers serialize on one of
+ * DCACHE_LOCKS striped mutexes. Entries are tagged with the generation of
+ * the parent, which changes whenever its inumber is deleted. */
+#define DCACHE_BUCKETS (512)
+#define DCACHE_LOCKS (16)
+#define DCACHE_MISS (-2)
+
+typedef struct {
+    atomic_uint dc_seq;
+    int dc_parent; // -1 if unused
+    unsigned dc_parent_gen;
+    int dc_inumber;
+    char dc_name[MAX_FILE_NAME];
+} dentry_t;
+
+typedef struct {
+    dentry_t dentries[DCACHE_BUCKETS];
+    pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+    atomic_uint *dir_gen;
+} dcache_t;
+
+static dcache_t dcache_slots[MAX_CONTEXTS];
+#define dcache_s (dcache_slots[ctx_slot_s])
+
+/* Block map generation of each i-node, bumped whenever blocks are unmapped
+ * from it; the block map caches of open files are only valid for the
+ * generation they were filled in */
+static atomic_uint *inode_map_gen_slots[MAX_CONTEXTS];
+#define inode_map_gen_s (inode_map_gen_slots[ctx_slot_s])
+
+/* Appends in flight to each i-node, under the map mutex of its stripe.
+ * Each one is given the range of the file from ap_end on, and its blocks,
+ * then copies its data at the same time as the others; the ranges become
+ * part of the file (the size moves past them) in the order they were given,
+ * ap_done being the end of those that did. */
+typedef struct {
+    size_t ap_pending;  // appends given a range that are not done
+    size_t ap_resizing; // resizes waiting for them to be done
+    size_t ap_end;
+    size_t ap_done;
+} append_state_t;
+
+static append_state_t *appends_slots[MAX_CONTEXTS];
+#define appends_s (appends_slots[ctx_slot_s])
 
 static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
+    return inumber >= 0 && (size_t)inumber < N_INODES;
 }
 
 static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
+    return block_number >= 0 && (size_t)block_number < data_blocks_s.n_blocks;
+}
+
+/* Tells whether count blocks starting at first are all in the volume (and
+ * there is at least one) */
+static inline bool valid_block_run(size_t first, size_t count) {
+    return count > 0 && first < data_blocks_s.n_blocks && count <= data_blocks_s.n_blocks - first;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+static inline int file_handle_index(int file_handle) {
+    return file_handle & (MAX_OPEN_FILES - 1);
 }
 
 /**
@@ -63,906 +397,4801 @@ static inline bool valid_file_handle(int file_handle) {
  */
 static void touch_all_memory() { __asm volatile("" : : : "memory"); }
 
+/* Latency model of the simulated storage */
+static struct {
+    _Atomic device_kind_t kind;
+    atomic_uint delay;
+    atomic_uint jitter;
+} device_slots[MAX_CONTEXTS];
+#define device_s (device_slots[ctx_slot_s])
+
+static _Thread_local uint32_t device_rng;
+
 /*
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Auxiliary function to insert a delay, as given by the latency model.
+ * Used in accesses to persistent FS state that miss the storage cache, as
+ * a way of emulating access latencies as if such data structures were
+ * really stored in secondary memory.
  */
 static void insert_delay() {
-    for (int i = 0; i < DELAY; i++) {
+    device_kind_t kind = atomic_load_explicit(&(device_s.kind), memory_order_relaxed);
+    unsigned delay = atomic_load_explicit(&(device_s.delay), memory_order_relaxed);
+
+    if (kind == DEVICE_ZERO) {
+        return;
+    }
+
+    if (kind == DEVICE_UNIFORM) {
+        unsigned jitter = atomic_load_explicit(&(device_s.jitter), memory_order_relaxed);
+
+        /* xorshift32, seeded differently for each thread */
+        if (device_rng == 0) {
+            device_rng = (uint32_t)(uintptr_t)&device_rng | 1u;
+        }
+        device_rng ^= device_rng << 13;
+        device_rng ^= device_rng >> 17;
+        device_rng ^= device_rng << 5;
+
+        delay = delay - jitter + (unsigned)(device_rng % (2 * (uint64_t)jitter + 1));
+    }
+
+    for (unsigned i = 0; i < delay; i++) {
         touch_all_memory();
     }
 }
 
 /*
- * Initializes FS state
+ * Stats (see tfs_stats_t): the counters of each thread are only written by
+ * it (so a relaxed load and store, not an atomic add, updates them), and
+ * are read by stats_snapshot under the registry mutex. A thread that exits
+ * adds them to the retired counters, which the registry mutex guards.
  */
-void state_init() {
+#if STATS_ENABLED
 
-    pthread_mutex_init(&(inode_table_s.inode_table_mutex), NULL);
-    pthread_rwlock_init(&(inode_table_s.inode_table_rwlock), NULL);
-
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table_s.freeinode_ts[i] = FREE;
-        pthread_mutex_init(&(inode_table_s.inode_table[i].inode_mutex), NULL);
-        pthread_rwlock_init(&(inode_table_s.inode_table[i].inode_rwlock), NULL);
-    }
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t hist[STATS_HIST_BUCKETS];
+} stats_op_counters_t;
 
-    pthread_mutex_init(&(data_blocks_s.data_blocks_mutex), NULL);
+typedef struct {
+    _Atomic uint64_t acquired;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t hold_ns;
+} stats_lock_counters_t;
+
+typedef struct stats_thread {
+    stats_op_counters_t ops[STATS_OPS];
+    stats_lock_counters_t locks[STATS_LOCKS];
+    _Atomic uint64_t cache_hits;
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t checksum_errors;
+    uint64_t held_since[STATS_LOCKS]; // when the thread took the outermost of each kind of lock
+    unsigned held_depth[STATS_LOCKS]; // locks of each kind the thread holds
+    struct stats_thread *next;
+    struct stats_thread *prev;
+} stats_thread_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    stats_thread_t *threads;
+    tfs_stats_t retired;
+} stats_s = {.mutex = PTHREAD_MUTEX_INITIALIZER};
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        data_blocks_s.free_blocks[i] = FREE;
+/*
+ * Bucket of the latency histograms that holds a value
+ */
+static size_t stats_bucket(uint64_t value) {
+    if (value < (1u << STATS_HIST_SUB_BITS)) {
+        return (size_t)value;
     }
 
-    pthread_mutex_init(&(fs_state_s.fs_state_mutex), NULL);
-    pthread_rwlock_init(&(fs_state_s.fs_state_rwlock), NULL);
+    unsigned shift = (unsigned)(63 - __builtin_clzll(value)) - STATS_HIST_SUB_BITS;
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        fs_state_s.free_open_file_entries[i] = FREE;
-        pthread_mutex_init(&(fs_state_s.open_file_table[i].open_file_mutex), NULL);
-        pthread_rwlock_init(&(fs_state_s.open_file_table[i].open_file_rwlock), NULL);
-    }
+    return ((size_t)(shift + 1) << STATS_HIST_SUB_BITS) +
+           (size_t)((value >> shift) & ((1u << STATS_HIST_SUB_BITS) - 1));
 }
 
-void state_destroy() { 
-
-    pthread_mutex_destroy(&(inode_table_s.inode_table_mutex));
-    pthread_rwlock_destroy(&(inode_table_s.inode_table_rwlock));
-
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        pthread_mutex_destroy(&(inode_table_s.inode_table[i].inode_mutex));
-        pthread_rwlock_destroy(&(inode_table_s.inode_table[i].inode_rwlock));
+/*
+ * Adds the counters of a thread to a snapshot
+ */
+static void stats_add(tfs_stats_t *stats, stats_thread_t *thread) {
+    for (size_t op = 0; op < STATS_OPS; op++) {
+        tfs_op_stats_t *to = &stats->st_ops[op];
+        stats_op_counters_t *from = &thread->ops[op];
+
+        to->os_count += atomic_load_explicit(&from->count, memory_order_relaxed);
+        to->os_total_ns += atomic_load_explicit(&from->total_ns, memory_order_relaxed);
+        uint64_t max_ns = atomic_load_explicit(&from->max_ns, memory_order_relaxed);
+        if (max_ns > to->os_max_ns) {
+            to->os_max_ns = max_ns;
+        }
+        for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+            to->os_hist[b] += atomic_load_explicit(&from->hist[b], memory_order_relaxed);
+        }
     }
 
-    pthread_mutex_destroy(&(fs_state_s.fs_state_mutex));
-    pthread_rwlock_destroy(&(fs_state_s.fs_state_rwlock));
-
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        pthread_mutex_destroy(&(fs_state_s.open_file_table[i].open_file_mutex));
-        pthread_rwlock_destroy(&(fs_state_s.open_file_table[i].open_file_rwlock));
+    for (size_t lock = 0; lock < STATS_LOCKS; lock++) {
+        tfs_lock_stats_t *to = &stats->st_locks[lock];
+        stats_lock_counters_t *from = &thread->locks[lock];
 
+        to->ls_acquired += atomic_load_explicit(&from->acquired, memory_order_relaxed);
+        to->ls_contended += atomic_load_explicit(&from->contended, memory_order_relaxed);
+        to->ls_wait_ns += atomic_load_explicit(&from->wait_ns, memory_order_relaxed);
+        to->ls_hold_ns += atomic_load_explicit(&from->hold_ns, memory_order_relaxed);
     }
 
-    pthread_mutex_destroy(&(data_blocks_s.data_blocks_mutex));
+    stats->st_cache_hits += atomic_load_explicit(&thread->cache_hits, memory_order_relaxed);
+    stats->st_cache_misses += atomic_load_explicit(&thread->cache_misses, memory_order_relaxed);
+    stats->st_checksum_errors +=
+        atomic_load_explicit(&thread->checksum_errors, memory_order_relaxed);
 }
 
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local stats_thread_t *stats_self;
+
 /*
- * Creates a new i-node in the i-node table.
- * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
+ * Called when a thread that recorded stats exits: keeps its counters in the
+ * retired ones
  */
+static void stats_thread_exit(void *arg) {
+    stats_thread_t *thread = arg;
+
+    mutex_lock(&stats_s.mutex);
+    stats_add(&stats_s.retired, thread);
+    if (thread->prev != NULL) {
+        thread->prev->next = thread->next;
+    } else {
+        stats_s.threads = thread->next;
+    }
+    if (thread->next != NULL) {
+        thread->next->prev = thread->prev;
+    }
+    mutex_unlock(&stats_s.mutex);
 
-int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int) sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        pthread_mutex_lock(&inode_table_s.inode_table_mutex);
-
-        // Finds first free entry in i-node table 
-        if (inode_table_s.freeinode_ts[inumber] == FREE) {      
-            // Found a free entry, so takes it for the new i-node
-            inode_table_s.freeinode_ts[inumber] = TAKEN;
+    free(thread);
+}
 
-            insert_delay(); // simulate storage access delay (to i-node)
+static void stats_key_create(void) {
+    if (pthread_key_create(&stats_key, stats_thread_exit) != 0) {
+        perror("pthread_key_create failed");
+        exit(EXIT_FAILURE);
+    }
+}
 
-            inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+/*
+ * Returns the counters of the calling thread, or NULL if they could not be
+ * allocated (and then nothing is recorded)
+ */
+static stats_thread_t *stats_thread(void) {
+    stats_thread_t *thread = stats_self;
+    if (thread != NULL) {
+        return thread;
+    }
 
-            local_inode->i_node_type = n_type;
+    pthread_once(&stats_key_once, stats_key_create);
 
-            if (n_type == T_DIRECTORY) {
-                // Initializes directory (filling its block with empty
-                // entries, labeled with inumber==-1) 
-                int b = data_block_alloc();
-                if (b == -1 && ((dir_entry_t *)data_block_get(b)) == NULL) {
-                    inode_table_s.freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
+    thread = calloc(1, sizeof(stats_thread_t));
+    if (thread == NULL) {
+        return NULL;
+    }
 
-                local_inode->i_size = BLOCK_SIZE;
-                local_inode->i_data_block = b;
-                memset(local_inode->i_block, -1, sizeof(local_inode->i_block));
+    mutex_lock(&stats_s.mutex);
+    thread->next = stats_s.threads;
+    if (thread->next != NULL) {
+        thread->next->prev = thread;
+    }
+    stats_s.threads = thread;
+    mutex_unlock(&stats_s.mutex);
 
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    if (pthread_setspecific(stats_key, thread) != 0) {
+        stats_thread_exit(thread);
+        return NULL;
+    }
 
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                // In case of a new file, simply sets its size to 0 
-                local_inode->i_size = 0;
-                local_inode->i_data_block = -1;
-                memset(local_inode->i_block, -1, sizeof(local_inode->i_block));
+    stats_self = thread;
+    return thread;
+}
 
-            }
+static inline void stats_counter_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
 
-            pthread_mutex_unlock(&inode_table_s.inode_table_mutex);
+uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
-            return inumber;
-        }
+void stats_op_end(stats_op_t op, uint64_t start) {
+    stats_thread_t *thread = stats_thread();
+    if (thread == NULL) {
+        return;
+    }
 
-        pthread_mutex_unlock(&inode_table_s.inode_table_mutex);
+    uint64_t elapsed = stats_clock() - start;
+    stats_op_counters_t *counters = &thread->ops[op];
 
+    stats_counter_add(&counters->count, 1);
+    stats_counter_add(&counters->total_ns, elapsed);
+    if (elapsed > atomic_load_explicit(&counters->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&counters->max_ns, elapsed, memory_order_relaxed);
     }
-    return -1;
+    stats_counter_add(&counters->hist[stats_bucket(elapsed)], 1);
 }
 
-
 /*
- * Deletes the i-node.
- * Input:
- *  - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
+ * Records that the calling thread took a lock, after waiting for it since
+ * start if it was contended
  */
-int inode_delete(int inumber) {
-    // simulate storage access delay (to i-node and freeinode_ts)
-    insert_delay();
-    insert_delay();
-    
-    pthread_mutex_lock(&(inode_table_s.inode_table_mutex));
-
-    if (!valid_inumber(inumber) || inode_table_s.freeinode_ts[inumber] == FREE) {
-        pthread_mutex_unlock(&(inode_table_s.inode_table_mutex));
-        return -1;
+static void stats_lock_acquired(stats_lock_t lock, uint64_t start, bool contended) {
+    stats_thread_t *thread = stats_thread();
+    if (thread == NULL) {
+        return;
     }
 
-    inode_table_s.freeinode_ts[inumber] = FREE;
+    uint64_t now = stats_clock();
+    stats_lock_counters_t *counters = &thread->locks[lock];
 
-    inode_t *local_inode = &inode_table_s.inode_table[inumber];
-
-    if (local_inode->i_size > 0 && (data_block_free(local_inode->i_data_block) == -1)) {
-        pthread_mutex_unlock(&(inode_table_s.inode_table_mutex));
-        return -1;
+    stats_counter_add(&counters->acquired, 1);
+    if (contended) {
+        stats_counter_add(&counters->contended, 1);
+        stats_counter_add(&counters->wait_ns, now - start);
+    }
+    if (thread->held_depth[lock]++ == 0) {
+        thread->held_since[lock] = now;
     }
-
-    pthread_mutex_unlock(&(inode_table_s.inode_table_mutex));
-
-    return 0;
 }
 
 /*
- * Returns a pointer to an existing i-node.
- * Input:
- *  - inumber: identifier of the i-node
- * Returns: pointer if successful, NULL if failed
+ * Records that the calling thread released a lock. When it holds several of
+ * the same kind (nested), the hold time runs from the first one it took to
+ * the release of the last one.
  */
-inode_t *inode_get(int inumber) {
-    if (!valid_inumber(inumber)) {
-        return NULL;
+static void stats_lock_released(stats_lock_t lock) {
+    stats_thread_t *thread = stats_thread();
+    if (thread == NULL || thread->held_depth[lock] == 0) {
+        return;
     }
-    
-    insert_delay(); // simulate storage access delay to i-node
 
-    return &(inode_table_s.inode_table[inumber]);
+    if (--thread->held_depth[lock] == 0) {
+        stats_counter_add(&thread->locks[lock].hold_ns, stats_clock() - thread->held_since[lock]);
+    }
 }
 
-/*
- * Adds an entry to the i-node directory data.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry
- * Returns: SUCCESS or FAIL
- */
-int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
-        return -1;
+static void stats_cache_access(bool hit) {
+    stats_thread_t *thread = stats_thread();
+    if (thread != NULL) {
+        stats_counter_add(hit ? &thread->cache_hits : &thread->cache_misses, 1);
     }
+}
 
-    pthread_rwlock_rdlock(&(inode_table_s.inode_table_rwlock));
-
-    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+static void stats_checksum_error() {
+    stats_thread_t *thread = stats_thread();
+    if (thread != NULL) {
+        stats_counter_add(&thread->checksum_errors, 1);
+    }
+}
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (local_inode->i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
-        return -1;
+int stats_lock(pthread_mutex_t *mutex, stats_lock_t lock) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        stats_lock_acquired(lock, 0, false);
+        return 0;
     }
 
-    if (strlen(sub_name) == 0) {
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+    uint64_t start = stats_clock();
+    if (mutex_lock(mutex) == -1) {
         return -1;
     }
+    stats_lock_acquired(lock, start, true);
+    return 0;
+}
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(local_inode->i_data_block);
+int stats_unlock(pthread_mutex_t *mutex, stats_lock_t lock) {
+    stats_lock_released(lock);
+    return mutex_unlock(mutex);
+}
 
-    pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+#else
 
-    if (dir_entry == NULL) {
-        return -1;
-    }
+static inline void stats_lock_acquired(stats_lock_t lock, uint64_t start, bool contended) {
+    (void)lock;
+    (void)start;
+    (void)contended;
+}
 
-    /* Finds and fills the first empty entry */
-    pthread_mutex_lock(&(fs_state_s.fs_state_mutex))
-        
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+static inline void stats_lock_released(stats_lock_t lock) { (void)lock; }
 
-        if (dir_entry[i].d_inumber == -1) {
+static inline void stats_cache_access(bool hit) { (void)hit; }
 
-            dir_entry[i].d_inumber = sub_inumber;
+static inline void stats_checksum_error() {}
 
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
+#endif
 
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
+/*
+ * Returns the largest value (in ns) that a bucket of the latency histograms
+ * holds
+ */
+uint64_t stats_bucket_upper(size_t bucket) {
+    if (bucket < (1u << STATS_HIST_SUB_BITS)) {
+        return (uint64_t)bucket;
+    }
+    if (bucket >= STATS_HIST_BUCKETS) {
+        return UINT64_MAX;
+    }
 
-            pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+    unsigned shift = (unsigned)(bucket >> STATS_HIST_SUB_BITS) - 1;
+    uint64_t mantissa = (uint64_t)((bucket & ((1u << STATS_HIST_SUB_BITS) - 1)) |
+                                   (1u << STATS_HIST_SUB_BITS));
 
-            return 0;
-        }
-    }
-    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+    return (mantissa << shift) + (((uint64_t)1 << shift) - 1);
+}
 
+/*
+ * Fills stats with the sum of the counters of every thread, including the
+ * ones that already exited
+ * Returns 0 if successful, -1 otherwise (stats are disabled).
+ */
+int stats_snapshot(tfs_stats_t *stats) {
+#if STATS_ENABLED
+    mutex_lock(&stats_s.mutex);
+    *stats = stats_s.retired;
+    for (stats_thread_t *thread = stats_s.threads; thread != NULL; thread = thread->next) {
+        stats_add(stats, thread);
+    }
+    mutex_unlock(&stats_s.mutex);
+    return 0;
+#else
+    (void)stats;
     return -1;
+#endif
 }
 
-/* Looks for a given name inside a directory
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
+/*
+ * Storage cache: which blocks and i-nodes were accessed recently enough to
+ * be in memory, so that only an access that misses it pays insert_delay.
+ * Frames are replaced with CLOCK: the hand clears the referenced bit of
+ * the frames it passes, and takes the first one that was not referenced
+ * since its last pass. A hit takes no lock; a miss (which pays the delay
+ * anyway) takes the cache mutex to claim a frame.
+ * Keys: the i-node bitmap, then each i-node, each word of the block
+ * bitmap, and each block.
  */
-int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
+typedef enum { CACHE_INODE_BITMAP, CACHE_INODE, CACHE_BLOCK_BITMAP, CACHE_BLOCK } cache_space_t;
 
-    pthread_rwlock_rdlock(&(inode_table_s.inode_table_rwlock));
+#define CACHE_KEY_NONE (UINT32_MAX)
 
-    if (!valid_inumber(inumber) ||
-        inode_table_s.inode_table[inumber].i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
-        return -1;
+typedef struct {
+    _Atomic uint32_t cf_key; // CACHE_KEY_NONE while the frame is empty
+    atomic_bool cf_referenced;
+} cache_frame_t;
+
+static struct {
+    cache_frame_t *frames;
+    size_t n_frames;
+    _Atomic uint32_t *resident; // frame + 1 of each key, 0 if not cached
+    size_t n_keys;
+    size_t hand;
+    pthread_mutex_t mutex;
+} cache_slots[MAX_CONTEXTS];
+#define cache_s (cache_slots[ctx_slot_s])
+
+static size_t cache_key(cache_space_t space, size_t index) {
+    switch (space) {
+    case CACHE_INODE_BITMAP:
+        return 0;
+    case CACHE_INODE:
+        return 1 + index;
+    case CACHE_BLOCK_BITMAP:
+        return 1 + N_INODES + index;
+    case CACHE_BLOCK:
+        return 1 + N_INODES + data_blocks_s.bitmap_words + index;
+    default:
+        return SIZE_MAX;
     }
+}
 
-    /* Locates the block containing the DIRECTORY's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table_s.inode_table[inumber].i_data_block);
+static bool cache_hit(size_t key) {
+    uint32_t frame = atomic_load_explicit(&(cache_s.resident[key]), memory_order_acquire);
 
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+    if (frame == 0 ||
+        atomic_load_explicit(&(cache_s.frames[frame - 1].cf_key), memory_order_relaxed) != key) {
+        return false;
+    }
 
-    if (dir_entry == NULL) {
-        return -1;
+    if (!atomic_load_explicit(&(cache_s.frames[frame - 1].cf_referenced), memory_order_relaxed)) {
+        atomic_store_explicit(&(cache_s.frames[frame - 1].cf_referenced), true,
+                              memory_order_relaxed);
     }
+    return true;
+}
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    pthread_mutex_lock(&(fs_state_s.fs_state_mutex));
+/* Puts a key in a frame, evicting the one the CLOCK hand stops at (caller
+ * holds the cache mutex) */
+static void cache_insert(size_t key) {
+    if (atomic_load_explicit(&(cache_s.resident[key]), memory_order_relaxed) != 0) {
+        return;
+    }
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+    for (;;) {
+        cache_frame_t *frame = &(cache_s.frames[cache_s.hand]);
+        size_t index = cache_s.hand;
 
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+        cache_s.hand = (cache_s.hand + 1) % cache_s.n_frames;
 
-            pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
-            return dir_entry[i].d_inumber;
+        if (atomic_exchange_explicit(&(frame->cf_referenced), false, memory_order_relaxed)) {
+            continue;
         }
-    }
-    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
 
-    return -1;
+        uint32_t old = atomic_load_explicit(&(frame->cf_key), memory_order_relaxed);
+
+        if (old != CACHE_KEY_NONE) {
+            atomic_store_explicit(&(cache_s.resident[old]), 0u, memory_order_relaxed);
+        }
+        atomic_store_explicit(&(frame->cf_key), (uint32_t)key, memory_order_relaxed);
+        atomic_store_explicit(&(frame->cf_referenced), true, memory_order_relaxed);
+        atomic_store_explicit(&(cache_s.resident[key]), (uint32_t)index + 1, memory_order_release);
+        return;
+    }
 }
 
 /*
- * Allocated a new data block
- * Returns: block index if successful, -1 otherwise
+ * Simulates an access to count consecutive items of the storage (a run of
+ * blocks is a single access): the delay is paid once if any of them is not
+ * cached, and then all of them are
+ * Inputs:
+ *  - space: kind of the items
+ *  - first: index of the first one
+ *  - count: number of items
  */
-// ignorar os locks?
-int data_block_alloc() {
-        
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int) sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+static void storage_access_run(cache_space_t space, size_t first, size_t count) {
+    bool miss = false;
 
-        pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+    if (cache_s.n_frames == 0) {
+        stats_cache_access(false);
+        insert_delay();
+        return;
+    }
 
-        if (data_blocks_s.free_blocks[i] == FREE) {
-            data_blocks_s.free_blocks[i] = TAKEN;
-       
-            pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
-            return i;
+    for (size_t i = 0; i < count; i++) {
+        if (!cache_hit(cache_key(space, first + i))) {
+            miss = true;
         }
+    }
 
-        pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
- 
+    stats_cache_access(!miss);
+    if (!miss) {
+        return;
     }
-    return -1;
+
+    insert_delay();
+
+    STATS_LOCK(&(cache_s.mutex), STATS_LOCK_CACHE);
+    for (size_t i = 0; i < count; i++) {
+        cache_insert(cache_key(space, first + i));
+    }
+    STATS_UNLOCK(&(cache_s.mutex), STATS_LOCK_CACHE);
 }
 
-/* Frees a data block
- * Input
- * 	- the block index
- * Returns: 0 if success, -1 otherwise
+static void storage_access(cache_space_t space, size_t index) {
+    storage_access_run(space, index, 1);
+}
+
+/* Simulates an access to the extent block of an i-node */
+static void extent_block_access(int extent_block) {
+    if (valid_block_number(extent_block)) {
+        storage_access(CACHE_BLOCK, (size_t)extent_block);
+    } else {
+        insert_delay();
+    }
+}
+
+/*
+ * Sets up the storage cache for the current geometry
+ * Returns: 0 if successful, -1 otherwise
  */
-int data_block_free(int block_number) {
+static int cache_init(size_t n_frames) {
+    size_t n_keys = cache_key(CACHE_BLOCK, data_blocks_s.n_blocks);
+
+    cache_s.n_frames = 0;
+    cache_s.hand = 0;
+    pthread_mutex_init(&(cache_s.mutex), NULL);
+
+    if (n_frames == 0) {
+        return 0;
+    }
 
-    if (!valid_block_number(block_number)) {
+    if (n_keys >= CACHE_KEY_NONE) {
+        pthread_mutex_destroy(&(cache_s.mutex));
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    cache_s.frames = malloc(n_frames * sizeof(cache_frame_t));
+    cache_s.resident = malloc(n_keys * sizeof(_Atomic uint32_t));
 
-    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+    if (cache_s.frames == NULL || cache_s.resident == NULL) {
+        free(cache_s.frames);
+        free(cache_s.resident);
+        pthread_mutex_destroy(&(cache_s.mutex));
+        return -1;
+    }
 
-    data_blocks_s.free_blocks[block_number] = FREE;
+    for (size_t i = 0; i < n_frames; i++) {
+        atomic_init(&(cache_s.frames[i].cf_key), CACHE_KEY_NONE);
+        atomic_init(&(cache_s.frames[i].cf_referenced), false);
+    }
+    for (size_t i = 0; i < n_keys; i++) {
+        atomic_init(&(cache_s.resident[i]), 0u);
+    }
 
-    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+    cache_s.n_frames = n_frames;
+    cache_s.n_keys = n_keys;
 
     return 0;
 }
 
-/* Returns a pointer to the contents of a given block
+static void cache_destroy() {
+    if (cache_s.n_frames > 0) {
+        free(cache_s.frames);
+        free(cache_s.resident);
+    }
+    cache_s.frames = NULL;
+    cache_s.resident = NULL;
+    cache_s.n_frames = 0;
+    pthread_mutex_destroy(&(cache_s.mutex));
+}
+
+/*
+ * Changes the latency model of the simulated storage
  * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
+ *  - model: the new model (dm_jitter may not exceed dm_delay)
+ * Returns: 0 if successful, -1 otherwise
  */
-void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return NULL;
+int state_set_device(device_model_t const *model) {
+    if (model == NULL ||
+        (model->dm_kind != DEVICE_ZERO && model->dm_kind != DEVICE_FIXED &&
+         model->dm_kind != DEVICE_UNIFORM) ||
+        model->dm_jitter > model->dm_delay) {
+        return -1;
     }
 
-    insert_delay(); // simulate storage access delay to block
+    atomic_store(&(device_s.delay), model->dm_delay);
+    atomic_store(&(device_s.jitter), model->dm_jitter);
+    atomic_store(&(device_s.kind), model->dm_kind);
 
-    return &(data_blocks_s.fs_data[block_number * BLOCK_SIZE]);
+    return 0;
 }
 
-/* Add new entry to the open file table
- * Inputs:
- * 	- I-node number of the file to open
- * 	- Initial offset
- * Returns: file handle if successful, -1 otherwise
+/*
+ * Rounds size up to a whole number of pages
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+static size_t page_round(size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
 
-        if (fs_state_s.free_open_file_entries[i] == FREE) {
-            fs_state_s.free_open_file_entries[i] = TAKEN;
-            fs_state_s.open_file_table[i].of_inumber = inumber;
-            fs_state_s.open_file_table[i].of_offset = offset;
-
-            return i;
-        }       
-
-    }
+    return (size + page_size - 1) / page_size * page_size;
+}
 
-    return -1;
+/*
+ * Fills the geometry and section offsets of a superblock
+ */
+static void image_layout(superblock_t *sb, size_t n_blocks) {
+    size_t inode_bytes = N_INODES * (sizeof(inode_t) + sizeof(allocation_state_t));
+    size_t bitmap_bytes = (n_blocks + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * sizeof(uint64_t);
+    size_t checksum_bytes = BLOCK_CHECKSUMS ? n_blocks * sizeof(uint64_t) : 0;
+
+    memset(sb, 0, sizeof(superblock_t));
+    sb->sb_magic = IMAGE_MAGIC;
+    sb->sb_version = IMAGE_VERSION;
+    sb->sb_block_size = FS_BLOCK_SIZE;
+    sb->sb_data_blocks = n_blocks;
+    sb->sb_inodes = N_INODES;
+    sb->sb_inode_table_offset = page_round(sizeof(superblock_t));
+    sb->sb_bitmap_offset = sb->sb_inode_table_offset + page_round(inode_bytes);
+    sb->sb_checksum_offset = sb->sb_bitmap_offset + page_round(bitmap_bytes);
+    sb->sb_journal_offset = sb->sb_checksum_offset + page_round(checksum_bytes);
+    sb->sb_data_offset = sb->sb_journal_offset + page_round(sizeof(journal_header_t)) +
+                         page_round(JOURNAL_RECORDS * sizeof(journal_record_t));
+    sb->sb_image_size = sb->sb_data_offset + page_round(n_blocks * FS_BLOCK_SIZE);
 }
 
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
+/*
+ * Maps an anonymous image, backed by huge pages when it is large enough and
+ * the system has them to spare (populate is MAP_POPULATE to fault all of
+ * it in at once, or 0)
+ * Returns: 0 if successful, -1 otherwise
  */
-int remove_from_open_file_table(int fhandle) {
+static int image_map_anonymous(size_t size, int populate) {
+    void *base = MAP_FAILED;
 
-    pthread_mutex_lock(&(fs_state_s.fs_state_mutex));
+#ifdef MAP_HUGETLB
+    if (size % HUGE_PAGE_SIZE == 0) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    }
+#endif
 
-    if (!valid_file_handle(fhandle) ||
-        fs_state_s.free_open_file_entries[fhandle] != TAKEN) {
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1,
+                    0);
 
-        pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+        if (base == MAP_FAILED) {
+            return -1;
+        }
 
-        return -1;
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE_SIZE) {
+            madvise(base, size, MADV_HUGEPAGE);
+        }
+#endif
     }
 
-    fs_state_s.free_open_file_entries[fhandle] = FREE;
-
-    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+    image_s.fd = -1;
+    image_s.base = (uint8_t *)base;
+    image_s.disk = NULL;
+    image_s.size = size;
+    image_s.mounted = false;
+    image_s.dirty_blocks = NULL;
 
     return 0;
 }
 
-/* Returns pointer to a given entry in the open file table
- * Inputs:
- * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+/*
+ * Maps an image file, creating it if it is empty: the image, copy on write,
+ * and the file mapping (see image_t). An existing image is only mounted if
+ * its superblock matches the requested geometry (populate as in
+ * image_map_anonymous, for the image).
+ * Returns: 0 if successful, -1 otherwise
  */
-open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
-        return NULL;
+static int image_map_file(char const *image_path, superblock_t const *layout, int populate) {
+    struct stat st;
+    superblock_t sb;
+
+    int fd = open(image_path, O_RDWR | O_CREAT, 0644);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        printf("[ image_map_file ] Error opening %s: %s\n", image_path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
     }
 
-    return &(fs_state_s.open_file_table[fhandle]);
-}
+    bool mounted = st.st_size != 0;
+
+    if (mounted) {
+        if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.sb_magic != IMAGE_MAGIC ||
+            sb.sb_version != IMAGE_VERSION || sb.sb_block_size != layout->sb_block_size ||
+            sb.sb_data_blocks != layout->sb_data_blocks || sb.sb_inodes != layout->sb_inodes ||
+            sb.sb_image_size != layout->sb_image_size ||
+            (uint64_t)st.st_size != layout->sb_image_size) {
+            printf("[ image_map_file ] %s is not an image with this geometry\n", image_path);
+            close(fd);
+            return -1;
+        }
+    } else if (ftruncate(fd, (off_t)layout->sb_image_size) == -1) {
+        printf("[ image_map_file ] Error sizing %s: %s\n", image_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    void *base =
+        mmap(NULL, layout->sb_image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | populate, fd, 0);
+    void *disk = mmap(NULL, layout->sb_image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    size_t dirty_words = (layout->sb_data_blocks + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    _Atomic uint64_t *dirty_blocks = calloc(dirty_words, sizeof(_Atomic uint64_t));
+
+    if (base == MAP_FAILED || disk == MAP_FAILED || dirty_blocks == NULL) {
+        if (base != MAP_FAILED) {
+            munmap(base, layout->sb_image_size);
+        }
+        if (disk != MAP_FAILED) {
+            munmap(disk, layout->sb_image_size);
+        }
+        free(dirty_blocks);
+        close(fd);
+        return -1;
+    }
+
+    image_s.fd = fd;
+    image_s.base = (uint8_t *)base;
+    image_s.disk = (uint8_t *)disk;
+    image_s.size = layout->sb_image_size;
+    image_s.mounted = mounted;
+    image_s.dirty_blocks = dirty_blocks;
+
+    return 0;
+}
+
+/*
+ * Copies the file data blocks written since the last sync to the image file
+ * and syncs them (contiguous dirty blocks are flushed with a single msync).
+ * Their metadata reaches the file through the journal.
+ */
+static void image_sync() {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t data_offset = image_s.sb->sb_data_offset;
+
+    for (size_t b = 0; b < data_blocks_s.n_blocks;) {
+        size_t w = b / BITMAP_WORD_BITS;
+        uint64_t dirty = atomic_load(&(image_s.dirty_blocks[w])) >> (b % BITMAP_WORD_BITS);
+
+        if (dirty == 0) {
+            b = (w + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+
+        b += (size_t)__builtin_ctzll(dirty);
+        size_t end = b;
+
+        while (end < data_blocks_s.n_blocks &&
+               (atomic_fetch_and(&(image_s.dirty_blocks[end / BITMAP_WORD_BITS]),
+                                 ~((uint64_t)1 << (end % BITMAP_WORD_BITS))) >>
+                    (end % BITMAP_WORD_BITS) & 1u)) {
+            end++;
+        }
+
+        size_t start_byte = (data_offset + b * FS_BLOCK_SIZE) / page_size * page_size;
+        size_t end_byte = data_offset + end * FS_BLOCK_SIZE;
+        memcpy(image_s.disk + data_offset + b * FS_BLOCK_SIZE,
+               image_s.base + data_offset + b * FS_BLOCK_SIZE, (end - b) * FS_BLOCK_SIZE);
+        msync(image_s.disk + start_byte, end_byte - start_byte, MS_SYNC);
+
+        b = end;
+    }
+}
+
+/*
+ * Marks file data blocks first .. first + count - 1 as written (dirty), for
+ * image_sync, or as freed, which image_sync leaves alone
+ */
+static void image_dirty(size_t first, size_t count, bool dirty) {
+    if (image_s.dirty_blocks == NULL) {
+        return;
+    }
+
+    for (size_t b = first; b < first + count; b++) {
+        _Atomic uint64_t *word = &(image_s.dirty_blocks[b / BITMAP_WORD_BITS]);
+        uint64_t mask = (uint64_t)1 << (b % BITMAP_WORD_BITS);
+        uint64_t bits = atomic_load_explicit(word, memory_order_relaxed);
+
+        if (dirty && (bits & mask) == 0) {
+            atomic_fetch_or_explicit(word, mask, memory_order_relaxed);
+        } else if (!dirty && (bits & mask) != 0) {
+            atomic_fetch_and_explicit(word, ~mask, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Copies the image to the image file: the sections before the journal and,
+ * if blocks is set, each taken data block that differs. Nothing else may
+ * change the image meanwhile (a mount or tfs_destroy).
+ */
+static void image_write_back(bool blocks) {
+    size_t journal_offset = image_s.sb->sb_journal_offset;
+    size_t data_offset = image_s.sb->sb_data_offset;
+
+    memcpy(image_s.disk, image_s.base, journal_offset);
+
+    for (size_t b = 0; blocks && b < data_blocks_s.n_blocks; b++) {
+        uint64_t word = atomic_load(&(data_blocks_s.free_blocks[b / BITMAP_WORD_BITS]));
+        size_t offset = data_offset + b * FS_BLOCK_SIZE;
+
+        if ((word >> (b % BITMAP_WORD_BITS) & 1u) != 0 &&
+            memcmp(image_s.disk + offset, image_s.base + offset, FS_BLOCK_SIZE) != 0) {
+            memcpy(image_s.disk + offset, image_s.base + offset, FS_BLOCK_SIZE);
+        }
+    }
+}
+
+/*
+ * Whether an i-node keeps its data inline (see inode_t): a file without
+ * extents
+ */
+static bool inode_is_inline(inode_t const *inode) {
+    return inode->i_node_type == T_FILE && inode->i_n_extents == 0;
+}
+
+#if BLOCK_CHECKSUMS
+/* CRC32C (Castagnoli) polynomial, bit-reversed */
+#define CRC32C_POLY (0x82f63b78u)
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* CRC32C of n bytes, going on from crc, a byte at a time */
+static uint32_t crc32c_soft(uint32_t crc, uint8_t const *data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xffu] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* CRC32C with the crc32 instruction of SSE4.2, 8 bytes at a time */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hard(uint32_t crc, uint8_t const *data,
+                                                            size_t n) {
+    uint64_t c = crc;
+
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    for (; n > 0; n--, data++) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *data);
+    }
+    return (uint32_t)c;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+/* CRC32C with the crc32c instructions of ARMv8, 8 bytes at a time */
+static uint32_t crc32c_hard(uint32_t crc, uint8_t const *data, size_t n) {
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; n > 0; n--, data++) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+/* Set once by crc32c_init: the instructions of the CPU, if it has them */
+static uint32_t (*crc32c_update)(uint32_t crc, uint8_t const *data, size_t n) = crc32c_soft;
+
+static void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1u ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_hard;
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_update = crc32c_hard;
+#endif
+}
+
+/* Returns the CRC32C of the contents of a data block */
+static uint32_t block_crc(size_t block_number) {
+    return ~crc32c_update(~0u, data_blocks_s.fs_data + block_number * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+}
+
+/*
+ * Block checksums: the entry of a file data block holds the CRC32C of its
+ * contents (high half), the writes in flight to it, a generation and
+ * whether the CRC is set. A write joins the writers of the blocks it
+ * touches before it changes them (block_csum_begin), and leaves them once
+ * it is done (block_csum_end): the last one to leave hashes the whole block
+ * and sets its CRC, unless another write joined or left while it hashed, in
+ * which case it looks again. Every change moves the generation, so a check
+ * that finds the entry unchanged after it hashed a block knows that no
+ * write touched the block meanwhile. A block is marked checked once it is
+ * found to match (or its writer hashed it), and reads do not hash it again
+ * until it is written; scrubs hash every block, and a mount starts over.
+ * Directory and extent blocks are not written through these, and keep no
+ * CRC.
+ */
+#define CSUM_SET ((uint64_t)1)
+#define CSUM_GEN ((uint64_t)1 << 1)
+#define CSUM_GEN_MASK ((uint64_t)0x3fff << 1)
+#define CSUM_CHECKED ((uint64_t)1 << 15)
+#define CSUM_WRITER ((uint64_t)1 << 16)
+#define CSUM_WRITERS_MASK ((uint64_t)0xffff << 16)
+
+/* Joins the writers of the blocks first .. first + count - 1 */
+static void block_csum_begin(int first, size_t count) {
+    for (size_t b = (size_t)first; b < (size_t)first + count; b++) {
+        atomic_fetch_add(&(data_blocks_s.checksums[b]), CSUM_WRITER);
+    }
+}
+
+/* Leaves the writers of the blocks first .. first + count - 1, the last
+ * one of each setting its CRC */
+static void block_csum_end(int first, size_t count) {
+    for (size_t b = (size_t)first; b < (size_t)first + count; b++) {
+        _Atomic uint64_t *checksum = &(data_blocks_s.checksums[b]);
+        uint64_t entry = atomic_load(checksum);
+        uint64_t next;
+
+        do {
+            /* Other writers still there set it as they leave */
+            uint64_t crc = entry >> 32;
+            uint64_t checked = 0;
+            if ((entry & CSUM_WRITERS_MASK) == CSUM_WRITER) {
+                crc = block_crc(b);
+                checked = CSUM_CHECKED;
+            }
+            next = crc << 32 | ((entry & CSUM_WRITERS_MASK) - CSUM_WRITER) |
+                   ((entry + CSUM_GEN) & CSUM_GEN_MASK) | checked | CSUM_SET;
+        } while (!atomic_compare_exchange_strong(checksum, &entry, next));
+    }
+}
+
+/* Forgets the CRCs of the blocks first .. first + count - 1 (freed) */
+static void block_csum_clear(size_t first, size_t count) {
+    for (size_t b = first; b < first + count; b++) {
+        _Atomic uint64_t *checksum = &(data_blocks_s.checksums[b]);
+
+        atomic_store(checksum, (atomic_load(checksum) + CSUM_GEN) & CSUM_GEN_MASK);
+    }
+}
+
+/*
+ * Checks the blocks first .. first + count - 1 against their CRCs (blocks
+ * without one, or being written, pass)
+ * Inputs:
+ *  - first, count: the blocks
+ *  - again: whether to hash those already checked since they were written
+ * Returns: the first block that does not match, -1 if they all do
+ */
+static int block_csum_check(int first, size_t count, bool again) {
+    for (size_t b = (size_t)first; b < (size_t)first + count; b++) {
+        _Atomic uint64_t *checksum = &(data_blocks_s.checksums[b]);
+        uint64_t entry = atomic_load(checksum);
+
+        if ((entry & CSUM_SET) == 0 || (entry & CSUM_WRITERS_MASK) != 0 ||
+            (!again && (entry & CSUM_CHECKED) != 0)) {
+            continue;
+        }
+
+        uint32_t crc = block_crc(b);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load(checksum) != entry) {
+            continue; // written meanwhile
+        }
+        if (crc != (uint32_t)(entry >> 32)) {
+            return (int)b;
+        }
+        /* Fails if it was written meanwhile, which the writer checks */
+        atomic_compare_exchange_strong(checksum, &entry, entry | CSUM_CHECKED);
+    }
+    return -1;
+}
+#else
+static inline void block_csum_begin(int first, size_t count) {
+    (void)first;
+    (void)count;
+}
+static inline void block_csum_end(int first, size_t count) {
+    (void)first;
+    (void)count;
+}
+static inline void block_csum_clear(size_t first, size_t count) {
+    (void)first;
+    (void)count;
+}
+static inline int block_csum_check(int first, size_t count, bool again) {
+    (void)first;
+    (void)count;
+    (void)again;
+    return -1;
+}
+#endif
+
+/* A write to file data blocks first .. first + count - 1 goes between these:
+ * it joins their writers (see block_csum_begin), and once it leaves them the
+ * blocks are dirty for image_sync */
+static void block_write_begin(int first, size_t count) { block_csum_begin(first, count); }
+
+static void block_write_end(int first, size_t count) {
+    block_csum_end(first, count);
+    image_dirty((size_t)first, count, true);
+}
+
+/*
+ * Returns the i-th extent of an i-node whose extent block is in the data
+ * blocks at fs_data, NULL if there is no room for it
+ */
+static extent_t *inode_extent_in(uint8_t *fs_data, inode_t *inode, size_t i) {
+    if (i < INODE_EXTENTS) {
+        return &(inode->i_extent[i]);
+    }
+
+    if (i >= MAX_EXTENTS || !valid_block_number(inode->i_extent_block)) {
+        return NULL;
+    }
+
+    return (extent_t *)(fs_data + (size_t)inode->i_extent_block * FS_BLOCK_SIZE) +
+           (i - INODE_EXTENTS);
+}
+
+/*
+ * Returns the i-th extent of an i-node, NULL if there is no room for it
+ * (no simulated delay: callers account for the access to the extent block)
+ */
+static extent_t *inode_extent(inode_t *inode, size_t i) {
+    return inode_extent_in(data_blocks_s.fs_data, inode, i);
+}
+
+/*
+ * Finds the extent holding file block k, by binary search
+ * Inputs:
+ *  - inode
+ *  - k: index of the block in the file
+ *  - index: if not NULL, set to the index of the extent
+ * Returns: the extent, NULL if k is past the last block of the i-node
+ */
+static extent_t *inode_extent_find(inode_t *inode, size_t k, size_t *index) {
+    size_t lo = 0;
+    size_t hi = inode->i_n_extents;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        extent_t *extent = inode_extent(inode, mid);
+
+        if (extent == NULL) {
+            return NULL;
+        }
+
+        if (k < extent->e_logical) {
+            hi = mid;
+        } else if (k - extent->e_logical >= extent->e_length) {
+            lo = mid + 1;
+        } else {
+            if (index != NULL) {
+                *index = mid;
+            }
+            return extent;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Translates file block k of an i-node to its data block (no simulated
+ * delay)
+ * Inputs:
+ *  - inode
+ *  - k: index of the block in the file
+ *  - run: if not NULL, set to the number of consecutive data blocks,
+ *         starting at the one returned, that hold the next file blocks
+ * Returns: block number, -1 if that block is not allocated
+ */
+static int inode_extent_block_number(inode_t *inode, size_t k, size_t *run) {
+    extent_t const *extent = inode_extent_find(inode, k, NULL);
+
+    if (extent == NULL) {
+        return -1;
+    }
+
+    if (run != NULL) {
+        *run = extent->e_length - (k - extent->e_logical);
+    }
+
+    return (int)(extent->e_physical + (k - extent->e_logical));
+}
+
+/*
+ * Checksum of a journal record (computed with jr_check set to zero)
+ */
+static uint32_t journal_checksum(journal_record_t const *record) {
+    journal_record_t copy = *record;
+    uint8_t const *bytes = (uint8_t const *)&copy;
+    uint32_t check = 2166136261u;
+
+    copy.jr_check = 0;
+
+    for (size_t i = 0; i < sizeof(copy); i++) {
+        check ^= bytes[i];
+        check *= 16777619u;
+    }
+    return check;
+}
+
+/*
+ * Appends a record to the journal ring, with the payload_size bytes of
+ * payload (its name or inline data, NULL for none). Callers make the change
+ * first and log it while still holding whatever lock serializes that
+ * change, so the journal order matches the order of the changes.
+ */
+static void journal_log_record(journal_type_t type, int inumber, int arg, uint32_t arg2,
+                               uint64_t value, void const *payload, size_t payload_size) {
+    if (!journal_s.enabled) {
+        return;
+    }
+
+    uint64_t lsn = atomic_fetch_add(&(journal_s.next_lsn), 1);
+
+    /* Waits for room in the ring, flushing it if needed */
+    while (lsn - atomic_load(&(journal_s.committed)) >= JOURNAL_RING) {
+        journal_flush_upto(lsn + 1 - JOURNAL_RING);
+    }
+
+    journal_record_t *record = &(journal_s.ring[lsn % JOURNAL_RING]);
+
+    memset(record, 0, sizeof(journal_record_t));
+    record->jr_type = type;
+    record->jr_inumber = inumber;
+    record->jr_arg = arg;
+    record->jr_arg2 = arg2;
+    record->jr_value = value;
+    if (payload != NULL) {
+        memcpy(record->jr_inline, payload, payload_size);
+    }
+
+    atomic_store_explicit(&(journal_s.ring_ready[lsn % JOURNAL_RING]), lsn + 1,
+                          memory_order_release);
+
+    journal_last_lsn = lsn + 1;
+}
+
+/*
+ * Appends a record that has no arg2
+ */
+static void journal_log(journal_type_t type, int inumber, int arg, uint64_t value,
+                        char const *name) {
+    journal_log_record(type, inumber, arg, 0, value, name,
+                       name != NULL ? strnlen(name, MAX_FILE_NAME - 1) : 0);
+}
+
+/*
+ * Appends a record of the data a file keeps inline (under its map mutex)
+ */
+static void journal_log_inline(inode_t *inode) {
+    journal_log_record(JR_INODE_INLINE, inode_number(inode), 0, 0, 0, inode->i_inline,
+                       INODE_INLINE_SIZE);
+}
+
+/*
+ * The parts of the image, or of the image file (disk), that journal
+ * records change
+ */
+static image_view_t image_view(bool disk) {
+    uint8_t *base = disk ? image_s.disk : image_s.base;
+    inode_t *inode_table = (inode_t *)(base + image_s.sb->sb_inode_table_offset);
+
+    return (image_view_t){
+        .v_inode_table = inode_table,
+        .v_freeinode_ts = (_Atomic allocation_state_t *)(inode_table + N_INODES),
+        .v_free_blocks = (_Atomic uint64_t *)(base + image_s.sb->sb_bitmap_offset),
+        .v_fs_data = base + image_s.sb->sb_data_offset,
+    };
+}
+
+/*
+ * Applies the records of the epoch, below lsn next_lsn, to the image file
+ * once they are durable, syncs it and empties the journal section (records
+ * of older epochs are ignored by journal_replay). A crash before the new
+ * epoch is durable replays them over what was applied, which they
+ * overwrite. Caller is the flush leader.
+ */
+static void journal_checkpoint(uint64_t next_lsn) {
+    size_t n = next_lsn - journal_s.epoch_base;
+    image_view_t disk = image_view(true);
+
+    if (n > 0) {
+        msync(journal_s.records, n * sizeof(journal_record_t), MS_SYNC);
+    }
+
+    for (size_t pos = 0; pos < n; pos++) {
+        journal_apply(&disk, &(journal_s.records[pos]));
+    }
+
+    msync(image_s.disk, image_s.size, MS_SYNC);
+
+    journal_s.header->jh_epoch++;
+    journal_s.epoch_base = next_lsn;
+
+    msync(journal_s.header, sizeof(journal_header_t), MS_SYNC);
+}
+
+/*
+ * Copies the records that are ready, starting at lsn from, to the journal
+ * section and syncs them. Caller is the flush leader.
+ * Returns: the lsn following the last record written
+ */
+static uint64_t journal_write(uint64_t from) {
+    uint64_t next_lsn = atomic_load(&(journal_s.next_lsn));
+    uint64_t to = from;
+    uint64_t first_pos = from - journal_s.epoch_base;
+
+    for (; to < next_lsn; to++) {
+        journal_record_t *record = &(journal_s.ring[to % JOURNAL_RING]);
+
+        if (atomic_load_explicit(&(journal_s.ring_ready[to % JOURNAL_RING]),
+                                 memory_order_acquire) != to + 1) {
+            break;
+        }
+
+        if (to - journal_s.epoch_base == JOURNAL_RECORDS) {
+            journal_checkpoint(to);
+            first_pos = 0;
+        }
+
+        uint64_t pos = to - journal_s.epoch_base;
+        journal_record_t *target = &(journal_s.records[pos]);
+
+        *target = *record;
+        target->jr_epoch = (uint32_t)journal_s.header->jh_epoch;
+        target->jr_lsn = pos;
+        target->jr_check = journal_checksum(target);
+    }
+
+    if (to > from) {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)&(journal_s.records[first_pos]) / page_size * page_size;
+        uintptr_t end = (uintptr_t)&(journal_s.records[to - journal_s.epoch_base]);
+
+        msync((void *)start, end - start, MS_SYNC);
+    }
+
+    return to;
+}
+
+/*
+ * Group commit: returns once every record below lsn target is durable. The
+ * first thread to get here becomes the leader, optionally waits (up to the
+ * commit interval) for a batch of records to build up, and flushes every
+ * record that is ready; the others just wait for its flush.
+ */
+static void journal_flush_upto(uint64_t target) {
+    pthread_mutex_lock(&(journal_s.mutex));
+
+    while (atomic_load(&(journal_s.committed)) < target) {
+
+        if (journal_s.flushing) {
+            pthread_cond_signal(&(journal_s.batch_cond));
+            pthread_cond_wait(&(journal_s.done_cond), &(journal_s.mutex));
+            continue;
+        }
+
+        journal_s.flushing = true;
+
+        if (journal_s.commit_us > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)journal_s.commit_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            while (atomic_load(&(journal_s.next_lsn)) - atomic_load(&(journal_s.committed)) <
+                       journal_s.batch &&
+                   pthread_cond_timedwait(&(journal_s.batch_cond), &(journal_s.mutex),
+                                          &deadline) == 0) {
+            }
+        }
+
+        uint64_t from = atomic_load(&(journal_s.committed));
+
+        pthread_mutex_unlock(&(journal_s.mutex));
+
+        uint64_t to = journal_write(from);
+
+        pthread_mutex_lock(&(journal_s.mutex));
+
+        atomic_store(&(journal_s.committed), to);
+        journal_s.flushing = false;
+        pthread_cond_broadcast(&(journal_s.done_cond));
+
+        /* The next record is still being filled in by its thread */
+        if (to < target && to == from) {
+            pthread_mutex_unlock(&(journal_s.mutex));
+            sched_yield();
+            pthread_mutex_lock(&(journal_s.mutex));
+        }
+    }
+
+    pthread_mutex_unlock(&(journal_s.mutex));
+}
+
+/*
+ * Waits until every journal record logged by the calling thread is durable
+ * Returns: 0
+ */
+int journal_commit() {
+    if (!journal_s.enabled) {
+        return 0;
+    }
+
+    uint64_t target = journal_last_lsn;
+    uint64_t next_lsn = atomic_load(&(journal_s.next_lsn));
+
+    // a record from a previous mount of the image
+    if (target > next_lsn) {
+        target = next_lsn;
+    }
+
+    journal_flush_upto(target);
+
+    return 0;
+}
+
+/*
+ * Translates file block k of an i-node of a view to its data block (-1 if
+ * it has none), with a linear search of its extents
+ */
+static int journal_block_number(image_view_t const *view, inode_t *inode, size_t k) {
+    for (size_t i = 0; i < inode->i_n_extents; i++) {
+        extent_t const *extent = inode_extent_in(view->v_fs_data, inode, i);
+
+        if (extent == NULL) {
+            break;
+        }
+        if (k >= extent->e_logical && k - extent->e_logical < extent->e_length) {
+            return (int)(extent->e_physical + (k - extent->e_logical));
+        }
+    }
+    return -1;
+}
+
+/*
+ * Applies a journal record directly to a view of the image (no delays, no
+ * logging)
+ */
+static void journal_apply(image_view_t const *view, journal_record_t const *record) {
+    int inumber = record->jr_inumber;
+    int block_number = (int)record->jr_value;
+    inode_t *inode = valid_inumber(inumber) ? &(view->v_inode_table[inumber]) : NULL;
+    uint8_t *block = valid_block_number(block_number)
+                         ? view->v_fs_data + (size_t)block_number * FS_BLOCK_SIZE
+                         : NULL;
+
+    switch ((journal_type_t)record->jr_type) {
+    case JR_INODE_INIT:
+        if (inode == NULL) {
+            return;
+        }
+        atomic_store(&(view->v_freeinode_ts[inumber]), TAKEN);
+        inode->i_node_type = (inode_type)record->jr_arg;
+        inode->i_size = 0;
+        inode->i_n_extents = 0;
+        memset(inode->i_inline, 0, INODE_INLINE_SIZE); // a file starts with no data inline
+        if (inode->i_node_type == T_DIRECTORY) {
+            inode->i_extent_block = -1;
+        }
+        if (inode->i_node_type == T_DIRECTORY && block != NULL) {
+            inode->i_size = FS_BLOCK_SIZE;
+            inode->i_n_extents = 1;
+            inode->i_extent[0] = (extent_t){0, (uint32_t)block_number, 1};
+        }
+        break;
+    case JR_INODE_FREE:
+        if (inode != NULL) {
+            atomic_store(&(view->v_freeinode_ts[inumber]), FREE);
+        }
+        break;
+    case JR_INODE_SIZE:
+        if (inode != NULL) {
+            inode->i_size = record->jr_value;
+        }
+        break;
+    case JR_INODE_EXTENT:
+        if (inode != NULL && record->jr_arg >= 0) {
+            extent_t *extent = inode_extent_in(view->v_fs_data, inode, (size_t)record->jr_arg);
+
+            if (extent != NULL) {
+                extent->e_logical = record->jr_arg2;
+                extent->e_physical = (uint32_t)(record->jr_value >> 32);
+                extent->e_length = (uint32_t)record->jr_value;
+                inode->i_n_extents = (uint32_t)record->jr_arg + 1;
+                if (record->jr_arg == 0) {
+                    inode->i_extent_block = -1; // was inline data (see inode_block_append)
+                }
+            }
+        }
+        break;
+    case JR_INODE_EXTENTS:
+        if (inode != NULL && record->jr_value <= MAX_EXTENTS) {
+            inode->i_n_extents = (uint32_t)record->jr_value;
+            if (inode_is_inline(inode)) {
+                memset(inode->i_inline, 0, INODE_INLINE_SIZE);
+            }
+        }
+        break;
+    case JR_INODE_EXTENT_BLOCK:
+        /* A file left without extents has no extent block to clear */
+        if (inode != NULL && !inode_is_inline(inode)) {
+            inode->i_extent_block = block != NULL ? block_number : -1;
+        }
+        break;
+    case JR_BLOCK_ALLOC:
+    case JR_BLOCK_FREE:
+        for (size_t i = 0; i < (size_t)record->jr_arg; i++) {
+            size_t b = (size_t)block_number + i;
+
+            if (!valid_block_number((int)b)) {
+                break;
+            }
+
+            _Atomic uint64_t *word = &(view->v_free_blocks[b / BITMAP_WORD_BITS]);
+            uint64_t mask = (uint64_t)1 << (b % BITMAP_WORD_BITS);
+
+            if (record->jr_type == JR_BLOCK_ALLOC) {
+                atomic_fetch_or(word, mask);
+            } else {
+                atomic_fetch_and(word, ~mask);
+            }
+        }
+        break;
+    case JR_DIR_BLOCK:
+        if (block != NULL) {
+            dir_entry_t *dir_entry = (dir_entry_t *)block;
+            for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+                dir_entry[i].d_inumber = -1;
+            }
+        }
+        break;
+    case JR_DIR_SET:
+        if (inode != NULL) {
+            size_t pos = record->jr_value;
+            int dir_block = journal_block_number(view, inode, pos / DIR_ENTRIES_PER_BLOCK);
+
+            if (valid_block_number(dir_block)) {
+                dir_entry_t *entry =
+                    (dir_entry_t *)(view->v_fs_data + (size_t)dir_block * FS_BLOCK_SIZE) +
+                    pos % DIR_ENTRIES_PER_BLOCK;
+                entry->d_inumber = record->jr_arg;
+                strncpy(entry->d_name, record->jr_name, MAX_FILE_NAME - 1);
+                entry->d_name[MAX_FILE_NAME - 1] = 0;
+            }
+        }
+        break;
+    case JR_INODE_INLINE:
+        /* Left alone once the file has blocks (its data moved to the first) */
+        if (inode != NULL && inode_is_inline(inode)) {
+            memcpy(inode->i_inline, record->jr_inline, INODE_INLINE_SIZE);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Replays the records of the current epoch on the image, in order, stopping
+ * at the first one that is missing or torn
+ * Returns: number of records replayed
+ */
+static size_t journal_replay() {
+    image_view_t image = image_view(false);
+    uint32_t epoch = (uint32_t)journal_s.header->jh_epoch;
+    size_t pos = 0;
+
+    for (; pos < JOURNAL_RECORDS; pos++) {
+        journal_record_t const *record = &(journal_s.records[pos]);
+
+        if (record->jr_epoch != epoch || record->jr_lsn != pos ||
+            record->jr_check != journal_checksum(record)) {
+            break;
+        }
+
+        journal_apply(&image, record);
+    }
+
+    return pos;
+}
+
+/*
+ * Sets up the journal of an image file, replaying it (and repairing what a
+ * prefix of it leaves) if the image was not cleanly unmounted. The image
+ * file gets the result, and the cleared sb_clean, before any record is
+ * logged.
+ */
+static void journal_init(superblock_t const *layout, unsigned commit_us, size_t batch,
+                         bool replay) {
+    uint8_t *journal = image_s.disk + layout->sb_journal_offset;
+
+    journal_s.header = (journal_header_t *)journal;
+    journal_s.records = (journal_record_t *)(journal + page_round(sizeof(journal_header_t)));
+    journal_s.commit_us = commit_us;
+    journal_s.batch = batch > 0 ? batch : 1;
+    journal_s.flushing = false;
+    journal_s.epoch_base = 0;
+    atomic_init(&(journal_s.next_lsn), (uint64_t)0);
+    atomic_init(&(journal_s.committed), (uint64_t)0);
+
+    for (size_t i = 0; i < JOURNAL_RING; i++) {
+        atomic_init(&(journal_s.ring_ready[i]), (uint64_t)0);
+    }
+
+    pthread_mutex_init(&(journal_s.mutex), NULL);
+    pthread_cond_init(&(journal_s.batch_cond), NULL);
+    pthread_cond_init(&(journal_s.done_cond), NULL);
+
+    if (replay) {
+        size_t replayed = journal_replay();
+        printf("[ journal_init ] Image was not cleanly unmounted: replayed %zu records\n",
+               replayed);
+
+        ssize_t repaired = image_check(true, false);
+        if (repaired > 0) {
+            printf("[ journal_init ] Repaired %zd inconsistencies\n", repaired);
+        }
+    }
+
+    /* Starts a new epoch once the image file holds everything replayed */
+    image_write_back(replay);
+    journal_checkpoint(0);
+
+    journal_s.enabled = true;
+}
+
+/*
+ * Flushes the journal and applies it to the image file, leaving it empty,
+ * before the image is unmapped
+ */
+static void journal_destroy() {
+    uint64_t next_lsn = atomic_load(&(journal_s.next_lsn));
+
+    journal_flush_upto(next_lsn);
+    journal_checkpoint(next_lsn);
+
+    journal_s.enabled = false;
+
+    pthread_mutex_destroy(&(journal_s.mutex));
+    pthread_cond_destroy(&(journal_s.batch_cond));
+    pthread_cond_destroy(&(journal_s.done_cond));
+}
+
+/*
+ * Sets the geometry of the volume from the parameters of state_init (the
+ * defaults of config.h for those that are 0, or without parameters)
+ * Returns: 0 if the geometry is valid, -1 otherwise
+ */
+static int geometry_set(state_params_t const *params) {
+    size_t block_size = BLOCK_SIZE;
+    size_t inodes = INODE_TABLE_SIZE;
+    size_t max_open_files = MAX_OPEN_FILES;
+
+    if (params != NULL) {
+        block_size = params->block_size != 0 ? params->block_size : block_size;
+        inodes = params->inodes != 0 ? params->inodes : inodes;
+        max_open_files = params->max_open_files != 0 ? params->max_open_files : max_open_files;
+    }
+
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0 || inodes > INT_MAX ||
+        max_open_files > MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    geometry_s = (geometry_t){.g_block_size = block_size,
+                              .g_block_shift = (unsigned)__builtin_ctzl(block_size),
+                              .g_inodes = inodes,
+                              .g_max_open_files = max_open_files,
+                              .g_dir_entries = block_size / sizeof(dir_entry_t),
+                              .g_max_extents = INODE_EXTENTS + block_size / sizeof(extent_t)};
+
+    return 0;
+}
+
+/* Frees the volatile tables with an entry per i-node */
+static void inode_tables_free() {
+    free(inode_table_s.free_next);
+    free(dir_index_s);
+    free(dcache_s.dir_gen);
+    free(inode_map_gen_s);
+    free(appends_s);
+
+    inode_table_s.free_next = NULL;
+    dir_index_s = NULL;
+    dcache_s.dir_gen = NULL;
+    inode_map_gen_s = NULL;
+    appends_s = NULL;
+}
+
+/*
+ * Allocates the volatile tables with an entry per i-node (their contents
+ * are set up by state_init)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int inode_tables_alloc() {
+    inode_table_s.free_next = malloc(N_INODES * sizeof(_Atomic int));
+    dir_index_s = malloc(N_INODES * sizeof(dir_index_t));
+    dcache_s.dir_gen = malloc(N_INODES * sizeof(atomic_uint));
+    inode_map_gen_s = malloc(N_INODES * sizeof(atomic_uint));
+    appends_s = malloc(N_INODES * sizeof(append_state_t));
+
+    if (inode_table_s.free_next == NULL || dir_index_s == NULL || dcache_s.dir_gen == NULL ||
+        inode_map_gen_s == NULL || appends_s == NULL) {
+        inode_tables_free();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Initializes FS state
+ * Input:
+ *  - params: geometry of the volume and, optionally, the image file to keep
+ *    it in; NULL for the defaults in config.h
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_init(state_params_t const *params) {
+
+    size_t n_blocks = params != NULL ? params->data_blocks : DATA_BLOCKS;
+    char const *image_path = params != NULL ? params->image_path : NULL;
+    superblock_t layout;
+
+    device_model_t const device = {.dm_kind = DEVICE_MODEL, .dm_delay = DELAY,
+                                   .dm_jitter = DELAY_JITTER};
+
+    if (n_blocks == 0 || n_blocks > INT_MAX || geometry_set(params) == -1 ||
+        state_set_device(params != NULL ? &(params->device) : &device) == -1) {
+        return -1;
+    }
+
+    data_blocks_s.n_blocks = n_blocks;
+    data_blocks_s.bitmap_words = (n_blocks + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+    if (inode_tables_alloc() == -1) {
+        return -1;
+    }
+
+    if (cache_init(params != NULL ? params->cache_frames : CACHE_FRAMES) == -1) {
+        inode_tables_free();
+        return -1;
+    }
+
+    image_layout(&layout, n_blocks);
+
+    /* Populated, the image is placed in memory now, near the calling thread */
+    int populate = 0;
+#ifdef MAP_POPULATE
+    populate = params != NULL && params->populate ? MAP_POPULATE : 0;
+#endif
+
+    if (image_path == NULL ? image_map_anonymous(layout.sb_image_size, populate) == -1
+                           : image_map_file(image_path, &layout, populate) == -1) {
+        cache_destroy();
+        inode_tables_free();
+        return -1;
+    }
+
+    image_s.sb = (superblock_t *)image_s.base;
+
+    inode_table_s.inode_table = (inode_t *)(image_s.base + layout.sb_inode_table_offset);
+    inode_table_s.freeinode_ts =
+        (_Atomic allocation_state_t *)(inode_table_s.inode_table + N_INODES);
+
+    data_blocks_s.free_blocks = (_Atomic uint64_t *)(image_s.base + layout.sb_bitmap_offset);
+    data_blocks_s.checksums = (_Atomic uint64_t *)(image_s.base + layout.sb_checksum_offset);
+    data_blocks_s.fs_data = image_s.base + layout.sb_data_offset;
+
+    /* A new image is all zeroes: every i-node and block is FREE */
+    if (!image_s.mounted) {
+        *image_s.sb = layout;
+
+        /* Bits past the last block in the last word are never handed out */
+        if (n_blocks % BITMAP_WORD_BITS != 0) {
+            atomic_store(&(data_blocks_s.free_blocks[data_blocks_s.bitmap_words - 1]),
+                         BITMAP_FULL_WORD << (n_blocks % BITMAP_WORD_BITS));
+        }
+    }
+
+    bool replay = image_s.mounted && image_s.sb->sb_clean == 0;
+    image_s.sb->sb_clean = 0;
+
+#if BLOCK_CHECKSUMS
+    pthread_once(&crc32c_once, crc32c_init);
+
+    /* File data is not journaled, so after a crash the blocks may not hold
+     * what their CRCs were set for: those are dropped. Otherwise the blocks
+     * of the image are checked again, as none has been since it was mapped */
+    for (size_t b = 0; b < n_blocks; b++) {
+        uint64_t entry = replay ? 0 : atomic_load(&(data_blocks_s.checksums[b]));
+        atomic_init(&(data_blocks_s.checksums[b]), entry & ~CSUM_CHECKED);
+    }
+#endif
+
+    /* Replays the journal before the volatile state is built from the image */
+    if (image_s.fd != -1) {
+        journal_init(&layout, params->journal_commit_us, params->journal_batch, replay);
+    }
+
+    /* Free inumbers go on the free stack, lowest on top */
+    int top = -1;
+    for (int i = (int)N_INODES - 1; i >= 0; i--) {
+        if (atomic_load(&(inode_table_s.freeinode_ts[i])) == FREE) {
+            atomic_init(&(inode_table_s.free_next[i]), top);
+            top = i;
+        }
+    }
+    atomic_init(&(inode_table_s.free_head), FREE_HEAD_PACK(0, top));
+
+    for (size_t i = 0; i < INODE_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&(inode_locks_s[i].il_mutex), NULL);
+        pthread_mutex_init(&(inode_locks_s[i].il_map_mutex), NULL);
+        pthread_mutex_init(&(inode_locks_s[i].il_range_mutex), NULL);
+        pthread_cond_init(&(inode_locks_s[i].il_range_cond), NULL);
+        pthread_cond_init(&(inode_locks_s[i].il_append_cond), NULL);
+        memset(inode_locks_s[i].il_ranges, 0, sizeof(inode_locks_s[i].il_ranges));
+    }
+
+    atomic_init(&(data_blocks_s.free_blocks_hint), (size_t)0);
+
+    /* Directory indexes are rebuilt lazily, on the first access to each one */
+    for (size_t i = 0; i < N_INODES; i++) {
+        pthread_mutex_init(&(dir_index_s[i].di_mutex), NULL);
+        atomic_init(&(dir_index_s[i].di_seq), 0u);
+        atomic_init(&(dir_index_s[i].di_slots), NULL);
+        atomic_init(&(dcache_s.dir_gen[i]), 0u);
+        atomic_init(&(inode_map_gen_s[i]), 0u);
+        appends_s[i] = (append_state_t){0, 0, 0, 0};
+    }
+
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        atomic_init(&(dcache_s.dentries[i].dc_seq), 0u);
+        dcache_s.dentries[i].dc_parent = -1;
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&(dcache_s.dcache_locks[i]), NULL);
+    }
+
+    for (size_t i = 0; i < OPEN_FILE_SEGMENTS; i++) {
+        atomic_init(&(fs_state_s.segments[i]), NULL);
+    }
+    atomic_init(&(fs_state_s.n_used), 0);
+    atomic_init(&(fs_state_s.free_head), FREE_HEAD_EMPTY);
+    atomic_fetch_add(&(fs_state_s.epoch), 1u);
+
+    if (scrubber_start(params != NULL ? params->scrub_interval_ms : SCRUB_INTERVAL_MS) == -1) {
+        state_destroy();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Tells whether state_init mounted an existing image (rather than starting
+ * from an empty one)
+ */
+bool state_mounted() { return image_s.mounted; }
+
+/* Returns the block size of the volume */
+size_t state_block_size() { return geometry_s.g_block_size; }
+
+/* Returns the number of i-nodes of the volume */
+size_t state_inodes() { return geometry_s.g_inodes; }
+
+/* Context slots in use (slot 0 always is) */
+static struct {
+    pthread_mutex_t mutex;
+    bool used[MAX_CONTEXTS];
+} ctx_table_s = {.mutex = PTHREAD_MUTEX_INITIALIZER, .used = {true}};
+
+/*
+ * Takes a context slot for a new volume (to be set up by state_init, once
+ * a thread uses it)
+ * Returns: the slot, -1 if MAX_CONTEXTS volumes are hosted already
+ */
+int state_ctx_alloc() {
+    int slot = -1;
+
+    mutex_lock(&ctx_table_s.mutex);
+    for (int i = 1; i < MAX_CONTEXTS && slot == -1; i++) {
+        if (!ctx_table_s.used[i]) {
+            ctx_table_s.used[i] = true;
+            slot = i;
+        }
+    }
+    mutex_unlock(&ctx_table_s.mutex);
+
+    return slot;
+}
+
+/* Gives back the slot of a volume that was destroyed */
+void state_ctx_free(int slot) {
+    if (slot > 0 && slot < MAX_CONTEXTS) {
+        mutex_lock(&ctx_table_s.mutex);
+        ctx_table_s.used[slot] = false;
+        mutex_unlock(&ctx_table_s.mutex);
+    }
+}
+
+/*
+ * Makes the calling thread use the volume of a context slot
+ * Returns: the slot it used before
+ */
+int state_ctx_use(int slot) {
+    int previous = ctx_slot_s;
+
+    ctx_slot_s = slot;
+
+    return previous;
+}
+
+/* Returns the context slot the calling thread uses */
+int state_ctx() { return ctx_slot_s; }
+
+/*
+ * Moves the calling thread to the CPUs of a NUMA node. Pages are placed on
+ * the node of the CPU that first touches them, so what the thread sets up
+ * there (and populates) is in memory local to the node.
+ * Inputs:
+ *  - node
+ *  - saved: set to the CPUs the thread ran on, for state_numa_restore
+ * Returns: 0 if successful, -1 otherwise (there is no such node, or it has
+ * no CPUs)
+ */
+int state_numa_pin(int node, uint64_t saved[NUMA_CPU_WORDS]) {
+    char path[64];
+    char list[256];
+    uint64_t cpus[NUMA_CPU_WORDS] = {0};
+    bool any = false;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *file = node >= 0 ? fopen(path, "r") : NULL;
+    if (file == NULL) {
+        return -1;
+    }
+    char *got = fgets(list, sizeof(list), file);
+    fclose(file);
+    if (got == NULL) {
+        return -1;
+    }
+
+    /* A list of CPUs and ranges of them, as in "0-3,8-11" */
+    for (char *next = list; *next >= '0' && *next <= '9';) {
+        char *end;
+        unsigned long first = strtoul(next, &end, 10);
+        unsigned long last = first;
+
+        if (*end == '-') {
+            last = strtoul(end + 1, &end, 10);
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < 64 * NUMA_CPU_WORDS; cpu++) {
+            cpus[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+            any = true;
+        }
+        next = *end == ',' ? end + 1 : end;
+    }
+
+    memset(saved, 0, NUMA_CPU_WORDS * sizeof(uint64_t));
+
+    /* The raw calls take a plain mask, where cpu_set_t needs _GNU_SOURCE */
+    if (!any || syscall(SYS_sched_getaffinity, 0, NUMA_CPU_WORDS * sizeof(uint64_t), saved) == -1 ||
+        syscall(SYS_sched_setaffinity, 0, NUMA_CPU_WORDS * sizeof(uint64_t), cpus) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Lets the calling thread run on the CPUs state_numa_pin saved again */
+void state_numa_restore(uint64_t const saved[NUMA_CPU_WORDS]) {
+    syscall(SYS_sched_setaffinity, 0, NUMA_CPU_WORDS * sizeof(uint64_t), saved);
+}
+
+/*
+ * Writes the file data blocks written since the last sync to the image
+ * file, whose metadata is made durable by journal_commit (nothing to do in
+ * memory only)
+ */
+void state_sync() {
+    if (image_s.fd != -1) {
+        image_sync();
+    }
+}
+
+/*
+ * Checks every taken data block against its CRC (see block_csum_check).
+ * The blocks are read past the storage cache, so that a scrub does not
+ * evict what the files use: each run of taken blocks is one access.
+ * Input:
+ *   - report: whether each block that does not match is printed
+ * Returns: number of blocks that do not match, -1 if the volume keeps no
+ *          checksums
+ */
+ssize_t state_scrub(bool report) {
+#if BLOCK_CHECKSUMS
+    ssize_t bad = 0;
+    size_t run_end = SIZE_MAX;
+
+    for (size_t w = 0; w < data_blocks_s.bitmap_words; w++) {
+        uint64_t taken = atomic_load(&(data_blocks_s.free_blocks[w]));
+
+        while (taken != 0) {
+            size_t b = w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(taken);
+
+            taken &= taken - 1;
+            if (b >= data_blocks_s.n_blocks) {
+                break;
+            }
+
+            if (b != run_end) {
+                insert_delay(); // simulate storage access delay to the run of blocks
+            }
+            run_end = b + 1;
+
+            if (block_csum_check((int)b, 1, true) != -1) {
+                if (report) {
+                    printf("[ state_scrub ] Error : block %zu does not match its checksum\n", b);
+                }
+                bad++;
+            }
+        }
+    }
+
+    return bad;
+#else
+    (void)report;
+    return -1;
+#endif
+}
+
+/*
+ * Marks the count blocks starting at first as held by an i-node, for
+ * image_check
+ * Returns: number of those not in the volume, not taken or already held
+ */
+static ssize_t image_check_hold(uint64_t *held, size_t first, size_t count, int inumber,
+                                bool report) {
+    ssize_t problems = 0;
+
+    for (size_t b = first; b < first + count; b++) {
+        uint64_t mask = (uint64_t)1 << (b % BITMAP_WORD_BITS);
+
+        if (b >= data_blocks_s.n_blocks) {
+            if (report) {
+                printf("[ state_check ] Error : i-node %d holds block %zu, past the volume\n",
+                       inumber, b);
+            }
+            return problems + 1;
+        }
+        if ((atomic_load(&(data_blocks_s.free_blocks[b / BITMAP_WORD_BITS])) & mask) == 0 ||
+            (held[b / BITMAP_WORD_BITS] & mask) != 0) {
+            if (report) {
+                printf("[ state_check ] Error : i-node %d holds block %zu, which is %s\n",
+                       inumber, b,
+                       (held[b / BITMAP_WORD_BITS] & mask) != 0 ? "held twice" : "free");
+            }
+            problems++;
+        }
+        held[b / BITMAP_WORD_BITS] |= mask;
+    }
+    return problems;
+}
+
+/*
+ * Checks that the metadata of the image is consistent: every directory entry
+ * names a taken i-node, every taken i-node is named by an entry (but the
+ * root) and is no larger than its blocks, and the taken blocks of the bitmap
+ * are exactly those the i-nodes hold, each by one. Nothing else may use the
+ * volume meanwhile.
+ * Inputs:
+ *   - repair: whether entries that name a free i-node are cleared, i-nodes
+ *     that no entry names are freed, sizes are cut to the blocks and the
+ *     bitmap is rebuilt from the blocks that are held (a block held twice
+ *     stays so)
+ *   - report: whether each problem is printed
+ * Returns: number of problems found, -1 if it could not check
+ */
+static ssize_t image_check(bool repair, bool report) {
+    ssize_t problems = 0;
+    bool *reached = calloc(N_INODES, sizeof(bool));
+    int *queue = malloc(N_INODES * sizeof(int));
+    uint64_t *held = calloc(data_blocks_s.bitmap_words, sizeof(uint64_t));
+    size_t head = 0;
+    size_t tail = 0;
+
+    if (reached == NULL || queue == NULL || held == NULL) {
+        free(reached);
+        free(queue);
+        free(held);
+        return -1;
+    }
+
+    if (atomic_load(&(inode_table_s.freeinode_ts[ROOT_DIR_INUM])) == TAKEN) {
+        reached[ROOT_DIR_INUM] = true;
+        queue[tail++] = ROOT_DIR_INUM;
+    }
+
+    /* Directories, from the root */
+    while (head < tail) {
+        inode_t *dir = &(inode_table_s.inode_table[queue[head++]]);
+
+        for (size_t i = 0; dir->i_node_type == T_DIRECTORY && i < dir->i_n_extents; i++) {
+            extent_t const *extent = inode_extent(dir, i);
+
+            if (extent == NULL || !valid_block_run(extent->e_physical, extent->e_length)) {
+                break;
+            }
+
+            dir_entry_t *entries =
+                (dir_entry_t *)(data_blocks_s.fs_data + (size_t)extent->e_physical * FS_BLOCK_SIZE);
+
+            for (size_t e = 0; e < extent->e_length * DIR_ENTRIES_PER_BLOCK; e++) {
+                int sub = entries[e].d_inumber;
+
+                if (sub == -1) {
+                    continue;
+                }
+                if (!valid_inumber(sub) ||
+                    atomic_load(&(inode_table_s.freeinode_ts[sub])) != TAKEN) {
+                    if (report) {
+                        printf("[ state_check ] Error : entry %.*s names i-node %d, which is "
+                               "free\n",
+                               MAX_FILE_NAME - 1, entries[e].d_name, sub);
+                    }
+                    problems++;
+                    if (repair) {
+                        entries[e].d_inumber = -1;
+                    }
+                } else if (!reached[sub]) {
+                    reached[sub] = true;
+                    queue[tail++] = sub;
+                }
+            }
+        }
+    }
+
+    /* I-nodes, and the blocks they hold */
+    for (int inumber = 0; (size_t)inumber < N_INODES; inumber++) {
+        inode_t *inode = &(inode_table_s.inode_table[inumber]);
+
+        if (atomic_load(&(inode_table_s.freeinode_ts[inumber])) != TAKEN) {
+            continue;
+        }
+        if (!reached[inumber]) {
+            if (report) {
+                printf("[ state_check ] Error : i-node %d is taken, but no entry names it\n",
+                       inumber);
+            }
+            problems++;
+            if (repair) {
+                atomic_store(&(inode_table_s.freeinode_ts[inumber]), FREE);
+            }
+            continue;
+        }
+        /* What its blocks (or its inline data) hold */
+        size_t held_size = INODE_INLINE_SIZE;
+        extent_t const *last =
+            inode_is_inline(inode) ? NULL : inode_extent(inode, inode->i_n_extents - 1);
+
+        if (last != NULL) {
+            held_size = ((size_t)last->e_logical + last->e_length) * FS_BLOCK_SIZE;
+        }
+
+        if (inode->i_size > held_size) {
+            if (report) {
+                printf("[ state_check ] Error : i-node %d has %zu bytes, but its blocks hold "
+                       "%zu\n",
+                       inumber, inode->i_size, held_size);
+            }
+            problems++;
+            if (repair) {
+                inode->i_size = held_size;
+            }
+        }
+
+        if (inode_is_inline(inode)) {
+            continue;
+        }
+
+        if (inode->i_extent_block != -1) {
+            problems += image_check_hold(held, (size_t)(uint32_t)inode->i_extent_block, 1,
+                                         inumber, report);
+        }
+        for (size_t i = 0; i < inode->i_n_extents; i++) {
+            extent_t const *extent = inode_extent(inode, i);
+
+            if (extent == NULL) {
+                if (report) {
+                    printf("[ state_check ] Error : i-node %d has no extent %zu\n", inumber, i);
+                }
+                problems++;
+                break;
+            }
+            problems += image_check_hold(held, extent->e_physical, extent->e_length, inumber,
+                                         report);
+        }
+    }
+
+    /* Blocks taken that no i-node holds (bits past the last block stay set) */
+    for (size_t w = 0; w < data_blocks_s.bitmap_words; w++) {
+        uint64_t past = 0;
+
+        if (w == data_blocks_s.bitmap_words - 1 && data_blocks_s.n_blocks % BITMAP_WORD_BITS != 0) {
+            past = BITMAP_FULL_WORD << (data_blocks_s.n_blocks % BITMAP_WORD_BITS);
+        }
+
+        uint64_t taken = atomic_load(&(data_blocks_s.free_blocks[w]));
+        uint64_t leaked = taken & ~held[w] & ~past;
+
+        if (leaked != 0) {
+            if (report) {
+                printf("[ state_check ] Error : %d blocks from %zu on are taken, but held by no "
+                       "i-node\n",
+                       __builtin_popcountll(leaked),
+                       w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(leaked));
+            }
+            problems += __builtin_popcountll(leaked);
+        }
+        if (repair) {
+            atomic_store(&(data_blocks_s.free_blocks[w]), held[w] | past);
+        }
+    }
+
+    free(reached);
+    free(queue);
+    free(held);
+
+    return problems;
+}
+
+/*
+ * Checks the metadata of the volume (see image_check), reporting each problem
+ * Returns: number of problems found, -1 if it could not check
+ */
+ssize_t state_check() { return image_check(false, true); }
+
+/* Background scrub of a volume: a thread that runs state_scrub every
+ * interval_ms, until it is stopped */
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool stop;
+    unsigned interval_ms;
+    int slot; // context of the volume
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} scrubber_t;
+
+static scrubber_t scrubber_slots[MAX_CONTEXTS];
+#define scrubber_s (scrubber_slots[ctx_slot_s])
+
+static void *scrubber_run(void *arg) {
+    scrubber_t *scrubber = (scrubber_t *)arg;
+
+    state_ctx_use(scrubber->slot);
+
+    pthread_mutex_lock(&(scrubber->mutex));
+    while (!scrubber->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(scrubber->interval_ms % 1000) * 1000000;
+        deadline.tv_sec += (time_t)(scrubber->interval_ms / 1000) + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        if (pthread_cond_timedwait(&(scrubber->cond), &(scrubber->mutex), &deadline) == ETIMEDOUT &&
+            !scrubber->stop) {
+            pthread_mutex_unlock(&(scrubber->mutex));
+            state_scrub(true);
+            pthread_mutex_lock(&(scrubber->mutex));
+        }
+    }
+    pthread_mutex_unlock(&(scrubber->mutex));
+
+    return NULL;
+}
+
+/* Starts the background scrub of the volume of the calling thread's
+ * context (none if interval_ms is 0, or without checksums)
+ * Returns: 0 if successful, -1 otherwise */
+static int scrubber_start(unsigned interval_ms) {
+    scrubber_s.running = false;
+
+    if (interval_ms == 0 || !BLOCK_CHECKSUMS) {
+        return 0;
+    }
+
+    scrubber_s.stop = false;
+    scrubber_s.interval_ms = interval_ms;
+    scrubber_s.slot = ctx_slot_s;
+    pthread_mutex_init(&(scrubber_s.mutex), NULL);
+    pthread_cond_init(&(scrubber_s.cond), NULL);
+
+    if (pthread_create(&(scrubber_s.thread), NULL, scrubber_run, &scrubber_s) != 0) {
+        pthread_mutex_destroy(&(scrubber_s.mutex));
+        pthread_cond_destroy(&(scrubber_s.cond));
+        return -1;
+    }
+
+    scrubber_s.running = true;
+    return 0;
+}
+
+/* Stops the background scrub of the volume, waiting for a pass that is
+ * going on */
+static void scrubber_stop() {
+    if (!scrubber_s.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&(scrubber_s.mutex));
+    scrubber_s.stop = true;
+    pthread_cond_signal(&(scrubber_s.cond));
+    pthread_mutex_unlock(&(scrubber_s.mutex));
+
+    pthread_join(scrubber_s.thread, NULL);
+    pthread_mutex_destroy(&(scrubber_s.mutex));
+    pthread_cond_destroy(&(scrubber_s.cond));
+    scrubber_s.running = false;
+}
+
+void state_destroy() { 
+
+    scrubber_stop();
+
+    /* File data first, then the metadata, and the rest of the sections
+     * before the journal (the block checksums) as they are */
+    if (image_s.fd != -1) {
+        image_sync();
+        journal_destroy();
+        image_write_back(false);
+        ((superblock_t *)image_s.disk)->sb_clean = 1;
+        msync(image_s.disk, image_s.sb->sb_journal_offset, MS_SYNC);
+        munmap(image_s.disk, image_s.size);
+        close(image_s.fd);
+        free(image_s.dirty_blocks);
+    }
+
+    munmap(image_s.base, image_s.size);
+    memset(&image_s, 0, sizeof(image_s));
+    cache_destroy();
+    data_blocks_s.n_blocks = 0;
+
+    for (size_t i = 0; i < INODE_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&(inode_locks_s[i].il_mutex));
+        pthread_mutex_destroy(&(inode_locks_s[i].il_map_mutex));
+        pthread_mutex_destroy(&(inode_locks_s[i].il_range_mutex));
+        pthread_cond_destroy(&(inode_locks_s[i].il_range_cond));
+        pthread_cond_destroy(&(inode_locks_s[i].il_append_cond));
+    }
+
+    for (size_t i = 0; i < N_INODES; i++) {
+        pthread_mutex_destroy(&(dir_index_s[i].di_mutex));
+
+        dir_slots_t *slots = atomic_load(&(dir_index_s[i].di_slots));
+        while (slots != NULL) {
+            dir_slots_t *retired = slots->ds_retired;
+            free(slots);
+            slots = retired;
+        }
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&(dcache_s.dcache_locks[i]));
+    }
+
+    inode_tables_free();
+
+    atomic_fetch_add(&(fs_state_s.epoch), 1u);
+
+    for (size_t i = 0; i < OPEN_FILE_SEGMENTS; i++) {
+        open_file_entry_t *segment = atomic_load(&(fs_state_s.segments[i]));
+
+        if (segment == NULL) {
+            continue;
+        }
+        for (size_t j = 0; j < OPEN_FILE_SEGMENT; j++) {
+            pthread_mutex_destroy(&(segment[j].open_file_mutex));
+        }
+        free(segment);
+        atomic_store(&(fs_state_s.segments[i]), NULL);
+    }
+}
+
+static int dir_index_reset(int inumber);
+static int inode_free_blocks(inode_t *inode, size_t keep);
+static inode_lock_t *inode_lock_get(inode_t *inode);
+
+/*
+ * Pops a free inumber from the free stack
+ * Returns: the inumber, -1 if there are no free i-nodes
+ */
+static int inode_free_pop() {
+    uint64_t head = atomic_load_explicit(&(inode_table_s.free_head), memory_order_acquire);
+
+    while (!FREE_HEAD_IS_EMPTY(head)) {
+        int inumber = FREE_HEAD_INUMBER(head);
+        int next = atomic_load_explicit(&(inode_table_s.free_next[inumber]), memory_order_relaxed);
+        uint64_t new_head = FREE_HEAD_PACK(FREE_HEAD_TAG(head) + 1, next);
+
+        /* The tag changes on every pop, so a stale head (whose inumber was
+         * popped and pushed back meanwhile) makes the exchange fail */
+        if (atomic_compare_exchange_weak_explicit(&(inode_table_s.free_head), &head, new_head,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            return inumber;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Pushes an inumber back onto the free stack
+ * Input:
+ *  - inumber: a valid i-node number, not currently in the stack
+ */
+static void inode_free_push(int inumber) {
+    uint64_t head = atomic_load_explicit(&(inode_table_s.free_head), memory_order_relaxed);
+    uint64_t new_head;
+
+    do {
+        int next = FREE_HEAD_INUMBER(head);
+        atomic_store_explicit(&(inode_table_s.free_next[inumber]), next, memory_order_relaxed);
+        new_head = FREE_HEAD_PACK(FREE_HEAD_TAG(head) + 1, inumber);
+    } while (!atomic_compare_exchange_weak_explicit(&(inode_table_s.free_head), &head, new_head,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
+int inode_create(inode_type n_type) {
+
+    storage_access(CACHE_INODE_BITMAP, 0); // simulate storage access delay (to freeinode_ts)
+
+    int inumber = inode_free_pop();
+
+    if (inumber == -1) {
+        return -1;
+    }
+
+    atomic_store(&(inode_table_s.freeinode_ts[inumber]), TAKEN);
+
+    storage_access(CACHE_INODE, (size_t)inumber); // simulate storage access delay (to i-node)
+
+    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+
+    local_inode->i_node_type = n_type;
+
+    if (n_type == T_DIRECTORY) {
+        // Initializes directory (filling its block with empty
+        // entries, labeled with inumber==-1)
+        int b = data_block_alloc();
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+
+        if (dir_entry == NULL || dir_index_reset(inumber) == -1) {
+            data_block_free(b);
+            atomic_store(&(inode_table_s.freeinode_ts[inumber]), FREE);
+            inode_free_push(inumber);
+            return -1;
+        }
+
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            dir_entry[i].d_inumber = -1;
+        }
+        journal_log(JR_DIR_BLOCK, -1, 0, (uint64_t)b, NULL);
+
+        local_inode->i_size = FS_BLOCK_SIZE;
+        local_inode->i_n_extents = 1;
+        local_inode->i_extent[0] = (extent_t){0, (uint32_t)b, 1};
+        local_inode->i_extent_block = -1;
+        journal_log(JR_INODE_INIT, inumber, (int)n_type, (uint64_t)b, NULL);
+    } else {
+        // In case of a new file, simply sets its size to 0 (with no data inline)
+        local_inode->i_size = 0;
+        local_inode->i_n_extents = 0;
+        memset(local_inode->i_inline, 0, INODE_INLINE_SIZE);
+        journal_log(JR_INODE_INIT, inumber, (int)n_type, (uint64_t)-1, NULL);
+    }
+
+    return inumber;
+}
+
+/*
+ * Deletes the i-node.
+ * Input:
+ *  - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_delete(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    // simulate storage access delay (to i-node and freeinode_ts)
+    storage_access(CACHE_INODE, (size_t)inumber);
+    storage_access(CACHE_INODE_BITMAP, 0);
+
+    /* Only the caller that flips the entry to FREE gives the inumber back */
+    allocation_state_t expected = TAKEN;
+    if (!atomic_compare_exchange_strong(&(inode_table_s.freeinode_ts[inumber]), &expected, FREE)) {
+        return -1;
+    }
+
+    /* Cached names under this inumber (if it was a directory) go stale */
+    atomic_fetch_add(&(dcache_s.dir_gen[inumber]), 1u);
+
+    journal_log(JR_INODE_FREE, inumber, 0, 0, NULL);
+
+    inode_t *local_inode = &inode_table_s.inode_table[inumber];
+
+    int status = inode_free_blocks(local_inode, 0);
+
+    inode_free_push(inumber);
+
+    return status;
+}
+
+/*
+ * Returns a pointer to an existing i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: pointer if successful, NULL if failed
+ */
+inode_t *inode_get(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+    
+    storage_access(CACHE_INODE, (size_t)inumber); // simulate storage access delay to i-node
+
+    return &(inode_table_s.inode_table[inumber]);
+}
+
+/*
+ * Returns the inumber of an i-node of the i-node table
+ */
+int inode_number(inode_t const *inode) {
+    return (int)(inode - inode_table_s.inode_table);
+}
+
+/*
+ * Sets the size of an i-node (caller holds its lock)
+ * Inputs:
+ *  - inode
+ *  - size: new size in bytes
+ */
+void inode_set_size(inode_t *inode, size_t size) {
+    inode->i_size = size;
+    journal_log(JR_INODE_SIZE, inode_number(inode), 0, size, NULL);
+}
+
+/*
+ * Returns the block number of the k-th block of an i-node
+ * Input:
+ *  - inode
+ *  - k: index of the block in the file
+ *  - run: if not NULL, set to the number of consecutive data blocks,
+ *         starting at the one returned, that hold the next file blocks
+ * Returns: block number, -1 if that block is not allocated
+ */
+static int inode_block_number(inode_t *inode, size_t k, size_t *run) {
+    if (inode->i_n_extents > INODE_EXTENTS) {
+        extent_block_access(inode->i_extent_block); // simulate storage access delay to the extent block
+    }
+
+    return inode_extent_block_number(inode, k, run);
+}
+
+/*
+ * Logs the i-th extent of an i-node, which is its last one
+ */
+static void inode_extent_log(inode_t *inode, size_t i) {
+    extent_t const *extent = inode_extent(inode, i);
+
+    if (extent == NULL) {
+        return;
+    }
+
+    journal_log_record(JR_INODE_EXTENT, inode_number(inode), (int)i, extent->e_logical,
+                       (uint64_t)extent->e_physical << 32 | extent->e_length, NULL, 0);
+}
+
+/*
+ * Allocates blocks at the end of an i-node, starting at file block k: up to
+ * want blocks, as one run of consecutive data blocks. The run extends the
+ * last extent when it starts right after it; otherwise it becomes a new
+ * extent (and the extent block is allocated the first time it is needed).
+ * Inputs:
+ *  - inode
+ *  - k: index of the first block, which must be the end of the i-node
+ *  - want: number of blocks wanted
+ *  - got: set to the number of blocks allocated (at least one)
+ * Returns: the first new block number, -1 otherwise
+ */
+static int inode_block_append(inode_t *inode, size_t k, size_t want, size_t *got) {
+    size_t n = inode->i_n_extents;
+    extent_t *last = n > 0 ? inode_extent(inode, n - 1) : NULL;
+    size_t end = last != NULL ? last->e_logical + last->e_length : 0;
+
+    if (k != end || want == 0 || k + want > UINT32_MAX) {
+        return -1;
+    }
+
+    int goal = last != NULL ? (int)(last->e_physical + last->e_length) : -1;
+    size_t count = 0;
+    int first = data_block_alloc_run(goal, want, &count);
+
+    if (first == -1) {
+        return -1;
+    }
+
+    if (last != NULL && first == goal) {
+        last->e_length += (uint32_t)count;
+        inode_extent_log(inode, n - 1);
+    } else {
+        if (n >= INODE_EXTENTS) {
+            if (inode->i_extent_block == -1) {
+                int extent_block = data_block_alloc();
+
+                if (data_block_get(extent_block) == NULL) {
+                    data_block_free_run(first, count);
+                    return -1;
+                }
+
+                inode->i_extent_block = extent_block;
+                journal_log(JR_INODE_EXTENT_BLOCK, inode_number(inode), 0,
+                            (uint64_t)extent_block, NULL);
+            } else {
+                extent_block_access(inode->i_extent_block); // simulate storage access delay to the extent block
+            }
+        }
+
+        extent_t *extent = inode_extent(inode, n);
+
+        if (extent == NULL) {
+            data_block_free_run(first, count);
+            return -1;
+        }
+
+        /* The first extent of a file takes the place of its inline data,
+         * which the caller moved out (see inode_spill) */
+        if (n == 0) {
+            inode->i_extent_block = -1;
+        }
+
+        extent->e_logical = (uint32_t)k;
+        extent->e_physical = (uint32_t)first;
+        extent->e_length = (uint32_t)count;
+        inode->i_n_extents = (uint32_t)n + 1;
+        inode_extent_log(inode, n);
+
+        if (n == 0) {
+            journal_log(JR_INODE_EXTENT_BLOCK, inode_number(inode), 0, (uint64_t)-1, NULL);
+        }
+    }
+
+    *got = count;
+
+    return first;
+}
+
+/*
+ * Frees the blocks of an i-node from file block keep on, as one batch (see
+ * data_block_free_runs), and its extent block once the extents that are
+ * left fit in the i-node (caller holds its map mutex, or the i-node is
+ * being deleted)
+ * Inputs:
+ *  - inode
+ *  - keep: number of file blocks that are kept
+ * Returns: 0 if successful, -1 if some block could not be freed
+ */
+static int inode_free_blocks(inode_t *inode, size_t keep) {
+    int inumber = inode_number(inode);
+    size_t n_runs = 0;
+    size_t n = inode->i_n_extents;
+    extent_t *last = NULL;
+    int status = 0;
+
+    /* Data kept inline holds no blocks */
+    if (inode_is_inline(inode)) {
+        return 0;
+    }
+
+    /* Every extent, and the extent block */
+    extent_t *runs = malloc((n + 1) * sizeof(extent_t));
+
+    if (runs == NULL) {
+        return -1;
+    }
+
+    if (n > INODE_EXTENTS) {
+        extent_block_access(inode->i_extent_block); // simulate storage access delay to the extent block
+    }
+
+    /* Whole extents past keep go, and the one keep falls in loses its tail */
+    for (; n > 0; n--) {
+        extent_t *extent = inode_extent(inode, n - 1);
+
+        if (extent == NULL) {
+            status = -1;
+            continue;
+        }
+
+        if (extent->e_logical >= keep) {
+            runs[n_runs++] = *extent;
+            continue;
+        }
+
+        size_t kept = keep - extent->e_logical;
+
+        if (kept < extent->e_length) {
+            runs[n_runs++] = (extent_t){.e_logical = (uint32_t)keep,
+                                        .e_physical = extent->e_physical + (uint32_t)kept,
+                                        .e_length = extent->e_length - (uint32_t)kept};
+            last = extent;
+        }
+        break;
+    }
+
+    bool free_extent_block = n <= INODE_EXTENTS && inode->i_extent_block != -1;
+
+    if (n_runs == 0 && !free_extent_block) {
+        free(runs);
+        return status;
+    }
+
+    /* Cached translations of this i-node go stale before its blocks can be
+     * reused */
+    atomic_fetch_add(&(inode_map_gen_s[inumber]), 1u);
+
+    if (free_extent_block) {
+        runs[n_runs++] = (extent_t){.e_logical = 0,
+                                    .e_physical = (uint32_t)inode->i_extent_block,
+                                    .e_length = 1};
+    }
+
+    /* The i-node lets go of the blocks (in the journal too) before they are
+     * freed, so that no prefix of it leaves a block free that a file holds */
+    if (last != NULL) {
+        last->e_length = (uint32_t)(keep - last->e_logical);
+        inode_extent_log(inode, n - 1);
+    }
+
+    if (n != inode->i_n_extents) {
+        inode->i_n_extents = (uint32_t)n;
+        journal_log(JR_INODE_EXTENTS, inumber, 0, n, NULL);
+    }
+
+    if (free_extent_block) {
+        inode->i_extent_block = -1;
+        journal_log(JR_INODE_EXTENT_BLOCK, inumber, 0, (uint64_t)-1, NULL);
+    }
+
+    /* A file left without blocks keeps its data inline again, from none */
+    if (inode_is_inline(inode)) {
+        memset(inode->i_inline, 0, INODE_INLINE_SIZE);
+    }
+
+    if (data_block_free_runs(runs, n_runs) == -1) {
+        status = -1;
+    }
+
+    free(runs);
+
+    return status;
+}
+
+/*
+ * Moves the data a file keeps inline to its first block, so that it can
+ * get blocks (caller holds its map mutex); the rest of the block is zeroed
+ * Input:
+ *  - inode
+ * Returns: 0 if successful (or if there was nothing to move), -1 otherwise
+ */
+static int inode_spill(inode_t *inode) {
+    if (!inode_is_inline(inode) || inode->i_size == 0) {
+        return 0;
+    }
+
+    size_t size = inode->i_size < INODE_INLINE_SIZE ? inode->i_size : INODE_INLINE_SIZE;
+    uint8_t data[INODE_INLINE_SIZE];
+    size_t got;
+
+    memcpy(data, inode->i_inline, size);
+
+    int block_number = inode_block_append(inode, 0, 1, &got);
+    uint8_t *block = data_block_get(block_number);
+
+    if (block == NULL) {
+        return -1;
+    }
+
+    block_write_begin(block_number, 1);
+    memcpy(block, data, size);
+    memset(block + size, 0, FS_BLOCK_SIZE - size);
+    block_write_end(block_number, 1);
+
+    return 0;
+}
+
+/*
+ * Frees the contents of a file, leaving it empty (caller holds a WRITE
+ * lock on all of its byte range)
+ * Input:
+ *  - inode
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_truncate(inode_t *inode) { return inode_resize(inode, 0); }
+
+/*
+ * Allocates every block that a file of a given size needs and does not
+ * have yet, asking the allocator for all of them at once (and again only if
+ * free space is fragmented). Caller holds the map mutex of the i-node.
+ * Inputs:
+ *  - inode
+ *  - size: size of the file once written
+ *  - zero: whether the new blocks are zeroed whole (otherwise only the part
+ *          of the last one past size is)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int block_map_reserve(inode_t *inode, size_t size, bool zero) {
+    size_t blocks = blocks_for(size);
+
+    /* A file that still fits inline needs no blocks */
+    if (inode_is_inline(inode)) {
+        if (size <= INODE_INLINE_SIZE) {
+            return 0;
+        }
+        if (inode_spill(inode) == -1) {
+            return -1;
+        }
+    }
+
+    for (;;) {
+        size_t n = inode->i_n_extents;
+        extent_t const *last = n > 0 ? inode_extent(inode, n - 1) : NULL;
+        size_t first = last != NULL ? last->e_logical + last->e_length : 0;
+        size_t got;
+
+        if (first >= blocks) {
+            return 0;
+        }
+
+        int allocated = inode_block_append(inode, first, blocks - first, &got);
+
+        if (allocated == -1) {
+            return -1;
+        }
+
+        if (zero) {
+            uint8_t *data = data_block_run_get(allocated, got);
+
+            if (data != NULL) {
+                block_write_begin(allocated, got);
+                memset(data, 0, got * FS_BLOCK_SIZE);
+                block_write_end(allocated, got);
+            }
+        } else if (first + got == blocks && offset_in_block(size) != 0) {
+            int tail_block = allocated + (int)(got - 1);
+            uint8_t *tail = data_block_get(tail_block);
+
+            if (tail != NULL) {
+                block_write_begin(tail_block, 1);
+                memset(tail + offset_in_block(size), 0, FS_BLOCK_SIZE - offset_in_block(size));
+                block_write_end(tail_block, 1);
+            }
+        }
+    }
+}
+
+/*
+ * Allocates, ahead of a write, every block that a file of a given size
+ * needs and does not have yet (see block_map_reserve). The size of the
+ * file does not change, and only the part of the last block past that size
+ * is zeroed: the caller must write the whole range, or truncate the file,
+ * before releasing its WRITE lock on it.
+ * Inputs:
+ *  - inode
+ *  - size: size of the file once written
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_reserve(inode_t *inode, size_t size) {
+    pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
+
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+    int status = block_map_reserve(inode, size, false);
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+    return status;
+}
+
+/*
+ * Changes the size of a file (caller holds a WRITE lock on its byte range
+ * from the smaller of the two sizes on). A smaller size frees the blocks
+ * past it, and zeroes the rest of the block it ends in; a larger one reads
+ * as zeros past the old size.
+ * Input:
+ *  - inode
+ *  - size: new size in bytes
+ * Returns: 0 if successful, -1 otherwise (a file that could not grow keeps
+ * its size)
+ */
+int inode_resize(inode_t *inode, size_t size) {
+    inode_lock_t *lock = inode_lock_get(inode);
+    pthread_mutex_t *map_mutex = &(lock->il_map_mutex);
+    append_state_t *append = &(appends_s[inode_number(inode)]);
+    int status = 0;
+
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+    /* Appends already given a range finish first (new ones wait) */
+    append->ap_resizing++;
+    while (append->ap_pending > 0) {
+        pthread_cond_wait(&(lock->il_append_cond), map_mutex);
+    }
+    append->ap_resizing--;
+
+    size_t old_size = inode->i_size;
+
+    /* Bytes past the end of the file read as zeros if it grows again */
+    size_t end = size < old_size ? size : old_size;
+
+    if (inode_is_inline(inode)) {
+        if (end < INODE_INLINE_SIZE) {
+            memset(inode->i_inline + end, 0, INODE_INLINE_SIZE - end);
+            journal_log_inline(inode);
+        }
+    } else if (offset_in_block(end) != 0) {
+        int tail_block = inode_block_number(inode, block_of(end), NULL);
+        uint8_t *tail = data_block_get(tail_block);
+
+        if (tail != NULL) {
+            block_write_begin(tail_block, 1);
+            memset(tail + offset_in_block(end), 0, FS_BLOCK_SIZE - offset_in_block(end));
+            block_write_end(tail_block, 1);
+        }
+    }
+
+    /* The size is logged before the blocks it no longer reaches are freed,
+     * and after those it needs are allocated, so that no prefix of the
+     * journal leaves a file larger than its blocks */
+    if (size <= old_size) {
+        inode_set_size(inode, size);
+        status = inode_free_blocks(inode, blocks_for(size));
+    } else {
+        status = block_map_reserve(inode, size, true);
+
+        if (status == 0) {
+            inode_set_size(inode, size);
+        }
+    }
+
+    pthread_cond_broadcast(&(lock->il_append_cond));
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+    return status;
+}
+
+/*
+ * FNV-1a hash of a directory entry name (at most MAX_FILE_NAME - 1 chars)
+ */
+static uint32_t dir_name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < MAX_FILE_NAME - 1 && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns a pointer to the entry at a given position of a directory
+ * Returns: pointer to the entry, NULL if no block backs that position
+ */
+static dir_entry_t *dir_entry_at(inode_t *dir, size_t pos) {
+    int block_number = inode_block_number(dir, pos / DIR_ENTRIES_PER_BLOCK, NULL);
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(block_number);
+
+    if (dir_entry == NULL) {
+        return NULL;
+    }
+
+    return &dir_entry[pos % DIR_ENTRIES_PER_BLOCK];
+}
+
+/*
+ * Opens a write section on a directory index (caller holds di_mutex)
+ */
+static void dir_index_write_begin(dir_index_t *index) {
+    unsigned seq = atomic_load_explicit(&(index->di_seq), memory_order_relaxed);
+    atomic_store_explicit(&(index->di_seq), seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/*
+ * Closes a write section, publishing the changes to readers
+ */
+static void dir_index_write_end(dir_index_t *index) {
+    unsigned seq = atomic_load_explicit(&(index->di_seq), memory_order_relaxed);
+    atomic_store_explicit(&(index->di_seq), seq + 1, memory_order_release);
+}
+
+/*
+ * Allocates an empty slot array for the directory index
+ */
+static dir_slots_t *dir_slots_alloc(size_t n_slots) {
+    dir_slots_t *slots = malloc(sizeof(dir_slots_t) + n_slots * sizeof(_Atomic uint64_t));
+
+    if (slots == NULL) {
+        return NULL;
+    }
+
+    slots->ds_mask = n_slots - 1;
+    slots->ds_retired = NULL;
+
+    for (size_t i = 0; i < n_slots; i++) {
+        atomic_init(&(slots->ds_slots[i]), DIR_INDEX_EMPTY);
+    }
+    return slots;
+}
+
+/*
+ * Empties the index of a newly created directory
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_index_reset(int inumber) {
+    dir_index_t *index = &(dir_index_s[inumber]);
+    int status = 0;
+
+    STATS_LOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+    dir_index_write_begin(index);
+
+    dir_slots_t *slots = atomic_load_explicit(&(index->di_slots), memory_order_relaxed);
+
+    if (slots == NULL) {
+        slots = dir_slots_alloc(DIR_INDEX_MIN_SLOTS);
+        atomic_store_explicit(&(index->di_slots), slots, memory_order_release);
+        status = slots == NULL ? -1 : 0;
+    } else {
+        for (size_t i = 0; i <= slots->ds_mask; i++) {
+            atomic_store_explicit(&(slots->ds_slots[i]), DIR_INDEX_EMPTY, memory_order_relaxed);
+        }
+    }
+
+    index->di_used = 0;
+    index->di_free_hint = 0;
+
+    dir_index_write_end(index);
+
+    STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+    return status;
+}
+
+/*
+ * Stores a slot in the first empty or deleted position of its probe sequence
+ * Returns: true if an empty (rather than deleted) position was used
+ */
+static bool dir_slots_insert(dir_slots_t *slots, uint64_t slot) {
+    for (size_t i = DIR_INDEX_HASH(slot) & slots->ds_mask;; i = (i + 1) & slots->ds_mask) {
+        uint64_t current = atomic_load_explicit(&(slots->ds_slots[i]), memory_order_relaxed);
+
+        if (current == DIR_INDEX_EMPTY || current == DIR_INDEX_TOMBSTONE) {
+            atomic_store_explicit(&(slots->ds_slots[i]), slot, memory_order_relaxed);
+            return current == DIR_INDEX_EMPTY;
+        }
+    }
+}
+
+/*
+ * Doubles the slot array of a directory index, dropping deleted slots
+ * (caller is inside a write section)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_index_grow(dir_index_t *index) {
+    dir_slots_t *old_slots = atomic_load_explicit(&(index->di_slots), memory_order_relaxed);
+    dir_slots_t *new_slots = dir_slots_alloc(2 * (old_slots->ds_mask + 1));
+
+    if (new_slots == NULL) {
+        return -1;
+    }
+
+    index->di_used = 0;
+
+    for (size_t i = 0; i <= old_slots->ds_mask; i++) {
+        uint64_t slot = atomic_load_explicit(&(old_slots->ds_slots[i]), memory_order_relaxed);
+
+        if (slot != DIR_INDEX_EMPTY && slot != DIR_INDEX_TOMBSTONE) {
+            dir_slots_insert(new_slots, slot);
+            index->di_used++;
+        }
+    }
+
+    new_slots->ds_retired = old_slots;
+    atomic_store_explicit(&(index->di_slots), new_slots, memory_order_release);
+
+    return 0;
+}
+
+/*
+ * Probes a directory index for a name
+ * Input:
+ *  - slots of the directory index and the directory i-node
+ *  - the name and its hash
+ * Returns: position of the matching entry, -1 if not found
+ */
+static ssize_t dir_index_probe(dir_slots_t *slots, inode_t *dir, char const *sub_name,
+                               uint32_t hash) {
+    for (size_t n = 0, i = hash & slots->ds_mask; n <= slots->ds_mask;
+         n++, i = (i + 1) & slots->ds_mask) {
+
+        uint64_t slot = atomic_load_explicit(&(slots->ds_slots[i]), memory_order_relaxed);
+
+        if (slot == DIR_INDEX_EMPTY) {
+            return -1;
+        }
+
+        if (slot != DIR_INDEX_TOMBSTONE && DIR_INDEX_HASH(slot) == hash) {
+            dir_entry_t *entry = dir_entry_at(dir, DIR_INDEX_POS(slot));
+
+            if (entry != NULL && strncmp(entry->d_name, sub_name, MAX_FILE_NAME - 1) == 0) {
+                return (ssize_t)DIR_INDEX_POS(slot);
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Builds the index of a directory from its entries, unless it is already
+ * built (only directories of a mounted image start without one). Caller
+ * holds di_mutex.
+ * Returns: the slot array, NULL otherwise
+ */
+static dir_slots_t *dir_index_load(dir_index_t *index, inode_t *dir) {
+    dir_slots_t *slots = atomic_load_explicit(&(index->di_slots), memory_order_relaxed);
+
+    if (slots != NULL) {
+        return slots;
+    }
+
+    size_t n_entries = block_of(dir->i_size) * DIR_ENTRIES_PER_BLOCK;
+    uint64_t *live = malloc((n_entries + 1) * sizeof(uint64_t));
+    size_t n_live = 0;
+
+    if (live == NULL) {
+        return NULL;
+    }
+
+    index->di_free_hint = n_entries;
+
+    for (size_t pos = 0; pos < n_entries; pos += DIR_ENTRIES_PER_BLOCK) {
+        dir_entry_t *dir_entry = dir_entry_at(dir, pos);
+
+        if (dir_entry == NULL) {
+            break;
+        }
+
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            if (dir_entry[i].d_inumber != -1) {
+                live[n_live++] = DIR_INDEX_PACK(dir_name_hash(dir_entry[i].d_name), pos + i);
+            } else if (pos + i < index->di_free_hint) {
+                index->di_free_hint = pos + i;
+            }
+        }
+    }
+
+    size_t n_slots = DIR_INDEX_MIN_SLOTS;
+    while (n_slots < 2 * (n_live + 1)) {
+        n_slots *= 2;
+    }
+
+    slots = dir_slots_alloc(n_slots);
+
+    if (slots != NULL) {
+        for (size_t i = 0; i < n_live; i++) {
+            dir_slots_insert(slots, live[i]);
+        }
+        index->di_used = n_live;
+        atomic_store_explicit(&(index->di_slots), slots, memory_order_release);
+    }
+
+    free(live);
+    return slots;
+}
+
+/*
+ * Picks the dentry cache bucket of a (parent, name) pair
+ */
+static size_t dcache_bucket(int parent, uint32_t hash) {
+    return (hash ^ ((uint32_t)parent * 2654435761u)) % DCACHE_BUCKETS;
+}
+
+/*
+ * Looks up a (parent, name) pair in the dentry cache
+ * Returns: the cached inumber (-1 for a cached miss), DCACHE_MISS if the
+ * pair is not cached
+ */
+static int dcache_lookup(int parent, char const *sub_name, uint32_t hash) {
+    dentry_t *dentry = &(dcache_s.dentries[dcache_bucket(parent, hash)]);
+    unsigned gen = atomic_load_explicit(&(dcache_s.dir_gen[parent]), memory_order_acquire);
+
+    for (;;) {
+        unsigned seq = atomic_load_explicit(&(dentry->dc_seq), memory_order_acquire);
+
+        if (seq & 1u) {
+            lock_cpu_relax();
+            continue;
+        }
+
+        int result = DCACHE_MISS;
+        if (dentry->dc_parent == parent && dentry->dc_parent_gen == gen &&
+            strncmp(dentry->dc_name, sub_name, MAX_FILE_NAME - 1) == 0) {
+            result = dentry->dc_inumber;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&(dentry->dc_seq), memory_order_relaxed) == seq) {
+            return result;
+        }
+    }
+}
+
+/*
+ * Caches the result of looking up a name in a directory
+ * Input:
+ *  - parent directory, name and its hash
+ *  - sub_inumber: result of the lookup (-1 if the name does not exist)
+ *  - dir_seq: sequence number of the directory index the result was read at;
+ *    nothing is cached if the directory changed since then
+ */
+static void dcache_insert(int parent, char const *sub_name, uint32_t hash, int sub_inumber,
+                          unsigned dir_seq) {
+    size_t bucket = dcache_bucket(parent, hash);
+    dentry_t *dentry = &(dcache_s.dentries[bucket]);
+    pthread_mutex_t *lock = &(dcache_s.dcache_locks[bucket % DCACHE_LOCKS]);
+
+    STATS_LOCK(lock, STATS_LOCK_DCACHE);
+
+    /* Directory writers update the cache after bumping di_seq, so checking it
+     * under the bucket lock keeps a stale miss from overwriting their entry */
+    if (atomic_load_explicit(&(dir_index_s[parent].di_seq), memory_order_acquire) == dir_seq) {
+        unsigned seq = atomic_load_explicit(&(dentry->dc_seq), memory_order_relaxed);
+        atomic_store_explicit(&(dentry->dc_seq), seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        dentry->dc_parent = parent;
+        dentry->dc_parent_gen = atomic_load(&(dcache_s.dir_gen[parent]));
+        dentry->dc_inumber = sub_inumber;
+        strncpy(dentry->dc_name, sub_name, MAX_FILE_NAME - 1);
+        dentry->dc_name[MAX_FILE_NAME - 1] = 0;
+
+        atomic_store_explicit(&(dentry->dc_seq), seq + 2, memory_order_release);
+    }
+
+    STATS_UNLOCK(lock, STATS_LOCK_DCACHE);
+}
+
+/*
+ * Returns the i-node of a directory
+ * Returns: pointer to the i-node, NULL if inumber is not a directory
+ */
+static inode_t *dir_inode_get(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+
+    inode_t *dir = &(inode_table_s.inode_table[inumber]);
+
+    return dir->i_node_type == T_DIRECTORY ? dir : NULL;
+}
+
+/*
+ * Adds an entry to the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL (also if the name already exists)
+ */
+int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
+    if (!valid_inumber(sub_inumber) || strlen(sub_name) == 0) {
+        return -1;
+    }
+
+    storage_access(CACHE_INODE, (size_t)inumber); // simulate storage access delay to i-node with inumber
+
+    inode_t *dir = dir_inode_get(inumber);
+
+    if (dir == NULL) {
+        return -1;
+    }
+
+    dir_index_t *index = &(dir_index_s[inumber]);
+    uint32_t hash = dir_name_hash(sub_name);
+    dir_entry_t *entry = NULL;
+    size_t pos = 0;
+
+    STATS_LOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+    dir_slots_t *slots = dir_index_load(index, dir);
+
+    if (slots == NULL || dir_index_probe(slots, dir, sub_name, hash) != -1) {
+        STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+        return -1;
+    }
+
+    /* Finds the first empty entry, one directory block at a time */
+    size_t n_entries = block_of(dir->i_size) * DIR_ENTRIES_PER_BLOCK;
+
+    for (pos = index->di_free_hint; entry == NULL && pos < n_entries;) {
+        dir_entry_t *candidate = dir_entry_at(dir, pos);
+
+        if (candidate == NULL) {
+            break;
+        }
+
+        /* Walks the rest of this block without fetching it again */
+        do {
+            if (candidate->d_inumber == -1) {
+                entry = candidate;
+                break;
+            }
+            candidate++;
+            pos++;
+        } while (pos % DIR_ENTRIES_PER_BLOCK != 0 && pos < n_entries);
+    }
+
+    /* Lock-free readers retry over anything from here on, the growth of
+     * the extents and size of a full directory included */
+    dir_index_write_begin(index);
+
+    /* Directory is full: grows it by one block */
+    if (entry == NULL) {
+        pos = n_entries;
+
+        size_t got;
+        int block_number = inode_block_append(dir, n_entries / DIR_ENTRIES_PER_BLOCK, 1, &got);
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(block_number);
+
+        if (dir_entry == NULL) {
+            dir_index_write_end(index);
+            STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+            return -1;
+        }
+
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            dir_entry[i].d_inumber = -1;
+        }
+        journal_log(JR_DIR_BLOCK, -1, 0, (uint64_t)block_number, NULL);
+
+        dir->i_size += FS_BLOCK_SIZE;
+        journal_log(JR_INODE_SIZE, inumber, 0, dir->i_size, NULL);
+        entry = dir_entry;
+    }
+
+    if (2 * (index->di_used + 1) > slots->ds_mask + 1 && dir_index_grow(index) == -1) {
+        dir_index_write_end(index);
+        STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+        return -1;
+    }
+    slots = atomic_load_explicit(&(index->di_slots), memory_order_relaxed);
+
+    entry->d_inumber = sub_inumber;
+    strncpy(entry->d_name, sub_name, MAX_FILE_NAME - 1);
+    entry->d_name[MAX_FILE_NAME - 1] = 0;
+    journal_log(JR_DIR_SET, inumber, sub_inumber, pos, entry->d_name);
+
+    if (dir_slots_insert(slots, DIR_INDEX_PACK(hash, pos))) {
+        index->di_used++;
+    }
+
+    dir_index_write_end(index);
+
+    index->di_free_hint = pos + 1;
+
+    dcache_insert(inumber, sub_name, hash, sub_inumber,
+                  atomic_load_explicit(&(index->di_seq), memory_order_relaxed));
+
+    STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+    return 0;
+}
+
+/*
+ * Removes the entry of a sub i-node from the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the directory i-node
+ *  - sub_inumber: identifier of the sub i-node entry to remove
+ * Returns: 0 if successful, -1 if the entry was not found
+ */
+int clear_dir_entry(int inumber, int sub_inumber) {
+    if (!valid_inumber(sub_inumber)) {
+        return -1;
+    }
+
+    storage_access(CACHE_INODE, (size_t)inumber); // simulate storage access delay to i-node with inumber
+
+    inode_t *dir = dir_inode_get(inumber);
+
+    if (dir == NULL) {
+        return -1;
+    }
+
+    dir_index_t *index = &(dir_index_s[inumber]);
+    int status = -1;
+
+    STATS_LOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+    if (dir_index_load(index, dir) == NULL) {
+        STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+        return -1;
+    }
+
+    size_t n_entries = block_of(dir->i_size) * DIR_ENTRIES_PER_BLOCK;
+
+    for (size_t pos = 0; pos < n_entries && status == -1; pos += DIR_ENTRIES_PER_BLOCK) {
+        dir_entry_t *dir_entry = dir_entry_at(dir, pos);
+
+        if (dir_entry == NULL) {
+            break;
+        }
+
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            if (dir_entry[i].d_inumber != sub_inumber) {
+                continue;
+            }
+
+            char sub_name[MAX_FILE_NAME];
+            strncpy(sub_name, dir_entry[i].d_name, MAX_FILE_NAME);
+            uint32_t hash = dir_name_hash(sub_name);
+            uint64_t target = DIR_INDEX_PACK(hash, pos + i);
+
+            dir_index_write_begin(index);
+
+            dir_slots_t *slots = atomic_load_explicit(&(index->di_slots), memory_order_relaxed);
+            for (size_t n = 0, j = hash & slots->ds_mask; n <= slots->ds_mask;
+                 n++, j = (j + 1) & slots->ds_mask) {
+                if (atomic_load_explicit(&(slots->ds_slots[j]), memory_order_relaxed) == target) {
+                    atomic_store_explicit(&(slots->ds_slots[j]), DIR_INDEX_TOMBSTONE,
+                                          memory_order_relaxed);
+                    break;
+                }
+            }
+
+            dir_entry[i].d_inumber = -1;
+            journal_log(JR_DIR_SET, inumber, -1, pos + i, NULL);
+
+            dir_index_write_end(index);
+
+            if (pos + i < index->di_free_hint) {
+                index->di_free_hint = pos + i;
+            }
+
+            dcache_insert(inumber, sub_name, hash, -1,
+                          atomic_load_explicit(&(index->di_seq), memory_order_relaxed));
+
+            status = 0;
+            break;
+        }
+    }
+
+    STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+    return status;
+}
+
+/* Looks for a given name inside a directory
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_in_dir(int inumber, char const *sub_name) {
+    int sub_inumber;
+
+    return find_many_in_dir(inumber, &sub_name, 1, &sub_inumber) == 0 ? sub_inumber : -1;
+}
+
+/* Looks for several names inside a directory at once: the names the
+ * dentry cache does not answer cost a single access to the directory, and
+ * are probed in the same pass over its index
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- sub_names: the n names to search
+ * 	- sub_inumbers: set to the i-number of each name, -1 if not found
+ * 	Returns 0 if successful, -1 if inumber is not a directory
+ */
+int find_many_in_dir(int inumber, char const *const *sub_names, size_t n, int *sub_inumbers) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    inode_t *dir = NULL;
+    dir_index_t *index = &(dir_index_s[inumber]);
+
+    /* Names are looked up 64 at a time; missed has a bit set for each one
+     * the dentry cache does not answer */
+    for (size_t first = 0; first < n; first += 64) {
+        size_t count = n - first < 64 ? n - first : 64;
+        char const *const *names = sub_names + first;
+        int *inumbers = sub_inumbers + first;
+        uint64_t missed = 0;
+
+        /* A cached answer (hit or miss) needs no access to the directory */
+        for (size_t i = 0; i < count; i++) {
+            inumbers[i] = dcache_lookup(inumber, names[i], dir_name_hash(names[i]));
+            if (inumbers[i] == DCACHE_MISS) {
+                missed |= (uint64_t)1 << i;
+            }
+        }
+
+        if (missed == 0) {
+            continue;
+        }
+
+        if (dir == NULL) {
+            storage_access(CACHE_INODE, (size_t)inumber); // simulate storage access delay to i-node with inumber
+
+            dir = dir_inode_get(inumber);
+
+            if (dir == NULL) {
+                return -1;
+            }
+
+            if (atomic_load_explicit(&(index->di_slots), memory_order_acquire) == NULL) {
+                STATS_LOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+                dir_slots_t *slots = dir_index_load(index, dir);
+                STATS_UNLOCK(&(index->di_mutex), STATS_LOCK_DIR_INDEX);
+
+                if (slots == NULL) {
+                    return -1;
+                }
+            }
+        }
+
+        /* Lock-free read: retries if a writer ran while the index was probed */
+        for (;;) {
+            unsigned seq = atomic_load_explicit(&(index->di_seq), memory_order_acquire);
+
+            if (seq & 1u) {
+                lock_cpu_relax();
+                continue;
+            }
+
+            dir_slots_t *slots = atomic_load_explicit(&(index->di_slots), memory_order_acquire);
+
+            for (size_t i = 0; i < count; i++) {
+                if (missed & ((uint64_t)1 << i)) {
+                    ssize_t pos = dir_index_probe(slots, dir, names[i], dir_name_hash(names[i]));
+                    dir_entry_t *entry = pos == -1 ? NULL : dir_entry_at(dir, (size_t)pos);
+
+                    inumbers[i] = entry == NULL ? -1 : entry->d_inumber;
+                }
+            }
+
+            atomic_thread_fence(memory_order_acquire);
+
+            if (atomic_load_explicit(&(index->di_seq), memory_order_relaxed) == seq) {
+                for (size_t i = 0; i < count; i++) {
+                    if (missed & ((uint64_t)1 << i)) {
+                        dcache_insert(inumber, names[i], dir_name_hash(names[i]), inumbers[i], seq);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Lowers the bitmap hint to word, if it is currently above it
+ */
+static void free_blocks_hint_lower(size_t word) {
+    size_t hint = atomic_load_explicit(&(data_blocks_s.free_blocks_hint), memory_order_relaxed);
+
+    while (word < hint &&
+           !atomic_compare_exchange_weak_explicit(&(data_blocks_s.free_blocks_hint), &hint, word,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/*
+ * Claims a free data block, scanning the bitmap a word at a time from the
+ * calling thread's cursor (or from the shared hint, if the cursor is behind
+ * it); a free bit is claimed with a compare-and-swap, so no lock is taken.
+ * Returns: block index if successful, -1 otherwise
+ */
+static int data_block_scan() {
+    size_t start = atomic_load_explicit(&(data_blocks_s.free_blocks_hint), memory_order_relaxed);
+    if (block_alloc_cursor > start) {
+        start = block_alloc_cursor;
+    }
+
+    for (size_t n = 0; n < data_blocks_s.bitmap_words; n++) {
+        size_t w = (start + n) % data_blocks_s.bitmap_words;
+        _Atomic uint64_t *word_ptr = &(data_blocks_s.free_blocks[w]);
+        uint64_t word = atomic_load_explicit(word_ptr, memory_order_relaxed);
+
+        while (word != BITMAP_FULL_WORD) {
+            // Finds first free (zero) bit in the word
+            int bit = __builtin_ctzll(~word);
+            uint64_t taken = word | ((uint64_t)1 << bit);
+
+            if (atomic_compare_exchange_weak_explicit(word_ptr, &word, taken, memory_order_acquire,
+                                                      memory_order_relaxed)) {
+                block_alloc_cursor = w;
+
+                // The word just filled up, so the hint can move past it
+                if (taken == BITMAP_FULL_WORD) {
+                    size_t expected = w;
+                    atomic_compare_exchange_strong_explicit(&(data_blocks_s.free_blocks_hint),
+                                                            &expected, w + 1, memory_order_relaxed,
+                                                            memory_order_relaxed);
+                }
+
+                return (int)(w * BITMAP_WORD_BITS + (size_t)bit);
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Claims a given data block, if it is free
+ * Returns: true if it was claimed, false if it was already taken
+ */
+static bool data_block_take(size_t block_number) {
+    uint64_t mask = (uint64_t)1 << (block_number % BITMAP_WORD_BITS);
+
+    return (atomic_fetch_or_explicit(&(data_blocks_s.free_blocks[block_number / BITMAP_WORD_BITS]),
+                                     mask, memory_order_acquire) &
+            mask) == 0;
+}
+
+/*
+ * Allocates a run of consecutive data blocks: it starts at goal if that
+ * block is free (so a file can keep growing in place), anywhere otherwise,
+ * and extends over the free blocks that follow, up to want blocks.
+ * Inputs:
+ *  - goal: preferred first block, -1 for none
+ *  - want: number of blocks wanted
+ *  - got: set to the number of blocks allocated (at least one)
+ * Returns: the first block index if successful, -1 otherwise
+ */
+int data_block_alloc_run(int goal, size_t want, size_t *got) {
+
+    size_t word = valid_block_number(goal) ? (size_t)goal / BITMAP_WORD_BITS : block_alloc_cursor;
+
+    // simulate storage access delay to free_blocks
+    storage_access(CACHE_BLOCK_BITMAP, word < data_blocks_s.bitmap_words ? word : 0);
+
+    int first = valid_block_number(goal) && data_block_take((size_t)goal) ? goal
+                                                                          : data_block_scan();
+
+    if (first == -1) {
+        return -1;
+    }
+
+    size_t count = 1;
+    while (count < want && (size_t)first + count < data_blocks_s.n_blocks &&
+           data_block_take((size_t)first + count)) {
+        count++;
+    }
+
+    block_alloc_cursor = ((size_t)first + count - 1) / BITMAP_WORD_BITS;
+
+    journal_log(JR_BLOCK_ALLOC, -1, (int)count, (uint64_t)first, NULL);
+
+    *got = count;
+
+    return first;
+}
+
+/*
+ * Allocated a new data block
+ * Returns: block index if successful, -1 otherwise
+ */
+int data_block_alloc() {
+    size_t got;
+
+    return data_block_alloc_run(-1, 1, &got);
+}
+
+/* Frees runs of consecutive data blocks, as one batch: the part of the
+ * bitmap they span is a single simulated storage access
+ * Input
+ * 	- runs: the n runs (e_physical and e_length of each one)
+ * Returns: 0 if success, -1 if some run is not valid (the others are freed)
+ */
+int data_block_free_runs(extent_t const *runs, size_t n) {
+    size_t low = SIZE_MAX;
+    size_t high = 0;
+    int status = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (!valid_block_run(runs[i].e_physical, runs[i].e_length)) {
+            status = -1;
+            continue;
+        }
+        if (runs[i].e_physical < low) {
+            low = runs[i].e_physical;
+        }
+        if (runs[i].e_physical + runs[i].e_length > high) {
+            high = runs[i].e_physical + runs[i].e_length;
+        }
+    }
+
+    if (low >= high) {
+        return status;
+    }
+
+    // simulate storage access delay to the words of free_blocks the runs span
+    storage_access_run(CACHE_BLOCK_BITMAP, low / BITMAP_WORD_BITS,
+                       (high - 1) / BITMAP_WORD_BITS - low / BITMAP_WORD_BITS + 1);
+
+    for (size_t i = 0; i < n; i++) {
+        if (!valid_block_run(runs[i].e_physical, runs[i].e_length)) {
+            continue;
+        }
+
+        size_t b = runs[i].e_physical;
+        size_t end = b + runs[i].e_length;
+
+        /* Logged before the bits are cleared (allocations are logged after
+         * they are set), so a reallocation of a block is always logged
+         * after this */
+        journal_log(JR_BLOCK_FREE, -1, (int)runs[i].e_length, (uint64_t)b, NULL);
+        block_csum_clear(b, runs[i].e_length);
+        image_dirty(b, runs[i].e_length, false);
+
+        while (b < end) {
+            size_t w = b / BITMAP_WORD_BITS;
+            size_t bits = BITMAP_WORD_BITS - b % BITMAP_WORD_BITS;
+
+            if (bits > end - b) {
+                bits = end - b;
+            }
+
+            uint64_t mask = (bits == BITMAP_WORD_BITS ? BITMAP_FULL_WORD : ((uint64_t)1 << bits) - 1)
+                            << (b % BITMAP_WORD_BITS);
+
+            atomic_fetch_and_explicit(&(data_blocks_s.free_blocks[w]), ~mask, memory_order_release);
+            b += bits;
+        }
+    }
+
+    size_t w = low / BITMAP_WORD_BITS;
+
+    free_blocks_hint_lower(w);
+
+    // Lets this thread reuse the freed blocks before scanning further ahead
+    if (w < block_alloc_cursor) {
+        block_alloc_cursor = w;
+    }
+
+    return status;
+}
+
+/* Frees a run of consecutive data blocks
+ * Input
+ * 	- the first block index
+ * 	- the number of blocks
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free_run(int first, size_t count) {
+    if (first < 0 || count > UINT32_MAX || !valid_block_run((size_t)first, count)) {
+        return -1;
+    }
+
+    extent_t run = {.e_logical = 0, .e_physical = (uint32_t)first, .e_length = (uint32_t)count};
+
+    return data_block_free_runs(&run, 1);
+}
+
+/* Frees a data block
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) { return data_block_free_run(block_number, 1); }
+
+/* Returns a pointer to the contents of a given block
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
+ */
+void *data_block_get(int block_number) { return data_block_run_get(block_number, 1); }
+
+/* Returns a pointer to the contents of a run of consecutive blocks, which
+ * are contiguous in memory (a single simulated storage access)
+ * Input:
+ * 	- the first block index
+ * 	- the number of blocks
+ * Returns: pointer to the first byte of the run, NULL otherwise
+ */
+void *data_block_run_get(int first, size_t count) {
+    if (!valid_block_number(first) || count == 0 ||
+        count > data_blocks_s.n_blocks - (size_t)first) {
+        return NULL;
+    }
+
+    storage_access_run(CACHE_BLOCK, (size_t)first, count); // simulate storage access delay to block
+
+    return data_blocks_s.fs_data + (size_t)first * FS_BLOCK_SIZE;
+}
+
+/*
+ * Returns the entry of the open file table at a given index, allocating
+ * its segment the first time it is needed
+ * Returns: pointer to the entry, NULL if the segment could not be allocated
+ */
+static open_file_entry_t *open_file_entry_at(int index, bool allocate) {
+    _Atomic(open_file_entry_t *) *slot = &(fs_state_s.segments[index / OPEN_FILE_SEGMENT]);
+    open_file_entry_t *segment = atomic_load_explicit(slot, memory_order_acquire);
+
+    if (segment == NULL && allocate) {
+        open_file_entry_t *fresh = calloc(OPEN_FILE_SEGMENT, sizeof(open_file_entry_t));
+
+        if (fresh == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < OPEN_FILE_SEGMENT; i++) {
+            atomic_init(&(fresh[i].of_handle), -1);
+            atomic_init(&(fresh[i].of_next), -1);
+            pthread_mutex_init(&(fresh[i].open_file_mutex), NULL);
+        }
+
+        /* Another thread may have installed the segment meanwhile */
+        if (atomic_compare_exchange_strong_explicit(slot, &segment, fresh, memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            segment = fresh;
+        } else {
+            for (size_t i = 0; i < OPEN_FILE_SEGMENT; i++) {
+                pthread_mutex_destroy(&(fresh[i].open_file_mutex));
+            }
+            free(fresh);
+        }
+    }
+
+    return segment != NULL ? &(segment[index % OPEN_FILE_SEGMENT]) : NULL;
+}
+
+/*
+ * Pops an index from the free stack of the open file table (same scheme as
+ * the free stack of the i-node table)
+ * Returns: the index, -1 if the stack is empty
+ */
+static int open_file_free_pop() {
+    uint64_t head = atomic_load_explicit(&(fs_state_s.free_head), memory_order_acquire);
+
+    while (!FREE_HEAD_IS_EMPTY(head)) {
+        int index = FREE_HEAD_INUMBER(head);
+        int next = atomic_load_explicit(&(open_file_entry_at(index, false)->of_next),
+                                        memory_order_relaxed);
+        uint64_t new_head = FREE_HEAD_PACK(FREE_HEAD_TAG(head) + 1, next);
+
+        if (atomic_compare_exchange_weak_explicit(&(fs_state_s.free_head), &head, new_head,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static void open_file_free_push(int index) {
+    open_file_entry_t *entry = open_file_entry_at(index, false);
+    uint64_t head = atomic_load_explicit(&(fs_state_s.free_head), memory_order_relaxed);
+    uint64_t new_head;
+
+    do {
+        int next = FREE_HEAD_INUMBER(head);
+        atomic_store_explicit(&(entry->of_next), next, memory_order_relaxed);
+        new_head = FREE_HEAD_PACK(FREE_HEAD_TAG(head) + 1, index);
+    } while (!atomic_compare_exchange_weak_explicit(&(fs_state_s.free_head), &head, new_head,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+#if OPEN_FILE_CACHE > 0
+/* Gives the entries cached by an exiting thread back to the table, unless
+ * the table they belong to was destroyed meanwhile */
+static void open_file_cache_release(void *arg) {
+    open_file_cache_t *cache = (open_file_cache_t *)arg;
+
+    if (cache->oc_epoch == atomic_load(&(fs_state_s.epoch))) {
+        while (cache->oc_count > 0) {
+            open_file_free_push(cache->oc_index[--cache->oc_count]);
+        }
+    }
+    free(cache);
+}
+
+/* Releases the caches of an exiting thread, each in the slot it was for */
+static void open_file_caches_release(void *arg) {
+    open_file_cache_t **caches = (open_file_cache_t **)arg;
+
+    for (int slot = 0; slot < MAX_CONTEXTS; slot++) {
+        if (caches[slot] != NULL) {
+            ctx_slot_s = slot;
+            open_file_cache_release(caches[slot]);
+            caches[slot] = NULL;
+        }
+    }
+}
+
+static void open_file_cache_key_create() {
+    pthread_key_create(&open_file_cache_key, open_file_caches_release);
+}
+
+/* Returns the cache of the calling thread for the current table, NULL if
+ * it could not be allocated */
+static open_file_cache_t *open_file_cache_get() {
+    open_file_cache_t *cache = open_file_cache_s;
+    unsigned epoch = atomic_load_explicit(&(fs_state_s.epoch), memory_order_relaxed);
+
+    if (cache == NULL) {
+        pthread_once(&open_file_cache_once, open_file_cache_key_create);
+
+        cache = malloc(sizeof(open_file_cache_t));
+        if (cache == NULL || pthread_setspecific(open_file_cache_key, open_file_cache_slots) != 0) {
+            free(cache);
+            return NULL;
+        }
+        cache->oc_epoch = epoch;
+        cache->oc_count = 0;
+        open_file_cache_s = cache;
+    }
+
+    /* Entries of a table that was destroyed are forgotten */
+    if (cache->oc_epoch != epoch) {
+        cache->oc_epoch = epoch;
+        cache->oc_count = 0;
+    }
+
+    return cache;
+}
+#endif
+
+/* Add new entry to the open file table: a closed entry cached by the
+ * calling thread, or one from the free stack, or else a never used one
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Initial offset
+ * 	- Flags it is opened with
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, size_t offset, int flags) {
+    int index = -1;
+
+#if OPEN_FILE_CACHE > 0
+    open_file_cache_t *cache = open_file_cache_get();
+
+    if (cache != NULL && cache->oc_count > 0) {
+        index = cache->oc_index[--cache->oc_count];
+    }
+#endif
+
+    if (index == -1) {
+        index = open_file_free_pop();
+    }
+
+    if (index == -1) {
+        index = atomic_fetch_add(&(fs_state_s.n_used), 1);
+
+        if ((size_t)index >= geometry_s.g_max_open_files) {
+            atomic_fetch_sub(&(fs_state_s.n_used), 1);
+            return -1;
+        }
+    }
+
+    open_file_entry_t *entry = open_file_entry_at(index, true);
+
+    if (entry == NULL) {
+        open_file_free_push(index);
+        return -1;
+    }
+
+    entry->of_inumber = inumber;
+    entry->of_offset = offset;
+    entry->of_flags = flags;
+    entry->of_map.bm_extent.e_length = 0;
+    entry->of_ra = (read_ahead_t){.ra_next = offset, .ra_end = 0, .ra_window = 0};
+    entry->of_gen = (entry->of_gen + 1) & OPEN_FILE_GEN_MASK;
+
+    int fhandle = (int)(entry->of_gen << OPEN_FILE_INDEX_BITS) | index;
+
+    atomic_store_explicit(&(entry->of_handle), fhandle, memory_order_release);
+
+    return fhandle;
+}
+
+/* Frees an entry from the open file table. The entry mutex is taken, so
+ * an operation that found the entry before it was closed ends first.
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise
+ */
+int remove_from_open_file_table(int fhandle) {
+    open_file_entry_t *entry = get_open_file_entry(fhandle);
+
+    if (entry == NULL) {
+        return -1;
+    }
+
+    open_file_lock(entry);
+
+    int expected = fhandle;
+    bool closed = atomic_compare_exchange_strong(&(entry->of_handle), &expected, -1);
+
+    open_file_unlock(entry);
+
+    if (!closed) {
+        return -1;
+    }
+
+    int index = file_handle_index(fhandle);
+
+#if OPEN_FILE_CACHE > 0
+    open_file_cache_t *cache = open_file_cache_get();
+
+    if (cache != NULL && cache->oc_count < OPEN_FILE_CACHE) {
+        cache->oc_index[cache->oc_count++] = index;
+        return 0;
+    }
+#endif
+
+    open_file_free_push(index);
+
+    return 0;
+}
+
+/* Returns pointer to a given entry in the open file table, without taking
+ * any lock
+ * Inputs:
+ * 	 - file handle
+ * Returns: pointer to the entry if sucessful, NULL otherwise (also for a
+ *          closed file handle)
+ */
+open_file_entry_t *get_open_file_entry(int fhandle) {
+    if (fhandle < 0) {
+        return NULL;
+    }
+
+    open_file_entry_t *entry = open_file_entry_at(file_handle_index(fhandle), false);
+
+    if (entry == NULL ||
+        atomic_load_explicit(&(entry->of_handle), memory_order_acquire) != fhandle) {
+        return NULL;
+    }
+
+    return entry;
+}
 
 
 
 // ------------------------------- AUX FUNCTIONS ---------------------------------------------
 
-/* Writes in the direct region
+/* Translates a file block to its data block, through a block map cache:
+ * sequential accesses find their block in the cached extent, and only a
+ * miss searches the extents of the i-node (under its map mutex).
  * Inputs:
- * 	 - inode
- *   - pointer to the file entry
- *   - buffer
- *   - n of bytes to write
- * Returns: total of written bytes if sucessful, -1 otherwise
+ *   - inode
+ *   - cache: block map cache of the caller
+ *   - k: index of the block in the file
+ *   - run: set to the number of consecutive data blocks, starting at the
+ *          one returned, that hold the next file blocks
+ * Returns: block number, -1 if that block is not allocated
  */
-ssize_t tfs_write_direct_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size) {
+static int block_map_lookup(inode_t *inode, block_map_cache_t *cache, size_t k, size_t *run) {
+    unsigned gen = atomic_load(&(inode_map_gen_s[inode_number(inode)]));
+    extent_t *cached = &(cache->bm_extent);
 
-    size_t bytes_written = 0;
-    size_t to_write_block = 0;
+    if (gen != cache->bm_gen || k < cached->e_logical || k - cached->e_logical >= cached->e_length) {
+        pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
+        size_t i;
 
-    for (int i = 0; write_size > 0 && i < REFERENCE_BLOCK_INDEX; i++) {
+        STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-        if (inode->i_size % BLOCK_SIZE == 0) {                                                           
-            int insert_status = direct_block_insert(inode);     
-            if (insert_status == -1) {
-                printf("[ tfs_write_direct_region ] Error writing in direct region: %s\n", strerror(errno));
-                return -1;
+        extent_t const *extent = inode_extent_find(inode, k, &i);
+
+        if (extent == NULL) {
+            STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+            return -1;
+        }
+
+        cache->bm_gen = gen;
+        *cached = *extent;
+
+        int extent_block = inode->i_extent_block;
+
+        STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+        if (i >= INODE_EXTENTS) {
+            extent_block_access(extent_block); // simulate storage access delay to the extent block
+        }
+    }
+
+    *run = cached->e_length - (k - cached->e_logical);
+
+    return (int)(cached->e_physical + (k - cached->e_logical));
+}
+
+/* Allocates the blocks of an i-node up to (and including) file block k,
+ * under its map mutex. The blocks still needed up to the end of the write
+ * are asked for as one run; blocks the write does not cover entirely are
+ * zeroed, so gaps left by a write past the end of the file read as zeros.
+ * Inputs:
+ *   - inode
+ *   - k: index of the block that must be allocated
+ *   - offset: first byte of the write
+ *   - end: byte after the last one of the write
+ *   - run: set to the number of consecutive data blocks, starting at the
+ *          one returned, that hold the next file blocks
+ * Returns: block number of k, -1 if it could not be allocated
+ */
+static int block_map_extend(inode_t *inode, size_t k, size_t offset, size_t end, size_t *run) {
+    pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
+
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+    int block_number = inode_extent_block_number(inode, k, run);
+
+    /* Data kept inline moves to a block before the file gets any others */
+    if (block_number == -1 && inode_is_inline(inode)) {
+        if (inode_spill(inode) == -1) {
+            STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+            return -1;
+        }
+        block_number = inode_extent_block_number(inode, k, run);
+    }
+
+    while (block_number == -1) {
+        size_t n = inode->i_n_extents;
+        extent_t const *last = n > 0 ? inode_extent(inode, n - 1) : NULL;
+        size_t first = last != NULL ? last->e_logical + last->e_length : 0;
+        size_t got;
+
+        int allocated = inode_block_append(inode, first, blocks_for(end) - first, &got);
+
+        if (allocated == -1) {
+            break;
+        }
+
+        for (size_t j = 0; j < got; j++) {
+            size_t block_start = (first + j) * FS_BLOCK_SIZE;
+
+            if (block_start < offset || block_start + FS_BLOCK_SIZE > end) {
+                block_write_begin(allocated + (int)j, 1);
+                memset(data_block_get(allocated + (int)j), 0, FS_BLOCK_SIZE);
+                block_write_end(allocated + (int)j, 1);
             }
         }
 
-        void *block = data_block_get(inode->i_data_block);
-
-        if (block == NULL) {
-            return -1;
+        if (k < first + got) {
+            block_number = allocated + (int)(k - first);
+            *run = got - (k - first);
         }
-        
-        if (write_size >= BLOCK_SIZE || BLOCK_SIZE - (file->of_offset % BLOCK_SIZE) < write_size) {
-            to_write_block = BLOCK_SIZE - (file->of_offset % BLOCK_SIZE);
-            write_size -= to_write_block;
+    }
+
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+    return block_number;
+}
+
+/* Copies n bytes between a run of blocks and the segments of an iovec
+ * array, starting at the segment cursor (*seg, *seg_offset), and moves the
+ * cursor forward
+ */
+static void iov_copy(struct iovec const *iov, int *seg, size_t *seg_offset, uint8_t *data,
+                     size_t n, bool to_data) {
+    while (n > 0) {
+        size_t chunk = iov[*seg].iov_len - *seg_offset;
 
-        } else  {   
-            to_write_block = write_size;
-            write_size = 0;
+        if (chunk > n) {
+            chunk = n;
         }
 
-        memcpy(block + (file->of_offset % BLOCK_SIZE), buffer + bytes_written, to_write_block);
+        /* Empty segments may have a NULL base, skip them */
+        if (chunk > 0) {
+            uint8_t *segment = (uint8_t *)iov[*seg].iov_base + *seg_offset;
 
-        file->of_offset += to_write_block;
-        inode->i_size += to_write_block;
-        bytes_written += to_write_block;
+            if (to_data) {
+                memcpy(data, segment, chunk);
+            } else {
+                memcpy(segment, data, chunk);
+            }
+        }
 
-    }
+        data += chunk;
+        n -= chunk;
+        *seg_offset += chunk;
 
-    return (ssize_t)bytes_written;
+        if (*seg_offset == iov[*seg].iov_len) {
+            (*seg)++;
+            *seg_offset = 0;
+        }
+    }
 }
 
-/* 
- *  INSERTS
+/* Sums the lengths of the segments of an iovec array
+ * Returns: the total, or -1 if it does not fit in a ssize_t
  */
-int direct_block_insert(inode_t *inode) {
-
-    inode->i_data_block = data_block_alloc();
+static ssize_t iov_total(struct iovec const *iov, int iovcnt) {
+    size_t total = 0;
 
-    void *block = data_block_get(inode->i_data_block);
-
-    if (inode->i_data_block == -1) {
-        printf("[ direct_block_insert ] Error : alloc block failed\n");
-        return -1;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - total) {
+            return -1;
+        }
+        total += iov[i].iov_len;
     }
 
-    memset(block, -1, BLOCK_SIZE);
+    return (ssize_t)total;
+}
 
-    inode->i_block[inode->i_data_block - 1] = inode->i_data_block;
+/* Copies a write to the data of a file kept inline, if it fits there,
+ * under its map mutex (which a spill takes, see inode_spill)
+ * Returns: true if the write was copied inline
+ */
+static bool inode_copy_in_inline(inode_t *inode, struct iovec const *iov, size_t write_size,
+                                 size_t offset) {
+    pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
+    bool copied = false;
+
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+    if (inode_is_inline(inode) && write_size <= INODE_INLINE_SIZE &&
+        offset <= INODE_INLINE_SIZE - write_size) {
+        int seg = 0;
+        size_t seg_offset = 0;
+
+        iov_copy(iov, &seg, &seg_offset, inode->i_inline + offset, write_size, true);
+        journal_log_inline(inode);
+        copied = true;
+    }
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-    return 0;
+    return copied;
 }
 
-/* Writes in the indirect region
+/* Copies the first write_size bytes of the segments of an iovec array to a
+ * file at a given offset, allocating its blocks as needed; the size of the
+ * file does not change. Each run of consecutive blocks is fetched once, and
+ * filled from as many segments as it spans; a small file keeps its data
+ * inline (see inode_copy_in_inline) until a write does not fit there.
  * Inputs:
  * 	 - inode
- *   - pointer to the file entry
- *   - buffer
- *   - n of bytes to write
- * Returns: total of written bytes if sucessful, -1 otherwise
+ *   - cache: block map cache of the caller
+ *   - iov: the segments (holding at least write_size bytes)
+ *   - write_size
+ *   - offset
+ * Returns: total of copied bytes (less than write_size if the volume fills
+ *          up)
  */
-ssize_t tfs_write_indirect_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size) {
+static size_t inode_copy_in(inode_t *inode, block_map_cache_t *cache, struct iovec const *iov,
+                            size_t write_size, size_t offset) {
 
     size_t bytes_written = 0;
-    size_t to_write_block = 0;
-    int insert_status = 0;
+    size_t end = offset + write_size;
+    int seg = 0;
+    size_t seg_offset = 0;
 
-    for (int i = 0; write_size > 0; i++) {
-
-        if (inode->i_size + write_size > MAX_BYTES) {
-            write_size = MAX_BYTES - inode->i_size;
-        }
+    if (inode_copy_in_inline(inode, iov, write_size, offset)) {
+        return write_size;
+    }
 
-        if (inode->i_size % BLOCK_SIZE == 0) { 
+    while (bytes_written < write_size) {
+        size_t position = offset + bytes_written;
+        size_t k = block_of(position);
+        size_t block_offset = offset_in_block(position);
+        size_t run = 0;
+        int block_number = block_map_lookup(inode, cache, k, &run);
 
-            insert_status = indirect_block_insert(inode);  
+        if (block_number == -1) {
+            block_number = block_map_extend(inode, k, position, end, &run);
 
-            if (insert_status == -1) {
-                printf("[ tfs_write_indirect_region ] Error writing in indirect region: %s\n", strerror(errno));
-                return -1;
+            if (block_number == -1) {
+                printf("[ inode_write ] Error : alloc block failed\n");
+                break;
             }
         }
 
-        void *block = data_block_get(inode->i_data_block);
+        size_t to_write_run = run * FS_BLOCK_SIZE - block_offset;
 
-        if (block == NULL) {
-            printf("[ tfs_write_indirect_region ] Error : NULL block\n");
-            return -1;
-        }
-        
-        if (write_size >= BLOCK_SIZE || BLOCK_SIZE - (file->of_offset % BLOCK_SIZE) < write_size) {
-            to_write_block = BLOCK_SIZE - (file->of_offset % BLOCK_SIZE);           
-            write_size -= to_write_block;
+        if (to_write_run > write_size - bytes_written) {
+            to_write_run = write_size - bytes_written;
         }
 
-        else  {
-            to_write_block = write_size;
-            write_size = 0;
+        size_t blocks = blocks_for(block_offset + to_write_run);
+        uint8_t *data = (uint8_t *)data_block_run_get(block_number, blocks);
+
+        if (data == NULL) {
+            break;
         }
 
+        block_write_begin(block_number, blocks);
+        iov_copy(iov, &seg, &seg_offset, data + block_offset, to_write_run, true);
+        block_write_end(block_number, blocks);
+
+        bytes_written += to_write_run;
+    }
 
-        memcpy(block + (file->of_offset % BLOCK_SIZE), buffer + bytes_written, to_write_block);
+    return bytes_written;
+}
 
+/* Writes the segments of an iovec array, one after the other, to a file at
+ * a given offset (see inode_copy_in), and moves its size past them
+ * Inputs:
+ * 	 - inode
+ *   - cache: block map cache of the caller
+ *   - iov, iovcnt: the segments
+ *   - offset
+ * Returns: total of written bytes (less than requested if the volume fills
+ *          up) if sucessful, -1 otherwise
+ */
+static ssize_t inode_write_at(inode_t *inode, block_map_cache_t *cache, struct iovec const *iov,
+                              int iovcnt, size_t offset) {
 
-        file->of_offset += to_write_block;
-        inode->i_size += to_write_block;
-        bytes_written += to_write_block;
+    ssize_t total = iov_total(iov, iovcnt);
 
-    
+    if (total <= 0) {
+        return total;
     }
-  
+
+    size_t bytes_written = inode_copy_in(inode, cache, iov, (size_t)total, offset);
+
+    if (bytes_written == 0) {
+        return -1;
+    }
+
+    pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
+
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+    if (offset + bytes_written > inode->i_size) {
+        inode_set_size(inode, offset + bytes_written);
+    }
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
     return (ssize_t)bytes_written;
 }
 
-int indirect_block_insert(inode_t *inode) {
+/* Reads from a file at a given offset into the segments of an iovec array,
+ * one after the other. Each run of consecutive blocks is fetched once, and
+ * copied to as many segments as it spans; data kept inline is copied under
+ * the map mutex.
+ * Inputs:
+ *   - inode
+ *   - cache: block map cache of the caller
+ *   - iov, iovcnt: the segments
+ *   - offset
+ * Returns: total of read bytes (0 at the end of the file) if sucessful,
+ *          -1 otherwise
+ */
+static ssize_t inode_read_at(inode_t *inode, block_map_cache_t *cache, struct iovec const *iov,
+                             int iovcnt, size_t offset) {
+
+    ssize_t total = iov_total(iov, iovcnt);
 
-    int *last_i_block = (int *)data_block_get(inode->i_block[MAX_DIRECT_BLOCKS]);
+    if (total <= 0) {
+        return total;
+    }
+
+    size_t to_read = (size_t)total;
+    size_t total_read = 0;
+    int seg = 0;
+    size_t seg_offset = 0;
+    pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
 
-    int block_number = data_block_alloc();
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+    size_t size = inode->i_size;
 
-    if (block_number == -1) {
-        printf(" Error : Invalid block insertion\n");
-        return -1;
+    if (offset < size && to_read > size - offset) {
+        to_read = size - offset;
     }
 
-    inode->i_data_block = block_number;
+    if (inode_is_inline(inode) && offset < size && size <= INODE_INLINE_SIZE) {
+        iov_copy(iov, &seg, &seg_offset, inode->i_inline + offset, to_read, false);
+        total_read = to_read;
+    }
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-    memset(data_block_get(block_number), -1, BLOCK_SIZE / sizeof(int));
+    if (offset >= size) {
+        return 0;
+    }
 
-    last_i_block[block_number - FIRST_INDIRECT_BLOCK] = block_number;    
+    while (total_read < to_read) {
+        size_t position = offset + total_read;
+        size_t block_offset = offset_in_block(position);
+        size_t run = 0;
+        int block_number = block_map_lookup(inode, cache, block_of(position), &run);
 
-    return 0;
+        if (block_number == -1) {
+            return -1;
+        }
 
-}
+        size_t to_read_run = run * FS_BLOCK_SIZE - block_offset;
 
-int tfs_handle_indirect_block(inode_t *inode) {
+        if (to_read_run > to_read - total_read) {
+            to_read_run = to_read - total_read;
+        }
 
-    int block_number = data_block_alloc();
+        size_t blocks = blocks_for(block_offset + to_read_run);
+        uint8_t *data = (uint8_t *)data_block_run_get(block_number, blocks);
 
-    if (block_number == -1) {
-        return -1;
-    }
+        if (data == NULL) {
+            return -1;
+        }
+
+        int bad = block_csum_check(block_number, blocks, false);
 
-    inode->i_block[MAX_DIRECT_BLOCKS] = block_number;
-    inode->i_data_block = block_number;
+        if (bad != -1) {
+            printf("[ inode_read ] Error : block %d does not match its checksum\n", bad);
+            stats_checksum_error();
+            return -1;
+        }
 
-    memset(data_block_get(inode->i_data_block), -1, sizeof(data_block_get(inode->i_data_block)));
+        iov_copy(iov, &seg, &seg_offset, data + block_offset, to_read_run, false);
 
-    return 0;
+        total_read += to_read_run;
+    }
+
+    return (ssize_t)total_read;
 }
 
-/* Reads from the direct region a certain amount of bytes to a buffer
+/* Writes the segments of an iovec array to a file at the offset of an open
+ * file, and moves the offset forward (caller holds the file entry and a
+ * WRITE lock on the range)
  * Inputs:
+ * 	 - inode
  *   - pointer to the file entry
- *   - n bytes to read
- *   - buffer
- * Returns: total of read bytes if sucessful, -1 otherwise
+ *   - iov, iovcnt: the segments
+ * Returns: total of written bytes if sucessful, -1 otherwise
  */
-ssize_t tfs_read_direct_region(open_file_entry_t *file, size_t to_read, void *buffer) {
-
-    size_t current_block = (file->of_offset / BLOCK_SIZE) + 1;
-    size_t block_offset = file->of_offset % BLOCK_SIZE;
-    size_t to_read_block = 0;
-    size_t total_read = 0;
-    
-    if (file->of_offset + to_read <= MAX_BYTES_DIRECT_DATA) {
+ssize_t inode_writev(inode_t *inode, open_file_entry_t *file, struct iovec const *iov,
+                     int iovcnt) {
+    ssize_t written = inode_write_at(inode, &(file->of_map), iov, iovcnt, file->of_offset);
 
-        while (to_read > 0 && current_block <= MAX_DIRECT_BLOCKS) {        
+    if (written > 0) {
+        file->of_offset += (size_t)written;
+    }
 
-            void *block = data_block_get((int) current_block);
+    return written;
+}
 
-            if (block == NULL) {
-                return -1;
-            }
+/* Appends the segments of an iovec array to a file. The range at the end
+ * of the file and its blocks are reserved under the map mutex, the data is
+ * copied without it (and without a range lock: readers do not see the
+ * range before it is done, and resizes wait for it), and the size moves
+ * past the range once the appends given the ranges before it are done too.
+ * Concurrent appends to a file thus copy their data at the same time.
+ * Inputs:
+ * 	 - inode
+ *   - iov, iovcnt: the segments
+ *   - offset: set to the offset the data was appended at
+ * Returns: total of written bytes (less than requested if the volume fills
+ *          up) if sucessful, -1 otherwise
+ */
+ssize_t inode_appendv(inode_t *inode, struct iovec const *iov, int iovcnt, size_t *offset) {
 
-            if (to_read + block_offset > BLOCK_SIZE ) { 
-                to_read_block = BLOCK_SIZE - block_offset;               
-                to_read -= to_read_block;
+    ssize_t total = iov_total(iov, iovcnt);
 
-            } else {
-                to_read_block = to_read;
-                to_read = 0;
-            }
+    if (total <= 0) {
+        return total;
+    }
 
-            memcpy(buffer + total_read, block + block_offset, to_read_block);
+    inode_lock_t *lock = inode_lock_get(inode);
+    pthread_mutex_t *map_mutex = &(lock->il_map_mutex);
+    append_state_t *append = &(appends_s[inode_number(inode)]);
+    size_t len = (size_t)total;
 
-            file->of_offset += to_read_block;
-            total_read += to_read_block;
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-            current_block = (file->of_offset / BLOCK_SIZE) + 1;
-            block_offset = file->of_offset % BLOCK_SIZE;
+    while (append->ap_resizing > 0) {
+        pthread_cond_wait(&(lock->il_append_cond), map_mutex);
+    }
 
-        }
+    if (append->ap_pending == 0) {
+        append->ap_end = inode->i_size;
+        append->ap_done = inode->i_size;
     }
 
-    return (ssize_t) total_read;
-}
+    size_t start = append->ap_end;
 
-/* Reads from the indirect region a certain amount of bytes to a buffer
- * Inputs:
- *   - pointer to the file entry
- *   - n bytes to read
- *   - buffer
- * Returns: total of read bytes if sucessful, -1 otherwise
- */
-ssize_t tfs_read_indirect_region(open_file_entry_t *file, size_t to_read, void *buffer) {
+    /* A full volume leaves the range at what its blocks hold */
+    if (len > SIZE_MAX - start || block_map_reserve(inode, start + len, false) != 0) {
+        size_t n = inode->i_n_extents;
+        extent_t const *last = n > 0 ? inode_extent(inode, n - 1) : NULL;
+        size_t mapped = last != NULL ? (last->e_logical + last->e_length) * FS_BLOCK_SIZE : 0;
 
-    size_t to_read_block = 0;
-    size_t total_read = 0;
-    size_t current_block = (file->of_offset / BLOCK_SIZE) + 2;
-    size_t block_offset = file->of_offset % BLOCK_SIZE;
+        len = mapped > start ? mapped - start : 0;
+    }
 
-    while (to_read > 0) {      
+    if (len > 0) {
+        append->ap_end = start + len;
+        append->ap_pending++;
+    }
 
-        void *block = data_block_get((int) current_block);
-        if (block == NULL) {
-            return -1;
-        }
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-        if (to_read + block_offset > BLOCK_SIZE ) {
-            to_read_block = BLOCK_SIZE - block_offset;              
-            to_read -= to_read_block;
+    if (len == 0) {
+        printf("[ inode_write ] Error : alloc block failed\n");
+        return -1;
+    }
 
-        } else {
-            to_read_block = to_read;
-            to_read = 0;
-        }
+    block_map_cache_t cache = {.bm_extent = {0, 0, 0}, .bm_gen = 0};
+    size_t written = inode_copy_in(inode, &cache, iov, len, start);
 
-        memcpy(buffer + total_read, block + block_offset, to_read_block);
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-        file->of_offset += to_read_block;
-        total_read += to_read_block;
+    while (append->ap_done != start) {
+        pthread_cond_wait(&(lock->il_append_cond), map_mutex);
+    }
 
-        current_block = (file->of_offset / BLOCK_SIZE) + 2;
-        block_offset = file->of_offset % BLOCK_SIZE;
+    /* The whole range is done, so that the appends after it are not held up */
+    append->ap_done = start + len;
+    if (append->ap_done > inode->i_size) {
+        inode_set_size(inode, append->ap_done);
     }
+    append->ap_pending--;
 
-    file->of_offset = file->of_offset;
+    pthread_cond_broadcast(&(lock->il_append_cond));
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
 
-    return (ssize_t)total_read;
+    *offset = start;
+
+    return written > 0 ? (ssize_t)written : -1;
 }
 
-/* Locks an inode mutex or a rwlock, specified by the flag lock_state
+#if READ_AHEAD_MAX > 0
+/* Bytes between the software prefetch hints of a block (a cache line) */
+#define PREFETCH_STRIDE (64)
+
+/* Prefetches the file blocks first .. last - 1 of an i-node: each run of
+ * consecutive blocks is a single simulated storage access. The CPU is also
+ * hinted to fetch the first block, which the next read copies from.
  * Inputs:
  *   - inode
- *   - lock_state - READ, WRITE, MUTEX
- * Returns: 0 if sucessful, -1 otherwise
+ *   - cache: block map cache of the caller
+ *   - first, last: the file blocks
  */
-int inode_lock(inode_t *inode, lock_state_t lock_state) {
+static void block_map_prefetch(inode_t *inode, block_map_cache_t *cache, size_t first,
+                               size_t last) {
+    bool hinted = false;
 
-    // READ
-    if (lock_state == READ) {
-        if (pthread_rwlock_rdlock(&inode->inode_rwlock) != 0) {
-            printf("[ inode_lock ] Error locking memory region\n");
-            return -1;
+    while (first < last) {
+        size_t run = 0;
+        int block_number = block_map_lookup(inode, cache, first, &run);
+
+        /* Past the end of the file */
+        if (block_number == -1) {
+            return;
         }
-    }
-    // WRITE
-    else if (lock_state == WRITE) {
-        if (pthread_rwlock_wrlock(&inode->inode_rwlock) != 0) {
-            printf("[ inode_lock ] Error locking memory region\n");
-            return -1;
+
+        if (run > last - first) {
+            run = last - first;
         }
-    }
-    // MUTEX
-    else if (lock_state == MUTEX){
-        if (pthread_mutex_lock(&inode->inode_mutex) != 0) {
-            printf("[ inode_lock ] Error locking memory region\n");
-            return -1;
+
+        storage_access_run(CACHE_BLOCK, (size_t)block_number, run); // simulate storage access delay to the blocks
+
+        if (!hinted) {
+            uint8_t const *data = data_blocks_s.fs_data + (size_t)block_number * FS_BLOCK_SIZE;
+
+            for (size_t line = 0; line < FS_BLOCK_SIZE; line += PREFETCH_STRIDE) {
+                __builtin_prefetch(data + line, 0, 3);
+            }
+            hinted = true;
         }
+
+        first += run;
     }
-    else {
-        printf("[ inode_lock ] Unrecognized lock state\n");
-        return -1;
-    }
-    return 0;
 }
 
-/* Unlocks an inode mutex or a rwlock, specified by the flag lock_state
- * Inputs:
- *   - inode
- *   - lock_state - READ, WRITE, MUTEX
- * Returns: 0 if sucessful, -1 otherwise
+/* Updates the read-ahead state of an open file after it read the bytes
+ * start .. end - 1 (caller holds the file entry). A sequential read that
+ * gets within half a window of the last block prefetched doubles the
+ * window and prefetches up to a window past its end, so a scan pays for a
+ * batch of blocks at a time; any other read stops the read-ahead.
  */
-int inode_unlock(inode_t *inode, lock_state_t lock_state) {
+static void read_ahead(inode_t *inode, open_file_entry_t *file, size_t start, size_t end) {
+    read_ahead_t *ra = &(file->of_ra);
+    size_t max = cache_s.n_frames / 4 < READ_AHEAD_MAX ? cache_s.n_frames / 4 : READ_AHEAD_MAX;
+    bool sequential = start == ra->ra_next;
 
-    // RWLOCK
-    if (lock_state == READ || lock_state == WRITE) {
-        if (pthread_rwlock_unlock(&inode->inode_rwlock) != 0) {
-            printf("[ inode_unlock ] Error unlocking memory region\n");
-            return -1;
-        }
+    ra->ra_next = end;
+
+    if (!sequential || max == 0) {
+        ra->ra_window = 0;
+        ra->ra_end = 0;
+        return;
     }
-    // MUTEX
-    else if (lock_state == MUTEX){
-        if (pthread_mutex_unlock(&inode->inode_mutex) != 0) {
-            printf("[ inode_unlock ] Error unlocking memory region\n");
-            return -1;
-        }
+
+    size_t next = blocks_for(end); // first block the read did not reach
+
+    if (ra->ra_end < next) {
+        ra->ra_end = next;
     }
-    else {
-        printf("[ inode_unlock ] Unrecognized lock state\n");
-        return -1;
+
+    if (ra->ra_window > 0 && ra->ra_end - next > ra->ra_window / 2) {
+        return;
+    }
+
+    ra->ra_window = ra->ra_window == 0 ? READ_AHEAD_MIN : 2 * ra->ra_window;
+    if (ra->ra_window > max) {
+        ra->ra_window = max;
+    }
+
+    if (next + ra->ra_window > ra->ra_end) {
+        block_map_prefetch(inode, &(file->of_map), ra->ra_end, next + ra->ra_window);
+        ra->ra_end = next + ra->ra_window;
     }
-    return 0;
 }
+#endif
 
-/* Locks an open_file_entry mutex or a rwlock, specified by the flag lock_state
+/* Reads from a file at the offset of an open file into the segments of an
+ * iovec array, and moves the offset forward (caller holds the file entry
+ * and a READ lock on the range); sequential reads prefetch the blocks that
+ * follow (see read_ahead)
  * Inputs:
- *   - open_file_entry
- *   - lock_state - READ, WRITE, MUTEX
+ *   - inode
+ *   - pointer to the file entry
+ *   - iov, iovcnt: the segments
+ * Returns: total of read bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_readv(inode_t *inode, open_file_entry_t *file, struct iovec const *iov, int iovcnt) {
+    ssize_t total_read = inode_read_at(inode, &(file->of_map), iov, iovcnt, file->of_offset);
+
+    if (total_read > 0) {
+#if READ_AHEAD_MAX > 0
+        read_ahead(inode, file, file->of_offset, file->of_offset + (size_t)total_read);
+#endif
+        file->of_offset += (size_t)total_read;
+    }
+
+    return total_read;
+}
+
+/* Writes all the segments of an iovec array to a file descriptor, going
+ * on after short writes
  * Returns: 0 if sucessful, -1 otherwise
  */
-int open_file_lock(open_file_entry_t * open_file_entry, lock_state_t lock_state) {
+static int fd_writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
 
-    // READ
-    if (lock_state == READ) {
-        if (pthread_rwlock_rdlock(&open_file_entry->open_file_rwlock) != 0) {
-            printf("[ open_file_lock ] Error locking memory region\n");
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             return -1;
         }
-    }
-    // WRITE
-    else if (lock_state == WRITE) {
-        if (pthread_rwlock_wrlock(&open_file_entry->open_file_rwlock) != 0) {
-            printf("[ open_file_lock ] Error locking memory region\n");
-            return -1; 
+
+        size_t left = (size_t)written;
+
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-    }
-    // MUTEX
-    else if(lock_state == MUTEX) {
-        if (pthread_mutex_lock(&open_file_entry->open_file_mutex) != 0) {
-            printf("[ open_file_lock ] Error locking memory region\n");
-            return -1;
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + left;
+            iov->iov_len -= left;
         }
     }
-    else {
-        printf("[ open_file_lock ] Unrecognized lock state\n");
-        return -1;
-    }
+
     return 0;
 }
 
-/* Unlocks an open_file_entry mutex or a rwlock, specified by the flag lock_state
+/* Writes the whole contents of a file to a file descriptor straight from
+ * the data blocks: each run of consecutive blocks is fetched once and
+ * becomes one segment of a writev, with no intermediate copy (caller holds
+ * a READ lock on the range of the whole file); a small file is written from
+ * its inline data
  * Inputs:
- *   - open_file_entry
- *   - lock_state - READ, WRITE, MUTEX
- * Returns: 0 if sucessful, -1 otherwise
+ *   - inode
+ *   - fd: descriptor open for writing
+ * Returns: total of exported bytes if sucessful, -1 otherwise
  */
-int open_file_unlock(open_file_entry_t *open_file_entry, lock_state_t lock_state) {
+ssize_t inode_export(inode_t *inode, int fd) {
+    block_map_cache_t cache = {.bm_extent = {0, 0, 0}, .bm_gen = 0};
+    struct iovec iov[EXPORT_SEGMENTS];
+    int iovcnt = 0;
+    size_t exported = 0;
+    pthread_mutex_t *map_mutex = &(inode_lock_get(inode)->il_map_mutex);
 
-    // RWLOCK
-    if (lock_state == READ || lock_state == WRITE) {
-        if (pthread_rwlock_unlock(&open_file_entry->open_file_rwlock) !=0) {
-            printf("[ open_file_unlock ] Error unlocking memory region\n");
-            return -1;
-        }
-    }
-    // MUTEX
-    else if (lock_state == MUTEX) {
-        if (pthread_mutex_unlock(&open_file_entry->open_file_mutex) != 0) {
-            printf("[ open_file_unlock ] Error unlocking memory region\n");
-            return -1;
-        }
+    uint8_t inline_data[INODE_INLINE_SIZE];
+
+    STATS_LOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+    size_t size = inode->i_size;
+    bool is_inline = inode_is_inline(inode) && size <= INODE_INLINE_SIZE;
+
+    if (is_inline) {
+        memcpy(inline_data, inode->i_inline, size);
     }
-    else {
-        printf("[ open_file_unlock ] Unrecognized lock state\n");
-        return -1;
+    STATS_UNLOCK(map_mutex, STATS_LOCK_BLOCK_MAP);
+
+    /* Data kept inline is written from a copy taken under the map mutex */
+    if (is_inline) {
+        iov[0] = (struct iovec){.iov_base = inline_data, .iov_len = size};
+
+        return size == 0 || fd_writev_all(fd, iov, 1) == 0 ? (ssize_t)size : -1;
     }
-    return 0;
-}
 
-int inode_allocation_map_lock(lock_state_t lock_state) {
+    while (exported < size) {
+        size_t run = 0;
+        int block_number = block_map_lookup(inode, &cache, block_of(exported), &run);
 
-    // RWLOCK
-    if (lock_state == READ) {
-        if (pthread_rwlock_rdlock(&inode_table_s.inode_table_rwlock) != 0) {
-            printf("[ inode_allocation_map_lock ] Error unlocking memory region\n");
+        if (block_number == -1) {
             return -1;
         }
-    }
-    else if (lock_state == WRITE) {
-        if (pthread_rwlock_wrlock(&inode_table_s.inode_table_rwlock) != 0) {
-            printf("[ inode_allocation_map_lock ] Error unlocking memory region\n");
-            return -1;
+
+        size_t len = run * FS_BLOCK_SIZE;
+
+        if (len > size - exported) {
+            len = size - exported;
         }
-    }
-    // MUTEX
-    else if (lock_state == MUTEX){
-        if (pthread_mutex_lock(&inode_table_s.inode_table_mutex) != 0) {
-            printf("[ inode_allocation_map_lock ] Error unlocking memory region\n");
+
+        void *data = data_block_run_get(block_number, blocks_for(len));
+
+        if (data == NULL) {
             return -1;
         }
-    }
-    else {
-        printf("[ inode_allocation_map_lock ] Unrecognized lock state\n");
-        return -1;
-    }
-    return 0;
-}
 
-int inode_allocation_map_unlock(lock_state_t lock_state) {
+        int bad = block_csum_check(block_number, blocks_for(len), false);
 
-    // RWLOCK
-    if (lock_state == READ || lock_state == WRITE) {
-        if (pthread_rwlock_unlock(&inode_table_s.inode_table_rwlock) != 0) {
-            printf("[ inode_allocation_map_unlock ] Error unlocking memory region\n");
+        if (bad != -1) {
+            printf("[ inode_export ] Error : block %d does not match its checksum\n", bad);
+            stats_checksum_error();
             return -1;
         }
-    }
-    // MUTEX
-    else if (lock_state == MUTEX) {
-        if (pthread_mutex_unlock(&inode_table_s.inode_table_mutex) != 0) {
-            printf("[ inode_allocation_map_unlock ] Error unlocking memory region\n");
-            return -1;
+
+        iov[iovcnt].iov_base = data;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+        exported += len;
+
+        if (iovcnt == EXPORT_SEGMENTS || exported == size) {
+            if (fd_writev_all(fd, iov, iovcnt) == -1) {
+                return -1;
+            }
+            iovcnt = 0;
         }
     }
-    else {
-        printf("[ inode_allocation_map_unlock ] Unrecognized lock state\n");
-        return -1;
-    }
-    return 0;
+
+    return (ssize_t)exported;
+}
+
+/* Writes the segments of an iovec array to a file at a given offset
+ * (caller holds a WRITE lock on the range); a write past the end of the
+ * file leaves a gap of zeros
+ * Returns: total of written bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_pwritev(inode_t *inode, struct iovec const *iov, int iovcnt, size_t offset) {
+    block_map_cache_t cache = {.bm_extent = {0, 0, 0}, .bm_gen = 0};
+
+    return inode_write_at(inode, &cache, iov, iovcnt, offset);
 }
 
+/* Reads from a file at a given offset into the segments of an iovec array
+ * (caller holds a READ lock on the range)
+ * Returns: total of read bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_preadv(inode_t *inode, struct iovec const *iov, int iovcnt, size_t offset) {
+    block_map_cache_t cache = {.bm_extent = {0, 0, 0}, .bm_gen = 0};
+
+    return inode_read_at(inode, &cache, iov, iovcnt, offset);
+}
 
-int file_allocation_map_lock(lock_state_t lock_state) {
+ssize_t inode_pwrite(inode_t *inode, void const *buffer, size_t write_size, size_t offset) {
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = write_size};
 
-    // RWLOCK
-    if (lock_state == READ) {
-        if (pthread_rwlock_rdlock(&fs_state_s.fs_state_rwlock) != 0) {
-            printf("[ file_allocation_map_lock ] Error locking memory region\n");
-            return -1;
-        }
+    return inode_pwritev(inode, &iov, 1, offset);
+}
+
+ssize_t inode_pread(inode_t *inode, void *buffer, size_t to_read, size_t offset) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = to_read};
+
+    return inode_preadv(inode, &iov, 1, offset);
+}
+
+/* Returns the lock stripe of an i-node of the i-node table
+ */
+static inode_lock_t *inode_lock_get(inode_t *inode) {
+    return &(inode_locks_s[(size_t)inode_number(inode) % INODE_LOCK_STRIPES]);
+}
+
+/* Locks the mutex of an i-node, which serializes opens (truncation and
+ * the offset of an append) of the i-nodes of its stripe
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+int inode_lock(inode_t *inode) { return STATS_LOCK(&(inode_lock_get(inode)->il_mutex), STATS_LOCK_INODE); }
+
+int inode_unlock(inode_t *inode) { return STATS_UNLOCK(&(inode_lock_get(inode)->il_mutex), STATS_LOCK_INODE); }
+
+/* Tells whether two byte ranges of the same i-node overlap */
+static bool byte_ranges_overlap(byte_range_t const *range, int inumber, size_t start, size_t end) {
+    return range->r_mode != 0 && range->r_inumber == inumber && start < range->r_end &&
+           range->r_start < end;
+}
+
+/* Locks a byte range of an i-node: READ ranges may overlap each other, a
+ * WRITE range overlaps none. Waits while a conflicting range is held (or
+ * while every slot of the stripe is in use).
+ * Inputs:
+ *   - inode
+ *   - offset, len: the byte range (len may be SIZE_MAX - offset, for the
+ *     whole file)
+ *   - lock_state - READ, WRITE
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+int inode_range_lock(inode_t *inode, size_t offset, size_t len, lock_state_t lock_state) {
+
+    if (lock_state != READ && lock_state != WRITE) {
+        printf("[ inode_range_lock ] Unrecognized lock state\n");
+        return -1;
     }
-    else if (lock_state == WRITE) {
-        if (pthread_rwlock_wrlock(&fs_state_s.fs_state_rwlock) != 0) {
-            printf("[ file_allocation_map_lock ] Error locking memory region\n");
-            return -1;
+
+    inode_lock_t *lock = inode_lock_get(inode);
+    int inumber = inode_number(inode);
+    size_t end = len > SIZE_MAX - offset ? SIZE_MAX : offset + len;
+    uint64_t start = stats_clock();
+    bool waited = false;
+
+    mutex_lock(&(lock->il_range_mutex));
+
+    for (;;) {
+        byte_range_t *free_slot = NULL;
+        bool conflict = false;
+
+        for (size_t i = 0; i < RANGE_LOCK_SLOTS && !conflict; i++) {
+            byte_range_t *range = &(lock->il_ranges[i]);
+
+            if (range->r_mode == 0) {
+                if (free_slot == NULL) {
+                    free_slot = range;
+                }
+            } else if (byte_ranges_overlap(range, inumber, offset, end) &&
+                       (lock_state == WRITE || range->r_mode == WRITE)) {
+                conflict = true;
+            }
         }
-    }
-    // MUTEX
-    else if (lock_state == MUTEX){
-        if (pthread_mutex_lock(&fs_state_s.fs_state_mutex) != 0) {
-            printf("[ file_allocation_map_lock ] Error locking memory region\n");
-            return -1;
+
+        if (!conflict && free_slot != NULL) {
+            *free_slot = (byte_range_t){inumber, offset, end, lock_state};
+            break;
         }
+
+        pthread_cond_wait(&(lock->il_range_cond), &(lock->il_range_mutex));
+        waited = true;
     }
-    else {
-        printf("[ inode_allocation_map ] Unrecognized lock state\n");
-        return -1;
-    }
+
+    mutex_unlock(&(lock->il_range_mutex));
+    stats_lock_acquired(STATS_LOCK_RANGE, start, waited);
+
     return 0;
 }
 
-int file_allocation_map_unlock(lock_state_t lock_state) {
+/* Unlocks a byte range locked by inode_range_lock (same arguments)
+ * Returns: 0 if sucessful, -1 if that range was not locked
+ */
+int inode_range_unlock(inode_t *inode, size_t offset, size_t len, lock_state_t lock_state) {
 
-    // RWLOCK
-    if (lock_state == READ || lock_state == WRITE) {
-        if (pthread_rwlock_unlock(&fs_state_s.fs_state_rwlock) != 0) {
-            printf("[ file_allocation_map_unlock ] Error unlocking memory region\n");
-            return -1;
-        }
-    }
-    // MUTEX
-    else if (lock_state == MUTEX) {
-        if (pthread_mutex_unlock(&fs_state_s.fs_state_mutex) != 0) {
-            printf("[ file_allocation_map_unlock ] Error unlocking memory region\n");
-            return -1;
+    inode_lock_t *lock = inode_lock_get(inode);
+    int inumber = inode_number(inode);
+    size_t end = len > SIZE_MAX - offset ? SIZE_MAX : offset + len;
+    int status = -1;
+
+    mutex_lock(&(lock->il_range_mutex));
+
+    for (size_t i = 0; i < RANGE_LOCK_SLOTS; i++) {
+        byte_range_t *range = &(lock->il_ranges[i]);
+
+        if (range->r_mode == lock_state && range->r_inumber == inumber &&
+            range->r_start == offset && range->r_end == end) {
+            range->r_mode = 0;
+            status = 0;
+            break;
         }
     }
-    else {
-        printf("[ file_allocation_map_unlock ] Unrecognized lock state\n");
-        return -1;
+
+    pthread_cond_broadcast(&(lock->il_range_cond));
+    mutex_unlock(&(lock->il_range_mutex));
+    if (status == 0) {
+        stats_lock_released(STATS_LOCK_RANGE);
     }
-    return 0;
+
+    return status;
 }
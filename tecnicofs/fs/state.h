@@ -2,97 +2,344 @@
 #define STATE_H
 
 #include "config.h"
+#include <stdint.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 
 /*
- * Directory entry
+ * Directory entry (44 bytes)
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
     int d_inumber;
-    pthread_mutex_t dir_entry_mutex;
-    pthread_rwlock_t dir_entry_rwlock;
 } dir_entry_t;
 
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
 /*
- * I-node
+ * Extent: the e_length file blocks starting at e_logical are held by as
+ * many consecutive data blocks, starting at e_physical
+ */
+typedef struct {
+    uint32_t e_logical;
+    uint32_t e_physical;
+    uint32_t e_length;
+} extent_t;
+
+/* Bytes of data a file keeps inline, in the place of its block map */
+#define INODE_INLINE_SIZE (48)
+
+/*
+ * I-node (one 64-byte cache line; its locks live in a separate volatile
+ * table, see inode_lock). Its blocks are the i_n_extents extents, in file
+ * order and without holes: the first INODE_EXTENTS in the i-node, the
+ * rest in its extent block. A file without extents keeps its data, up to
+ * INODE_INLINE_SIZE bytes (and zeros past its size), in i_inline instead.
  */
 typedef struct {
     inode_type i_node_type;
+    uint32_t i_n_extents;
     size_t i_size;
-    int i_data_block; //current block in use to write
-    int i_block[11];   // 10 primeiras entradas sao diretas
-    pthread_mutex_t inode_mutex;
-    pthread_rwlock_t inode_rwlock;
-    /* in a real FS, more fields would exist here */
+    union {
+        struct {
+            extent_t i_extent[INODE_EXTENTS];
+            int i_extent_block; // -1 if the i-node has no more than INODE_EXTENTS extents
+            /* in a real FS, more fields would exist here */
+            uint32_t i_reserved;
+        };
+        uint8_t i_inline[INODE_INLINE_SIZE];
+    };
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == 64, "inode_t should fill exactly one cache line");
+_Static_assert(INODE_EXTENTS * sizeof(extent_t) + 2 * sizeof(uint32_t) <= INODE_INLINE_SIZE,
+               "the block map of an i-node should fit where its inline data goes");
+
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/*
+ * Block map cache: the last extent of a file used (empty if e_length is 0),
+ * valid while the block map generation of the i-node is still bm_gen
+ */
+typedef struct {
+    extent_t bm_extent;
+    unsigned bm_gen;
+} block_map_cache_t;
+
+/*
+ * Read-ahead state of an open file: a read that starts where the previous
+ * one ended (ra_next) is sequential, and keeps the file blocks up to
+ * ra_end prefetched, about ra_window blocks past the end of the read
+ */
+typedef struct {
+    size_t ra_next;
+    size_t ra_end;
+    size_t ra_window; // 0 until a sequential read prefetches
+} read_ahead_t;
+
 /*
  * Open file entry (in open file table)
  * of_inumber : entry number
  * of_offset : current offset position
+ * of_flags : flags the file was opened with
+ * of_map : block map cache
+ * of_ra : read-ahead state
+ * of_handle : file handle the entry is open under, -1 while it is free
+ * of_gen : generation of the entry, bumped every time it is reused
+ * of_next : next entry of the free stack
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    int of_flags;
+    block_map_cache_t of_map;
+    read_ahead_t of_ra;
+    _Atomic int of_handle;
+    unsigned of_gen;
+    _Atomic int of_next;
     pthread_mutex_t open_file_mutex;
-    pthread_rwlock_t open_file_rwlock;
 } open_file_entry_t;
 
-typedef enum { READ = 1, WRITE = 2, MUTEX = 3 } lock_state_t;
+/* Mode of a byte range lock (see inode_range_lock) */
+typedef enum { READ = 1, WRITE = 2 } lock_state_t;
+
+/*
+ * Lock primitives. Every object has one lock, of the kind its accesses
+ * need: a mutex for an open file entry (its offset) and for the i-node
+ * stripes (opens and the block map), and byte range locks for file data.
+ * Mutexes spin for LOCK_SPIN attempts before they block, which pays off
+ * for the short critical sections they guard when other cores hold them.
+ */
+static inline void lock_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm volatile("yield");
+#endif
+}
+
+static inline int mutex_lock(pthread_mutex_t *mutex) {
+#if LOCK_SPIN > 0
+    for (int i = 0; i < LOCK_SPIN; i++) {
+        if (pthread_mutex_trylock(mutex) == 0) {
+            return 0;
+        }
+        lock_cpu_relax();
+    }
+#endif
+    return pthread_mutex_lock(mutex) == 0 ? 0 : -1;
+}
 
+static inline int mutex_unlock(pthread_mutex_t *mutex) {
+    return pthread_mutex_unlock(mutex) == 0 ? 0 : -1;
+}
 
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+/*
+ * Stats: each thread counts, in counters only it writes, the calls it
+ * makes (with a latency histogram per call), the locks it takes (how often
+ * it had to wait, for how long, and how long it held them), its storage
+ * cache hits and misses and the blocks it found not to match their CRCs.
+ * tfs_stats_snapshot adds up the counters of every thread, including those
+ * that exited, since the process started.
+ * Histograms are log-linear (as HDR histograms): values below
+ * 2^STATS_HIST_SUB_BITS ns have a bucket each, and every power of two above
+ * is split into 2^STATS_HIST_SUB_BITS buckets of equal width.
+ */
+typedef enum {
+    STATS_OP_LOOKUP,
+    STATS_OP_MKDIR,
+    STATS_OP_OPEN,
+    STATS_OP_OPEN_MANY,
+    STATS_OP_STAT_MANY,
+    STATS_OP_CLOSE,
+    STATS_OP_FSYNC,
+    STATS_OP_FTRUNCATE,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_READV,
+    STATS_OP_WRITEV,
+    STATS_OP_PREAD,
+    STATS_OP_PWRITE,
+    STATS_OP_PREADV,
+    STATS_OP_PWRITEV,
+    STATS_OP_COPY_TO_EXTERNAL,
+    STATS_OP_COPY_FROM_EXTERNAL,
+    STATS_OPS
+} stats_op_t;
+
+typedef enum {
+    STATS_LOCK_INODE,     // i-node stripe mutex (opens)
+    STATS_LOCK_BLOCK_MAP, // i-node stripe block map mutex
+    STATS_LOCK_RANGE,     // byte range locks (waits include conflicting ranges)
+    STATS_LOCK_OPEN_FILE, // open file entry mutex
+    STATS_LOCK_DIR_INDEX, // directory index mutex (writers)
+    STATS_LOCK_DCACHE,    // dentry cache bucket mutex
+    STATS_LOCK_CACHE,     // storage cache mutex (misses)
+    STATS_LOCKS
+} stats_lock_t;
 
+#define STATS_HIST_SUB_BITS (3)
+#define STATS_HIST_BUCKETS ((64 - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
 
-void state_init();
+typedef struct {
+    uint64_t os_count;
+    uint64_t os_total_ns;
+    uint64_t os_max_ns;
+    uint64_t os_hist[STATS_HIST_BUCKETS];
+} tfs_op_stats_t;
+
+typedef struct {
+    uint64_t ls_acquired;
+    uint64_t ls_contended; // acquisitions that had to wait
+    uint64_t ls_wait_ns;
+    uint64_t ls_hold_ns;
+} tfs_lock_stats_t;
+
+typedef struct {
+    tfs_op_stats_t st_ops[STATS_OPS];
+    tfs_lock_stats_t st_locks[STATS_LOCKS];
+    uint64_t st_cache_hits;
+    uint64_t st_cache_misses;
+    uint64_t st_checksum_errors; // reads and copies out failed on a block with a bad CRC
+} tfs_stats_t;
+
+int stats_snapshot(tfs_stats_t *stats);
+uint64_t stats_bucket_upper(size_t bucket);
+
+#if STATS_ENABLED
+uint64_t stats_clock();
+void stats_op_end(stats_op_t op, uint64_t start);
+int stats_lock(pthread_mutex_t *mutex, stats_lock_t lock);
+int stats_unlock(pthread_mutex_t *mutex, stats_lock_t lock);
+
+#define STATS_LOCK(mutex, lock) stats_lock((mutex), (lock))
+#define STATS_UNLOCK(mutex, lock) stats_unlock((mutex), (lock))
+#else
+static inline uint64_t stats_clock() { return 0; }
+static inline void stats_op_end(stats_op_t op, uint64_t start) {
+    (void)op;
+    (void)start;
+}
+
+#define STATS_LOCK(mutex, lock) mutex_lock(mutex)
+#define STATS_UNLOCK(mutex, lock) mutex_unlock(mutex)
+#endif
+
+/* Locks an open file entry (its offset and block map cache)
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static inline int open_file_lock(open_file_entry_t *open_file_entry) {
+    return STATS_LOCK(&(open_file_entry->open_file_mutex), STATS_LOCK_OPEN_FILE);
+}
+
+static inline int open_file_unlock(open_file_entry_t *open_file_entry) {
+    return STATS_UNLOCK(&(open_file_entry->open_file_mutex), STATS_LOCK_OPEN_FILE);
+}
+
+
+/*
+ * Latency model of the simulated storage: a miss in the cache of its
+ * blocks and i-nodes costs no time (DEVICE_ZERO), dm_delay iterations of a
+ * busy loop (DEVICE_FIXED), or a number of them drawn uniformly between
+ * dm_delay - dm_jitter and dm_delay + dm_jitter (DEVICE_UNIFORM)
+ */
+typedef enum { DEVICE_ZERO = 0, DEVICE_FIXED = 1, DEVICE_UNIFORM = 2 } device_kind_t;
+
+typedef struct {
+    device_kind_t dm_kind;
+    unsigned dm_delay;
+    unsigned dm_jitter;
+} device_model_t;
+
+/*
+ * Runtime geometry of the volume (block_size, inodes and max_open_files
+ * may be 0 for the defaults of config.h)
+ */
+typedef struct {
+    size_t block_size;     // a power of two, MIN_BLOCK_SIZE .. MAX_BLOCK_SIZE
+    size_t data_blocks;    // number of blocks in the data block arena
+    size_t inodes;         // size of the i-node table
+    size_t max_open_files; // at most MAX_OPEN_FILES
+    char const *image_path; // file holding the state, NULL for memory only
+    unsigned journal_commit_us; // how long a journal commit waits for a batch
+    size_t journal_batch;       // records that end that wait early
+    device_model_t device;      // latency of the simulated storage
+    size_t cache_frames;        // blocks and i-nodes kept cached, 0 for none
+    bool populate;              // fault the whole image in at init
+    unsigned scrub_interval_ms; // period of the background scrub, 0 for none
+} state_params_t;
+
+/* CPUs of a NUMA node state_numa_pin handles, in 64-bit words */
+#define NUMA_CPU_WORDS (16)
+
+int state_init(state_params_t const *params);
+size_t state_block_size();
+size_t state_inodes();
+int state_ctx_alloc();
+void state_ctx_free(int slot);
+int state_ctx_use(int slot);
+int state_ctx();
+int state_numa_pin(int node, uint64_t saved[NUMA_CPU_WORDS]);
+void state_numa_restore(uint64_t const saved[NUMA_CPU_WORDS]);
+bool state_mounted();
 void state_destroy();
+void state_sync();
+ssize_t state_scrub(bool report);
+ssize_t state_check();
+int state_set_device(device_model_t const *model);
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+int inode_number(inode_t const *inode);
+void inode_set_size(inode_t *inode, size_t size);
+int inode_truncate(inode_t *inode);
+int inode_reserve(inode_t *inode, size_t size);
+int inode_resize(inode_t *inode, size_t size);
 
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
+int find_many_in_dir(int inumber, char const *const *sub_names, size_t n, int *sub_inumbers);
+
+/* Makes the journal records logged by the calling thread durable (see the
+ * journal in state.c) */
+int journal_commit();
 
 int data_block_alloc();
+int data_block_alloc_run(int goal, size_t want, size_t *got);
 int data_block_free(int block_number);
+int data_block_free_run(int first, size_t count);
+int data_block_free_runs(extent_t const *runs, size_t n);
 void *data_block_get(int block_number);
-int data_block_insert(int i_block[], int block_number);
-int index_block_insert(int index_block[], int block_number);
+void *data_block_run_get(int first, size_t count);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, size_t offset, int flags);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 
-ssize_t tfs_write_direct_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size);
-int direct_block_insert(inode_t *inode);
-ssize_t tfs_write_indirect_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size);
-int indirect_block_insert(inode_t *inode);
-int tfs_handle_indirect_block(inode_t *inode);
-ssize_t tfs_read_direct_region(open_file_entry_t *file, size_t to_read, void *buffer);
-ssize_t tfs_read_indirect_region(open_file_entry_t *file, size_t to_read, void *buffer);
-
-int inode_lock(inode_t *inode, lock_state_t lock_state);
-int inode_unlock(inode_t *inode, lock_state_t lock_state);
-int open_file_lock(open_file_entry_t *open_file_entry, lock_state_t lock_state);
-int open_file_unlock(open_file_entry_t *open_file_entry, lock_state_t lock_state);
-int inode_allocation_map_lock(lock_state_t lock_state);
-int inode_allocation_map_unlock(lock_state_t lock_state);
-int file_allocation_map_lock(lock_state_t lock_state);
-int file_allocation_map_unlock(lock_state_t lock_state);
+ssize_t inode_writev(inode_t *inode, open_file_entry_t *file, struct iovec const *iov, int iovcnt);
+ssize_t inode_appendv(inode_t *inode, struct iovec const *iov, int iovcnt, size_t *offset);
+ssize_t inode_readv(inode_t *inode, open_file_entry_t *file, struct iovec const *iov, int iovcnt);
+ssize_t inode_export(inode_t *inode, int fd);
+ssize_t inode_pwritev(inode_t *inode, struct iovec const *iov, int iovcnt, size_t offset);
+ssize_t inode_preadv(inode_t *inode, struct iovec const *iov, int iovcnt, size_t offset);
+ssize_t inode_pwrite(inode_t *inode, void const *buffer, size_t write_size, size_t offset);
+ssize_t inode_pread(inode_t *inode, void *buffer, size_t to_read, size_t offset);
+
+int inode_lock(inode_t *inode);
+int inode_unlock(inode_t *inode);
+int inode_range_lock(inode_t *inode, size_t offset, size_t len, lock_state_t lock_state);
+int inode_range_unlock(inode_t *inode, size_t offset, size_t len, lock_state_t lock_state);
 
 #endif // STATE_H
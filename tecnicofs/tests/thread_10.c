@@ -0,0 +1,101 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test uses multiple threads, each importing (with tfs_copy_from_external_fs, some of them in
+ * parallel mode) a file of the host into its own file of TecnicoFS, which already has other
+ * contents, and reading it back. A write past the end of an imported file must leave zeros after
+ * it, an empty source makes an empty file, and a source that does not exist is an error.
+ */
+
+#define N_THREADS 3
+#define SIZE (200 * BLOCK_SIZE + 333)
+#define OLD_SIZE (3 * BLOCK_SIZE)
+#define SOURCE "/tmp/tfs_thread_10"
+#define EMPTY "/tmp/tfs_thread_10_empty"
+
+static char content[SIZE];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    static char buffer[N_THREADS][SIZE + BLOCK_SIZE];
+    static char old[OLD_SIZE];
+
+    snprintf(path, sizeof(path), "/f10_%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, old, sizeof(old)) == sizeof(old));
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_copy_from_external_fs_parallel(SOURCE, path, id + 1) != -1);
+
+    fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer[id], sizeof(buffer[id])) == SIZE);
+    assert(memcmp(buffer[id], content, SIZE) == 0);
+
+    assert(tfs_pwrite(fh, "x", 1, SIZE + 100) == 1);
+    assert(tfs_pread(fh, buffer[id], 101, SIZE) == 101);
+    for (size_t i = 0; i < 100; i++) {
+        assert(buffer[id][i] == 0);
+    }
+    assert(buffer[id][100] == 'x');
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    char buffer[1];
+
+    for (size_t i = 0; i < SIZE; i++) {
+        content[i] = (char)('a' + (i / 7 + i) % 26);
+    }
+
+    FILE *fp = fopen(SOURCE, "w");
+    assert(fp != NULL);
+    assert(fwrite(content, 1, SIZE, fp) == SIZE);
+    assert(fclose(fp) == 0);
+
+    fp = fopen(EMPTY, "w");
+    assert(fp != NULL);
+    assert(fclose(fp) == 0);
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_copy_from_external_fs(EMPTY, "/f10_0") != -1);
+    int fh = tfs_open("/f10_0", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_copy_from_external_fs("/tmp/tfs_thread_10_missing", "/f10_missing") == -1);
+    assert(tfs_lookup("/f10_missing") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(SOURCE) == 0);
+    assert(unlink(EMPTY) == 0);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test uses multiple threads, each keeping HANDLES handles open at the same time (many more
+ * than the old fixed table could hold) to its own file and to a file shared by all of them, and
+ * then closing them while they reopen some of them.
+ * A closed handle must be rejected by every operation, even once its entry in the open file table
+ * was reused by a new handle, and no handle can be closed twice.
+ */
+
+#define N_THREADS 4
+#define HANDLES 1000
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    static int fhs[N_THREADS][HANDLES];
+    char buffer[16];
+
+    snprintf(path, sizeof(path), "/f11_%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, path, strlen(path)) == (ssize_t)strlen(path));
+    assert(tfs_close(fh) != -1);
+
+    for (int i = 0; i < HANDLES; i++) {
+        fhs[id][i] = tfs_open(i % 2 == 0 ? path : "/shared", 0);
+        assert(fhs[id][i] != -1);
+    }
+
+    for (int i = 0; i < HANDLES; i += 2) {
+        memset(buffer, 0, sizeof(buffer));
+        assert(tfs_read(fhs[id][i], buffer, sizeof(buffer)) == (ssize_t)strlen(path));
+        assert(strcmp(buffer, path) == 0);
+    }
+
+    for (int i = 0; i < HANDLES; i++) {
+        int old = fhs[id][i];
+
+        assert(tfs_close(old) != -1);
+
+        if (i % 10 == 0) {
+            /* The entry that was just closed is reused under a new handle */
+            fhs[id][i] = tfs_open(path, 0);
+            assert(fhs[id][i] != -1 && fhs[id][i] != old);
+            assert(tfs_read(old, buffer, sizeof(buffer)) == -1);
+            assert(tfs_write(old, "x", 1) == -1);
+            assert(tfs_pread(old, buffer, 1, 0) == -1);
+            assert(tfs_close(old) == -1);
+            assert(tfs_close(fhs[id][i]) != -1);
+        }
+
+        assert(tfs_close(old) == -1);
+    }
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+
+    assert(tfs_init() != -1);
+
+    int fh = tfs_open("/shared", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_read(-1, NULL, 1) == -1);
+    assert(tfs_close(MAX_OPEN_FILES - 1) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * This test uses multiple threads, each holding a file open while the main thread calls
+ * tfs_destroy_after_all_closed. Meanwhile new opens must fail, the files already open can still be
+ * written, and the destruction must only happen after every thread closed its file.
+ * Afterwards tecnicofs can be initialized again and files opened as usual.
+ */
+
+#define N_THREADS 4
+
+static pthread_barrier_t opened;
+static atomic_int closed;
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 50 * 1000 * 1000 * (id + 1)};
+
+    snprintf(path, sizeof(path), "/f12_%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    pthread_barrier_wait(&opened);
+
+    /* Let the main thread start waiting */
+    nanosleep(&wait, NULL);
+
+    assert(tfs_open(path, 0) == -1);
+    assert(tfs_open("/new", TFS_O_CREAT) == -1);
+    assert(tfs_write(fh, path, strlen(path)) == (ssize_t)strlen(path));
+
+    atomic_fetch_add(&closed, 1);
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+
+    assert(pthread_barrier_init(&opened, NULL, N_THREADS + 1) == 0);
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    pthread_barrier_wait(&opened);
+
+    assert(tfs_destroy_after_all_closed() != -1);
+    assert(atomic_load(&closed) == N_THREADS);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    /* Nothing is open: it returns right away */
+    assert(tfs_init() != -1);
+    int fh = tfs_open("/f12", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy_after_all_closed() != -1);
+
+    assert(pthread_barrier_destroy(&opened) == 0);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
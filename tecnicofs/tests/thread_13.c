@@ -0,0 +1,82 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test changes the latency model of the simulated storage while multiple threads write and read
+ * back files that have, all together, more blocks than the storage cache holds (so blocks are
+ * evicted and fetched again). Invalid models must be rejected and leave the current one in place.
+ */
+
+#define N_THREADS 4
+#define SIZE (100 * BLOCK_SIZE + 11)
+
+static char content[N_THREADS][SIZE];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    static char buffer[N_THREADS][SIZE];
+
+    snprintf(path, sizeof(path), "/f13_%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (size_t written = 0; written < SIZE; written += BLOCK_SIZE / 2) {
+        size_t len = SIZE - written < BLOCK_SIZE / 2 ? SIZE - written : BLOCK_SIZE / 2;
+        assert(tfs_write(fh, content[id] + written, len) == (ssize_t)len);
+    }
+
+    for (int pass = 0; pass < 3; pass++) {
+        assert(tfs_pread(fh, buffer[id], SIZE, 0) == SIZE);
+        assert(memcmp(buffer[id], content[id], SIZE) == 0);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    device_model_t uniform = {.dm_kind = DEVICE_UNIFORM, .dm_delay = 200, .dm_jitter = 150};
+    device_model_t zero = {.dm_kind = DEVICE_ZERO, .dm_delay = 0, .dm_jitter = 0};
+    device_model_t bad_jitter = {.dm_kind = DEVICE_UNIFORM, .dm_delay = 10, .dm_jitter = 11};
+    device_model_t bad_kind = {.dm_kind = (device_kind_t)7, .dm_delay = 10, .dm_jitter = 0};
+
+    for (int i = 0; i < N_THREADS; i++) {
+        for (size_t j = 0; j < SIZE; j++) {
+            content[i][j] = (char)('a' + ((size_t)i * 3 + j) % 26);
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_set_device_model(&bad_jitter) == -1);
+    assert(tfs_set_device_model(&bad_kind) == -1);
+    assert(tfs_set_device_model(NULL) == -1);
+    assert(tfs_set_device_model(&uniform) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    /* The model can change while the threads run */
+    assert(tfs_set_device_model(&zero) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test makes a known number of calls from multiple threads (some of which exit before the
+ * snapshot, so their counters are kept as retired ones) and checks the stats: the count of each
+ * call, that its histogram adds up to that count, that the percentiles are ordered, and that the
+ * locks and the storage cache were counted.
+ */
+
+#define N_THREADS 4
+#define N_ROUNDS 25
+#define SIZE (BLOCK_SIZE + 7)
+
+static char content[SIZE];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    char buffer[SIZE];
+
+    snprintf(path, sizeof(path), "/f14_%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (int i = 0; i < N_ROUNDS; i++) {
+        assert(tfs_pwrite(fh, content, SIZE, 0) == SIZE);
+        assert(tfs_pread(fh, buffer, SIZE, 0) == SIZE);
+        assert(memcmp(buffer, content, SIZE) == 0);
+    }
+
+    assert(tfs_write(fh, content, SIZE) == SIZE);
+    assert(tfs_lookup(path) != -1);
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, SIZE) == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+#if STATS_ENABLED
+static void check_op(tfs_stats_t const *stats, stats_op_t op, uint64_t count) {
+    tfs_op_stats_t const *op_stats = &stats->st_ops[op];
+    uint64_t in_hist = 0;
+
+    assert(op_stats->os_count == count);
+    for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+        in_hist += op_stats->os_hist[b];
+    }
+    assert(in_hist == count);
+    assert(op_stats->os_max_ns * count >= op_stats->os_total_ns);
+
+    uint64_t p50 = tfs_stats_percentile(op_stats, 0.5);
+    uint64_t p99 = tfs_stats_percentile(op_stats, 0.99);
+    assert(p50 <= p99 && p99 <= op_stats->os_max_ns);
+}
+#endif
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    tfs_stats_t *stats = malloc(sizeof(tfs_stats_t));
+    assert(stats != NULL);
+
+    for (size_t j = 0; j < SIZE; j++) {
+        content[j] = (char)('a' + j % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* A failed call is timed as well */
+    assert(tfs_lookup("/missing") == -1);
+    assert(tfs_mkdir("/d14") != -1);
+
+#if STATS_ENABLED
+    assert(tfs_stats_snapshot(stats) != -1);
+
+    check_op(stats, STATS_OP_OPEN, 2 * N_THREADS);
+    check_op(stats, STATS_OP_CLOSE, 2 * N_THREADS);
+    check_op(stats, STATS_OP_PWRITE, N_THREADS * N_ROUNDS);
+    check_op(stats, STATS_OP_PREAD, N_THREADS * N_ROUNDS);
+    check_op(stats, STATS_OP_WRITE, N_THREADS);
+    check_op(stats, STATS_OP_READ, N_THREADS);
+    check_op(stats, STATS_OP_LOOKUP, N_THREADS + 1);
+    check_op(stats, STATS_OP_MKDIR, 1);
+    /* tfs_write and tfs_read are not counted again as their vector calls */
+    check_op(stats, STATS_OP_WRITEV, 0);
+    check_op(stats, STATS_OP_READV, 0);
+    check_op(stats, STATS_OP_COPY_TO_EXTERNAL, 0);
+
+    /* Each positional call takes a range lock, which is released */
+    tfs_lock_stats_t const *range = &stats->st_locks[STATS_LOCK_RANGE];
+    assert(range->ls_acquired >= 2 * N_THREADS * N_ROUNDS);
+    assert(range->ls_contended <= range->ls_acquired);
+    assert(stats->st_locks[STATS_LOCK_OPEN_FILE].ls_acquired >= 2 * N_THREADS);
+    assert(stats->st_cache_hits + stats->st_cache_misses > 0);
+
+    /* Counters only grow */
+    tfs_stats_t *later = malloc(sizeof(tfs_stats_t));
+    assert(later != NULL);
+    assert(tfs_lookup("/d14") != -1);
+    assert(tfs_stats_snapshot(later) != -1);
+    assert(later->st_ops[STATS_OP_LOOKUP].os_count == N_THREADS + 2);
+    assert(later->st_locks[STATS_LOCK_RANGE].ls_acquired == range->ls_acquired);
+    free(later);
+#else
+    assert(tfs_stats_snapshot(stats) == -1);
+#endif
+
+    free(stats);
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "async.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * This test uses the asynchronous queue. With one worker, writes and reads of a file handle that
+ * are submitted together run in order (merged into vector calls), so the file reads back as it was
+ * written. With several workers and a small ring, threads submit positional writes to disjoint
+ * ranges of shared files (so submissions are cut short when the rings fill up) and read them back.
+ * Opens, closes and calls that fail complete as well.
+ */
+
+#define CHUNK 100
+#define CHUNKS 40
+#define N_FILES 3
+#define N_THREADS 3
+#define ENTRIES 8
+
+static char content[N_FILES][CHUNKS * CHUNK];
+static int fhs[N_FILES];
+static tfs_aio_t *shared;
+
+/* Submits all the entries, reaping completions when the rings are full, and checks them */
+static void submit_all(tfs_aio_t *aio, tfs_aio_sqe_t const *sqes, unsigned n, ssize_t expected) {
+    tfs_aio_cqe_t cqes[ENTRIES];
+    unsigned submitted = 0;
+    unsigned reaped = 0;
+
+    while (reaped < n) {
+        if (submitted < n) {
+            int queued = tfs_aio_submit(aio, sqes + submitted, n - submitted);
+            assert(queued != -1);
+            submitted += (unsigned)queued;
+        }
+
+        int r = tfs_aio_reap(aio, cqes, ENTRIES, 1);
+        assert(r >= 0);
+        for (int i = 0; i < r; i++) {
+            assert(cqes[i].cqe_result == expected);
+        }
+        reaped += (unsigned)r;
+    }
+}
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    tfs_aio_sqe_t sqes[N_FILES * CHUNKS];
+    unsigned n = 0;
+
+    /* Each thread writes every N_THREADS-th pair of chunks of every file */
+    for (int f = 0; f < N_FILES; f++) {
+        for (size_t c = (size_t)id * 2; c < CHUNKS; c += N_THREADS * 2) {
+            for (size_t k = c; k < c + 2 && k < CHUNKS; k++) {
+                sqes[n++] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_PWRITE,
+                                            .sqe_fhandle = fhs[f],
+                                            .sqe_buffer = content[f] + k * CHUNK,
+                                            .sqe_len = CHUNK,
+                                            .sqe_offset = k * CHUNK};
+            }
+        }
+    }
+
+    /* The main thread reaps the completions, which frees room in the rings */
+    for (unsigned submitted = 0; submitted < n;) {
+        int queued = tfs_aio_submit(shared, sqes + submitted, n - submitted);
+        assert(queued != -1);
+        if (queued == 0) {
+            sched_yield();
+        }
+        submitted += (unsigned)queued;
+    }
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    char path[MAX_FILE_NAME];
+    char buffer[CHUNKS * CHUNK];
+    tfs_aio_sqe_t sqes[CHUNKS];
+    tfs_aio_cqe_t cqes[2 * CHUNKS];
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+
+    for (int f = 0; f < N_FILES; f++) {
+        for (size_t j = 0; j < sizeof(content[f]); j++) {
+            content[f][j] = (char)('a' + ((size_t)f * 5 + j / 7) % 26);
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_aio_create(0, 1) == NULL);
+    assert(tfs_aio_create(4, 0) == NULL);
+
+    /* One worker: opens, then ordered writes and reads of one handle */
+    tfs_aio_t *aio = tfs_aio_create(CHUNKS, 1);
+    assert(aio != NULL);
+
+    for (int f = 0; f < N_FILES; f++) {
+        snprintf(path, sizeof(path), "/f15_%d", f);
+        sqes[f] = (tfs_aio_sqe_t){
+            .sqe_op = TFS_AIO_OPEN, .sqe_path = strdup(path), .sqe_flags = TFS_O_CREAT,
+            .sqe_user_data = (uint64_t)f};
+    }
+    assert(tfs_aio_submit(aio, sqes, N_FILES) == N_FILES);
+    assert(tfs_aio_reap(aio, cqes, 2 * CHUNKS, N_FILES) == N_FILES);
+    for (int f = 0; f < N_FILES; f++) {
+        assert(cqes[f].cqe_result >= 0);
+        fhs[cqes[f].cqe_user_data] = (int)cqes[f].cqe_result;
+        free((void *)sqes[f].sqe_path);
+    }
+
+#if STATS_ENABLED
+    tfs_stats_t *stats = malloc(sizeof(tfs_stats_t));
+    assert(stats != NULL && tfs_stats_snapshot(stats) != -1);
+    uint64_t writes = stats->st_ops[STATS_OP_WRITE].os_count;
+    uint64_t writevs = stats->st_ops[STATS_OP_WRITEV].os_count;
+#endif
+
+    for (int c = 0; c < CHUNKS; c++) {
+        sqes[c] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_WRITE,
+                                  .sqe_fhandle = fhs[0],
+                                  .sqe_buffer = content[0] + c * CHUNK,
+                                  .sqe_len = CHUNK,
+                                  .sqe_user_data = (uint64_t)c};
+    }
+    assert(tfs_aio_submit(aio, sqes, CHUNKS) == CHUNKS);
+    assert(tfs_aio_reap(aio, cqes, 2 * CHUNKS, CHUNKS) == CHUNKS);
+    for (int c = 0; c < CHUNKS; c++) {
+        assert(cqes[c].cqe_result == CHUNK);
+    }
+
+#if STATS_ENABLED
+    /* The writes were merged: fewer calls were made than entries submitted */
+    assert(tfs_stats_snapshot(stats) != -1);
+    assert(stats->st_ops[STATS_OP_WRITEV].os_count > writevs);
+    assert(stats->st_ops[STATS_OP_WRITE].os_count - writes +
+               (stats->st_ops[STATS_OP_WRITEV].os_count - writevs) <
+           CHUNKS);
+    free(stats);
+#endif
+
+    assert(tfs_pread(fhs[0], buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(memcmp(buffer, content[0], sizeof(buffer)) == 0);
+
+    /* Reads past the end of the file get what is left, then 0 */
+    int fh = tfs_open("/f15_0", 0);
+    assert(fh != -1);
+    for (int c = 0; c < CHUNKS + 2; c++) {
+        sqes[c % CHUNKS] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_READ,
+                                           .sqe_fhandle = fh,
+                                           .sqe_buffer = buffer + (c % CHUNKS) * CHUNK,
+                                           .sqe_len = CHUNK};
+        if (c % CHUNKS == CHUNKS - 1 || c == CHUNKS + 1) {
+            unsigned n = (unsigned)(c % CHUNKS) + 1;
+            assert(tfs_aio_submit(aio, sqes, n) == (int)n);
+            assert(tfs_aio_reap(aio, cqes, 2 * CHUNKS, n) == (int)n);
+            for (unsigned i = 0; i < n; i++) {
+                assert(cqes[i].cqe_result == (c < CHUNKS ? CHUNK : 0));
+            }
+        }
+    }
+    assert(tfs_close(fh) != -1);
+
+    /* Calls that fail complete with -1 */
+    sqes[0] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_READ, .sqe_fhandle = -1, .sqe_buffer = buffer,
+                              .sqe_len = CHUNK, .sqe_user_data = 7};
+    sqes[1] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_OPEN, .sqe_path = "/missing", .sqe_user_data = 8};
+    assert(tfs_aio_submit(aio, sqes, 2) == 2);
+    assert(tfs_aio_reap(aio, cqes, 2 * CHUNKS, 2) == 2);
+    assert(cqes[0].cqe_result == -1 && cqes[1].cqe_result == -1);
+    assert(cqes[0].cqe_user_data + cqes[1].cqe_user_data == 15);
+    assert(tfs_aio_reap(aio, cqes, 2 * CHUNKS, 1) == 0);
+
+    assert(tfs_aio_destroy(aio) != -1);
+
+    /* Several workers and a small ring, shared by several threads */
+    shared = tfs_aio_create(ENTRIES, 4);
+    assert(shared != NULL);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int reaped = 0; reaped < N_FILES * CHUNKS;) {
+        int r = tfs_aio_reap(shared, cqes, ENTRIES, 1);
+        assert(r >= 0);
+        if (r == 0) {
+            sched_yield(); // nothing submitted yet
+        }
+        for (int i = 0; i < r; i++) {
+            assert(cqes[i].cqe_result == CHUNK);
+        }
+        reaped += r;
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    for (int f = 0; f < N_FILES; f++) {
+        for (int c = 0; c < CHUNKS; c++) {
+            sqes[c] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_PREAD,
+                                      .sqe_fhandle = fhs[f],
+                                      .sqe_buffer = buffer + c * CHUNK,
+                                      .sqe_len = CHUNK,
+                                      .sqe_offset = (size_t)c * CHUNK};
+        }
+        submit_all(shared, sqes, CHUNKS, CHUNK);
+        assert(memcmp(buffer, content[f], sizeof(buffer)) == 0);
+
+        sqes[0] = (tfs_aio_sqe_t){.sqe_op = TFS_AIO_CLOSE, .sqe_fhandle = fhs[f]};
+        submit_all(shared, sqes, 1, 0);
+    }
+
+    assert(tfs_aio_destroy(shared) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test appends many small records to files through TFS_O_BUFFERED handles from multiple
+ * threads (more than the write-back buffer holds, in records that do not line up with blocks) and
+ * checks that the files read back whole once closed. Whatever a buffered handle wrote must be seen
+ * by reads, opens and writes of other handles at any time, tfs_fsync must write it back, and writes
+ * that do not continue the file must not be buffered.
+ */
+
+#define N_THREADS 4
+#define RECORD 13
+#define RECORDS 1500
+#define SIZE (RECORD * RECORDS)
+
+static char content[N_THREADS][SIZE];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    static char buffer[N_THREADS][SIZE];
+
+    snprintf(path, sizeof(path), "/f16_%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fh != -1);
+
+    for (size_t r = 0; r < RECORDS; r++) {
+        assert(tfs_write(fh, content[id] + r * RECORD, RECORD) == RECORD);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer[id], SIZE) == SIZE);
+    assert(memcmp(buffer[id], content[id], SIZE) == 0);
+    assert(tfs_read(fh, buffer[id], 1) == 0);
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    char buffer[3 * RECORD];
+
+    for (int i = 0; i < N_THREADS; i++) {
+        for (size_t j = 0; j < SIZE; j++) {
+            content[i][j] = (char)('a' + ((size_t)i * 7 + j / RECORD) % 26);
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* Other handles see what is still buffered */
+    int fh = tfs_open("/g16", TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fh != -1);
+    assert(tfs_write(fh, content[0], RECORD) == RECORD);
+    assert(tfs_write(fh, content[0] + RECORD, RECORD) == RECORD);
+
+    int reader = tfs_open("/g16", 0);
+    assert(reader != -1);
+    assert(tfs_read(reader, buffer, sizeof(buffer)) == 2 * RECORD);
+    assert(memcmp(buffer, content[0], 2 * RECORD) == 0);
+
+    assert(tfs_write(fh, content[0] + 2 * RECORD, RECORD) == RECORD);
+    assert(tfs_pread(reader, buffer, sizeof(buffer), 0) == 3 * RECORD);
+    assert(memcmp(buffer, content[0], 3 * RECORD) == 0);
+
+    /* An append handle opened later starts after what was buffered */
+    assert(tfs_write(fh, content[1], RECORD) == RECORD);
+    int appender = tfs_open("/g16", TFS_O_APPEND);
+    assert(appender != -1);
+    assert(tfs_write(appender, content[2], RECORD) == RECORD);
+    assert(tfs_pread(reader, buffer, 2 * RECORD, 3 * RECORD) == 2 * RECORD);
+    assert(memcmp(buffer, content[1], RECORD) == 0);
+    assert(memcmp(buffer + RECORD, content[2], RECORD) == 0);
+
+    /* The buffered handle is no longer at the end of the file: its write overwrites the record of
+     * the other one, and is not buffered */
+    assert(tfs_write(fh, content[3], RECORD) == RECORD);
+    assert(tfs_pread(reader, buffer, sizeof(buffer), 4 * RECORD) == RECORD);
+    assert(memcmp(buffer, content[3], RECORD) == 0);
+
+    /* Back at the end, it buffers again until tfs_fsync */
+    assert(tfs_write(fh, content[1], RECORD) == RECORD);
+    assert(tfs_fsync(fh) != -1);
+    assert(tfs_fsync(-1) == -1);
+    assert(tfs_pread(reader, buffer, sizeof(buffer), 5 * RECORD) == RECORD);
+    assert(memcmp(buffer, content[1], RECORD) == 0);
+
+    assert(tfs_close(appender) != -1);
+    assert(tfs_close(reader) != -1);
+    assert(tfs_close(fh) != -1);
+
+    /* What was buffered is written before a truncation, so it does not come back after it */
+    fh = tfs_open("/g16", TFS_O_APPEND | TFS_O_BUFFERED);
+    assert(fh != -1);
+    assert(tfs_write(fh, content[0], RECORD) == RECORD);
+    int truncator = tfs_open("/g16", TFS_O_TRUNC);
+    assert(truncator != -1);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_read(truncator, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(truncator) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
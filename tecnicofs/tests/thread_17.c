@@ -0,0 +1,129 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test reads files sequentially in small calls, so that they are read ahead, from multiple
+ * threads: each one scans the same file (after it was pushed out of the storage cache) with its own
+ * handle, and the data must read back whole. A scan must miss the storage cache in far fewer
+ * accesses than it has blocks. Reads that are not sequential, and a file that grows while it is
+ * read, read back whole as well.
+ */
+
+#define N_THREADS 3
+#define BLOCKS 64
+#define SIZE (BLOCKS * BLOCK_SIZE)
+#define EVICT_SIZE (300 * BLOCK_SIZE)
+#define READ_SIZE 200
+
+static char content[SIZE];
+
+/* Reads a file in calls of READ_SIZE and checks it against content */
+static void scan(char const *path) {
+    char buffer[READ_SIZE];
+    size_t done = 0;
+
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+
+    for (;;) {
+        ssize_t r = tfs_read(fh, buffer, sizeof(buffer));
+        assert(r != -1);
+        if (r == 0) {
+            break;
+        }
+        assert(memcmp(buffer, content + done, (size_t)r) == 0);
+        done += (size_t)r;
+    }
+
+    assert(done == SIZE);
+    assert(tfs_close(fh) != -1);
+}
+
+void *fn(void *arg) {
+    (void)arg;
+
+    scan("/f17");
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    char buffer[READ_SIZE];
+    static char big[EVICT_SIZE];
+
+    for (size_t j = 0; j < SIZE; j++) {
+        content[j] = (char)('a' + (j / 11) % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int fh = tfs_open("/f17", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, SIZE) == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    /* Push the file out of the storage cache */
+    fh = tfs_open("/evict", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, big, EVICT_SIZE) == EVICT_SIZE);
+    assert(tfs_close(fh) != -1);
+
+#if STATS_ENABLED && READ_AHEAD_MAX > 0
+    tfs_stats_t *stats = malloc(sizeof(tfs_stats_t));
+    assert(stats != NULL && tfs_stats_snapshot(stats) != -1);
+    uint64_t misses = stats->st_cache_misses;
+#endif
+
+    scan("/f17");
+
+#if STATS_ENABLED && READ_AHEAD_MAX > 0
+    assert(tfs_stats_snapshot(stats) != -1);
+    assert(stats->st_cache_misses - misses < BLOCKS / 4);
+    free(stats);
+#endif
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn, NULL) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* Writes in between make the reads of a handle not sequential */
+    fh = tfs_open("/f17", 0);
+    assert(fh != -1);
+    for (size_t done = 0; done + 2 * READ_SIZE <= SIZE; done += 2 * READ_SIZE) {
+        assert(tfs_read(fh, buffer, READ_SIZE) == READ_SIZE);
+        assert(memcmp(buffer, content + done, READ_SIZE) == 0);
+        assert(tfs_write(fh, content + done + READ_SIZE, READ_SIZE) == READ_SIZE);
+    }
+    assert(tfs_close(fh) != -1);
+    scan("/f17");
+
+    /* A reader at the end of a file that grows reads what is appended */
+    int writer = tfs_open("/g17", TFS_O_CREAT);
+    int reader = tfs_open("/g17", 0);
+    assert(writer != -1 && reader != -1);
+    for (size_t done = 0; done < SIZE; done += READ_SIZE) {
+        size_t len = SIZE - done < READ_SIZE ? SIZE - done : READ_SIZE;
+
+        assert(tfs_write(writer, content + done, len) == (ssize_t)len);
+        assert(tfs_read(reader, buffer, sizeof(buffer)) == (ssize_t)len);
+        assert(memcmp(buffer, content + done, len) == 0);
+        assert(tfs_read(reader, buffer, sizeof(buffer)) == 0);
+    }
+    assert(tfs_close(reader) != -1);
+    assert(tfs_close(writer) != -1);
+    scan("/g17");
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
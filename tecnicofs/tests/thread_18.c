@@ -0,0 +1,161 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test opens and stats batches of files, in two directories and the root, with
+ * tfs_open_many and tfs_stat_many. Multiple threads create the same batch at once (and all of them
+ * must get the same files), then open it again and read each file back. Entries that cannot be
+ * opened or found fail on their own, with their error, and the sizes stat reports include what is
+ * buffered.
+ */
+
+#define N_THREADS 4
+#define PER_DIR 16
+#define N_FILES (3 * PER_DIR - 8)
+#define LEN 10
+
+static char names[N_FILES][MAX_FILE_NAME];
+static int inumbers[N_THREADS][N_FILES];
+
+static void batch_init(tfs_batch_entry_t *batch) {
+    for (int i = 0; i < N_FILES; i++) {
+        batch[i] = (tfs_batch_entry_t){.tb_name = names[i]};
+    }
+}
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    tfs_batch_entry_t batch[N_FILES];
+    char buffer[LEN + 1];
+
+    batch_init(batch);
+    assert(tfs_open_many(batch, N_FILES, TFS_O_CREAT) == N_FILES);
+    for (int i = 0; i < N_FILES; i++) {
+        assert(batch[i].tb_error == 0 && batch[i].tb_fhandle != -1);
+        inumbers[id][i] = batch[i].tb_inumber;
+        assert(tfs_close(batch[i].tb_fhandle) != -1);
+    }
+
+    /* The files are there (and empty) for the next batch */
+    batch_init(batch);
+    assert(tfs_open_many(batch, N_FILES, 0) == N_FILES);
+    for (int i = 0; i < N_FILES; i++) {
+        assert(batch[i].tb_inumber == inumbers[id][i] && batch[i].tb_size == 0);
+        assert(tfs_read(batch[i].tb_fhandle, buffer, sizeof(buffer)) == 0);
+        assert(tfs_close(batch[i].tb_fhandle) != -1);
+    }
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    tfs_batch_entry_t batch[N_FILES];
+    char buffer[LEN + 1];
+
+    /* Names alternate between groups of directories, so batches have several groups */
+    for (int i = 0; i < N_FILES; i++) {
+        if (i < PER_DIR) {
+            snprintf(names[i], MAX_FILE_NAME, "/d0/f%d", i);
+        } else if (i < 2 * PER_DIR) {
+            snprintf(names[i], MAX_FILE_NAME, "/d1/f%d", i);
+        } else {
+            snprintf(names[i], MAX_FILE_NAME, "/f%d", i);
+        }
+    }
+
+    assert(tfs_init() != -1);
+    assert(tfs_mkdir("/d0") != -1);
+    assert(tfs_mkdir("/d1") != -1);
+
+    assert(tfs_open_many(NULL, 1, 0) == -1);
+    assert(tfs_stat_many(NULL, 1) == -1);
+    assert(tfs_open_many(batch, 0, 0) == 0);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* The threads that raced to create a file all opened the same one */
+    for (int t = 1; t < N_THREADS; t++) {
+        assert(memcmp(inumbers[t], inumbers[0], sizeof(inumbers[0])) == 0);
+    }
+
+    /* Open the files to write, each with its name */
+    batch_init(batch);
+    assert(tfs_open_many(batch, N_FILES, TFS_O_TRUNC) == N_FILES);
+    for (int i = 0; i < N_FILES; i++) {
+        assert(batch[i].tb_inumber == inumbers[0][i] && batch[i].tb_size == 0);
+        assert(tfs_write(batch[i].tb_fhandle, names[i], strlen(names[i])) ==
+               (ssize_t)strlen(names[i]));
+        assert(tfs_close(batch[i].tb_fhandle) != -1);
+    }
+
+    /* Appends start at the end of each file */
+    batch_init(batch);
+    assert(tfs_open_many(batch, N_FILES, TFS_O_APPEND) == N_FILES);
+    for (int i = 0; i < N_FILES; i++) {
+        assert(batch[i].tb_size == strlen(names[i]));
+        assert(tfs_write(batch[i].tb_fhandle, "!", 1) == 1);
+        assert(tfs_close(batch[i].tb_fhandle) != -1);
+    }
+
+    for (int i = 0; i < N_FILES; i++) {
+        int fh = tfs_open(names[i], 0);
+        assert(fh != -1);
+        ssize_t r = tfs_read(fh, buffer, sizeof(buffer));
+        assert(r == (ssize_t)strlen(names[i]) + 1);
+        assert(memcmp(buffer, names[i], strlen(names[i])) == 0 && buffer[r - 1] == '!');
+        assert(tfs_close(fh) != -1);
+    }
+
+    /* Entries that fail do so each on its own */
+    tfs_batch_entry_t mixed[] = {{.tb_name = names[0]},   {.tb_name = "relative"},
+                                 {.tb_name = "/d0/"},     {.tb_name = "/d0"},
+                                 {.tb_name = "/d2/f"},    {.tb_name = "/d0/missing"},
+                                 {.tb_name = names[N_FILES - 1]}, {.tb_name = NULL}};
+    size_t n_mixed = sizeof(mixed) / sizeof(mixed[0]);
+
+    assert(tfs_open_many(mixed, n_mixed, 0) == 2);
+    assert(mixed[0].tb_error == 0 && mixed[6].tb_error == 0);
+    assert(mixed[1].tb_error == EINVAL && mixed[2].tb_error == EINVAL);
+    assert(mixed[3].tb_error == EISDIR && mixed[3].tb_fhandle == -1);
+    assert(mixed[4].tb_error == ENOENT && mixed[5].tb_error == ENOENT);
+    assert(mixed[7].tb_error == EINVAL);
+    assert(tfs_close(mixed[0].tb_fhandle) != -1);
+    assert(tfs_close(mixed[6].tb_fhandle) != -1);
+
+    assert(tfs_stat_many(mixed, n_mixed) == 3);
+    assert(mixed[0].tb_type == T_FILE && mixed[0].tb_size == strlen(names[0]) + 1);
+    assert(mixed[3].tb_error == 0 && mixed[3].tb_type == T_DIRECTORY);
+    assert(mixed[4].tb_error == ENOENT && mixed[4].tb_inumber == -1);
+
+    /* Files created by a batch are there for lookups */
+    tfs_batch_entry_t created[] = {{.tb_name = "/d1/new"}, {.tb_name = "/d1/new2"}};
+    assert(tfs_open_many(created, 2, TFS_O_CREAT | TFS_O_BUFFERED) == 2);
+    assert(tfs_lookup("/d1/new") == created[0].tb_inumber);
+    assert(tfs_lookup("/d1/new2") == created[1].tb_inumber);
+
+    /* Stat sees what is buffered */
+    assert(tfs_write(created[0].tb_fhandle, "buffered", 8) == 8);
+    assert(tfs_stat_many(created, 2) == 2);
+    assert(created[0].tb_size == 8 && created[1].tb_size == 0);
+    assert(tfs_close(created[0].tb_fhandle) != -1);
+    assert(tfs_close(created[1].tb_fhandle) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
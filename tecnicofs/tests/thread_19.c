@@ -0,0 +1,172 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * This test recycles files with tfs_ftruncate from multiple threads: each one writes its own log
+ * file, cuts it to some size (checking what is left), grows it (checking the new bytes read as
+ * zeros) and empties it, many more times than the volume could hold without freeing the blocks.
+ * A file with an extent block is cut in the middle of an extent, what is buffered is cut like the
+ * rest, and at the end the whole volume can be written again. A cut logged in the journal of an
+ * image that was not cleanly unmounted is replayed (over the data synced before it).
+ */
+
+#define N_THREADS 4
+#define ROUNDS 30
+#define LOG_SIZE (40 * BLOCK_SIZE)
+#define GROW 3000
+#define IMAGE "/tmp/tfs_thread_19.img"
+
+static char content[LOG_SIZE];
+
+static void check_zeros(int fh, size_t offset, size_t len) {
+    static _Thread_local char buffer[GROW];
+
+    assert(len <= sizeof(buffer));
+    assert(tfs_pread(fh, buffer, len, offset) == (ssize_t)len);
+    for (size_t i = 0; i < len; i++) {
+        assert(buffer[i] == 0);
+    }
+}
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    static char buffer[N_THREADS][LOG_SIZE + GROW];
+
+    snprintf(path, sizeof(path), "/log%d", id);
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        size_t cut = (round * 7919 + (size_t)id * 1231) % LOG_SIZE;
+
+        assert(tfs_pwrite(fh, content, LOG_SIZE, 0) == LOG_SIZE);
+
+        assert(tfs_ftruncate(fh, cut) != -1);
+        assert(tfs_pread(fh, buffer[id], LOG_SIZE, 0) == (ssize_t)cut);
+        assert(memcmp(buffer[id], content, cut) == 0);
+
+        assert(tfs_ftruncate(fh, cut + GROW) != -1);
+        check_zeros(fh, cut, GROW);
+        assert(tfs_pread(fh, buffer[id], LOG_SIZE + GROW, 0) == (ssize_t)(cut + GROW));
+
+        assert(tfs_ftruncate(fh, 0) != -1);
+        assert(tfs_pread(fh, buffer[id], 1, 0) == 0);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    static char buffer[LOG_SIZE];
+
+    for (size_t j = 0; j < LOG_SIZE; j++) {
+        content[j] = (char)('a' + (j / 13) % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_ftruncate(-1, 0) == -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* Two files written a block at a time, one after the other, have one extent per block */
+    int f = tfs_open("/frag", TFS_O_CREAT);
+    int g = tfs_open("/other", TFS_O_CREAT);
+    assert(f != -1 && g != -1);
+    for (size_t b = 0; b < 8; b++) {
+        assert(tfs_write(f, content + b * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_write(g, content, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+
+    size_t cut = 5 * BLOCK_SIZE + 100;
+    assert(tfs_ftruncate(f, cut) != -1);
+    assert(tfs_pread(f, buffer, LOG_SIZE, 0) == (ssize_t)cut);
+    assert(memcmp(buffer, content, cut) == 0);
+
+    /* The handle writes past the end again: the gap reads as zeros */
+    assert(tfs_write(f, content, 10) == 10);
+    check_zeros(f, cut, 8 * BLOCK_SIZE - cut);
+    assert(tfs_pread(f, buffer, 10, 8 * BLOCK_SIZE) == 10);
+    assert(memcmp(buffer, content, 10) == 0);
+
+    /* Few enough extents are left to fit in the i-node */
+    assert(tfs_ftruncate(f, 2 * BLOCK_SIZE + 5) != -1);
+    assert(tfs_pread(f, buffer, LOG_SIZE, 0) == 2 * BLOCK_SIZE + 5);
+    assert(memcmp(buffer, content, 2 * BLOCK_SIZE + 5) == 0);
+
+    assert(tfs_ftruncate(f, 0) != -1);
+    assert(tfs_ftruncate(g, 0) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+
+    /* What is buffered is cut like the rest of the file */
+    int b = tfs_open("/buffered", TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(b != -1);
+    assert(tfs_write(b, content, 300) == 300);
+    assert(tfs_ftruncate(b, 100) != -1);
+    assert(tfs_pread(b, buffer, sizeof(buffer), 0) == 100);
+    assert(memcmp(buffer, content, 100) == 0);
+    assert(tfs_close(b) != -1);
+
+    /* Every block was given back: almost the whole volume fits in one file */
+    int big = tfs_open("/big", TFS_O_CREAT);
+    assert(big != -1);
+    for (size_t done = 0; done < (DATA_BLOCKS - 8) * BLOCK_SIZE; done += LOG_SIZE) {
+        size_t len = (DATA_BLOCKS - 8) * BLOCK_SIZE - done;
+        len = len < LOG_SIZE ? len : LOG_SIZE;
+        assert(tfs_write(big, content, len) == (ssize_t)len);
+    }
+    assert(tfs_close(big) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+
+    if (pid == 0) {
+        assert(tfs_mount(IMAGE) != -1);
+        int fh = tfs_open("/cut", TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_write(fh, content, LOG_SIZE) == LOG_SIZE);
+        assert(tfs_ftruncate(fh, cut) != -1);
+        assert(tfs_fsync(fh) != -1);
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_mount(IMAGE) != -1);
+    int fh = tfs_open("/cut", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == (ssize_t)cut);
+    assert(memcmp(buffer, content, cut) == 0);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
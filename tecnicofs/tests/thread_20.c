@@ -0,0 +1,178 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test appends records to one log file from multiple threads, each with its own TFS_O_APPEND
+ * handle, while another thread reads the log: every record must read back whole, those of each
+ * thread in the order it wrote them, and the reader must never see a record that is not whole.
+ * The log is then emptied while the threads keep appending, and what is left is whole records too.
+ */
+
+#define N_THREADS 4
+#define APPENDS 150
+#define RECORD 100 // does not divide BLOCK_SIZE, so records straddle blocks
+
+static _Atomic int appending;
+
+/* Fills a record: the thread, its number and the thread again up to the newline */
+static void record_fill(char *record, int id, int seq) {
+    memset(record, 'a' + id, RECORD);
+    snprintf(record + 1, RECORD - 1, "%06d", seq);
+    record[7] = (char)('a' + id);
+    record[RECORD - 1] = '\n';
+}
+
+/* Checks len bytes of records and, if last is not NULL, that the records of each thread come
+ * after last[thread] (and updates it) */
+static void check_records(char const *data, size_t len, int *last) {
+    assert(len % RECORD == 0);
+
+    for (size_t r = 0; r < len / RECORD; r++) {
+        char const *record = data + r * RECORD;
+        char expected[RECORD];
+        int id = record[0] - 'a';
+
+        assert(id >= 0 && id < N_THREADS);
+        int seq = atoi(record + 1);
+        record_fill(expected, id, seq);
+        assert(memcmp(record, expected, RECORD) == 0);
+
+        if (last != NULL) {
+            assert(seq > last[id]);
+            last[id] = seq;
+        }
+    }
+}
+
+void *append_fn(void *arg) {
+
+    int id = *((int *)arg);
+    char record[RECORD];
+
+    int fh = tfs_open("/log", TFS_O_APPEND);
+    assert(fh != -1);
+
+    for (int seq = 0; seq < APPENDS; seq++) {
+        record_fill(record, id, seq);
+        assert(tfs_write(fh, record, RECORD) == RECORD);
+    }
+
+    assert(tfs_close(fh) != -1);
+    appending--;
+
+    return (void *)NULL;
+}
+
+void *read_fn(void *arg) {
+
+    (void)arg;
+    static char buffer[N_THREADS * APPENDS * RECORD];
+
+    int fh = tfs_open("/log", 0);
+    assert(fh != -1);
+
+    while (appending > 0) {
+        ssize_t r = tfs_pread(fh, buffer, sizeof(buffer), 0);
+        assert(r != -1);
+        check_records(buffer, (size_t)r, NULL);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+void *truncate_fn(void *arg) {
+
+    (void)arg;
+
+    int fh = tfs_open("/log", 0);
+    assert(fh != -1);
+
+    int cuts = 0;
+    do {
+        assert(tfs_ftruncate(fh, 0) != -1);
+    } while (++cuts < 10 && appending > 0);
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+static void run(void *(*other)(void *)) {
+    pthread_t tids[N_THREADS + 1];
+    int ids[N_THREADS];
+
+    appending = N_THREADS;
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, append_fn, (void *)&ids[i]) == 0);
+    }
+    assert(pthread_create(&tids[N_THREADS], NULL, other, NULL) == 0);
+
+    for (int i = 0; i < N_THREADS + 1; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+}
+
+int main() {
+
+    static char buffer[(N_THREADS * APPENDS + 4) * RECORD];
+    int last[N_THREADS];
+
+    assert(tfs_init() != -1);
+
+    int fh = tfs_open("/log", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+
+    run(read_fn);
+
+    fh = tfs_open("/log", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == N_THREADS * APPENDS * RECORD);
+    for (int i = 0; i < N_THREADS; i++) {
+        last[i] = -1;
+    }
+    check_records(buffer, N_THREADS * APPENDS * RECORD, last);
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(last[i] == APPENDS - 1);
+    }
+
+    /* An append handle that was not at the end writes there, and moves to it */
+    int appender = tfs_open("/log", TFS_O_APPEND);
+    assert(appender != -1);
+    assert(tfs_write(fh, buffer, RECORD) == RECORD);
+    assert(tfs_pwrite(fh, buffer, RECORD, N_THREADS * APPENDS * RECORD + RECORD) == RECORD);
+    assert(tfs_write(appender, buffer, RECORD) == RECORD);
+    assert(tfs_read(appender, buffer, sizeof(buffer)) == 0);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == (N_THREADS * APPENDS + 3) * RECORD);
+    assert(tfs_close(appender) != -1);
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open("/log", TFS_O_TRUNC);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+
+    run(truncate_fn);
+
+    fh = tfs_open("/log", 0);
+    assert(fh != -1);
+    ssize_t r = tfs_read(fh, buffer, sizeof(buffer));
+    assert(r != -1);
+    for (int i = 0; i < N_THREADS; i++) {
+        last[i] = -1;
+    }
+    check_records(buffer, (size_t)r, last);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
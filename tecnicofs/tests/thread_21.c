@@ -0,0 +1,185 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * This test runs tecnicofs with volumes of other geometries, from tfs_init_with_params: for each
+ * block size, multiple threads write files that have an extent block, through plain and buffered
+ * handles, and read them back, a directory holds more entries than one of its blocks can, and a
+ * file is cut in the middle of a block. The i-node table and the open file table hold as many
+ * files as they were given. A volume in an image file is mounted again with its geometry, and
+ * only with it. Geometries that cannot be used are refused.
+ */
+
+#define N_THREADS 3
+#define PIECES 12
+#define MAX_SIZE (PIECES * 3 * 65536)
+#define IMAGE "/tmp/tfs_thread_21.img"
+
+static char content[MAX_SIZE];
+static size_t block_size;
+
+/* Writes a file in pieces of 3 blocks, each followed by a block of another file, so that the file
+ * has more extents than the i-node holds, and checks it and the other file */
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    char other[MAX_FILE_NAME];
+    static char buffer[N_THREADS][MAX_SIZE];
+    size_t piece = 3 * block_size;
+
+    snprintf(path, sizeof(path), "/f%d", id);
+    snprintf(other, sizeof(other), "/g%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT | (id % 2 == 0 ? TFS_O_BUFFERED : 0));
+    int gh = tfs_open(other, TFS_O_CREAT);
+    assert(fh != -1 && gh != -1);
+
+    for (size_t i = 0; i < PIECES; i++) {
+        assert(tfs_write(fh, content + i * piece, piece) == (ssize_t)piece);
+        assert(tfs_fsync(fh) != -1);
+        assert(tfs_write(gh, content, block_size) == (ssize_t)block_size);
+    }
+
+    assert(tfs_pread(fh, buffer[id], MAX_SIZE, 0) == (ssize_t)(PIECES * piece));
+    assert(memcmp(buffer[id], content, PIECES * piece) == 0);
+    assert(tfs_pread(gh, buffer[id], MAX_SIZE, 0) == (ssize_t)(PIECES * block_size));
+    assert(memcmp(buffer[id], content, block_size) == 0);
+
+    /* Cut in the middle of a block: what is left reads back, what grows back reads as zeros */
+    size_t cut = 5 * block_size + block_size / 2;
+    assert(tfs_ftruncate(fh, cut) != -1);
+    assert(tfs_ftruncate(fh, cut + block_size) != -1);
+    assert(tfs_pread(fh, buffer[id], MAX_SIZE, 0) == (ssize_t)(cut + block_size));
+    assert(memcmp(buffer[id], content, cut) == 0);
+    for (size_t j = cut; j < cut + block_size; j++) {
+        assert(buffer[id][j] == 0);
+    }
+
+    assert(tfs_close(fh) != -1);
+    assert(tfs_close(gh) != -1);
+
+    return (void *)NULL;
+}
+
+static void run(size_t size) {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    char path[MAX_FILE_NAME];
+    size_t dir_entries = size / (MAX_FILE_NAME + sizeof(int)) + 1;
+    /* The root, the files of the threads, the directory and its entries, and a few more */
+    size_t used = 1 + 2 * N_THREADS + 1 + dir_entries;
+    size_t inodes = used + 3;
+
+    block_size = size;
+
+    tfs_params_t params = {.tp_block_size = size,
+                           .tp_data_blocks = N_THREADS * 6 * PIECES,
+                           .tp_inodes = inodes,
+                           .tp_max_open_files = 8};
+    assert(tfs_init_with_params(&params) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* A directory with more entries than fit in one of its blocks */
+    assert(tfs_mkdir("/d") != -1);
+    for (size_t i = 0; i < dir_entries; i++) {
+        snprintf(path, sizeof(path), "/d/e%zu", i);
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_close(fh) != -1);
+    }
+    for (size_t i = 0; i < dir_entries; i++) {
+        snprintf(path, sizeof(path), "/d/e%zu", i);
+        assert(tfs_lookup(path) != -1);
+    }
+
+    /* The i-node table is full once every i-node is taken */
+    for (size_t i = used; i < inodes; i++) {
+        snprintf(path, sizeof(path), "/x%zu", i);
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_close(fh) != -1);
+    }
+    assert(tfs_open("/full", TFS_O_CREAT) == -1);
+
+    /* So is the open file table */
+    int fhs[8];
+    for (int i = 0; i < 8; i++) {
+        fhs[i] = tfs_open("/f0", 0);
+        assert(fhs[i] != -1);
+    }
+    assert(tfs_open("/f0", 0) == -1);
+    for (int i = 0; i < 8; i++) {
+        assert(tfs_close(fhs[i]) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+
+    char buffer[100];
+
+    for (size_t j = 0; j < MAX_SIZE; j++) {
+        content[j] = (char)('a' + (j / 7) % 26);
+    }
+
+    run(MIN_BLOCK_SIZE);
+    run(4096);
+    run(MAX_BLOCK_SIZE);
+
+    /* Geometries that cannot be used */
+    tfs_params_t bad[] = {{.tp_block_size = 3000},
+                          {.tp_block_size = MIN_BLOCK_SIZE / 2},
+                          {.tp_block_size = MAX_BLOCK_SIZE * 2},
+                          {.tp_max_open_files = MAX_OPEN_FILES + 1}};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        assert(tfs_init_with_params(&bad[i]) == -1);
+    }
+    assert(tfs_init_with_params(NULL) == -1);
+
+    /* An image keeps its geometry: it is not mounted with the default block size */
+    unlink(IMAGE);
+    tfs_params_t params = {.tp_block_size = 4096, .tp_image_path = IMAGE};
+    assert(tfs_init_with_params(&params) != -1);
+    int fh = tfs_open("/kept", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, 3 * 4096 + 10) == 3 * 4096 + 10);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_mount(IMAGE) == -1);
+
+    assert(tfs_init_with_params(&params) != -1);
+    fh = tfs_open("/kept", 0);
+    assert(fh != -1);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 3 * 4096) == 10);
+    assert(memcmp(buffer, content + 3 * 4096, 10) == 0);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+    unlink(IMAGE);
+
+    /* The defaults are still there */
+    assert(tfs_init() != -1);
+    fh = tfs_open("/f", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, 2 * BLOCK_SIZE) == 2 * BLOCK_SIZE);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
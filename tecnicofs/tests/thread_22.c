@@ -0,0 +1,183 @@
+#include "async.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * This test runs several volumes side by side in one process, each in a context of its own:
+ * threads of each context write files with the same names as those of the others and must only
+ * ever see their own, and each volume fills up (or runs out of i-nodes) on its own. A context is
+ * placed on a NUMA node, a queue of async.h runs its entries in the context it was created in,
+ * and a thread whose context is destroyed goes back to the default one.
+ */
+
+#define N_CONTEXTS 3
+#define THREADS_PER_CONTEXT 2
+#define FILES 6
+#define LEN 3000
+
+static tfs_ctx_t *contexts[N_CONTEXTS];
+
+static void fill(char *data, int ctx, int thread, int file) {
+    for (size_t i = 0; i < LEN; i++) {
+        data[i] = (char)('a' + (ctx * 7 + thread * 3 + file + (int)(i / 100)) % 26);
+    }
+}
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    int ctx = id / THREADS_PER_CONTEXT;
+    int thread = id % THREADS_PER_CONTEXT;
+    char path[MAX_FILE_NAME];
+    char expected[LEN];
+    char buffer[LEN + 1];
+
+    /* A new thread starts in the default context */
+    assert(tfs_ctx_use(contexts[ctx]) != contexts[ctx]);
+    assert(tfs_ctx_current() == contexts[ctx]);
+
+    for (int f = 0; f < FILES; f++) {
+        snprintf(path, sizeof(path), "/t%d_%d", thread, f);
+        fill(expected, ctx, thread, f);
+
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_write(fh, expected, LEN) == LEN);
+        assert(tfs_close(fh) != -1);
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        snprintf(path, sizeof(path), "/t%d_%d", thread, f);
+        fill(expected, ctx, thread, f);
+
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_read(fh, buffer, sizeof(buffer)) == LEN);
+        assert(memcmp(buffer, expected, LEN) == 0);
+        assert(tfs_close(fh) != -1);
+    }
+
+    /* Only the context that created it has this file */
+    snprintf(path, sizeof(path), "/only%d", ctx);
+    assert(tfs_close(tfs_open(path, TFS_O_CREAT)) != -1);
+    for (int other = 0; other < N_CONTEXTS; other++) {
+        snprintf(path, sizeof(path), "/only%d", other);
+        assert((tfs_lookup(path) != -1) == (other == ctx));
+    }
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_CONTEXTS * THREADS_PER_CONTEXT];
+    int ids[N_CONTEXTS * THREADS_PER_CONTEXT];
+    char buffer[LEN];
+
+    assert(tfs_init() != -1);
+    tfs_ctx_t *base = tfs_ctx_current();
+
+    int fh = tfs_open("/default", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, "default", 7) == 7);
+
+    /* Volumes of different geometries; the last one on a NUMA node, if there are any */
+    tfs_params_t params[N_CONTEXTS] = {
+        {.tp_data_blocks = 64},
+        {.tp_block_size = 4096, .tp_data_blocks = 32, .tp_inodes = 20},
+        {.tp_block_size = 512, .tp_data_blocks = 256, .tp_inodes = 30}};
+    bool numa = access("/sys/devices/system/node/node0", F_OK) == 0;
+
+    for (int i = 0; i < N_CONTEXTS; i++) {
+        contexts[i] = tfs_ctx_create(&params[i], i == N_CONTEXTS - 1 && numa ? 0 : -1);
+        assert(contexts[i] != NULL && contexts[i] != base);
+    }
+    assert(tfs_ctx_current() == base);
+
+    assert(tfs_ctx_create(NULL, 1 << 20) == NULL);
+    assert(tfs_ctx_create(&(tfs_params_t){.tp_block_size = 3000}, -1) == NULL);
+    assert(tfs_ctx_destroy(base) == -1);
+    assert(tfs_ctx_destroy(NULL) == -1);
+
+    for (int i = 0; i < N_CONTEXTS * THREADS_PER_CONTEXT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_CONTEXTS * THREADS_PER_CONTEXT; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* The default volume did not see any of it */
+    assert(tfs_lookup("/t0_0") == -1 && tfs_lookup("/only0") == -1);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == 7);
+    assert(memcmp(buffer, "default", 7) == 0);
+
+    /* Each volume runs out of i-nodes on its own: the second one holds 20 */
+    assert(tfs_ctx_use(contexts[1]) == base);
+    int created = 0;
+    for (;; created++) {
+        char path[MAX_FILE_NAME];
+        snprintf(path, sizeof(path), "/x%d", created);
+        int x = tfs_open(path, TFS_O_CREAT);
+        if (x == -1) {
+            break;
+        }
+        assert(tfs_close(x) != -1);
+    }
+    assert(created == 20 - 1 - THREADS_PER_CONTEXT * FILES - 1);
+    assert(tfs_ctx_use(NULL) == contexts[1]);
+    assert(tfs_close(tfs_open("/x0", TFS_O_CREAT)) != -1);
+
+    /* A queue created in a context runs its entries there */
+    assert(tfs_ctx_use(contexts[0]) == base);
+    tfs_aio_t *aio = tfs_aio_create(4, 2);
+    assert(aio != NULL);
+    assert(tfs_ctx_use(base) == contexts[0]);
+
+    tfs_aio_sqe_t open_sqe = {.sqe_op = TFS_AIO_OPEN, .sqe_path = "/t0_0", .sqe_flags = 0};
+    tfs_aio_cqe_t cqe;
+    assert(tfs_aio_submit(aio, &open_sqe, 1) == 1);
+    assert(tfs_aio_reap(aio, &cqe, 1, 1) == 1 && cqe.cqe_result != -1);
+
+    tfs_aio_sqe_t read_sqe = {.sqe_op = TFS_AIO_PREAD, .sqe_fhandle = (int)cqe.cqe_result,
+                              .sqe_buffer = buffer, .sqe_len = LEN, .sqe_offset = 0};
+    char expected[LEN];
+    fill(expected, 0, 0, 0);
+    assert(tfs_aio_submit(aio, &read_sqe, 1) == 1);
+    assert(tfs_aio_reap(aio, &cqe, 1, 1) == 1 && cqe.cqe_result == LEN);
+    assert(memcmp(buffer, expected, LEN) == 0);
+    assert(tfs_aio_destroy(aio) != -1);
+
+    /* A thread whose context is destroyed goes back to the default one */
+    assert(tfs_ctx_use(contexts[2]) == base);
+    assert(tfs_ctx_destroy(contexts[2]) != -1);
+    assert(tfs_ctx_current() == base);
+    assert(tfs_lookup("/default") != -1);
+
+    /* Its slot is there for another context, up to MAX_CONTEXTS of them */
+    tfs_ctx_t *more[MAX_CONTEXTS];
+    int n_more = 0;
+    while ((more[n_more] = tfs_ctx_create(NULL, -1)) != NULL) {
+        n_more++;
+    }
+    assert(n_more == MAX_CONTEXTS - N_CONTEXTS);
+    for (int i = 0; i < n_more; i++) {
+        assert(tfs_ctx_use(more[i]) == base);
+        assert(tfs_lookup("/t0_0") == -1 && tfs_lookup("/default") == -1);
+        assert(tfs_ctx_use(NULL) == more[i]);
+        assert(tfs_ctx_destroy(more[i]) != -1);
+    }
+
+    assert(tfs_ctx_destroy(contexts[0]) != -1);
+    assert(tfs_ctx_destroy(contexts[1]) != -1);
+
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
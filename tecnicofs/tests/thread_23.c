@@ -0,0 +1,190 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * This test writes small files that keep their data inline, in their i-nodes: multiple threads
+ * write more of them than the volume has blocks, through plain, buffered and append handles, and
+ * read them back. A file that outgrows its i-node moves its data to blocks, and one cut back to
+ * nothing keeps it inline again. Concurrent appends to one file cross the limit, inline data is
+ * mounted again from an image, and is copied out of tecnicofs.
+ */
+
+#define N_THREADS 3
+#define FILES 20
+#define VOLUME_BLOCKS 16
+#define RECORD 7
+#define RECORDS 10
+#define IMAGE "/tmp/tfs_thread_23.img"
+#define COPY "/tmp/tfs_thread_23.out"
+
+static char content[4 * 4096];
+
+/* Length of the data of file f of a thread, all of which fits inline */
+static size_t length(int id, int f) { return (size_t)(2 + (id * FILES + f) % (INODE_INLINE_SIZE - 1)); }
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    char buffer[INODE_INLINE_SIZE + 1];
+    int flags = id == 0 ? 0 : (id == 1 ? TFS_O_BUFFERED : TFS_O_APPEND);
+
+    for (int f = 0; f < FILES; f++) {
+        size_t len = length(id, f);
+        size_t half = len / 2;
+
+        snprintf(path, sizeof(path), "/s%d_%d", id, f);
+
+        int fh = tfs_open(path, TFS_O_CREAT | flags);
+        assert(fh != -1);
+        assert(tfs_write(fh, content, half) == (ssize_t)half);
+        assert(tfs_write(fh, content + half, len - half) == (ssize_t)(len - half));
+        assert(tfs_close(fh) != -1);
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        size_t len = length(id, f);
+
+        snprintf(path, sizeof(path), "/s%d_%d", id, f);
+
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_read(fh, buffer, sizeof(buffer)) == (ssize_t)len);
+        assert(memcmp(buffer, content, len) == 0);
+        assert(tfs_close(fh) != -1);
+    }
+
+    /* Appends to a shared file, which outgrows its i-node while they go on */
+    int fh = tfs_open("/log", TFS_O_APPEND);
+    assert(fh != -1);
+    for (int r = 0; r < RECORDS; r++) {
+        char record[RECORD];
+
+        memset(record, 'a' + id, RECORD);
+        assert(tfs_write(fh, record, RECORD) == RECORD);
+    }
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    static char buffer[sizeof(content)];
+
+    for (size_t j = 0; j < sizeof(content); j++) {
+        content[j] = (char)('a' + (j / 3) % 26);
+    }
+
+    /* Fewer blocks than files: the small files take none */
+    tfs_params_t params = {.tp_block_size = 4096, .tp_data_blocks = VOLUME_BLOCKS, .tp_inodes = 100};
+    assert(tfs_init_with_params(&params) != -1);
+    assert(tfs_close(tfs_open("/log", TFS_O_CREAT)) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    /* Every record of every append is whole */
+    int fh = tfs_open("/log", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == N_THREADS * RECORDS * RECORD);
+    int records[N_THREADS] = {0};
+    for (int r = 0; r < N_THREADS * RECORDS; r++) {
+        int id = buffer[r * RECORD] - 'a';
+        assert(id >= 0 && id < N_THREADS);
+        for (int j = 1; j < RECORD; j++) {
+            assert(buffer[r * RECORD + j] == buffer[r * RECORD]);
+        }
+        records[id]++;
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(records[i] == RECORDS);
+    }
+    assert(tfs_close(fh) != -1);
+
+    /* A file that outgrows its i-node moves its data to blocks */
+    fh = tfs_open("/grow", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, 30) == 30);
+    assert(tfs_pwrite(fh, content + 30, 3 * 4096, 30) == 3 * 4096);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == 30 + 3 * 4096);
+    assert(memcmp(buffer, content, 30 + 3 * 4096) == 0);
+
+    /* Cut back to nothing, it is inline again: what it grows to reads as zeros */
+    assert(tfs_ftruncate(fh, 0) != -1);
+    assert(tfs_ftruncate(fh, INODE_INLINE_SIZE) != -1);
+    assert(tfs_pwrite(fh, "xyz", 3, 20) == 3);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == INODE_INLINE_SIZE);
+    for (size_t j = 0; j < INODE_INLINE_SIZE; j++) {
+        assert(buffer[j] == (j >= 20 && j < 23 ? "xyz"[j - 20] : 0));
+    }
+    assert(tfs_ftruncate(fh, 10) != -1);
+    assert(tfs_ftruncate(fh, 30) != -1);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == 30);
+    for (size_t j = 0; j < 30; j++) {
+        assert(buffer[j] == 0);
+    }
+
+    /* A write past an inline end that spills keeps the zeros in between */
+    assert(tfs_pwrite(fh, content, 100, 40) == 100);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == 140);
+    for (size_t j = 0; j < 40; j++) {
+        assert(buffer[j] == 0);
+    }
+    assert(memcmp(buffer + 40, content, 100) == 0);
+    assert(tfs_close(fh) != -1);
+
+    /* The blocks are all there for a file that needs them: the directory,
+     * "/log" and "/grow" hold one each, the rest hold the file */
+    fh = tfs_open("/big", TFS_O_CREAT);
+    assert(fh != -1);
+    for (int i = 0; i < VOLUME_BLOCKS - 3; i++) {
+        assert(tfs_write(fh, content, 4096) == 4096);
+    }
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    /* Inline data is in the image, and is copied out of it */
+    unlink(IMAGE);
+    unlink(COPY);
+    tfs_params_t image = {.tp_image_path = IMAGE};
+    assert(tfs_init_with_params(&image) != -1);
+    fh = tfs_open("/small", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, 25) == 25);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_with_params(&image) != -1);
+    fh = tfs_open("/small", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == 25);
+    assert(memcmp(buffer, content, 25) == 0);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_copy_to_external_fs("/small", COPY) != -1);
+    assert(tfs_destroy() != -1);
+
+    FILE *fp = fopen(COPY, "r");
+    assert(fp != NULL);
+    assert(fread(buffer, 1, sizeof(buffer), fp) == 25);
+    assert(memcmp(buffer, content, 25) == 0);
+    assert(fclose(fp) == 0);
+    unlink(COPY);
+    unlink(IMAGE);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include "operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * This test checks the CRC32C of the data blocks: multiple threads write the same blocks side by
+ * side (plain writes to their own parts, appends and buffered appends) while another scrubs the
+ * volume, and a scrub runs in the background, and no block is ever found not to match. A byte of
+ * a block changed behind tecnicofs, in the image file, is found by a scrub, makes the reads of the
+ * block and the copy of its file fail, and is gone once the block is written again.
+ */
+
+#define N_THREADS 4
+#define ROUNDS 200
+#define PIECE 100
+#define IMAGE "/tmp/tfs_thread_24.img"
+#define COPY "/tmp/tfs_thread_24.out"
+#define MARK "tfs-thread-24-block-"
+
+/* What a scrub of a volume with no changed block finds */
+#define CLEAN (BLOCK_CHECKSUMS ? 0 : -1)
+
+static char content[4 * BLOCK_SIZE];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char buffer[PIECE];
+
+    /* The last thread scrubs while the others write */
+    if (id == N_THREADS - 1) {
+        for (int i = 0; i < ROUNDS / 10; i++) {
+            assert(tfs_scrub() == CLEAN);
+        }
+        return (void *)NULL;
+    }
+
+    int fh = tfs_open("/shared", 0);
+    int ah = tfs_open("/log", TFS_O_APPEND | (id % 2 == 0 ? TFS_O_BUFFERED : 0));
+    assert(fh != -1 && ah != -1);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        /* Its own part of the blocks of a file the others write too */
+        size_t offset = (size_t)(((i % 13) * (N_THREADS - 1) + id) * PIECE);
+
+        memset(buffer, 'a' + id, PIECE);
+        assert(tfs_pwrite(fh, buffer, PIECE, offset) == PIECE);
+        assert(tfs_pread(fh, buffer, PIECE, offset) == PIECE);
+        for (int j = 0; j < PIECE; j++) {
+            assert(buffer[j] == 'a' + id);
+        }
+
+        assert(tfs_write(ah, content + i, 10) == 10);
+    }
+
+    assert(tfs_close(fh) != -1);
+    assert(tfs_close(ah) != -1);
+
+    return (void *)NULL;
+}
+
+#if BLOCK_CHECKSUMS
+/* Finds the offset of the first byte of a block of the file in the image */
+static off_t find_block(int block) {
+    char mark[32];
+    off_t found = -1;
+
+    snprintf(mark, sizeof(mark), MARK "%d", block);
+
+    int fd = open(IMAGE, O_RDONLY);
+    assert(fd != -1);
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *image = malloc((size_t)size);
+    assert(image != NULL);
+    assert(pread(fd, image, (size_t)size, 0) == size);
+    assert(close(fd) == 0);
+
+    for (off_t i = 0; found == -1 && i + (off_t)strlen(mark) <= size; i++) {
+        if (memcmp(image + i, mark, strlen(mark)) == 0) {
+            found = i;
+        }
+    }
+    free(image);
+    return found;
+}
+#endif
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    static char buffer[sizeof(content)];
+
+    for (size_t j = 0; j < sizeof(content); j++) {
+        content[j] = (char)('a' + (j / 5) % 26);
+    }
+    for (int b = 0; b < 4; b++) {
+        snprintf(content + b * BLOCK_SIZE, 32, MARK "%d", b);
+    }
+
+    /* Writes side by side, with scrubs going on */
+    tfs_params_t params = {.tp_scrub_interval_ms = 1};
+    assert(tfs_init_with_params(&params) != -1);
+
+    int fh = tfs_open("/shared", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, sizeof(content)) == sizeof(content));
+    assert(tfs_close(tfs_open("/log", TFS_O_CREAT)) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    assert(tfs_scrub() == CLEAN);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == sizeof(content));
+    assert(tfs_close(fh) != -1);
+
+    /* Cut and grown back, blocks are still checked */
+    fh = tfs_open("/log", 0);
+    assert(fh != -1);
+    assert(tfs_ftruncate(fh, BLOCK_SIZE / 2) != -1);
+    assert(tfs_ftruncate(fh, 3 * BLOCK_SIZE) != -1);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_scrub() == CLEAN);
+    assert(tfs_destroy() != -1);
+
+#if BLOCK_CHECKSUMS
+    /* A block changed in the image behind tecnicofs */
+    unlink(IMAGE);
+    unlink(COPY);
+    assert(tfs_init_with_params(&(tfs_params_t){.tp_image_path = IMAGE}) != -1);
+    fh = tfs_open("/victim", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, sizeof(content)) == sizeof(content));
+    assert(tfs_close(fh) != -1);
+    assert(tfs_scrub() == CLEAN);
+    assert(tfs_destroy() != -1);
+
+    off_t offset = find_block(2);
+    assert(offset != -1);
+    int fd = open(IMAGE, O_WRONLY);
+    assert(fd != -1);
+    assert(pwrite(fd, "X", 1, offset + BLOCK_SIZE / 2) == 1);
+    assert(close(fd) == 0);
+
+    assert(tfs_mount(IMAGE) != -1);
+    assert(tfs_scrub() == 1);
+#if STATS_ENABLED
+    tfs_stats_t *stats = malloc(sizeof(tfs_stats_t));
+    assert(stats != NULL && tfs_stats_snapshot(stats) != -1);
+    uint64_t errors = stats->st_checksum_errors;
+#endif
+
+    fh = tfs_open("/victim", 0);
+    assert(fh != -1);
+    assert(tfs_pread(fh, buffer, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+    assert(memcmp(buffer, content, 2 * BLOCK_SIZE) == 0);
+    assert(tfs_pread(fh, buffer, BLOCK_SIZE, 2 * BLOCK_SIZE) == -1);
+    assert(tfs_copy_to_external_fs("/victim", COPY) == -1);
+#if STATS_ENABLED
+    /* Each of the failures is counted, apart from any other error */
+    assert(tfs_stats_snapshot(stats) != -1);
+    assert(stats->st_checksum_errors - errors == 2);
+#endif
+
+    /* Written again, the block holds what its checksum says */
+    assert(tfs_pwrite(fh, content + 2 * BLOCK_SIZE, BLOCK_SIZE, 2 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_scrub() == CLEAN);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == sizeof(content));
+    assert(memcmp(buffer, content, sizeof(content)) == 0);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+#if STATS_ENABLED
+    assert(tfs_stats_snapshot(stats) != -1);
+    assert(stats->st_checksum_errors - errors == 2);
+    free(stats);
+#endif
+
+    unlink(COPY);
+    unlink(IMAGE);
+#endif
+
+    printf("Successfull test\n");
+
+    return 0;
+}
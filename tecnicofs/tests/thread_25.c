@@ -0,0 +1,132 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * This test crashes tecnicofs in the middle of a storm of creates and writes: a child process
+ * mounts an image and runs N_THREADS threads that create, rewrite, truncate and sometimes sync
+ * files of many sizes (some kept inline, some with several extents), logging far more than the
+ * journal section holds, until the parent kills it. The next mount replays the journal, and
+ * every directory entry must name a taken i-node and the bitmap must hold exactly the blocks of
+ * the files and directories (tfs_check), and every file named must be read whole. The image is
+ * crashed ROUNDS times, each time after running a little longer.
+ */
+
+#define N_THREADS 4
+#define FILES 30
+#define ROUNDS 6
+#define MAX_SIZE (6 * BLOCK_SIZE)
+#define IMAGE "/tmp/tfs_thread_25.img"
+
+static char content[MAX_SIZE];
+
+static tfs_params_t const params = {.tp_data_blocks = 4 * N_THREADS * FILES * 8,
+                                    .tp_inodes = 4 * N_THREADS * FILES,
+                                    .tp_image_path = IMAGE};
+
+void *storm(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+
+    for (size_t i = 0;; i++) {
+        size_t size = 1 + (i * 7919 + (size_t)id * 1231) % MAX_SIZE;
+
+        snprintf(path, sizeof(path), "/d%d/f%zu", id, i % FILES);
+        int fh = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fh != -1);
+        assert(tfs_write(fh, content, size) == (ssize_t)size);
+
+        if (i % 3 == 0) {
+            assert(tfs_ftruncate(fh, size / 2) != -1);
+        }
+        if (i % 8 == 0) {
+            assert(tfs_fsync(fh) != -1);
+        }
+        assert(tfs_close(fh) != -1);
+    }
+
+    return (void *)NULL;
+}
+
+static void check_files() {
+    static char buffer[MAX_SIZE + 1];
+    char path[MAX_FILE_NAME];
+
+    assert(tfs_check() == 0);
+
+    for (int id = 0; id < N_THREADS; id++) {
+        for (size_t f = 0; f < FILES; f++) {
+            snprintf(path, sizeof(path), "/d%d/f%zu", id, f);
+            int fh = tfs_open(path, 0);
+            if (fh == -1) {
+                continue;
+            }
+            ssize_t got = tfs_read(fh, buffer, sizeof(buffer));
+            assert(got >= 0 && got <= MAX_SIZE);
+            assert(tfs_close(fh) != -1);
+        }
+    }
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    char path[MAX_FILE_NAME];
+
+    for (size_t j = 0; j < MAX_SIZE; j++) {
+        content[j] = (char)('a' + (j / 13) % 26);
+    }
+
+    unlink(IMAGE);
+
+    assert(tfs_init_with_params(&params) != -1);
+    for (int id = 0; id < N_THREADS; id++) {
+        snprintf(path, sizeof(path), "/d%d", id);
+        assert(tfs_mkdir(path) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    for (unsigned round = 0; round < ROUNDS; round++) {
+        pid_t pid = fork();
+        assert(pid != -1);
+
+        if (pid == 0) {
+            assert(tfs_init_with_params(&params) != -1);
+            for (int i = 0; i < N_THREADS; i++) {
+                ids[i] = i;
+                assert(pthread_create(&tids[i], NULL, storm, (void *)&ids[i]) == 0);
+            }
+            for (int i = 0; i < N_THREADS; i++) {
+                pthread_join(tids[i], NULL);
+            }
+            _exit(1);
+        }
+
+        usleep(50000 + round * 40000);
+        assert(kill(pid, SIGKILL) == 0);
+
+        int status;
+        assert(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status));
+
+        assert(tfs_init_with_params(&params) != -1);
+        check_files();
+        assert(tfs_destroy() != -1);
+    }
+
+    /* A clean unmount leaves nothing to repair */
+    assert(tfs_init_with_params(&params) != -1);
+    check_files();
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
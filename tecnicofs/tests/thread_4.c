@@ -0,0 +1,90 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * This test uses multiple threads to create files inside a nested directory (macro DIR).
+ * N_THREADS * FILES_PER_THREAD files are created, which is more than fit in one directory block,
+ * so the directory has to grow while the threads are concurrently adding entries to it.
+ * In the end every file must be found by tfs_lookup() with a distinct inumber, and a name that
+ * was looked up (and cached) as missing must be found once it is created.
+ */
+
+#define N_THREADS 4
+#define FILES_PER_THREAD 10
+
+#define DIR ("/d/e")
+
+static int inumbers[N_THREADS * FILES_PER_THREAD];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME * 3];
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "%s/f%d_%d", DIR, id, i);
+
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_close(fh) != -1);
+    }
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    char path[MAX_FILE_NAME * 3];
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_mkdir("/d") != -1);
+    assert(tfs_mkdir(DIR) != -1);
+    assert(tfs_mkdir(DIR) == -1);
+    assert(tfs_mkdir("/x/y") == -1);
+    assert(tfs_open("/d", 0) == -1);
+
+    assert(tfs_lookup("/d/e/late") == -1);
+    assert(tfs_lookup("/d/e/late") == -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int id = 0; id < N_THREADS; id++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            snprintf(path, sizeof(path), "%s/f%d_%d", DIR, id, i);
+
+            int inum = tfs_lookup(path);
+            assert(inum != -1);
+
+            for (int j = 0; j < id * FILES_PER_THREAD + i; j++) {
+                assert(inumbers[j] != inum);
+            }
+            inumbers[id * FILES_PER_THREAD + i] = inum;
+        }
+    }
+
+    assert(tfs_lookup("/d/f0_0") == -1);
+
+    int fh = tfs_open("/d/e/late", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_lookup("/d/e/late") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * This test checks that an image file survives tfs_destroy() and can be mounted again.
+ * A file (macro PATH) is written and a directory with an empty file in it is created, then the
+ * filesystem is destroyed and the image is mounted again.
+ * After the remount, N_THREADS threads open the file with their own file handlers and must read
+ * back exactly what was written before, and the directory tree must still be there.
+ * Finally, a child process mounts the image, creates a file and exits without tfs_destroy(); the
+ * next mount finds the image was not cleanly unmounted, replays its journal and must see the file.
+ */
+
+#define N_THREADS 4
+#define SIZE 5000
+
+#define IMAGE ("tests/thread_5.img")
+#define PATH ("/f1")
+
+static char content[SIZE];
+
+void *fn() {
+
+    char buffer[SIZE];
+
+    int fh = tfs_open(PATH, 0);
+    assert(fh != -1);
+
+    assert(tfs_read(fh, buffer, SIZE) == SIZE);
+    assert(memcmp(buffer, content, SIZE) == 0);
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+
+    for (int i = 0; i < SIZE; i++) {
+        content[i] = (char)('a' + i % 26);
+    }
+
+    unlink(IMAGE);
+
+    assert(tfs_mount(IMAGE) != -1);
+
+    int fh = tfs_open(PATH, TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, content, SIZE) == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_mkdir("/d") != -1);
+    fh = tfs_open("/d/f2", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_mount(IMAGE) != -1);
+
+    assert(tfs_lookup("/d/f2") != -1);
+    assert(tfs_lookup("/d/f3") == -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn, NULL) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+
+    if (pid == 0) {
+        assert(tfs_mount(IMAGE) != -1);
+        assert(tfs_open("/d/f3", TFS_O_CREAT) != -1);
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_mount(IMAGE) != -1);
+
+    assert(tfs_lookup("/d/f2") != -1);
+    assert(tfs_lookup("/d/f3") != -1);
+    assert(tfs_lookup(PATH) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * This test checks that reads follow the block map of each file.
+ * N_THREADS threads write their own file in CHUNK-sized pieces at the same time, so the blocks of
+ * the files may be interleaved in the data blocks (and each file split in many extents). Each file
+ * is then read back (in pieces that do not line up with blocks) and must hold exactly what its
+ * thread wrote. Finally, a file larger than BIG is written with a single write and read back.
+ */
+
+#define N_THREADS 4
+#define SIZE (13 * BLOCK_SIZE + 100)
+#define BIG (300 * BLOCK_SIZE + 5)
+#define CHUNK 700
+#define READ_CHUNK 333
+
+static char content[N_THREADS][SIZE];
+static char big[BIG];
+static char big_read[BIG];
+
+void *fn(void *arg) {
+
+    int id = *((int *)arg);
+    char path[MAX_FILE_NAME];
+    snprintf(path, sizeof(path), "/f%d", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (size_t written = 0; written < SIZE; written += CHUNK) {
+        size_t to_write = SIZE - written < CHUNK ? SIZE - written : CHUNK;
+        assert(tfs_write(fh, content[id] + written, to_write) == (ssize_t)to_write);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    int ids[N_THREADS];
+    char buffer[READ_CHUNK];
+
+    for (int i = 0; i < N_THREADS; i++) {
+        for (int j = 0; j < SIZE; j++) {
+            content[i][j] = (char)('a' + (i * 7 + j) % 26);
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        char path[MAX_FILE_NAME];
+        snprintf(path, sizeof(path), "/f%d", i);
+
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+
+        size_t total = 0;
+        ssize_t r;
+        while ((r = tfs_read(fh, buffer, sizeof(buffer))) > 0) {
+            assert(memcmp(buffer, content[i] + total, (size_t)r) == 0);
+            total += (size_t)r;
+        }
+        assert(r == 0 && total == SIZE);
+
+        assert(tfs_close(fh) != -1);
+    }
+
+    /* Truncating gives the blocks back, and the file can be written again */
+    int fh = tfs_open("/f0", TFS_O_TRUNC);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == 0);
+    assert(tfs_write(fh, content[1], READ_CHUNK) == READ_CHUNK);
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open("/f0", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == READ_CHUNK);
+    assert(memcmp(buffer, content[1], READ_CHUNK) == 0);
+    assert(tfs_close(fh) != -1);
+
+    for (int j = 0; j < BIG; j++) {
+        big[j] = (char)('A' + j % 23);
+    }
+
+    fh = tfs_open("/big", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, big, BIG) == BIG);
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open("/big", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, big_read, BIG) == BIG);
+    assert(memcmp(big, big_read, BIG) == 0);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
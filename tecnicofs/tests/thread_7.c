@@ -0,0 +1,83 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * This test uses multiple threads sharing one file handle, each writing (with tfs_pwrite) and then
+ * reading back (with tfs_pread) its own CHUNK-sized region of the file. The regions do not line up
+ * with blocks, so neighbouring threads share blocks, and threads with higher ids may write before
+ * the ones below them, past the end of the file.
+ * Afterwards the whole file must hold every region, the offset of the file handle must not have
+ * moved, and a gap left by a write past the end of the file must read as zeros.
+ */
+
+#define N_THREADS 8
+#define CHUNK 1500
+#define GAP (3 * BLOCK_SIZE)
+
+static char content[N_THREADS * CHUNK];
+static int fh;
+
+void *fn(void *arg) {
+
+    size_t id = *((size_t *)arg);
+    char buffer[CHUNK];
+
+    assert(tfs_pwrite(fh, content + id * CHUNK, CHUNK, id * CHUNK) == CHUNK);
+
+    assert(tfs_pread(fh, buffer, CHUNK, id * CHUNK) == CHUNK);
+    assert(memcmp(buffer, content + id * CHUNK, CHUNK) == 0);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    size_t ids[N_THREADS];
+    static char buffer[N_THREADS * CHUNK + GAP + 1];
+
+    for (size_t i = 0; i < sizeof(content); i++) {
+        content[i] = (char)('a' + (i / CHUNK + i) % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    fh = tfs_open("/f7", TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (size_t i = 0; i < N_THREADS; i++) {
+        ids[i] = N_THREADS - 1 - i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    /* The shared offset is still at the start of the file */
+    assert(tfs_read(fh, buffer, sizeof(content)) == sizeof(content));
+    assert(memcmp(buffer, content, sizeof(content)) == 0);
+
+    assert(tfs_pread(fh, buffer, 10, sizeof(content)) == 0);
+
+    /* A write past the end leaves a gap of zeros */
+    assert(tfs_pwrite(fh, "x", 1, sizeof(content) + GAP) == 1);
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(memcmp(buffer, content, sizeof(content)) == 0);
+    for (size_t i = sizeof(content); i < sizeof(content) + GAP; i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(buffer[sizeof(content) + GAP] == 'x');
+
+    assert(tfs_close(fh) != -1);
+    assert(tfs_pread(fh, buffer, 1, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
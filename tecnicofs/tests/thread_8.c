@@ -0,0 +1,98 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test uses multiple threads, each writing RECORDS records to its own file with tfs_writev,
+ * every record gathered from a header, an empty segment, a payload that crosses block boundaries
+ * and a trailer. Each file is then read back with tfs_readv, split into segments that do not line up
+ * with the ones that were written, and must hold the records in order.
+ */
+
+#define N_THREADS 4
+#define RECORDS 16
+#define HEADER 13
+#define PAYLOAD (BLOCK_SIZE + 300)
+#define TRAILER 7
+#define RECORD (HEADER + PAYLOAD + TRAILER)
+
+void *fn(void *arg) {
+
+    size_t id = *((size_t *)arg);
+    char path[MAX_FILE_NAME];
+    char header[HEADER], payload[PAYLOAD], trailer[TRAILER];
+    static char expected[N_THREADS][RECORDS * RECORD];
+    static char first[N_THREADS][RECORD / 3], rest[N_THREADS][RECORDS * RECORD];
+
+    snprintf(path, sizeof(path), "/f8_%zu", id);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (size_t r = 0; r < RECORDS; r++) {
+        memset(header, (int)('A' + id), sizeof(header));
+        memset(payload, (int)('a' + (id + r) % 26), sizeof(payload));
+        memset(trailer, (int)('0' + r % 10), sizeof(trailer));
+
+        struct iovec iov[] = {
+            {.iov_base = header, .iov_len = sizeof(header)},
+            {.iov_base = NULL, .iov_len = 0},
+            {.iov_base = payload, .iov_len = sizeof(payload)},
+            {.iov_base = trailer, .iov_len = sizeof(trailer)},
+        };
+        assert(tfs_writev(fh, iov, 4) == RECORD);
+
+        char *record = expected[id] + r * RECORD;
+        memcpy(record, header, HEADER);
+        memcpy(record + HEADER, payload, PAYLOAD);
+        memcpy(record + HEADER + PAYLOAD, trailer, TRAILER);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open(path, 0);
+    assert(fh != -1);
+
+    struct iovec iov[] = {
+        {.iov_base = first[id], .iov_len = sizeof(first[id])},
+        {.iov_base = NULL, .iov_len = 0},
+        {.iov_base = rest[id], .iov_len = sizeof(rest[id])},
+    };
+    assert(tfs_readv(fh, iov, 3) == RECORDS * RECORD);
+    assert(memcmp(first[id], expected[id], sizeof(first[id])) == 0);
+    assert(memcmp(rest[id], expected[id] + sizeof(first[id]),
+                  RECORDS * RECORD - sizeof(first[id])) == 0);
+
+    /* The offset is at the end of the file */
+    assert(tfs_readv(fh, iov, 3) == 0);
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    size_t ids[N_THREADS];
+
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_writev(0, NULL, -1) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}
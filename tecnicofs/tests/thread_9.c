@@ -0,0 +1,142 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test uses multiple threads, each exporting (with tfs_copy_to_external_fs) its own file, whose
+ * blocks were written interleaved with the ones of the other files, while another thread appends to
+ * a file that all of them export as well. Every exported file must hold the contents of its source,
+ * and the shared one a prefix of it that ends at a write boundary.
+ * Exporting an empty file makes an empty file, and a file that is not in TecnicoFS is an error.
+ */
+
+#define N_THREADS 4
+#define SIZE (20 * BLOCK_SIZE + 77)
+#define APPEND 500
+#define APPENDS 40
+
+static char content[N_THREADS][SIZE];
+static char shared[APPENDS * APPEND];
+
+static void check_export(char const *path, char const *expected, size_t size) {
+    static char buffer[N_THREADS][SIZE + 1];
+    static _Atomic int next;
+    int slot = atomic_fetch_add(&next, 1) % N_THREADS;
+
+    FILE *fp = fopen(path, "r");
+    assert(fp != NULL);
+    assert(fread(buffer[slot], 1, sizeof(buffer[slot]), fp) == size);
+    assert(memcmp(buffer[slot], expected, size) == 0);
+    assert(fclose(fp) == 0);
+}
+
+void *export_fn(void *arg) {
+
+    size_t id = *((size_t *)arg);
+    char source[MAX_FILE_NAME], dest[64];
+
+    snprintf(source, sizeof(source), "/f9_%zu", id);
+    snprintf(dest, sizeof(dest), "/tmp/tfs_thread_9_%zu", id);
+
+    assert(tfs_copy_to_external_fs(source, dest) != -1);
+    check_export(dest, content[id], SIZE);
+
+    assert(tfs_copy_to_external_fs("/shared", dest) != -1);
+
+    FILE *fp = fopen(dest, "r");
+    assert(fp != NULL);
+    assert(fseek(fp, 0, SEEK_END) == 0);
+    long size = ftell(fp);
+    assert(fclose(fp) == 0);
+
+    assert(size % APPEND == 0);
+    check_export(dest, shared, (size_t)size);
+
+    assert(unlink(dest) == 0);
+
+    return (void *)NULL;
+}
+
+void *append_fn(void *arg) {
+
+    (void)arg;
+
+    int fh = tfs_open("/shared", TFS_O_APPEND);
+    assert(fh != -1);
+
+    for (size_t i = 0; i < APPENDS; i++) {
+        assert(tfs_write(fh, shared + i * APPEND, APPEND) == APPEND);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS + 1];
+    size_t ids[N_THREADS];
+    int fhs[N_THREADS];
+
+    for (size_t i = 0; i < N_THREADS; i++) {
+        for (size_t j = 0; j < SIZE; j++) {
+            content[i][j] = (char)('a' + (i + j) % 26);
+        }
+    }
+    for (size_t j = 0; j < sizeof(shared); j++) {
+        shared[j] = (char)('A' + j / APPEND % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < N_THREADS; i++) {
+        char path[MAX_FILE_NAME];
+        snprintf(path, sizeof(path), "/f9_%zu", i);
+        fhs[i] = tfs_open(path, TFS_O_CREAT);
+        assert(fhs[i] != -1);
+    }
+
+    for (size_t written = 0; written < SIZE; written += BLOCK_SIZE) {
+        for (size_t i = 0; i < N_THREADS; i++) {
+            size_t len = SIZE - written < BLOCK_SIZE ? SIZE - written : BLOCK_SIZE;
+            assert(tfs_write(fhs[i], content[i] + written, len) == (ssize_t)len);
+        }
+    }
+
+    for (size_t i = 0; i < N_THREADS; i++) {
+        assert(tfs_close(fhs[i]) != -1);
+    }
+
+    int fh = tfs_open("/shared", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_copy_to_external_fs("/shared", "/tmp/tfs_thread_9_empty") != -1);
+    check_export("/tmp/tfs_thread_9_empty", shared, 0);
+    assert(unlink("/tmp/tfs_thread_9_empty") == 0);
+
+    assert(tfs_copy_to_external_fs("/missing", "/tmp/tfs_thread_9_missing") == -1);
+
+    assert(pthread_create(&tids[N_THREADS], NULL, append_fn, NULL) == 0);
+
+    for (size_t i = 0; i < N_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, export_fn, (void *)&ids[i]) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS + 1; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_copy_to_external_fs("/shared", "/tmp/tfs_thread_9_shared") != -1);
+    check_export("/tmp/tfs_thread_9_shared", shared, sizeof(shared));
+    assert(unlink("/tmp/tfs_thread_9_shared") == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+}